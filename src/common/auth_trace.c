@@ -0,0 +1,216 @@
+/*
+ * PAM-PKCS11 authentication trace recorder
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+#define __AUTH_TRACE_C_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "debug.h"
+#include "cert_info.h"
+#include "alg_st.h"
+#include "token_profile.h"
+#include "auth_trace.h"
+
+/* number of hex digits of the certificate digest kept as identifier */
+#define TRACE_ID_LEN 16
+
+/*
+* A record is built in memory and appended to the trace file with a
+* single write() once the authentication is over, so that concurrent
+* logins never interleave their lines. Each authentication has its own
+* record, found through the calling thread; helper threads of the same
+* authentication adopt it with auth_trace_use(), hence the lock.
+*/
+struct auth_trace {
+	pthread_mutex_t mutex;
+	char *file;
+	char *buf;
+	size_t len;
+	size_t size;
+	int cert;
+	struct timeval start;
+};
+
+#if defined(__GNUC__) || defined(__SUNPRO_C)
+static __thread struct auth_trace *current = NULL;
+#else
+static struct auth_trace *current = NULL;
+#endif
+
+/* called with t->mutex held */
+static void trace_printf(struct auth_trace *t, const char *format, ...) {
+	va_list ap;
+	char *pt;
+	int n;
+
+	if (!t->buf) return;
+	for (;;) {
+		va_start(ap, format);
+		n = vsnprintf(t->buf + t->len, t->size - t->len, format, ap);
+		va_end(ap);
+		if (n < 0) return;
+		if (t->len + n < t->size) break;
+		pt = realloc(t->buf, t->size * 2 + n);
+		if (!pt) return;
+		t->buf = pt;
+		t->size = t->size * 2 + n;
+	}
+	t->len += n;
+}
+
+/* trace files are space separated: keep names and results single words */
+static const char *trace_word(const char *str) {
+	if (!str || !*str || strpbrk(str, " \t\n=")) return "-";
+	return str;
+}
+
+struct auth_trace *auth_trace_begin(const char *file, const char *mode, const char *crl) {
+	struct auth_trace *t;
+
+	current = NULL;
+	if (!file || !*file) return NULL;
+	t = calloc(1, sizeof(struct auth_trace));
+	if (!t) return NULL;
+	t->size = 1024;
+	t->buf = malloc(t->size);
+	t->file = strdup(file);
+	if (!t->buf || !t->file) {
+		free(t->buf);
+		free(t->file);
+		free(t);
+		return NULL;
+	}
+	pthread_mutex_init(&t->mutex, NULL);
+	gettimeofday(&t->start, NULL);
+	t->buf[0] = '\0';
+	trace_printf(t, "auth time=%ld mode=%s crl=%s\n",
+		(long)t->start.tv_sec, trace_word(mode), trace_word(crl));
+	current = t;
+	return t;
+}
+
+void auth_trace_use(struct auth_trace *t) {
+	current = t;
+}
+
+struct auth_trace *auth_trace_current(void) {
+	return current;
+}
+
+void auth_trace_cert(int n, X509 *x509) {
+	struct auth_trace *t = current;
+	char id[TRACE_ID_LEN + 1];
+	char **digest;
+	const char *pt;
+	int len = 0;
+
+	if (!t) return;
+	digest = cert_info(x509, CERT_DIGEST, ALGORITHM_SHA256);
+	if (digest && digest[0]) {
+		for (pt = digest[0]; *pt && len < TRACE_ID_LEN; pt++) {
+			if (isxdigit((unsigned char)*pt)) id[len++] = tolower((unsigned char)*pt);
+		}
+	}
+	id[len] = '\0';
+	pthread_mutex_lock(&t->mutex);
+	trace_printf(t, "cert n=%d id=%s\n", n, len ? id : "-");
+	pthread_mutex_unlock(&t->mutex);
+}
+
+void auth_trace_set_cert(int n) {
+	struct auth_trace *t = current;
+	if (!t) return;
+	pthread_mutex_lock(&t->mutex);
+	t->cert = n;
+	pthread_mutex_unlock(&t->mutex);
+}
+
+void auth_trace_event(const char *kind, const char *name, const char *result, unsigned long ms) {
+	struct auth_trace *t = current;
+	if (!t) return;
+	pthread_mutex_lock(&t->mutex);
+	trace_printf(t, "%s cert=%d name=%s ms=%lu result=%s\n", trace_word(kind),
+		t->cert, trace_word(name), ms, trace_word(result));
+	pthread_mutex_unlock(&t->mutex);
+}
+
+void auth_trace_pkcs11(const char *fn, unsigned long rv, unsigned long us, const char *args) {
+	struct auth_trace *t = current;
+	if (!t) return;
+	pthread_mutex_lock(&t->mutex);
+	trace_printf(t, "pkcs11 cert=%d name=%s us=%lu rv=0x%08lx args=%s\n", t->cert,
+		trace_word(fn), us, rv, trace_word(args));
+	pthread_mutex_unlock(&t->mutex);
+}
+
+void auth_trace_pkcs11_total(const char *fn, unsigned long calls,
+	unsigned long errors, unsigned long us) {
+	struct auth_trace *t = current;
+	if (!t) return;
+	pthread_mutex_lock(&t->mutex);
+	trace_printf(t, "pkcs11_total name=%s calls=%lu errors=%lu us=%lu\n",
+		trace_word(fn), calls, errors, us);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+void auth_trace_end(const char *result) {
+	struct auth_trace *t = current;
+	int fd;
+
+	current = NULL;
+	if (!t) return;
+	pthread_mutex_lock(&t->mutex);
+	if (t->buf) {
+		trace_printf(t, "end ms=%lu result=%s\n\n",
+			token_profile_elapsed(&t->start), trace_word(result));
+		fd = open(t->file, O_WRONLY | O_APPEND | O_CREAT, 0600);
+		if (fd < 0 || write(fd, t->buf, t->len) != (ssize_t)t->len) {
+			DBG2("cannot append trace to %s: %s", t->file, strerror(errno));
+		}
+		if (fd >= 0) close(fd);
+	}
+	/* stored once only */
+	free(t->buf);
+	t->buf = NULL;
+	t->len = t->size = 0;
+	pthread_mutex_unlock(&t->mutex);
+}
+
+void auth_trace_free(struct auth_trace *t) {
+	if (!t) return;
+	if (current == t) current = NULL;
+	pthread_mutex_destroy(&t->mutex);
+	free(t->buf);
+	free(t->file);
+	free(t);
+}
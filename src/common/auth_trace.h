@@ -0,0 +1,130 @@
+/*
+ * PAM-PKCS11 authentication trace recorder
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/** \file
+ Authentication traces record what happened during one authentication,
+ without any user identity: certificates are only known by a truncated
+ digest, and only mapper names and outcomes are kept, never the logins.
+ One record is appended to the trace file per authentication:
+ <pre>
+ auth time=1700000000 mode=find crl=auto
+ cert n=1 id=0f3a9c21d4e5b678
+ stage cert=0 name=login ms=230 result=ok
+ verify cert=1 name=- ms=120 result=1
+ find cert=1 name=ldap ms=350 result=nomatch
+ chosen cert=1 name=- ms=0 result=ok
+ end ms=1200 result=success
+ </pre>
+ With pkcs11_trace enabled, the PKCS#11 calls are recorded as well:
+ <pre>
+ pkcs11 cert=0 name=C_FindObjects us=850 rv=0x00000000 args=session:1,max:1,found:1
+ pkcs11_total name=C_FindObjects calls=6 errors=0 us=5210
+ </pre>
+ The pkcs11_trace_replay tool replays such records against another
+ configuration.
+*/
+
+#ifndef __AUTH_TRACE_H_
+#define __AUTH_TRACE_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include "cert_st.h"
+
+#ifndef __AUTH_TRACE_C_
+#define AUTH_TRACE_EXTERN extern
+#else
+#define AUTH_TRACE_EXTERN
+#endif
+
+/** A trace record, one per authentication */
+struct auth_trace;
+
+/**
+* Start recording an authentication. The record becomes the current one of
+* the calling thread: events recorded from this thread go to it
+*@param file Trace file, records are appended. NULL disables tracing
+*@param mode "find" (login deduced from certificate) or "match"
+*@param crl  Revocation policy in use: "none", "online", "offline" or "auto"
+*@return the record, to be released with auth_trace_free(); NULL if none
+*/
+AUTH_TRACE_EXTERN struct auth_trace *auth_trace_begin(const char *file, const char *mode, const char *crl);
+
+/**
+* Make a record the current one of the calling thread, for threads working
+* for an authentication started in another one. NULL stops recording
+*/
+AUTH_TRACE_EXTERN void auth_trace_use(struct auth_trace *t);
+
+/**
+* Current record of the calling thread, NULL if none
+*/
+AUTH_TRACE_EXTERN struct auth_trace *auth_trace_current(void);
+
+/**
+* Record a certificate found on the token (by digest only)
+*/
+AUTH_TRACE_EXTERN void auth_trace_cert(int n, X509 *x509);
+
+/**
+* Select the certificate (1-based, 0 for none) following events refer to
+*/
+AUTH_TRACE_EXTERN void auth_trace_set_cert(int n);
+
+/**
+* Record an event
+*@param kind Event kind: "stage", "verify", "crl", "find", "match", "chosen"
+*@param name Stage or mapper name
+*@param result Outcome
+*@param ms Duration in milliseconds
+*/
+AUTH_TRACE_EXTERN void auth_trace_event(const char *kind, const char *name, const char *result, unsigned long ms);
+
+/**
+* Record a PKCS#11 call
+*@param fn Function name
+*@param rv Return code
+*@param us Duration in microseconds
+*@param args Argument summary, "key:value" pairs separated by commas
+*/
+AUTH_TRACE_EXTERN void auth_trace_pkcs11(const char *fn, unsigned long rv, unsigned long us, const char *args);
+
+/**
+* Record the aggregated PKCS#11 calls of a function
+*/
+AUTH_TRACE_EXTERN void auth_trace_pkcs11_total(const char *fn, unsigned long calls,
+	unsigned long errors, unsigned long us);
+
+/**
+* Finish and store the current record. The calling thread has no current
+* record anymore
+*/
+AUTH_TRACE_EXTERN void auth_trace_end(const char *result);
+
+/**
+* Release a record, stored or not
+*/
+AUTH_TRACE_EXTERN void auth_trace_free(struct auth_trace *t);
+
+#undef AUTH_TRACE_EXTERN
+
+#endif /* __AUTH_TRACE_H_ */
@@ -23,12 +23,215 @@
 #include <config.h>
 #endif
 
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
 #include "debug.h"
 #include "error.h"
 #include "strings.h"
 #include "cert_info.h"
 #include "alg_st.h"
 
+/*
+* Canonical distinguished names, shared by both crypto backends
+*/
+
+/* attribute type spellings found in the wild, and their short name */
+static const struct {
+	const char *alias;
+	const char *name;
+} dn_aliases[] = {
+	{ "commonname", "cn" },
+	{ "surname", "sn" },
+	{ "givenname", "gn" },
+	{ "countryname", "c" },
+	{ "localityname", "l" },
+	{ "stateorprovincename", "st" },
+	{ "s", "st" },
+	{ "streetaddress", "street" },
+	{ "organizationname", "o" },
+	{ "organizationalunitname", "ou" },
+	{ "domaincomponent", "dc" },
+	{ "userid", "uid" },
+	{ "e", "emailaddress" },
+	{ "email", "emailaddress" },
+	{ NULL, NULL }
+};
+
+/*
+* compose "type=value" in canonical form from an unescaped value
+*/
+static char *canonical_ava(const char *type, size_t tlen, const char *value, size_t vlen) {
+	char tbuf[80];
+	const char *name = tbuf;
+	size_t i, out, start;
+	int blank = 0;
+	char *res;
+
+	while (tlen && isspace((unsigned char)*type)) { type++; tlen--; }
+	while (tlen && isspace((unsigned char)type[tlen - 1])) tlen--;
+	if (tlen == 0) return NULL;
+	if (tlen >= sizeof(tbuf)) tlen = sizeof(tbuf) - 1;
+	for (i = 0; i < tlen; i++) tbuf[i] = tolower((unsigned char)type[i]);
+	tbuf[tlen] = '\0';
+	/* RFC 1485 numeric form */
+	if (tlen > 4 && !strncmp(tbuf, "oid.", 4)) name = tbuf + 4;
+	for (i = 0; dn_aliases[i].alias; i++) {
+		if (!strcmp(tbuf, dn_aliases[i].alias)) {
+			name = dn_aliases[i].name;
+			break;
+		}
+	}
+
+	res = malloc(strlen(name) + 2 + 2 * vlen);
+	if (!res) return NULL;
+	out = start = sprintf(res, "%s=", name);
+	for (i = 0; i < vlen; i++) {
+		unsigned char c = value[i];
+		if (isspace(c)) {
+			blank = 1;
+			continue;
+		}
+		if (blank && out > start) res[out++] = ' ';
+		blank = 0;
+		/* keep the separators of the canonical form unambiguous */
+		if (c == ',' || c == '+' || c == '\\') res[out++] = '\\';
+		res[out++] = c;
+	}
+	res[out] = '\0';
+	return res;
+}
+
+static int cmp_ava(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+* join canonical attribute value assertions, rdns[] telling the RDN each
+* one belongs to (the ones of an RDN are contiguous). The assertions of a
+* multi-valued RDN are sorted and joined with '+', then the RDNs are
+* joined with ',' in RFC 2253 order (most specific first): the given
+* order, reversed if it is the certificate order. Frees the assertions
+*/
+static char *join_avas(char **avas, const int *rdns, int n, int reverse) {
+	char **groups, *res = NULL;
+	size_t len;
+	int i, j, k, ngroups = 0;
+
+	groups = calloc(n, sizeof(char *));
+	for (i = 0; groups && i < n; i = j) {
+		for (j = i + 1; j < n && rdns[j] == rdns[i]; j++);
+		qsort(avas + i, j - i, sizeof(char *), cmp_ava);
+		for (len = 1, k = i; k < j; k++) len += strlen(avas[k]) + 1;
+		groups[ngroups] = malloc(len);
+		if (!groups[ngroups]) break;
+		groups[ngroups][0] = '\0';
+		for (k = i; k < j; k++) {
+			if (k > i) strcat(groups[ngroups], "+");
+			strcat(groups[ngroups], avas[k]);
+		}
+		ngroups++;
+	}
+	if (groups && i >= n) {
+		for (len = 1, k = 0; k < ngroups; k++) len += strlen(groups[k]) + 1;
+		res = malloc(len);
+		if (res) {
+			res[0] = '\0';
+			for (k = 0; k < ngroups; k++) {
+				if (k) strcat(res, ",");
+				strcat(res, groups[reverse ? ngroups - 1 - k : k]);
+			}
+		}
+	}
+	for (k = 0; k < ngroups; k++) free(groups[k]);
+	free(groups);
+	for (i = 0; i < n; i++) free(avas[i]);
+	return res;
+}
+
+static int hex_value(int c) {
+	return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/* an attribute type followed by '=' starts at pt */
+static int is_ava_start(const char *pt) {
+	const char *start = pt;
+	while (isalnum((unsigned char)*pt) || *pt == '.' || *pt == '-') pt++;
+	return pt > start && *pt == '=';
+}
+
+char *canonical_dn(const char *dn) {
+	const char *pt, *type;
+	char **avas, *value, *res;
+	int *rdns;
+	size_t tlen, vlen;
+	int n = 0, rdn = 0, quoted;
+	char sep;
+
+	if (!dn) return NULL;
+	while (isspace((unsigned char)*dn)) dn++;
+	/* X509_NAME_oneline() form, else RFC 2253 / RFC 1485 */
+	sep = (*dn == '/') ? '/' : ',';
+	if (sep == '/') dn++;
+	value = malloc(strlen(dn) + 1);
+	/* at most one assertion per separator */
+	avas = calloc(strlen(dn) / 2 + 2, sizeof(char *));
+	rdns = calloc(strlen(dn) / 2 + 2, sizeof(int));
+	if (!value || !avas || !rdns) {
+		free(value);
+		free(avas);
+		free(rdns);
+		return NULL;
+	}
+	for (pt = dn; *pt; ) {
+		type = pt;
+		while (*pt && *pt != '=' && *pt != sep) pt++;
+		if (*pt != '=') { /* malformed component: skip */
+			if (*pt) pt++;
+			continue;
+		}
+		tlen = pt++ - type;
+		vlen = 0;
+		quoted = 0;
+		while (*pt) {
+			if (*pt == '\\' && pt[1]) {
+				if (pt[1] == 'x' && isxdigit((unsigned char)pt[2]) && isxdigit((unsigned char)pt[3])) {
+					value[vlen++] = hex_value(pt[2]) * 16 + hex_value(pt[3]);
+					pt += 4;
+				} else if (isxdigit((unsigned char)pt[1]) && isxdigit((unsigned char)pt[2])) {
+					value[vlen++] = hex_value(pt[1]) * 16 + hex_value(pt[2]);
+					pt += 3;
+				} else {
+					value[vlen++] = pt[1];
+					pt += 2;
+				}
+				continue;
+			}
+			if (*pt == '"' && sep == ',') {
+				quoted = !quoted;
+				pt++;
+				continue;
+			}
+			if (!quoted && (*pt == sep || (sep == ',' && *pt == ';')))
+				break;
+			/* multi-valued RDN; X509_NAME_oneline() does not escape '+' */
+			if (!quoted && *pt == '+' && (sep == ',' || is_ava_start(pt + 1)))
+				break;
+			value[vlen++] = *pt++;
+		}
+		if ((avas[n] = canonical_ava(type, tlen, value, vlen)) != NULL)
+			rdns[n++] = rdn;
+		if (*pt != '+') rdn++;
+		if (*pt) pt++;
+	}
+	free(value);
+	/* X509_NAME_oneline() lists the RDNs in certificate order */
+	res = n ? join_avas(avas, rdns, n, sep == '/') : NULL;
+	free(avas);
+	free(rdns);
+	return res;
+}
+
 #ifdef HAVE_NSS
 
 #include "secoid.h"
@@ -223,6 +426,16 @@ char **cert_info(X509 *x509, int type, ALGORITHM_TYPE algorithm ) {
       results[0] = CERT_NameToAscii(&x509->issuer);
       results[1] = 0;
       break;
+    case CERT_CANON_SUBJECT : /* Certificate subject, canonical form */
+    case CERT_CANON_ISSUER : /* Certificate issuer, canonical form */
+      {
+        char *dn = CERT_NameToAscii(type == CERT_CANON_SUBJECT ?
+          &x509->subject : &x509->issuer);
+        results[0] = canonical_dn(dn);
+        results[1] = 0;
+        PORT_Free(dn);
+      }
+      break;
     case CERT_SERIAL : /* Certificate serial number */
       results[0] = bin2hex(x509->serialNumber.data, x509->serialNumber.len);
       results[1] = 0;
@@ -406,6 +619,55 @@ static char **cert_info_issuer(X509 *x509) {
 	return entries;
 }
 
+/*
+* Canonical form of a certificate name, built from its DER content
+*/
+static char **cert_info_canonical_name(X509_NAME *name) {
+	static char *entries[2] = { NULL, NULL };
+	X509_NAME_ENTRY *entry;
+	ASN1_OBJECT *obj;
+	unsigned char *txt;
+	const char *type;
+	char oid[80];
+	char **avas;
+	int *rdns;
+	int i, n = 0, len, nid;
+
+	if (!name) return NULL;
+	avas = calloc(X509_NAME_entry_count(name) + 1, sizeof(char *));
+	rdns = calloc(X509_NAME_entry_count(name) + 1, sizeof(int));
+	if (!avas || !rdns) {
+		free(avas);
+		free(rdns);
+		return NULL;
+	}
+	for (i = 0; i < X509_NAME_entry_count(name); i++) {
+		entry = X509_NAME_get_entry(name, i);
+		obj = X509_NAME_ENTRY_get_object(entry);
+		nid = OBJ_obj2nid(obj);
+		if (nid != NID_undef) {
+			type = OBJ_nid2sn(nid);
+		} else {
+			OBJ_obj2txt(oid, sizeof(oid), obj, 1);
+			type = oid;
+		}
+		len = ASN1_STRING_to_UTF8(&txt, X509_NAME_ENTRY_get_data(entry));
+		if (len < 0) {
+			DBG1("ASN1_STRING_to_UTF8() failed: %s", ERR_error_string(ERR_get_error(),NULL));
+			continue;
+		}
+		if ((avas[n] = canonical_ava(type, strlen(type), (const char *)txt, len)) != NULL)
+			rdns[n++] = X509_NAME_ENTRY_set(entry);
+		OPENSSL_free(txt);
+	}
+	entries[0] = n ? join_avas(avas, rdns, n, 1) : NULL;
+	free(avas);
+	free(rdns);
+	if (!entries[0]) return NULL;
+	DBG1("canonical name: '%s'", entries[0]);
+	return entries;
+}
+
 /*
 * Extract Certificate's Kerberos Principal Name
 */
@@ -913,6 +1175,10 @@ char **cert_info(X509 *x509, int type, const char *algorithm ) {
 		return cert_info_subject(x509);
 	    case CERT_ISSUER : /* Certificate issuer */
 		return cert_info_issuer(x509);
+	    case CERT_CANON_SUBJECT : /* Certificate subject, canonical form */
+		return cert_info_canonical_name(X509_get_subject_name(x509));
+	    case CERT_CANON_ISSUER : /* Certificate issuer, canonical form */
+		return cert_info_canonical_name(X509_get_issuer_name(x509));
 	    case CERT_SERIAL : /* Certificate serial number */
 		/* fix me */
 		return cert_info_serial_number(x509);
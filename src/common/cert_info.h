@@ -47,6 +47,10 @@
 #define CERT_SERIAL	12
 /** Certificate key algorithm */
 #define CERT_KEY_ALG	13
+/** Certificate subject, canonical form (see canonical_dn()) */
+#define CERT_CANON_SUBJECT	14
+/** Certificate issuer, canonical form (see canonical_dn()) */
+#define CERT_CANON_ISSUER	15
 
 /** Max size of returned certificate content array */
 #define CERT_INFO_SIZE 16
@@ -76,6 +80,22 @@ void add_cert(X509 *cert, X509 ***certs, int *ncerts);
 */
 CERTINFO_EXTERN char **cert_info(X509 *x509, int type, ALGORITHM_TYPE algorithm);
 
+/**
+* Canonical form of a distinguished name: attribute types are mapped
+* to their lowercase short names and blanks in values are folded. The
+* attribute value assertions of a multi-valued RDN are sorted and kept
+* together ("cn=x+uid=y"). The RDNs keep their order, given most specific
+* first as in RFC 2253: names listing the same RDNs in another order are
+* different names. Letter case of values is kept: compare with
+* strcasecmp() to ignore it. OpenSSL "/C=ES/CN=x" (certificate order)
+* and RFC 2253 "CN=x, C=ES" forms of a name give the same string as
+* CERT_CANON_SUBJECT or CERT_CANON_ISSUER does for the certificate
+* holding it.
+* @param dn Distinguished name in text form
+* @return malloc()'d canonical name, or NULL on error
+*/
+CERTINFO_EXTERN char *canonical_dn(const char *dn);
+
 #undef CERTINFO_EXTERN
 
 #endif /* __CERT_INFO_H_ */
@@ -0,0 +1,139 @@
+/*
+ * PAM-PKCS11 certificate information
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/*
+* Checks canonical names: the text forms of a name, and the name held by
+* a certificate, give the same string, and names listing the same RDNs
+* in another order do not.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cert_info.h"
+
+static int failures = 0;
+
+#define CHECK(cond, what) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s (line %d)\n", what, __LINE__); \
+		failures++; \
+	} \
+} while (0)
+
+static void check_canonical(const char *dn, const char *expected, const char *what) {
+	char *res = canonical_dn(dn);
+	CHECK(expected ? res && !strcmp(res, expected) : !res, what);
+	if (res && expected && strcmp(res, expected))
+		fprintf(stderr, "  '%s' gives '%s'\n", dn, res);
+	free(res);
+}
+
+static void check_same(const char *a, const char *b, int same, const char *what) {
+	char *ca = canonical_dn(a), *cb = canonical_dn(b);
+	CHECK(ca && cb && (strcmp(ca, cb) == 0) == same, what);
+	free(ca);
+	free(cb);
+}
+
+#ifndef HAVE_NSS
+#include <openssl/x509.h>
+
+/* canonical subject of a certificate named by "type=value" pairs, in
+ * certificate order; a type starting with '+' joins the previous RDN */
+static char *certificate_subject(const char **pairs) {
+	X509 *x509 = X509_new();
+	X509_NAME *name = X509_get_subject_name(x509);
+	char **res, *copy = NULL;
+	int i;
+
+	for (i = 0; pairs[i]; i += 2) {
+		int more = pairs[i][0] == '+';
+		X509_NAME_add_entry_by_txt(name, pairs[i] + more, MBSTRING_UTF8,
+			(const unsigned char *)pairs[i + 1], -1, -1, more ? -1 : 0);
+	}
+	res = cert_info(x509, CERT_CANON_SUBJECT, NULL);
+	if (res && res[0]) copy = strdup(res[0]);
+	X509_free(x509);
+	return copy;
+}
+
+static void check_certificate(const char **pairs, const char *expected, const char *what) {
+	char *res = certificate_subject(pairs);
+	CHECK(res && !strcmp(res, expected), what);
+	if (res && strcmp(res, expected))
+		fprintf(stderr, "  certificate gives '%s'\n", res);
+	free(res);
+}
+#endif
+
+int main(int argc, char **argv) {
+	/* the text forms */
+	check_canonical("CN=Juan, O=FNMT, C=ES", "cn=Juan,o=FNMT,c=ES", "RFC 2253 form");
+	check_canonical("/C=ES/O=FNMT/CN=Juan", "cn=Juan,o=FNMT,c=ES", "OpenSSL form, reversed");
+	check_canonical("  commonName = Juan  Garcia ;countryName=ES", "cn=Juan Garcia,c=ES",
+		"aliases, blanks and ';'");
+	check_canonical("CN=\"Garcia, Juan\",C=ES", "cn=Garcia\\, Juan,c=ES", "quoted separator");
+	check_canonical("CN=a\\2Cb,C=ES", "cn=a\\,b,c=ES", "hex escape");
+	check_canonical("/C=ES/CN=a\\x2Cb", "cn=a\\,b,c=ES", "OpenSSL hex escape");
+	check_canonical("OID.2.5.4.3=x", "2.5.4.3=x", "numeric type");
+	check_canonical("", NULL, "empty name");
+
+	/* multi-valued RDNs */
+	check_same("CN=a+UID=b,O=x", "UID=b+CN=a,O=x", 1, "multi-valued RDN in any order");
+	check_same("/O=x/CN=a+UID=b", "UID=b+CN=a,O=x", 1, "multi-valued RDN in OpenSSL form");
+	check_same("CN=a+UID=b,O=x", "CN=a,UID=b,O=x", 0, "multi-valued RDN is not two RDNs");
+	check_canonical("/O=x/CN=a+b", "cn=a\\+b,o=x", "'+' inside an OpenSSL value");
+
+	/* RDN order tells names apart */
+	check_same("CN=x,OU=y,O=z", "OU=y,CN=x,O=z", 0, "reordered RDNs differ");
+	check_same("CN=admin,OU=staff,O=corp", "OU=admin,CN=staff,O=corp", 0,
+		"swapped values differ");
+	check_same("/O=z/OU=y/CN=x", "CN=x,OU=y,O=z", 1, "forms agree on order");
+	check_same("/O=z/OU=y/CN=x", "O=z,OU=y,CN=x", 0, "OpenSSL form is not RFC 2253 order");
+	check_same("CN=Juan,C=ES", "CN=juan,C=ES", 0, "letter case is kept");
+
+#ifndef HAVE_NSS
+	/* the certificate name gives the text forms */
+	{
+		const char *juan[] = { "C", "ES", "O", "FNMT", "CN", "Juan", NULL };
+		const char *multi[] = { "O", "x", "UID", "b", "+CN", "a", NULL };
+		const char *reordered[] = { "O", "z", "CN", "x", "OU", "y", NULL };
+		char *a, *b;
+
+		check_certificate(juan, "cn=Juan,o=FNMT,c=ES", "certificate name");
+		check_certificate(multi, "cn=a+uid=b,o=x", "certificate multi-valued RDN");
+		a = certificate_subject(reordered);
+		b = canonical_dn("CN=x,OU=y,O=z");
+		CHECK(a && b && strcmp(a, b), "reordered certificate name differs");
+		free(a);
+		free(b);
+		check_certificate(reordered, "ou=y,cn=x,o=z", "reordered certificate name");
+	}
+#endif
+
+	if (failures) fprintf(stderr, "%d check(s) failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -75,6 +75,9 @@ int verify_signature(X509 * x509, unsigned char *data, int data_length,
 #define __CERT_VFY_C_
 
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "../common/pam-pkcs11-ossl-compat.h"
 #include <openssl/objects.h>
 #include <openssl/err.h>
@@ -84,6 +87,8 @@ int verify_signature(X509 * x509, unsigned char *data, int data_length,
 #include "error.h"
 #include "base64.h"
 #include "uri.h"
+#include "token_profile.h"
+#include "auth_trace.h"
 
 static X509_CRL *download_crl(const char *uri)
 {
@@ -179,7 +184,7 @@ static int verify_crl(X509_CRL * crl, X509_STORE_CTX * ctx)
     DBG("crl is invalid");
     return 0;
   }
-  /* compare update times */
+  /* compare update times, expiry is left to crl_freshness() */
   rv = X509_cmp_current_time(X509_CRL_get_lastUpdate(crl));
   if (rv == 0) {
     set_error("crl has an invalid last update field");
@@ -189,16 +194,96 @@ static int verify_crl(X509_CRL * crl, X509_STORE_CTX * ctx)
     DBG("crl is not yet valid");
     return 0;
   }
-  rv = X509_cmp_current_time(X509_CRL_get_nextUpdate(crl));
-  if (rv == 0) {
-    set_error("crl has an invalid next update field");
-    return -1;
+  return 1;
+}
+
+/* crl states, as returned by crl_state() */
+#define CRL_FRESH	0
+#define CRL_GRACE	1
+#define CRL_UNUSABLE	2
+
+static const char *crl_state_names[] = { "fresh", "in grace period", "unusable" };
+
+/*
+* A crl is fresh until its nextUpdate time and, for local crls when
+* crl_max_age is set, as long as it is less than crl_max_age seconds old.
+* It stays in its grace period for crl_grace more seconds.
+*/
+static int crl_freshness(X509_CRL * crl, cert_policy *policy, int local)
+{
+  const ASN1_TIME *next = X509_CRL_get0_nextUpdate(crl);
+  time_t now = time(NULL), limit;
+  int grace = policy->crl_grace > 0 ? policy->crl_grace : 0;
+  int rv, state = CRL_FRESH;
+
+  /* nextUpdate is optional, a crl without it never expires by itself */
+  if (next != NULL) {
+    rv = X509_cmp_time(next, &now);
+    if (rv == 0) {
+      set_error("crl has an invalid next update field");
+      return -1;
+    }
+    if (rv < 0) {
+      limit = now - grace;
+      state = X509_cmp_time(next, &limit) > 0 ? CRL_GRACE : CRL_UNUSABLE;
+      DBG("crl has expired");
+    }
+  }
+  if (local && policy->crl_max_age > 0) {
+    limit = now - policy->crl_max_age;
+    if (X509_cmp_time(X509_CRL_get0_lastUpdate(crl), &limit) < 0) {
+      limit -= grace;
+      rv = X509_cmp_time(X509_CRL_get0_lastUpdate(crl), &limit) > 0 ? CRL_GRACE : CRL_UNUSABLE;
+      if (rv > state) state = rv;
+      DBG1("crl is older than %d seconds", policy->crl_max_age);
+    }
   }
+  return state;
+}
+
+static int crl_state(X509_CRL * crl, X509_STORE_CTX * ctx, cert_policy *policy, int local)
+{
+  int rv;
+
+  DBG("verifying crl");
+  rv = verify_crl(crl, ctx);
   if (rv < 0) {
-    DBG("crl has expired");
-    return 0;
+    set_error("verify_crl() failed: %s", get_error());
+    return -1;
+  } else if (rv == 0) {
+    return CRL_UNUSABLE;
   }
-  return 1;
+  return crl_freshness(crl, policy, local);
+}
+
+/* look up the crl of the certificate issuer in crl_dir */
+static X509_CRL *get_local_crl(X509 * x509, X509_STORE_CTX * ctx)
+{
+  int rv;
+  X509_CRL *crl;
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
+  X509_OBJECT obj;
+  rv = X509_STORE_get_by_subject(ctx, X509_LU_CRL, X509_get_issuer_name(x509), &obj);
+  if (rv <= 0) {
+    set_error("no dedicated crl available");
+    return NULL;
+  }
+  crl = X509_OBJECT_get0_X509_CRL((&obj));
+  X509_CRL_up_ref(crl);
+  X509_OBJECT_free_contents(&obj);
+#else
+  X509_OBJECT *obj = X509_OBJECT_new();
+  rv = X509_STORE_get_by_subject(ctx, X509_LU_CRL, X509_get_issuer_name(x509), obj);
+  if (rv <= 0) {
+    X509_OBJECT_free(obj);
+    set_error("no dedicated crl available");
+    return NULL;
+  }
+  crl = X509_OBJECT_get0_X509_CRL(obj);
+  X509_CRL_up_ref(crl);
+  X509_OBJECT_free(obj);
+#endif
+  return crl;
 }
 
 /* the structure DIST_POINT_NAME_st has been changed from 0.9.6 to 0.9.7 */
@@ -208,7 +293,8 @@ static int verify_crl(X509_CRL * crl, X509_STORE_CTX * ctx)
 #define GET_FULLNAME(a) a->fullname
 #endif
 
-static int check_for_revocation(X509 * x509, X509_STORE_CTX * ctx, crl_policy_t policy)
+/* download the crl from the distribution points of the certificate or its ca */
+static X509_CRL *get_online_crl(X509 * x509, X509_STORE_CTX * ctx)
 {
   int rv, i, j;
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L)
@@ -216,113 +302,159 @@ static int check_for_revocation(X509 * x509, X509_STORE_CTX * ctx, crl_policy_t
 #else
   X509_OBJECT *obj = X509_OBJECT_new();
 #endif
-  X509_REVOKED *rev = NULL;
   STACK_OF(DIST_POINT) * dist_points;
   DIST_POINT *point;
   GENERAL_NAME *name;
   X509_CRL *crl;
   X509 *x509_ca = NULL;
+  struct timeval start;
 
-  DBG1("crl policy: %d", policy);
-  if (policy == CRLP_NONE) {
-    /* NONE */
-    DBG("no revocation-check performed");
-    return 1;
-  } else if (policy == CRLP_AUTO) {
-    /* AUTO -> first try it ONLINE then OFFLINE */
-    rv = check_for_revocation(x509, ctx, CRLP_ONLINE);
-    if (rv < 0) {
-      DBG1("check_for_revocation() failed: %s", get_error());
-      rv = check_for_revocation(x509, ctx, CRLP_OFFLINE);
-    }
-    return rv;
-  } else if (policy == CRLP_OFFLINE) {
-    /* OFFLINE */
-    DBG("looking for an dedicated local crl");
+  DBG("extracting crl distribution points");
+  dist_points = X509_get_ext_d2i(x509, NID_crl_distribution_points, NULL, NULL);
+  if (dist_points == NULL) {
+    /* if there is not crl distribution point in the certificate hava a look at the ca certificate */
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L)
-    rv = X509_STORE_get_by_subject(ctx, X509_LU_CRL, X509_get_issuer_name(x509), &obj);
+    rv = X509_STORE_get_by_subject(ctx, X509_LU_X509, X509_get_issuer_name(x509), &obj);
 #else
-    rv = X509_STORE_get_by_subject(ctx, X509_LU_CRL, X509_get_issuer_name(x509), obj);
+    rv = X509_STORE_get_by_subject(ctx, X509_LU_X509, X509_get_issuer_name(x509), obj);
 #endif
     if (rv <= 0) {
-      set_error("no dedicated crl available");
-      return -1;
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+      X509_OBJECT_free(obj);
+#endif
+      set_error("no dedicated ca certificate available");
+      return NULL;
     }
-    crl = X509_OBJECT_get0_X509_CRL((&obj));
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L)
+    x509_ca = X509_OBJECT_get0_X509((&obj));
+    dist_points = X509_get_ext_d2i(x509_ca, NID_crl_distribution_points, NULL, NULL);
     X509_OBJECT_free_contents(&obj);
 #else
-    X509_OBJECT_free(obj);
+    x509_ca = X509_OBJECT_get0_X509(obj);
+    dist_points = X509_get_ext_d2i(x509_ca, NID_crl_distribution_points, NULL, NULL);
 #endif
-  } else if (policy == CRLP_ONLINE) {
-    /* ONLINE */
-    DBG("extracting crl distribution points");
-    dist_points = X509_get_ext_d2i(x509, NID_crl_distribution_points, NULL, NULL);
     if (dist_points == NULL) {
-      /* if there is not crl distribution point in the certificate hava a look at the ca certificate */
-      rv = X509_STORE_get_by_subject(ctx, X509_LU_X509, X509_get_issuer_name(x509), &obj);
-      if (rv <= 0) {
-        set_error("no dedicated ca certificate available");
-        return -1;
-      }
-      x509_ca = X509_OBJECT_get0_X509((&obj));
-      dist_points = X509_get_ext_d2i(x509_ca, NID_crl_distribution_points, NULL, NULL);
-#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
-      X509_OBJECT_free_contents(&obj);
-#else
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
       X509_OBJECT_free(obj);
 #endif
-      if (dist_points == NULL) {
-        set_error("neither the user nor the ca certificate does contain a crl distribution point");
-        return -1;
-      }
+      set_error("neither the user nor the ca certificate does contain a crl distribution point");
+      return NULL;
     }
-    crl = NULL;
-    for (i = 0; i < sk_DIST_POINT_num(dist_points) && crl == NULL; i++) {
-      point = sk_DIST_POINT_value(dist_points, i);
-      /* until now, only fullName is supported */
-      if (point->distpoint != NULL && GET_FULLNAME(point->distpoint) != NULL) {
-        for (j = 0; j < sk_GENERAL_NAME_num(GET_FULLNAME(point->distpoint)); j++) {
-          name = sk_GENERAL_NAME_value(GET_FULLNAME(point->distpoint), j);
-          if (name != NULL && name->type == GEN_URI) {
-            DBG1("downloading crl from %s", name->d.ia5->data);
-            crl = download_crl((const char *)name->d.ia5->data);
-
-            /*crl = download_crl("file:///home/mario/projects/pkcs11_login/tests/ca_crl_0.pem"); */
-            /*crl = download_crl("http://www-t.zhwin.ch/ca/root_ca.crl"); */
-            /*crl = download_crl("http://www.zhwin.ch/~sri/"); */
-            /*crl = download_crl("ldap://directory.verisign.com:389/CN=VeriSign IECA, OU=IECA-3, OU=Contractor, OU=PKI, OU=DOD, O=U.S. Government, C=US?certificateRevocationList;binary"); */
-            if (crl != NULL)
-              break;
-            else
-              DBG1("download_crl() failed: %s", get_error());
-          }
+  }
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+  X509_OBJECT_free(obj);
+#endif
+  crl = NULL;
+  for (i = 0; i < sk_DIST_POINT_num(dist_points) && crl == NULL; i++) {
+    point = sk_DIST_POINT_value(dist_points, i);
+    /* until now, only fullName is supported */
+    if (point->distpoint != NULL && GET_FULLNAME(point->distpoint) != NULL) {
+      for (j = 0; j < sk_GENERAL_NAME_num(GET_FULLNAME(point->distpoint)); j++) {
+        name = sk_GENERAL_NAME_value(GET_FULLNAME(point->distpoint), j);
+        if (name != NULL && name->type == GEN_URI) {
+          DBG1("downloading crl from %s", name->d.ia5->data);
+          gettimeofday(&start, NULL);
+          crl = download_crl((const char *)name->d.ia5->data);
+          auth_trace_event("crl", "download", crl ? "ok" : "error",
+            token_profile_elapsed(&start));
+
+          /*crl = download_crl("file:///home/mario/projects/pkcs11_login/tests/ca_crl_0.pem"); */
+          /*crl = download_crl("http://www-t.zhwin.ch/ca/root_ca.crl"); */
+          /*crl = download_crl("http://www.zhwin.ch/~sri/"); */
+          /*crl = download_crl("ldap://directory.verisign.com:389/CN=VeriSign IECA, OU=IECA-3, OU=Contractor, OU=PKI, OU=DOD, O=U.S. Government, C=US?certificateRevocationList;binary"); */
+          if (crl != NULL)
+            break;
+          else
+            DBG1("download_crl() failed: %s", get_error());
         }
       }
     }
-    sk_DIST_POINT_pop_free(dist_points, DIST_POINT_free);
-    if (crl == NULL) {
-      set_error("downloading the crl failed for all distribution points");
-      return -1;
-    }
-  } else {
-    set_error("policy %d is not supported", policy);
-    return -1;
   }
-  /* verify the crl and check whether the certificate is revoked or not */
-  DBG("verifying crl");
-  rv = verify_crl(crl, ctx);
-  if (rv < 0) {
-    X509_CRL_free(crl);
-    set_error("verify_crl() failed: %s", get_error());
+  sk_DIST_POINT_pop_free(dist_points, DIST_POINT_free);
+  if (crl == NULL)
+    set_error("downloading the crl failed for all distribution points");
+  return crl;
+}
+
+static int check_for_revocation(X509 * x509, X509_STORE_CTX * ctx, cert_policy *policy)
+{
+  int rv;
+  int local_state = CRL_UNUSABLE, online_state;
+  X509_REVOKED *rev = NULL;
+  X509_CRL *local = NULL, *online = NULL, *crl = NULL;
+  crl_policy_t crl_policy = policy->crl_policy;
+
+  DBG1("crl policy: %d", crl_policy);
+  if (crl_policy == CRLP_NONE) {
+    /* NONE */
+    DBG("no revocation-check performed");
+    return 1;
+  } else if (crl_policy != CRLP_ONLINE && crl_policy != CRLP_OFFLINE &&
+             crl_policy != CRLP_AUTO) {
+    set_error("policy %d is not supported", crl_policy);
     return -1;
-  } else if (rv == 0) {
-    return 0;
   }
-  DBG("checking revocation");
-  rv = X509_CRL_get0_by_cert(crl, &rev, x509);
-  X509_CRL_free(crl);
-  return (rv == 0);
+
+  /* OFFLINE, and AUTO: a fresh local crl makes the download needless */
+  if (crl_policy != CRLP_ONLINE) {
+    DBG("looking for an dedicated local crl");
+    local = get_local_crl(x509, ctx);
+    if (local == NULL) {
+      if (crl_policy == CRLP_OFFLINE)
+        return -1;
+      DBG1("get_local_crl() failed: %s", get_error());
+    } else {
+      local_state = crl_state(local, ctx, policy, 1);
+      if (local_state < 0) {
+        X509_CRL_free(local);
+        return -1;
+      }
+      DBG1("local crl is %s", crl_state_names[local_state]);
+      auth_trace_event("crl", "local", crl_state_names[local_state], 0);
+      if (local_state == CRL_FRESH)
+        crl = local;
+    }
+  }
+
+  /* ONLINE, and AUTO without a fresh local crl */
+  if (crl == NULL && crl_policy != CRLP_OFFLINE) {
+    online = get_online_crl(x509, ctx);
+    if (online == NULL) {
+      if (crl_policy == CRLP_ONLINE)
+        return -1;
+      DBG1("get_online_crl() failed: %s", get_error());
+    } else {
+      online_state = crl_state(online, ctx, policy, 0);
+      if (online_state < 0) {
+        X509_CRL_free(online);
+        X509_CRL_free(local);
+        return -1;
+      }
+      DBG1("downloaded crl is %s", crl_state_names[online_state]);
+      if (online_state == CRL_FRESH)
+        crl = online;
+    }
+  }
+
+  /* AUTO: an expired local crl is still accepted within the grace period */
+  if (crl == NULL && local_state == CRL_GRACE && crl_policy == CRLP_AUTO) {
+    DBG("no fresher crl available, using the local crl");
+    crl = local;
+  }
+
+  if (crl == NULL) {
+    rv = (local != NULL || online != NULL) ? 0 : -1;
+    if (rv < 0)
+      set_error("neither a local nor a downloaded crl is available");
+    else
+      DBG("no valid crl available");
+  } else {
+    DBG("checking revocation");
+    rv = (X509_CRL_get0_by_cert(crl, &rev, x509) == 0);
+  }
+  X509_CRL_free(local);
+  X509_CRL_free(online);
+  return rv;
 }
 
 static int add_hash( X509_LOOKUP *lookup, const char *dir) {
@@ -425,14 +557,192 @@ add_store_error:
   return NULL;
 }
 
+/*
+* Validated issuer cache. Once X509_verify_cert() has accepted a chain,
+* the issuer of the user certificate is remembered together with the
+* policy and the state of the ca_dir the chain was built from. Other
+* certificates of the same issuer then only need their own signature and
+* validity checked, as long as the cache entry lives: chain_cache_ttl
+* seconds, never beyond the expiry of a certificate of the path, and
+* until ca_dir changes. Paths carrying constraints on the certificates
+* below them (names, policies, path length) are never cached, nor are
+* their checks skipped for CA or proxy certificates: those are left to
+* X509_verify_cert() every time.
+*/
+#define CHAIN_CACHE_SIZE 16
+
+struct chain_cache_entry {
+  X509 *issuer;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  char *key;
+  time_t expires;
+};
+
+static struct chain_cache_entry chain_cache[CHAIN_CACHE_SIZE];
+static pthread_mutex_t chain_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void chain_cache_drop(struct chain_cache_entry *entry)
+{
+  X509_free(entry->issuer);
+  free(entry->key);
+  memset(entry, 0, sizeof(*entry));
+}
+
+/*
+* what a path is validated against: the policy, and ca_dir as it is now
+* (adding, removing or replacing a hash link changes the directory)
+* @return -1 if ca_dir cannot be read
+*/
+static int chain_cache_key(cert_policy *policy, char *buf, size_t size)
+{
+  const char *pt = policy->ca_dir;
+  struct stat st;
+
+  if (strstr(pt, "file:///")) pt += 8;
+  if (stat(pt, &st) < 0)
+    return -1;
+  snprintf(buf, size, "%d %d %s %s %ld %ld %ld %ld", policy->ca_policy,
+    policy->crl_policy, policy->ca_dir, policy->crl_dir ? policy->crl_dir : "",
+    (long)st.st_dev, (long)st.st_ino, (long)st.st_mtime, (long)st.st_ctime);
+  return 0;
+}
+
+/* whether a CA certificate constrains the certificates issued below it */
+static int path_constrained(X509 * x509)
+{
+  BASIC_CONSTRAINTS *bc;
+  int rv;
+
+  if (X509_get_ext_by_NID(x509, NID_name_constraints, -1) >= 0 ||
+      X509_get_ext_by_NID(x509, NID_policy_constraints, -1) >= 0 ||
+      X509_get_ext_by_NID(x509, NID_policy_mappings, -1) >= 0 ||
+      X509_get_ext_by_NID(x509, NID_inhibit_any_policy, -1) >= 0)
+    return 1;
+  bc = X509_get_ext_d2i(x509, NID_basic_constraints, NULL, NULL);
+  rv = bc != NULL && bc->pathlen != NULL;
+  BASIC_CONSTRAINTS_free(bc);
+  return rv;
+}
+
+/* remember the issuer path just validated in ctx */
+static void chain_cache_add(X509_STORE_CTX * ctx, cert_policy *policy, const char *key)
+{
+  STACK_OF(X509) *chain;
+  struct chain_cache_entry *entry = NULL;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  time_t now = time(NULL), expires = now + policy->chain_cache_ttl;
+  X509 *issuer;
+  int i, found = 0;
+
+  chain = X509_STORE_CTX_get1_chain(ctx);
+  if (chain == NULL)
+    return;
+  /* a trusted certificate on its own has no path worth caching */
+  if (sk_X509_num(chain) < 2)
+    goto end;
+  /* only cache paths which stay valid for the whole lifetime of the entry */
+  for (i = 1; i < sk_X509_num(chain); i++) {
+    if (X509_cmp_time(X509_get_notAfter(sk_X509_value(chain, i)), &expires) <= 0) {
+      DBG("issuer path expires too soon to be cached");
+      goto end;
+    }
+    if (path_constrained(sk_X509_value(chain, i))) {
+      DBG("constrained issuer path not cached");
+      goto end;
+    }
+  }
+  issuer = sk_X509_value(chain, 1);
+  if (!X509_digest(issuer, EVP_sha256(), digest, &digest_len))
+    goto end;
+
+  pthread_mutex_lock(&chain_cache_mutex);
+  for (i = 0; i < CHAIN_CACHE_SIZE; i++) {
+    struct chain_cache_entry *e = &chain_cache[i];
+    if (e->issuer != NULL && e->digest_len == digest_len &&
+        !memcmp(e->digest, digest, digest_len) && !strcmp(e->key, key)) {
+      entry = e;
+      found = 1;
+      break;
+    }
+    /* else take a free entry, or the one expiring first */
+    if (entry == NULL || (entry->issuer != NULL &&
+        (e->issuer == NULL || e->expires < entry->expires)))
+      entry = e;
+  }
+  if (!found) {
+    chain_cache_drop(entry);
+    entry->key = strdup(key);
+    if (entry->key == NULL) {
+      pthread_mutex_unlock(&chain_cache_mutex);
+      goto end;
+    }
+    X509_up_ref(issuer);
+    entry->issuer = issuer;
+    memcpy(entry->digest, digest, digest_len);
+    entry->digest_len = digest_len;
+  }
+  entry->expires = expires;
+  pthread_mutex_unlock(&chain_cache_mutex);
+  DBG1("issuer path cached for %d seconds", policy->chain_cache_ttl);
+end:
+  sk_X509_pop_free(chain, X509_free);
+}
+
+/*
+* check a certificate against the cached issuer paths
+* @return 1 if issued by a cached issuer and valid, 0 if a full
+* verification is needed
+*/
+static int chain_cache_verify(X509 * x509, const char *key)
+{
+  struct chain_cache_entry *entry;
+  EVP_PKEY *pkey;
+  time_t now = time(NULL);
+  int i, rv = 0;
+
+  /* leave unsupported critical extensions, invalid extensions, and the
+     CA and proxy certificates path constraints apply to, to X509_verify_cert() */
+  X509_check_purpose(x509, -1, 0);
+  if (X509_get_extension_flags(x509) &
+      (EXFLAG_CRITICAL | EXFLAG_INVALID | EXFLAG_CA | EXFLAG_PROXY))
+    return 0;
+  if (X509_cmp_current_time(X509_get_notBefore(x509)) >= 0 ||
+      X509_cmp_current_time(X509_get_notAfter(x509)) <= 0)
+    return 0;
+
+  pthread_mutex_lock(&chain_cache_mutex);
+  for (i = 0; i < CHAIN_CACHE_SIZE && rv == 0; i++) {
+    entry = &chain_cache[i];
+    if (entry->issuer == NULL)
+      continue;
+    if (entry->expires <= now) {
+      chain_cache_drop(entry);
+      continue;
+    }
+    if (strcmp(entry->key, key) ||
+        X509_check_issued(entry->issuer, x509) != X509_V_OK)
+      continue;
+    pkey = X509_get_pubkey(entry->issuer);
+    if (pkey == NULL)
+      continue;
+    rv = X509_verify(x509, pkey) == 1;
+    EVP_PKEY_free(pkey);
+  }
+  pthread_mutex_unlock(&chain_cache_mutex);
+  return rv;
+}
+
 /*
 * @return -1 on error, 0 on verify failed, 1 on verify sucess
 */
 int verify_certificate(X509 * x509, cert_policy *policy)
 {
-  int rv;
+  int rv, cached = 0;
   X509_STORE *store;
   X509_STORE_CTX *ctx;
+  char key[1024] = "";
 
   /* if neither ca nor crl check are requested skip */
   if ( (policy->ca_policy==0) && (policy->crl_policy==CRLP_NONE) ) {
@@ -440,6 +750,16 @@ int verify_certificate(X509 * x509, cert_policy *policy)
 	return 1;
   }
 
+  /* the issuer path may already be known to be valid */
+  if (policy->ca_policy && policy->chain_cache_ttl > 0 && policy->ca_dir &&
+      chain_cache_key(policy, key, sizeof(key)) == 0)
+    cached = chain_cache_verify(x509, key);
+  if (cached) {
+    DBG("certificate is valid (cached issuer path)");
+    if (policy->crl_policy == CRLP_NONE)
+      return 1;
+  }
+
   /* setup the x509 store to verify the certificate */
   store = setup_store(policy);
   if (store == NULL) {
@@ -457,7 +777,7 @@ int verify_certificate(X509 * x509, cert_policy *policy)
 #if 0
   X509_STORE_CTX_set_purpose(ctx, purpose);
 #endif
-  if (policy->ca_policy) {
+  if (policy->ca_policy && !cached) {
   rv = X509_verify_cert(ctx);
   if (rv != 1) {
     X509_STORE_CTX_free(ctx);
@@ -480,11 +800,13 @@ int verify_certificate(X509 * x509, cert_policy *policy)
 		return rv;
   } else {
     DBG("certificate is valid");
+    if (key[0])
+      chain_cache_add(ctx, policy, key);
   }
   }
 
   /* verify whether the certificate was revoked or not */
-  rv = check_for_revocation(x509, ctx, policy->crl_policy);
+  rv = check_for_revocation(x509, ctx, policy);
   X509_STORE_CTX_free(ctx);
   X509_STORE_free(store);
   if (rv < 0) {
@@ -36,7 +36,7 @@ typedef enum {
 	CRLP_ONLINE,
 	/** Retrieve CRL from local filesystem */
 	CRLP_OFFLINE,
-	/** Try CRL check online, else ofline, else fail */
+	/** Use the local CRL if fresh, else try online, else fail */
 	CRLP_AUTO
 	} crl_policy_t;
 
@@ -53,6 +53,9 @@ struct cert_policy_st {
 	const char *crl_dir;
 	const char *nss_dir;
 	int ocsp_policy;
+	int crl_max_age;	/* seconds a local CRL is fresh, 0: until nextUpdate */
+	int crl_grace;	/* seconds a stale local CRL is still accepted by crl_auto */
+	int chain_cache_ttl;	/* seconds a validated issuer path is reused, 0: never */
 };
 
 #ifndef __CERT_VFY_C
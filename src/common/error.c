@@ -23,6 +23,22 @@
 
 static char error_buffer[ERROR_BUFFER_SIZE] = "";
 
+/* buffer of the calling thread, if any */
+static __thread char *thread_buffer = NULL;
+static __thread size_t thread_size = 0;
+
+/**
+* store the error messages of the calling thread into its own buffer
+* instead of the shared one
+* @param buffer Buffer to use, NULL to go back to the shared buffer
+* @param size Size of buffer
+*/
+void set_error_buffer(char *buffer, size_t size) {
+  thread_buffer = size ? buffer : NULL;
+  thread_size = size;
+  if (thread_buffer) thread_buffer[0] = '\0';
+}
+
 /**
 * store an error message into a temporary buffer, in a similar way as sprintf does
 * @param format String to be stored
@@ -30,11 +46,18 @@ static char error_buffer[ERROR_BUFFER_SIZE] = "";
 */
 void set_error(const char *format, ...) {
   static char tmp[ERROR_BUFFER_SIZE];
+  char own[ERROR_BUFFER_SIZE];
   va_list ap;
   va_start(ap, format);
-  vsnprintf(tmp, ERROR_BUFFER_SIZE, format, ap);
+  /* format may use the current message */
+  if (thread_buffer) {
+    vsnprintf(own, ERROR_BUFFER_SIZE, format, ap);
+    snprintf(thread_buffer, thread_size, "%s", own);
+  } else {
+    vsnprintf(tmp, ERROR_BUFFER_SIZE, format, ap);
+    strcpy(error_buffer, tmp);
+  }
   va_end(ap);
-  strcpy(error_buffer, tmp);
 }
 
 /**
@@ -42,5 +65,5 @@ void set_error(const char *format, ...) {
 *@return Error message
 */
 const char *get_error(void) {
-  return (const char *)error_buffer;
+  return (const char *)(thread_buffer ? thread_buffer : error_buffer);
 }
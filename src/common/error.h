@@ -28,6 +28,7 @@
 #include <openssl/err.h>
 #endif
 #include <errno.h>
+#include <stddef.h>
 
 /** Default error message buffer size */
 #define ERROR_BUFFER_SIZE 512
@@ -51,5 +52,13 @@ ERROR_EXTERN void set_error(const char *format, ...);
 */
 ERROR_EXTERN const char *get_error(void);
 
+/**
+* store the error messages of the calling thread into its own buffer
+* instead of the shared one, for programs running jobs in parallel
+* @param buffer Buffer to use, NULL to go back to the shared buffer
+* @param size Size of buffer
+*/
+ERROR_EXTERN void set_error_buffer(char *buffer, size_t size);
+
 #undef ERROR_EXTERN
 #endif /* __ERROR_H_ */
@@ -0,0 +1,200 @@
+/*
+ * PAM-PKCS11 card event socket
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+#define __EVENT_SOCKET_C_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "debug.h"
+#include "error.h"
+#include "event_socket.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define MAX_SUBSCRIBERS 64
+
+static int listen_fd = -1;
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int subscribers[MAX_SUBSCRIBERS];
+static int nsubscribers = 0;
+
+static int set_nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+static void drop_subscriber(int i) {
+	DBG1("event subscriber %d disconnected", subscribers[i]);
+	close(subscribers[i]);
+	subscribers[i] = subscribers[--nsubscribers];
+}
+
+int event_socket_open(const char *path, const char *group, int mode) {
+	struct sockaddr_un addr;
+	struct group *gr = NULL;
+	mode_t mask;
+	int fd, rv;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		set_error("event socket name too long: %s", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (group && !(gr = getgrnam(group))) {
+		set_error("unknown event socket group %s", group);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		set_error("socket() failed: %s", strerror(errno));
+		return -1;
+	}
+	/* do not take the socket over from a running event manager */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		close(fd);
+		set_error("event socket %s is in use", path);
+		return -1;
+	}
+	unlink(path);
+	/* nobody may connect before the group and mode are set */
+	mask = umask(0177);
+	rv = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (rv < 0 || (gr && chown(path, (uid_t)-1, gr->gr_gid) < 0)
+		|| chmod(path, mode & 0777) < 0
+		|| listen(fd, 16) < 0 || set_nonblock(fd) < 0) {
+		set_error("cannot listen on %s: %s", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	listen_fd = fd;
+	strcpy(socket_path, path);
+	DBG1("publishing events on %s", path);
+	return 0;
+}
+
+void event_socket_accept(void) {
+	char buf[64];
+	int fd, i;
+	ssize_t n;
+
+	if (listen_fd < 0) return;
+	/* subscribers never write: readable means gone, or to be ignored */
+	for (i = 0; i < nsubscribers; ) {
+		n = recv(subscribers[i], buf, sizeof(buf), MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+			&& errno != EINTR)) {
+			drop_subscriber(i);
+			continue;
+		}
+		i++;
+	}
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		if (nsubscribers == MAX_SUBSCRIBERS || set_nonblock(fd) < 0) {
+			DBG("too many event subscribers, connection refused");
+			close(fd);
+			continue;
+		}
+		DBG1("event subscriber %d connected", fd);
+		subscribers[nsubscribers++] = fd;
+	}
+}
+
+/* append " key=value", escaped, without the blank padding of PKCS#11 */
+static size_t add_field(char *buf, size_t len, size_t size,
+	const char *key, const char *value) {
+	size_t end;
+
+	if (!value) return len;
+	for (end = strlen(value); end > 0 && value[end - 1] == ' '; end--);
+	if (!end) return len;
+	len += snprintf(buf + len, size - len, " %s=", key);
+	for (; end > 0 && len < size; value++, end--) {
+		unsigned char c = (unsigned char)*value;
+		if (c <= ' ' || c >= 0x7f || c == '%' || c == '=')
+			len += snprintf(buf + len, size - len, "%%%02X", c);
+		else
+			buf[len++] = c;
+	}
+	return len < size ? len : size - 1;
+}
+
+void event_socket_publish(const char *event,
+	const char *slot, const char *label, const char *serial, const char *atr) {
+	char line[1024];
+	struct timeval now;
+	size_t len;
+	int i;
+
+	if (listen_fd < 0) return;
+	event_socket_accept();
+	if (!nsubscribers) return;
+
+	gettimeofday(&now, NULL);
+	len = snprintf(line, sizeof(line) - 1, "event=%s time=%ld.%06ld",
+		event, (long)now.tv_sec, (long)now.tv_usec);
+	len = add_field(line, len, sizeof(line) - 1, "slot", slot);
+	len = add_field(line, len, sizeof(line) - 1, "label", label);
+	len = add_field(line, len, sizeof(line) - 1, "serial", serial);
+	len = add_field(line, len, sizeof(line) - 1, "atr", atr);
+	line[len++] = '\n';
+
+	for (i = 0; i < nsubscribers; ) {
+		/* a line is written whole or the subscriber is dropped */
+		if (send(subscribers[i], line, len, MSG_DONTWAIT | MSG_NOSIGNAL)
+			!= (ssize_t)len) {
+			drop_subscriber(i);
+			continue;
+		}
+		i++;
+	}
+	DBG2("event %s sent to %d subscriber(s)", event, nsubscribers);
+}
+
+void event_socket_close(void) {
+	if (listen_fd < 0) return;
+	while (nsubscribers) drop_subscriber(0);
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(socket_path);
+}
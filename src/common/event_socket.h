@@ -0,0 +1,85 @@
+/*
+ * PAM-PKCS11 card event socket
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/** \file
+ The card event managers publish every card event on a local UNIX stream
+ socket, so that screen lockers or session managers can react without an
+ action being spawned for them. Subscribers connect and read one line per
+ event, made of space separated key=value fields:
+
+ event=card_remove time=1700000000.123456 slot=... label=... serial=... atr=...
+
+ Fields without a value are left out. Values are escaped as %XX for
+ spaces, '=', '%' and non printable characters. Subscribers never write;
+ a subscriber that does not keep up with the events is disconnected.
+*/
+
+#ifndef __EVENT_SOCKET_H_
+#define __EVENT_SOCKET_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef __EVENT_SOCKET_C_
+#define EVENT_SOCKET_EXTERN extern
+#else
+#define EVENT_SOCKET_EXTERN
+#endif
+
+/** Default permissions of the event socket: subscribing needs write access */
+#define EVENT_SOCKET_MODE 0660
+
+/**
+* Create the event socket. A stale socket file is replaced, a socket
+* still served by another process is not.
+*@param path Socket file name
+*@param group Group owning the socket, NULL to keep the group of the process
+*@param mode Permissions of the socket, EVENT_SOCKET_MODE by default
+*@return 0 on success, -1 on error
+*/
+EVENT_SOCKET_EXTERN int event_socket_open(const char *path, const char *group, int mode);
+
+/**
+* Accept pending subscribers and drop the ones which have disconnected.
+* Meant to be called from the event loop, it never blocks.
+*/
+EVENT_SOCKET_EXTERN void event_socket_accept(void);
+
+/**
+* Send an event to every subscriber
+*@param event Event name, as the event blocks of the configuration
+*@param slot Slot description or reader name, may be NULL
+*@param label Token label, may be NULL
+*@param serial Token serial number, may be NULL
+*@param atr Hexadecimal ATR, may be NULL
+*/
+EVENT_SOCKET_EXTERN void event_socket_publish(const char *event,
+	const char *slot, const char *label, const char *serial, const char *atr);
+
+/**
+* Disconnect the subscribers and remove the socket file
+*/
+EVENT_SOCKET_EXTERN void event_socket_close(void);
+
+#undef EVENT_SOCKET_EXTERN
+
+#endif /* __EVENT_SOCKET_H_ */
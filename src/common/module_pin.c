@@ -0,0 +1,77 @@
+/*
+ * PAM-PKCS11 module pinning
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/* dladdr() */
+#define _GNU_SOURCE
+#define __MODULE_PIN_C_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <dlfcn.h>
+#include <sys/auxv.h>
+#include <pthread.h>
+#include "debug.h"
+#include "error.h"
+#include "module_pin.h"
+
+static pthread_mutex_t pin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int pinned = 0;
+
+int pin_module(void) {
+	Dl_info info, prog;
+	void *handle;
+	int rv = 0;
+
+	pthread_mutex_lock(&pin_mutex);
+	if (pinned) goto out;
+#ifdef RTLD_NODELETE
+	if (!dladdr((void *)pin_module, &info) || !info.dli_fname) {
+		set_error("dladdr() failed");
+		rv = -1;
+		goto out;
+	}
+	/* linked into a program, whose headers the kernel mapped: never unloaded */
+	if (dladdr((void *)getauxval(AT_PHDR), &prog) && prog.dli_fbase == info.dli_fbase) {
+		pinned = 1;
+		goto out;
+	}
+	/* the handle is never closed: one more reference, never dropped */
+	handle = dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE);
+	if (!handle) {
+		set_error("cannot keep %s loaded: %s", info.dli_fname, dlerror());
+		rv = -1;
+		goto out;
+	}
+	DBG1("%s kept loaded until the process exits", info.dli_fname);
+	pinned = 1;
+#else
+	(void)info;
+	(void)prog;
+	(void)handle;
+	set_error("RTLD_NODELETE not supported");
+	rv = -1;
+#endif
+out:
+	pthread_mutex_unlock(&pin_mutex);
+	return rv;
+}
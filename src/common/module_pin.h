@@ -0,0 +1,53 @@
+/*
+ * PAM-PKCS11 module pinning
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/** \file
+ The PAM library unloads pam_pkcs11 at pam_end(), which would drop
+ everything kept between authentications (parsed configuration, mapper
+ chain, PKCS#11 modules) and leave threads still running in unmapped
+ code. State meant to outlive an authentication pins the module first:
+ it then stays loaded until the process exits, and the next pam_start()
+ finds it as it was left.
+*/
+
+#ifndef __MODULE_PIN_H_
+#define __MODULE_PIN_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef __MODULE_PIN_C_
+#define MODULE_PIN_EXTERN extern
+#else
+#define MODULE_PIN_EXTERN
+#endif
+
+/**
+* Keep the shared object holding this code loaded until the process
+* exits. Does nothing when linked into a program
+*@return 0 on success, -1 on error (the object may still be unloaded)
+*/
+MODULE_PIN_EXTERN int pin_module(void);
+
+#undef MODULE_PIN_EXTERN
+
+#endif /* __MODULE_PIN_H_ */
@@ -93,9 +93,12 @@ extern "C" {
 #define EVP_MD_CTX_free			EVP_MD_CTX_destroy
 #define EVP_PKEY_up_ref(user_key)	CRYPTO_add(&user_key->references, 1, CRYPTO_LOCK_EVP_PKEY)
 #define X509_up_ref(cert)		CRYPTO_add(&cert->references, 1, CRYPTO_LOCK_X509)
+#define X509_CRL_up_ref(crl)		CRYPTO_add(&crl->references, 1, CRYPTO_LOCK_X509_CRL)
 #define X509_get0_tbs_sigalg(x)		(x->cert_info->key->algor)
 #define X509_OBJECT_get0_X509(x)	(x->data.x509)
 #define X509_OBJECT_get0_X509_CRL(x)	(x->data.crl)
+#define X509_CRL_get0_lastUpdate(x)	X509_CRL_get_lastUpdate(x)
+#define X509_CRL_get0_nextUpdate(x)	X509_CRL_get_nextUpdate(x)
 #define RSA_get0_e(x) (x->e)
 #define RSA_get0_n(x) (x->n)
 #define ECDSA_SIG_get0_r(x) (x->r)
@@ -0,0 +1,742 @@
+/*
+ * PAM-PKCS11 PKCS#11 call deadlines
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+#define __PKCS11_DEADLINE_C_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef HAVE_NSS
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "debug.h"
+#include "module_pin.h"
+#include "pkcs11_lib.h"
+#include "pkcs11_deadline.h"
+
+/* operation flag of C_SessionCancel(), PKCS#11 3.0 */
+#ifndef CKF_FIND_OBJECTS
+#define CKF_FIND_OBJECTS 0x00000040UL
+#endif
+
+/*
+* One interposer per module: the registry keeps several modules loaded at
+* once. A function list gives no context to its functions, so each
+* interposer has its own entry points (see DEADLINE_ENTRY_POINTS), which
+* hand it to the code below.
+*/
+#define DEADLINE_WRAPPERS 8
+
+struct deadline_wrapper {
+	CK_FUNCTION_LIST fl; /* handed out in place of the module's list */
+	CK_FUNCTION_LIST_PTR real_fl; /* the module's list, NULL when unused */
+	int deadline_ms;
+	pkcs11_session_cancel_t session_cancel;
+	int refs; /* handles using the interposer */
+	int pending; /* calls and cancellations still running in the module */
+};
+
+static struct deadline_wrapper wrappers[DEADLINE_WRAPPERS];
+
+/* protects the interposers and the calls in progress */
+static pthread_mutex_t deadline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+enum {
+	D_OpenSession, D_CloseSession, D_GetSessionInfo, D_GetTokenInfo,
+	D_Login, D_Logout, D_FindObjectsInit, D_FindObjects, D_FindObjectsFinal,
+	D_GetAttributeValue, D_SignInit, D_Sign
+};
+
+static const char *deadline_names[] = {
+	"C_OpenSession", "C_CloseSession", "C_GetSessionInfo", "C_GetTokenInfo",
+	"C_Login", "C_Logout", "C_FindObjectsInit", "C_FindObjects", "C_FindObjectsFinal",
+	"C_GetAttributeValue", "C_SignInit", "C_Sign"
+};
+
+/* a call, with private copies of its arguments */
+struct pkcs11_call {
+	struct deadline_wrapper *w;
+	CK_FUNCTION_LIST_PTR fl; /* the module's list */
+	int deadline_ms;
+	pkcs11_session_cancel_t session_cancel;
+	int fn;
+	CK_SESSION_HANDLE session;
+	CK_SLOT_ID slot;
+	CK_FLAGS flags;
+	CK_VOID_PTR application;
+	CK_NOTIFY notify;
+	CK_SESSION_INFO session_info;
+	CK_TOKEN_INFO token_info;
+	CK_USER_TYPE user;
+	CK_BYTE_PTR data; /* PIN, or data to sign */
+	CK_ULONG data_len;
+	CK_ATTRIBUTE_PTR attrs;
+	CK_ULONG count; /* attributes, or objects wanted */
+	CK_OBJECT_HANDLE object; /* object read, or signing key */
+	CK_OBJECT_HANDLE_PTR objects;
+	CK_ULONG found;
+	CK_MECHANISM mechanism;
+	CK_BYTE_PTR signature;
+	CK_ULONG signature_len;
+	CK_RV rv;
+	int done;
+	int abandoned;
+	pthread_cond_t cond;
+};
+
+/* a session to cancel, once its call has been given up */
+struct pkcs11_cancel {
+	struct deadline_wrapper *w;
+	CK_FUNCTION_LIST_PTR fl;
+	pkcs11_session_cancel_t session_cancel;
+	int fn;
+	CK_SESSION_HANDLE session;
+};
+
+static struct pkcs11_call *new_call(struct deadline_wrapper *w, int fn, CK_SESSION_HANDLE session) {
+	struct pkcs11_call *call = calloc(1, sizeof(struct pkcs11_call));
+	pthread_condattr_t attr;
+
+	if (!call) return NULL;
+	pthread_mutex_lock(&deadline_mutex);
+	call->w = w;
+	call->fl = w->real_fl;
+	call->deadline_ms = w->deadline_ms;
+	call->session_cancel = w->session_cancel;
+	pthread_mutex_unlock(&deadline_mutex);
+	call->fn = fn;
+	call->session = session;
+	/* deadlines are not moved by changes of the system time */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&call->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return call;
+}
+
+static void free_call(struct pkcs11_call *call) {
+	CK_ULONG i;
+
+	if (call->data) {
+		cleanse(call->data, call->data_len);
+		free(call->data);
+	}
+	if (call->attrs) {
+		for (i = 0; i < call->count; i++)
+			free(call->attrs[i].pValue);
+		free(call->attrs);
+	}
+	free(call->objects);
+	free(call->mechanism.pParameter);
+	free(call->signature);
+	pthread_cond_destroy(&call->cond);
+	free(call);
+}
+
+static CK_BYTE_PTR copy_bytes(const void *src, CK_ULONG len) {
+	CK_BYTE_PTR copy = malloc(len ? len : 1);
+
+	if (copy) memcpy(copy, src, len);
+	return copy;
+}
+
+/* copy a template with its values; the values are read back by copy_back() */
+static CK_ATTRIBUTE_PTR copy_template(CK_ATTRIBUTE_PTR attrs, CK_ULONG count) {
+	CK_ATTRIBUTE_PTR copy = calloc(count ? count : 1, sizeof(CK_ATTRIBUTE));
+	CK_ULONG i;
+
+	if (!copy) return NULL;
+	for (i = 0; i < count; i++) {
+		copy[i].type = attrs[i].type;
+		copy[i].ulValueLen = attrs[i].ulValueLen;
+		if (attrs[i].pValue == NULL) continue;
+		copy[i].pValue = copy_bytes(attrs[i].pValue, attrs[i].ulValueLen);
+		if (copy[i].pValue == NULL) {
+			while (i--) free(copy[i].pValue);
+			free(copy);
+			return NULL;
+		}
+	}
+	return copy;
+}
+
+static void copy_back(CK_ATTRIBUTE_PTR attrs, const CK_ATTRIBUTE *copy, CK_ULONG count) {
+	CK_ULONG i;
+
+	for (i = 0; i < count; i++) {
+		if (attrs[i].pValue && copy[i].pValue && copy[i].ulValueLen != (CK_ULONG)-1
+			&& copy[i].ulValueLen <= attrs[i].ulValueLen)
+			memcpy(attrs[i].pValue, copy[i].pValue, copy[i].ulValueLen);
+		attrs[i].ulValueLen = copy[i].ulValueLen;
+	}
+}
+
+static void run_call(struct pkcs11_call *call) {
+	switch (call->fn) {
+	case D_OpenSession:
+		call->rv = call->fl->C_OpenSession(call->slot, call->flags,
+			call->application, call->notify, &call->session);
+		break;
+	case D_CloseSession:
+		call->rv = call->fl->C_CloseSession(call->session);
+		break;
+	case D_GetSessionInfo:
+		call->rv = call->fl->C_GetSessionInfo(call->session, &call->session_info);
+		break;
+	case D_GetTokenInfo:
+		call->rv = call->fl->C_GetTokenInfo(call->slot, &call->token_info);
+		break;
+	case D_Login:
+		call->rv = call->fl->C_Login(call->session, call->user,
+			call->data, call->data_len);
+		break;
+	case D_Logout:
+		call->rv = call->fl->C_Logout(call->session);
+		break;
+	case D_FindObjectsInit:
+		call->rv = call->fl->C_FindObjectsInit(call->session, call->attrs, call->count);
+		break;
+	case D_FindObjects:
+		call->rv = call->fl->C_FindObjects(call->session, call->objects,
+			call->count, &call->found);
+		break;
+	case D_FindObjectsFinal:
+		call->rv = call->fl->C_FindObjectsFinal(call->session);
+		break;
+	case D_GetAttributeValue:
+		call->rv = call->fl->C_GetAttributeValue(call->session, call->object,
+			call->attrs, call->count);
+		break;
+	case D_SignInit:
+		call->rv = call->fl->C_SignInit(call->session, &call->mechanism, call->object);
+		break;
+	case D_Sign:
+		call->rv = call->fl->C_Sign(call->session, call->data, call->data_len,
+			call->signature, &call->signature_len);
+		break;
+	}
+}
+
+/* a call or cancellation left running has returned, called with deadline_mutex held */
+static void pending_done(struct deadline_wrapper *w) {
+	w->pending--;
+	if (w->pending == 0 && w->refs == 0)
+		w->real_fl = NULL;
+}
+
+static void *call_worker(void *arg) {
+	struct pkcs11_call *call = arg;
+	int abandoned;
+
+	run_call(call);
+	pthread_mutex_lock(&deadline_mutex);
+	call->done = 1;
+	abandoned = call->abandoned;
+	if (!abandoned)
+		pthread_cond_signal(&call->cond);
+	pthread_mutex_unlock(&deadline_mutex);
+	if (!abandoned) return NULL;
+
+	/* nobody waits for this answer anymore */
+	DBG2("%s returned 0x%08lX after its deadline", deadline_names[call->fn], call->rv);
+	if (call->fn == D_OpenSession && call->rv == CKR_OK)
+		call->fl->C_CloseSession(call->session);
+	pthread_mutex_lock(&deadline_mutex);
+	pending_done(call->w);
+	pthread_mutex_unlock(&deadline_mutex);
+	free_call(call);
+	return NULL;
+}
+
+static void *cancel_worker(void *arg) {
+	struct pkcs11_cancel *cancel = arg;
+	CK_FLAGS op = 0;
+	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+
+	switch (cancel->fn) {
+	case D_FindObjectsInit:
+	case D_FindObjects:
+	case D_FindObjectsFinal:
+		op = CKF_FIND_OBJECTS;
+		break;
+	case D_SignInit:
+	case D_Sign:
+		op = CKF_SIGN;
+		break;
+	}
+	if (cancel->session_cancel && op)
+		rv = cancel->session_cancel(cancel->session, op);
+	if (rv != CKR_OK) {
+		/* the other operations can only be aborted with their session */
+		rv = cancel->fl->C_CloseSession(cancel->session);
+	}
+	DBG2("%s cancelled: 0x%08lX", deadline_names[cancel->fn], rv);
+	pthread_mutex_lock(&deadline_mutex);
+	pending_done(cancel->w);
+	pthread_mutex_unlock(&deadline_mutex);
+	free(cancel);
+	return NULL;
+}
+
+/*
+* cancel the session of a call given up at its deadline. The cancellation
+* may block on the module as well, so it gets its own thread.
+*/
+static void cancel_session(struct pkcs11_cancel *given_up) {
+	struct pkcs11_cancel *cancel;
+	pthread_t thread;
+	pthread_attr_t attr;
+	int fn = given_up->fn, rv;
+
+	if (fn == D_OpenSession || fn == D_CloseSession || fn == D_GetTokenInfo)
+		return;
+	cancel = malloc(sizeof(struct pkcs11_cancel));
+	if (!cancel) return;
+	*cancel = *given_up;
+	pthread_mutex_lock(&deadline_mutex);
+	cancel->w->pending++;
+	pthread_mutex_unlock(&deadline_mutex);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rv = pthread_create(&thread, &attr, cancel_worker, cancel);
+	pthread_attr_destroy(&attr);
+	if (rv != 0) {
+		DBG1("Cannot start cancel thread: %s", strerror(rv));
+		pthread_mutex_lock(&deadline_mutex);
+		pending_done(cancel->w);
+		pthread_mutex_unlock(&deadline_mutex);
+		free(cancel);
+	}
+}
+
+/*
+* run a call in a worker thread and wait for it until the deadline.
+* returns 0 when the call returned, its results are then in the call;
+* -1 when it was given up: the call is no longer ours
+*/
+static int deadline_call(struct pkcs11_call *call) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	struct timespec ts;
+	struct pkcs11_cancel given_up;
+	int rv;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += call->deadline_ms / 1000;
+	ts.tv_nsec += (call->deadline_ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rv = pthread_create(&thread, &attr, call_worker, call);
+	pthread_attr_destroy(&attr);
+	if (rv != 0) {
+		DBG1("Cannot start PKCS#11 call thread: %s, no deadline applied", strerror(rv));
+		run_call(call);
+		return 0;
+	}
+
+	rv = 0;
+	pthread_mutex_lock(&deadline_mutex);
+	while (!call->done && rv != ETIMEDOUT)
+		rv = pthread_cond_timedwait(&call->cond, &deadline_mutex, &ts);
+	/*
+	* the worker, and the module, may run past pam_end(): the call can
+	* only be left behind if they stay loaded until then
+	*/
+	if (!call->done && pin_module() != 0) {
+		DBG1("%s: no answer in time, but pam_pkcs11 cannot be kept loaded: still waiting",
+			deadline_names[call->fn]);
+		while (!call->done)
+			pthread_cond_wait(&call->cond, &deadline_mutex);
+	}
+	if (call->done) {
+		pthread_mutex_unlock(&deadline_mutex);
+		return 0;
+	}
+	/* the worker releases the call when it returns, if ever */
+	call->abandoned = 1;
+	call->w->pending++;
+	given_up.w = call->w;
+	given_up.fl = call->fl;
+	given_up.session_cancel = call->session_cancel;
+	given_up.fn = call->fn;
+	given_up.session = call->session;
+	pthread_mutex_unlock(&deadline_mutex);
+	DBG2("%s: no answer within %d ms, given up", deadline_names[given_up.fn],
+		call->deadline_ms);
+	cancel_session(&given_up);
+	return -1;
+}
+
+static CK_RV deadline_OpenSession(struct deadline_wrapper *w, CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication,
+	CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession) {
+	struct pkcs11_call *call = new_call(w, D_OpenSession, CK_INVALID_HANDLE);
+	CK_RV rv;
+
+	if (!call) return CKR_HOST_MEMORY;
+	call->slot = slotID;
+	call->flags = flags;
+	call->application = pApplication;
+	call->notify = Notify;
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	if (rv == CKR_OK) *phSession = call->session;
+	free_call(call);
+	return rv;
+}
+
+/* calls with no other argument than their session */
+static CK_RV session_call(struct deadline_wrapper *w, int fn, CK_SESSION_HANDLE hSession) {
+	struct pkcs11_call *call = new_call(w, fn, hSession);
+	CK_RV rv;
+
+	if (!call) return CKR_HOST_MEMORY;
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	free_call(call);
+	return rv;
+}
+
+static CK_RV deadline_CloseSession(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession) {
+	return session_call(w, D_CloseSession, hSession);
+}
+
+static CK_RV deadline_GetSessionInfo(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo) {
+	struct pkcs11_call *call = new_call(w, D_GetSessionInfo, hSession);
+	CK_RV rv;
+
+	if (!call) return CKR_HOST_MEMORY;
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	if (rv == CKR_OK) *pInfo = call->session_info;
+	free_call(call);
+	return rv;
+}
+
+static CK_RV deadline_GetTokenInfo(struct deadline_wrapper *w, CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo) {
+	struct pkcs11_call *call = new_call(w, D_GetTokenInfo, CK_INVALID_HANDLE);
+	CK_RV rv;
+
+	if (!call) return CKR_HOST_MEMORY;
+	call->slot = slotID;
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	if (rv == CKR_OK) *pInfo = call->token_info;
+	free_call(call);
+	return rv;
+}
+
+static CK_RV deadline_Login(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
+	CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) {
+	struct pkcs11_call *call = new_call(w, D_Login, hSession);
+	CK_RV rv;
+
+	if (!call) return CKR_HOST_MEMORY;
+	call->user = userType;
+	if (pPin) {
+		call->data_len = ulPinLen;
+		call->data = copy_bytes(pPin, ulPinLen);
+		if (!call->data) {
+			free_call(call);
+			return CKR_HOST_MEMORY;
+		}
+	}
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	free_call(call);
+	return rv;
+}
+
+static CK_RV deadline_Logout(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession) {
+	return session_call(w, D_Logout, hSession);
+}
+
+static CK_RV deadline_FindObjectsInit(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate,
+	CK_ULONG ulCount) {
+	struct pkcs11_call *call = new_call(w, D_FindObjectsInit, hSession);
+	CK_RV rv;
+
+	if (!call) return CKR_HOST_MEMORY;
+	if (pTemplate) {
+		call->attrs = copy_template(pTemplate, ulCount);
+		if (!call->attrs) {
+			free_call(call);
+			return CKR_HOST_MEMORY;
+		}
+	}
+	call->count = ulCount;
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	free_call(call);
+	return rv;
+}
+
+static CK_RV deadline_FindObjects(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+	CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount) {
+	struct pkcs11_call *call = new_call(w, D_FindObjects, hSession);
+	CK_RV rv;
+
+	if (!call) return CKR_HOST_MEMORY;
+	call->objects = calloc(ulMaxObjectCount ? ulMaxObjectCount : 1, sizeof(CK_OBJECT_HANDLE));
+	if (!call->objects) {
+		free_call(call);
+		return CKR_HOST_MEMORY;
+	}
+	call->count = ulMaxObjectCount;
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	if (rv == CKR_OK) {
+		if (call->found > ulMaxObjectCount) call->found = ulMaxObjectCount;
+		memcpy(phObject, call->objects, call->found * sizeof(CK_OBJECT_HANDLE));
+		*pulObjectCount = call->found;
+	}
+	free_call(call);
+	return rv;
+}
+
+static CK_RV deadline_FindObjectsFinal(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession) {
+	return session_call(w, D_FindObjectsFinal, hSession);
+}
+
+static CK_RV deadline_GetAttributeValue(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+	CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+	struct pkcs11_call *call = new_call(w, D_GetAttributeValue, hSession);
+	CK_RV rv;
+
+	if (!call) return CKR_HOST_MEMORY;
+	call->attrs = copy_template(pTemplate, ulCount);
+	if (!call->attrs) {
+		free_call(call);
+		return CKR_HOST_MEMORY;
+	}
+	call->count = ulCount;
+	call->object = hObject;
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	copy_back(pTemplate, call->attrs, ulCount);
+	free_call(call);
+	return rv;
+}
+
+static CK_RV deadline_SignInit(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey) {
+	struct pkcs11_call *call;
+	CK_RV rv;
+
+	if (!pMechanism) return CKR_ARGUMENTS_BAD;
+	call = new_call(w, D_SignInit, hSession);
+	if (!call) return CKR_HOST_MEMORY;
+	call->mechanism.mechanism = pMechanism->mechanism;
+	if (pMechanism->pParameter) {
+		call->mechanism.ulParameterLen = pMechanism->ulParameterLen;
+		call->mechanism.pParameter = copy_bytes(pMechanism->pParameter,
+			pMechanism->ulParameterLen);
+		if (!call->mechanism.pParameter) {
+			free_call(call);
+			return CKR_HOST_MEMORY;
+		}
+	}
+	call->object = hKey;
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	free_call(call);
+	return rv;
+}
+
+static CK_RV deadline_Sign(struct deadline_wrapper *w, CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+	CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) {
+	struct pkcs11_call *call;
+	CK_RV rv;
+
+	if (!pulSignatureLen) return CKR_ARGUMENTS_BAD;
+	call = new_call(w, D_Sign, hSession);
+	if (!call) return CKR_HOST_MEMORY;
+	if (pData) {
+		call->data_len = ulDataLen;
+		call->data = copy_bytes(pData, ulDataLen);
+	}
+	call->signature_len = *pulSignatureLen;
+	if (pSignature)
+		call->signature = malloc(*pulSignatureLen ? *pulSignatureLen : 1);
+	if ((pData && !call->data) || (pSignature && !call->signature)) {
+		free_call(call);
+		return CKR_HOST_MEMORY;
+	}
+	if (deadline_call(call) < 0) return CKR_FUNCTION_CANCELED;
+	rv = call->rv;
+	if (rv == CKR_OK && pSignature && call->signature_len <= *pulSignatureLen)
+		memcpy(pSignature, call->signature, call->signature_len);
+	if (rv == CKR_OK || rv == CKR_BUFFER_TOO_SMALL)
+		*pulSignatureLen = call->signature_len;
+	free_call(call);
+	return rv;
+}
+
+/*
+* the entry points of interposer i
+*/
+#define DEADLINE_ENTRY_POINTS(i) \
+static CK_RV deadline_OpenSession_##i(CK_SLOT_ID slotID, CK_FLAGS flags, \
+	CK_VOID_PTR pApplication, CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession) { \
+	return deadline_OpenSession(&wrappers[i], slotID, flags, pApplication, Notify, phSession); \
+} \
+static CK_RV deadline_CloseSession_##i(CK_SESSION_HANDLE hSession) { \
+	return deadline_CloseSession(&wrappers[i], hSession); \
+} \
+static CK_RV deadline_GetSessionInfo_##i(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo) { \
+	return deadline_GetSessionInfo(&wrappers[i], hSession, pInfo); \
+} \
+static CK_RV deadline_GetTokenInfo_##i(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo) { \
+	return deadline_GetTokenInfo(&wrappers[i], slotID, pInfo); \
+} \
+static CK_RV deadline_Login_##i(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, \
+	CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) { \
+	return deadline_Login(&wrappers[i], hSession, userType, pPin, ulPinLen); \
+} \
+static CK_RV deadline_Logout_##i(CK_SESSION_HANDLE hSession) { \
+	return deadline_Logout(&wrappers[i], hSession); \
+} \
+static CK_RV deadline_FindObjectsInit_##i(CK_SESSION_HANDLE hSession, \
+	CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) { \
+	return deadline_FindObjectsInit(&wrappers[i], hSession, pTemplate, ulCount); \
+} \
+static CK_RV deadline_FindObjects_##i(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, \
+	CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount) { \
+	return deadline_FindObjects(&wrappers[i], hSession, phObject, ulMaxObjectCount, \
+		pulObjectCount); \
+} \
+static CK_RV deadline_FindObjectsFinal_##i(CK_SESSION_HANDLE hSession) { \
+	return deadline_FindObjectsFinal(&wrappers[i], hSession); \
+} \
+static CK_RV deadline_GetAttributeValue_##i(CK_SESSION_HANDLE hSession, \
+	CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) { \
+	return deadline_GetAttributeValue(&wrappers[i], hSession, hObject, pTemplate, ulCount); \
+} \
+static CK_RV deadline_SignInit_##i(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, \
+	CK_OBJECT_HANDLE hKey) { \
+	return deadline_SignInit(&wrappers[i], hSession, pMechanism, hKey); \
+} \
+static CK_RV deadline_Sign_##i(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, \
+	CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) { \
+	return deadline_Sign(&wrappers[i], hSession, pData, ulDataLen, pSignature, \
+		pulSignatureLen); \
+} \
+static void deadline_entry_points_##i(CK_FUNCTION_LIST_PTR fl) { \
+	fl->C_OpenSession = deadline_OpenSession_##i; \
+	fl->C_CloseSession = deadline_CloseSession_##i; \
+	fl->C_GetSessionInfo = deadline_GetSessionInfo_##i; \
+	fl->C_GetTokenInfo = deadline_GetTokenInfo_##i; \
+	fl->C_Login = deadline_Login_##i; \
+	fl->C_Logout = deadline_Logout_##i; \
+	fl->C_FindObjectsInit = deadline_FindObjectsInit_##i; \
+	fl->C_FindObjects = deadline_FindObjects_##i; \
+	fl->C_FindObjectsFinal = deadline_FindObjectsFinal_##i; \
+	fl->C_GetAttributeValue = deadline_GetAttributeValue_##i; \
+	fl->C_SignInit = deadline_SignInit_##i; \
+	fl->C_Sign = deadline_Sign_##i; \
+}
+
+DEADLINE_ENTRY_POINTS(0)
+DEADLINE_ENTRY_POINTS(1)
+DEADLINE_ENTRY_POINTS(2)
+DEADLINE_ENTRY_POINTS(3)
+DEADLINE_ENTRY_POINTS(4)
+DEADLINE_ENTRY_POINTS(5)
+DEADLINE_ENTRY_POINTS(6)
+DEADLINE_ENTRY_POINTS(7)
+
+static void (* const deadline_entry_points[DEADLINE_WRAPPERS])(CK_FUNCTION_LIST_PTR) = {
+	deadline_entry_points_0, deadline_entry_points_1,
+	deadline_entry_points_2, deadline_entry_points_3,
+	deadline_entry_points_4, deadline_entry_points_5,
+	deadline_entry_points_6, deadline_entry_points_7
+};
+
+/* the interposer of a module, called with deadline_mutex held */
+static struct deadline_wrapper *find_wrapper(CK_FUNCTION_LIST_PTR fl) {
+	int i;
+
+	for (i = 0; i < DEADLINE_WRAPPERS; i++)
+		if (fl && wrappers[i].real_fl == fl) return &wrappers[i];
+	return NULL;
+}
+
+CK_FUNCTION_LIST_PTR pkcs11_deadline_wrap(CK_FUNCTION_LIST_PTR fl,
+	int timeout, pkcs11_session_cancel_t cancel) {
+	struct deadline_wrapper *w;
+	int i;
+
+	pthread_mutex_lock(&deadline_mutex);
+	w = find_wrapper(fl);
+	for (i = 0; !w && i < DEADLINE_WRAPPERS; i++) {
+		if (wrappers[i].real_fl) continue;
+		w = &wrappers[i];
+		w->fl = *fl;
+		deadline_entry_points[i](&w->fl);
+		w->real_fl = fl;
+		w->refs = 0;
+		w->pending = 0;
+	}
+	if (!w) {
+		pthread_mutex_unlock(&deadline_mutex);
+		DBG1("More than %d modules with deadlines, calls run without one",
+			DEADLINE_WRAPPERS);
+		return fl;
+	}
+	w->deadline_ms = timeout;
+	w->session_cancel = cancel;
+	w->refs++;
+	pthread_mutex_unlock(&deadline_mutex);
+	DBG2("PKCS#11 calls given up after %d ms, %s", timeout,
+		cancel ? "cancelled with C_SessionCancel()" : "cancelled by closing their session");
+	return &w->fl;
+}
+
+void pkcs11_deadline_unwrap(CK_FUNCTION_LIST_PTR fl) {
+	struct deadline_wrapper *w;
+
+	pthread_mutex_lock(&deadline_mutex);
+	w = find_wrapper(fl);
+	if (w && --w->refs == 0 && w->pending == 0)
+		w->real_fl = NULL;
+	pthread_mutex_unlock(&deadline_mutex);
+}
+
+int pkcs11_deadline_pending(CK_FUNCTION_LIST_PTR fl) {
+	struct deadline_wrapper *w;
+	int n;
+
+	pthread_mutex_lock(&deadline_mutex);
+	w = find_wrapper(fl);
+	n = w ? w->pending : 0;
+	pthread_mutex_unlock(&deadline_mutex);
+	return n;
+}
+
+#endif /* HAVE_NSS */
@@ -0,0 +1,93 @@
+/*
+ * PAM-PKCS11 PKCS#11 call deadlines
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/** \file
+ The deadline interposer runs every token operation pkcs11_lib issues on
+ a session (open, login, logout, object search, attribute read, signature)
+ in a worker thread, and gives up on it at a deadline. The worker gets
+ private copies of the arguments, so that a call left running can never
+ write into the caller's buffers.
+
+ A call which misses its deadline returns CKR_FUNCTION_CANCELED and is
+ cancelled with C_SessionCancel() when the module has it (PKCS#11 3.0)
+ and the operation allows it, by closing its session otherwise. This
+ calls the module while the abandoned call still runs, so the module must
+ be initialised for concurrent calls.
+
+ The abandoned worker runs pam_pkcs11 code until the module answers,
+ possibly after pam_end(). pam_pkcs11 is pinned (see module_pin.h) before
+ a call is given up, and the PKCS#11 module is neither finalised nor
+ unloaded while such calls are pending. If pam_pkcs11 cannot be pinned,
+ the call is waited for with no deadline.
+
+ Each module gets its own interposer, shared by the handles using it,
+ and its own count of pending calls: a stuck module keeps no other one
+ loaded. Up to 8 modules can have deadlines at once.
+*/
+
+#ifndef __PKCS11_DEADLINE_H_
+#define __PKCS11_DEADLINE_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include "rsaref/pkcs11.h"
+
+#ifndef __PKCS11_DEADLINE_C_
+#define PKCS11_DEADLINE_EXTERN extern
+#else
+#define PKCS11_DEADLINE_EXTERN
+#endif
+
+/** C_SessionCancel() of PKCS#11 3.0 */
+typedef CK_RV (*pkcs11_session_cancel_t)(CK_SESSION_HANDLE, CK_FLAGS);
+
+/**
+* Interpose the deadlines. The module must have been initialised for
+* concurrent calls (CKF_OS_LOCKING_OK). Each call must be matched by a
+* pkcs11_deadline_unwrap()
+*@param fl Function list of the module
+*@param timeout Deadline of every call, in milliseconds
+*@param cancel C_SessionCancel() of the module, or NULL
+*@return function list to be used in place of fl, fl itself when no
+* interposer is left
+*/
+PKCS11_DEADLINE_EXTERN CK_FUNCTION_LIST_PTR pkcs11_deadline_wrap(CK_FUNCTION_LIST_PTR fl,
+	int timeout, pkcs11_session_cancel_t cancel);
+
+/**
+* Release the interposer of a module once its handle is done with it. The
+* interposer is reused when no call given up is left running in the module
+*@param fl Function list of the module, as given to pkcs11_deadline_wrap()
+*/
+PKCS11_DEADLINE_EXTERN void pkcs11_deadline_unwrap(CK_FUNCTION_LIST_PTR fl);
+
+/**
+* Tell whether calls given up at their deadline are still running in a
+* module, which then must be neither finalised nor unloaded
+*@param fl Function list of the module, as given to pkcs11_deadline_wrap()
+*@return number of such calls in that module
+*/
+PKCS11_DEADLINE_EXTERN int pkcs11_deadline_pending(CK_FUNCTION_LIST_PTR fl);
+
+#undef PKCS11_DEADLINE_EXTERN
+
+#endif /* __PKCS11_DEADLINE_H_ */
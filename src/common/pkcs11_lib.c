@@ -199,6 +199,8 @@ struct pkcs11_handle_str {
   PK11SlotInfo *slot;
   cert_object_t **certs;
   int cert_count;
+  char serial[17];
+  pkcs11_handle_t *parent; /* handle this one was duplicated from */
 };
 
 static int app_has_NSS = 0;
@@ -332,6 +334,49 @@ int init_pkcs11_module(pkcs11_handle_t *h, int flag)
   return 0; /* NSS initialized the module on load */
 }
 
+int use_token_profiles(pkcs11_handle_t *h, const char *dir)
+{
+  /* NSS does its own token caching, nothing is learned here */
+  DBG("token profiles are not supported with NSS");
+  return 0;
+}
+
+int use_pkcs11_deadline(pkcs11_handle_t *h, int timeout, int threads)
+{
+  /* NSS calls the module itself, there is no function list to wrap */
+  DBG("PKCS#11 call deadlines are not supported with NSS");
+  return -1;
+}
+
+int use_pkcs11_trace(pkcs11_handle_t *h)
+{
+  /* NSS calls the module itself, there is no function list to wrap */
+  DBG("PKCS#11 call tracing is not supported with NSS");
+  return -1;
+}
+
+void pkcs11_module_registry(int idle_timeout)
+{
+  /* NSS keeps its modules loaded in its own module database */
+  if (idle_timeout > 0)
+    DBG("module registry is not used with NSS");
+}
+
+void pkcs11_module_registry_flush(void)
+{
+}
+
+int get_slot_certs_visible(pkcs11_handle_t *h)
+{
+  return -1; /* unknown */
+}
+
+int prefetch_certificates(pkcs11_handle_t *h)
+{
+  /* no token profiles with NSS */
+  return 0;
+}
+
 int find_slot_by_number(pkcs11_handle_t *h, unsigned int slot_num, unsigned int *slotID)
 {
   SECMODModule *module = h->module;
@@ -631,6 +676,98 @@ int wait_for_token_by_slotlabel(pkcs11_handle_t *h,
   return rv;
 }
 
+/*
+ * list the ids of the slots of the selected module which hold a token,
+ * in slot order. Returns the number of slots, or -1 on error.
+ */
+int find_token_slots(pkcs11_handle_t *h, unsigned int **slots)
+{
+  SECMODModule *module = h->module;
+  int i, n = 0;
+
+  *slots = NULL;
+  if (module == NULL) {
+    return 0;
+  }
+  *slots = malloc(sizeof(unsigned int) * (module->slotCount + 1));
+  if (*slots == NULL) {
+    set_error("not enough free memory available");
+    return -1;
+  }
+  for (i = 0; i < module->slotCount; i++) {
+    if (module->slots[i] && PK11_IsPresent(module->slots[i])) {
+      (*slots)[n++] = PK11_GetSlotID(module->slots[i]);
+    }
+  }
+  return n;
+}
+
+/*
+ * another handle on the module of h, to select a second slot
+ */
+pkcs11_handle_t *dup_pkcs11_handle(pkcs11_handle_t *h)
+{
+  pkcs11_handle_t *dup;
+
+  dup = (pkcs11_handle_t *)calloc(sizeof(pkcs11_handle_t), 1);
+  if (dup == NULL) {
+    set_error("pkcs11_handle_t malloc failed: %s", strerror(errno));
+    return NULL;
+  }
+  if (h->module) {
+    dup->module = SECMOD_ReferenceModule(h->module);
+  }
+  dup->parent = h;
+  return dup;
+}
+
+/*
+ * release a handle made by dup_pkcs11_handle(). The token is not logged
+ * out: login state is shared with the other handles.
+ */
+void free_pkcs11_handle(pkcs11_handle_t *h)
+{
+  if (h->parent == NULL) {
+    DBG("free_pkcs11_handle() called on a module handle");
+    return;
+  }
+  if (h->slot) {
+    PK11_FreeSlot(h->slot);
+  }
+  if (h->certs) {
+    CERT_DestroyCertArray((CERTCertificate **)h->certs, h->cert_count);
+  }
+  if (h->module) {
+    SECMOD_DestroyModule(h->module);
+  }
+  cleanse(h, sizeof(pkcs11_handle_t));
+  free(h);
+}
+
+/*
+ * make h use the slot selected by dup, then release dup. The certificates
+ * are not taken over: NSS only lists user certificates once logged in.
+ */
+int adopt_pkcs11_session(pkcs11_handle_t *h, pkcs11_handle_t *dup)
+{
+  if (dup->parent != h || dup->slot == NULL) {
+    set_error("no session to take over");
+    return -1;
+  }
+  if (h->slot) {
+    PK11_FreeSlot(h->slot);
+  }
+  if (h->certs) {
+    CERT_DestroyCertArray((CERTCertificate **)h->certs, h->cert_count);
+    h->certs = NULL;
+    h->cert_count = 0;
+  }
+  h->slot = dup->slot;
+  dup->slot = NULL;
+  free_pkcs11_handle(dup);
+  return 0;
+}
+
 
 void release_pkcs11_module(pkcs11_handle_t *h)
 {
@@ -745,6 +882,28 @@ const char *get_slot_tokenlabel(pkcs11_handle_t *h)
   return PK11_GetTokenName(h->slot);
 }
 
+const char *get_slot_tokenserial(pkcs11_handle_t *h)
+{
+  CK_TOKEN_INFO tinfo;
+  int i;
+
+  if (!h->slot || PK11_GetTokenInfo(h->slot, &tinfo) != SECSuccess) {
+    return NULL;
+  }
+  memcpy(h->serial, tinfo.serialNumber, 16);
+  for (i = 16; i > 0 && h->serial[i - 1] == ' '; i--);
+  h->serial[i] = 0;
+  return h->serial;
+}
+
+const char *get_slot_description(pkcs11_handle_t *h)
+{
+  if (!h->slot) {
+    return NULL;
+  }
+  return PK11_GetSlotName(h->slot);
+}
+
 
 
 cert_object_t **get_certificate_list(pkcs11_handle_t *h, int *count)
@@ -946,10 +1105,17 @@ SECU_Strerror(PRErrorCode errNum)
 
 #else
 #include "cert_st.h"
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 #include <openssl/x509.h>
 #include <openssl/err.h>
 
 #include "rsaref/pkcs11.h"
+#include "token_profile.h"
+#include "pkcs11_trace.h"
+#include "pkcs11_deadline.h"
+#include "module_pin.h"
 
 
 struct cert_object_str {
@@ -965,9 +1131,29 @@ typedef struct {
   CK_SLOT_ID id;
   CK_BBOOL token_present;
   CK_UTF8CHAR label[33]; /* token label */
+  CK_UTF8CHAR serial[17]; /* token serial number */
   CK_UTF8CHAR slotDescription[64];
+  char description[65]; /* slotDescription, without padding */
 } slot_t;
 
+/* a module kept loaded and initialised between two handles */
+typedef struct module_entry_st {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  void *module_handle;
+  CK_FUNCTION_LIST_PTR fl;
+  int initialized;
+  int should_finalize;
+  pid_t pid; /* process which initialised the module */
+  int refs;
+  time_t idle_since;
+  slot_t *slots; /* slot table of the last released handle */
+  CK_ULONG slot_count;
+  struct module_entry_st *next;
+} module_entry_t;
+
 struct pkcs11_handle_str {
   void *module_handle;
   CK_FUNCTION_LIST_PTR fl;
@@ -978,6 +1164,14 @@ struct pkcs11_handle_str {
   cert_object_t **certs;
   int cert_count;
   int current_slot;
+  char *module_path;
+  const char *profile_dir;
+  token_profile_t *profile;
+  int prelogin_cert_count; /* -1: certificates not read before login */
+  CK_FUNCTION_LIST_PTR traced; /* list under the call tracer, NULL without it */
+  CK_FUNCTION_LIST_PTR deadline; /* list under the deadlines, NULL without them */
+  module_entry_t *entry; /* NULL when the module is not in the registry */
+  pkcs11_handle_t *parent; /* handle whose module and slots are shared */
 };
 
 
@@ -990,12 +1184,189 @@ int crypto_init(cert_policy *policy)
   return 0;
 }
 
+/*
+* Module registry: with a non zero idle timeout, release_pkcs11_module()
+* keeps the module loaded and initialised, with its slot table, and the
+* next load_pkcs11_module() of the same path in this process reuses it.
+* The registry outlives pam_end(): pam_pkcs11 is pinned in memory until
+* the process exits. Idle modules are released by a background thread
+* once the timeout has expired, or by pkcs11_module_registry_flush().
+*/
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static module_entry_t *registry = NULL;
+static int registry_timeout = 0;
+static pid_t reaper_pid = 0; /* process whose reaper thread is running */
+
+/* called with registry_mutex held, entry must not be in use */
+static void drop_module_entry(module_entry_t *entry)
+{
+  module_entry_t **pt;
+  int stuck;
+
+  for (pt = &registry; *pt && *pt != entry; pt = &(*pt)->next);
+  if (*pt)
+    *pt = entry->next;
+  DBG1("releasing cached module %s", entry->path);
+  /* a forked child must not finalise the module of its parent, and a
+   * call given up at its deadline may still be running in the module */
+  stuck = pkcs11_deadline_pending(entry->fl);
+  if (entry->should_finalize && entry->pid == getpid() && !stuck)
+    entry->fl->C_Finalize(NULL);
+  if (!stuck)
+    dlclose(entry->module_handle);
+  free(entry->slots);
+  free(entry->path);
+  free(entry);
+}
+
+/* called with registry_mutex held */
+static void reap_module_entries(int all)
+{
+  module_entry_t *entry, *next;
+  time_t now = time(NULL);
+
+  for (entry = registry; entry; entry = next) {
+    next = entry->next;
+    if (entry->refs == 0 && (all || registry_timeout <= 0
+        || now - entry->idle_since >= registry_timeout))
+      drop_module_entry(entry);
+  }
+}
+
+/* called with registry_mutex held: seconds until the first idle module
+ * expires, -1 if none */
+static int registry_next_expiry(void)
+{
+  module_entry_t *entry;
+  time_t now = time(NULL);
+  int wait = -1, left;
+
+  for (entry = registry; entry; entry = entry->next) {
+    if (entry->refs != 0)
+      continue;
+    left = (int)(entry->idle_since + registry_timeout - now);
+    if (left < 1)
+      left = 1;
+    if (wait < 0 || left < wait)
+      wait = left;
+  }
+  return wait;
+}
+
+/* releases idle modules at the timeout, even if no authentication follows */
+static void *registry_reaper(void *arg)
+{
+  int wait;
+
+  (void)arg;
+  pthread_mutex_lock(&registry_mutex);
+  for (;;) {
+    reap_module_entries(0);
+    wait = registry_timeout > 0 ? registry_next_expiry() : -1;
+    if (wait < 0)
+      break;
+    pthread_mutex_unlock(&registry_mutex);
+    sleep(wait);
+    pthread_mutex_lock(&registry_mutex);
+  }
+  reaper_pid = 0;
+  pthread_mutex_unlock(&registry_mutex);
+  return NULL;
+}
+
+/* called with registry_mutex held */
+static void start_registry_reaper(void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+
+  /* a forked child inherits the flag, not the thread */
+  if (reaper_pid == getpid())
+    return;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  /* signals are for the application's threads */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&thread, &attr, registry_reaper, NULL) == 0)
+    reaper_pid = getpid();
+  else
+    DBG("cannot start a thread to release idle modules");
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+void pkcs11_module_registry(int idle_timeout)
+{
+  /* modules kept past pam_end() need the code handling them */
+  if (idle_timeout > 0 && pin_module() < 0) {
+    DBG1("module registry disabled: %s", get_error());
+    idle_timeout = 0;
+  }
+  pthread_mutex_lock(&registry_mutex);
+  registry_timeout = idle_timeout;
+  reap_module_entries(0);
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void pkcs11_module_registry_flush(void)
+{
+  pthread_mutex_lock(&registry_mutex);
+  reap_module_entries(1);
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+/* find a registered module, unless the file has changed since it was loaded */
+static module_entry_t *find_module_entry(const char *module, const struct stat *st)
+{
+  module_entry_t *entry;
+
+  reap_module_entries(0);
+  for (entry = registry; entry; entry = entry->next) {
+    if (strcmp(entry->path, module))
+      continue;
+    if (entry->dev == st->st_dev && entry->ino == st->st_ino
+        && entry->mtime == st->st_mtime)
+      return entry;
+    DBG1("module %s has changed on disk", module);
+    if (entry->refs == 0)
+      drop_module_entry(entry);
+    return NULL;
+  }
+  return NULL;
+}
+
+static void add_module_entry(pkcs11_handle_t *h, const struct stat *st)
+{
+  module_entry_t *entry;
+
+  entry = calloc(sizeof(module_entry_t), 1);
+  if (entry == NULL)
+    return;
+  entry->path = strdup(h->module_path);
+  if (entry->path == NULL) {
+    free(entry);
+    return;
+  }
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->mtime = st->st_mtime;
+  entry->module_handle = h->module_handle;
+  entry->fl = h->fl;
+  entry->refs = 1;
+  entry->next = registry;
+  registry = entry;
+  h->entry = entry;
+}
+
 int load_pkcs11_module(const char *module, pkcs11_handle_t **hp)
 {
   int rv;
   struct stat module_stat;
   CK_C_GetFunctionList C_GetFunctionList_ptr;
   pkcs11_handle_t *h;
+  module_entry_t *entry;
 
   DBG1("PKCS #11 module = [%s]", module);
   /* reset pkcs #11 handle */
@@ -1022,6 +1393,24 @@ int load_pkcs11_module(const char *module, pkcs11_handle_t **hp)
     free(h);
     return -1;
   }
+  /* reuse the module kept by the registry */
+  if (registry_timeout > 0) {
+    pthread_mutex_lock(&registry_mutex);
+    entry = find_module_entry(module, &module_stat);
+    if (entry != NULL) {
+      entry->refs++;
+      pthread_mutex_unlock(&registry_mutex);
+      DBG1("reusing cached module %s", module);
+      h->entry = entry;
+      h->module_handle = entry->module_handle;
+      h->fl = entry->fl;
+      h->module_path = strdup(module);
+      h->prelogin_cert_count = -1;
+      *hp = h;
+      return 0;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+  }
   /* load module */
   DBG1("loading module %s", module);
   h->module_handle = dlopen(module, RTLD_NOW);
@@ -1044,10 +1433,90 @@ int load_pkcs11_module(const char *module, pkcs11_handle_t **hp)
     free(h);
     return -1;
   }
+  h->module_path = strdup(module);
+  h->prelogin_cert_count = -1;
+  if (registry_timeout > 0 && h->module_path != NULL) {
+    pthread_mutex_lock(&registry_mutex);
+    add_module_entry(h, &module_stat);
+    pthread_mutex_unlock(&registry_mutex);
+  }
   *hp = h;
   return 0;
 }
 
+int use_token_profiles(pkcs11_handle_t *h, const char *dir)
+{
+  h->profile_dir = dir;
+  return 0;
+}
+
+int use_pkcs11_deadline(pkcs11_handle_t *h, int timeout, int threads)
+{
+  pkcs11_session_cancel_t cancel;
+
+  if (timeout <= 0 || h->deadline)
+    return 0;
+  /* a call given up is cancelled while it still runs in the module */
+  if (!threads) {
+    DBG("token_timeout needs support_threads, no deadline applied");
+    return 0;
+  }
+  /* PKCS#11 3.0 modules can abort an operation and keep the session */
+  cancel = (pkcs11_session_cancel_t)dlsym(h->module_handle, "C_SessionCancel");
+  h->deadline = h->fl;
+  h->fl = pkcs11_deadline_wrap(h->fl, timeout, cancel);
+  return 0;
+}
+
+int use_pkcs11_trace(pkcs11_handle_t *h)
+{
+  if (!h->traced) {
+    h->traced = h->fl;
+    h->fl = pkcs11_trace_wrap(h->fl);
+  }
+  return 0;
+}
+
+/* look up what has been learned about the token in the current slot */
+static void load_slot_profile(pkcs11_handle_t *h)
+{
+  CK_TOKEN_INFO tinfo;
+  char manufacturer[33], model[17], firmware[16];
+  CK_RV rv;
+
+  if (h->profile_dir == NULL || h->module_path == NULL)
+    return;
+  rv = h->fl->C_GetTokenInfo(h->slots[h->current_slot].id, &tinfo);
+  if (rv != CKR_OK) {
+    DBG1("C_GetTokenInfo() failed: 0x%08lX, token profile disabled", rv);
+    return;
+  }
+  snprintf(manufacturer, sizeof(manufacturer), "%.32s", tinfo.manufacturerID);
+  snprintf(model, sizeof(model), "%.16s", tinfo.model);
+  snprintf(firmware, sizeof(firmware), "%d.%d",
+      tinfo.firmwareVersion.major, tinfo.firmwareVersion.minor);
+  h->profile = load_token_profile(h->profile_dir, h->module_path,
+      manufacturer, model, firmware);
+  if (h->profile == NULL)
+    DBG1("token profile disabled: %s", get_error());
+}
+
+static void release_slot_profile(pkcs11_handle_t *h)
+{
+  if (h->profile == NULL)
+    return;
+  if (save_token_profile(h->profile) != 0)
+    DBG1("save_token_profile() failed: %s", get_error());
+  free_token_profile(h->profile);
+  h->profile = NULL;
+  h->prelogin_cert_count = -1;
+}
+
+int get_slot_certs_visible(pkcs11_handle_t *h)
+{
+  return token_profile_get(h->profile, TOKEN_CAP_CERTS_WITHOUT_LOGIN);
+}
+
 static int
 refresh_slots(pkcs11_handle_t *h)
 {
@@ -1110,6 +1579,10 @@ refresh_slots(pkcs11_handle_t *h)
     CK_TOKEN_INFO tinfo;
 
     DBG1("slot %ld:", i + 1);
+    /* the slot table may be reused from a previous handle */
+    h->slots[i].token_present = FALSE;
+    memset(h->slots[i].label, 0, sizeof(h->slots[i].label));
+    memset(h->slots[i].serial, 0, sizeof(h->slots[i].serial));
     rv = h->fl->C_GetSlotInfo(h->slots[i].id, &sinfo);
     if (rv != CKR_OK) {
       set_error("C_GetSlotInfo() failed: 0x%08lX", rv);
@@ -1118,6 +1591,9 @@ refresh_slots(pkcs11_handle_t *h)
 
     (void) memcpy(h->slots[i].slotDescription, sinfo.slotDescription,
 		sizeof(h->slots[i].slotDescription));
+    memcpy(h->slots[i].description, sinfo.slotDescription, 64);
+    for (j = 64; j > 0 && h->slots[i].description[j - 1] == ' '; j--);
+    h->slots[i].description[j] = 0;
 
     DBG1("- description: %.64s", sinfo.slotDescription);
     DBG1("- manufacturer: %.32s", sinfo.manufacturerID);
@@ -1137,6 +1613,9 @@ refresh_slots(pkcs11_handle_t *h)
       h->slots[i].token_present = TRUE;
       memcpy(h->slots[i].label, tinfo.label, 32);
       for (j = 31; h->slots[i].label[j] == ' '; j--) h->slots[i].label[j] = 0;
+      memcpy(h->slots[i].serial, tinfo.serialNumber, 16);
+      for (j = 16; j > 0 && h->slots[i].serial[j - 1] == ' '; j--);
+      h->slots[i].serial[j] = 0;
     }
   }
   return 0;
@@ -1161,15 +1640,53 @@ int init_pkcs11_module(pkcs11_handle_t *h,int flag)
 	.pReserved = NULL
   };
 
+  module_entry_t *entry = h->entry;
+
+  h->slot_count = -1;
+  h->slots = NULL;
+  if (entry != NULL) {
+    pthread_mutex_lock(&registry_mutex);
+    if (entry->initialized && entry->pid == getpid()) {
+      /* take the slot table over, refresh_slots() updates the tokens */
+      if (entry->slots != NULL) {
+        h->slots = entry->slots;
+        h->slot_count = entry->slot_count;
+        entry->slots = NULL;
+      }
+      pthread_mutex_unlock(&registry_mutex);
+      DBG("module already initialised");
+      return refresh_slots(h);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+  }
+
   /* initialise the module */
   if (flag) rv = h->fl->C_Initialize((CK_VOID_PTR) &initArgs);
   else      rv = h->fl->C_Initialize(NULL);
+  if (rv == CKR_CRYPTOKI_ALREADY_INITIALIZED && entry != NULL && entry->initialized) {
+    /* forked child: the state inherited from the parent is not usable */
+    DBG("process has forked, initialising the module again");
+    h->fl->C_Finalize(NULL);
+    if (flag) rv = h->fl->C_Initialize((CK_VOID_PTR) &initArgs);
+    else      rv = h->fl->C_Initialize(NULL);
+  }
   if (rv == CKR_OK)
     h->should_finalize = 1;
   else if (rv != CKR_CRYPTOKI_ALREADY_INITIALIZED) {
     set_error("C_Initialize() failed: 0x%08lX", rv);
     return -1;
   }
+  if (entry != NULL) {
+    /* from now on the registry finalises the module */
+    pthread_mutex_lock(&registry_mutex);
+    free(entry->slots);
+    entry->slots = NULL;
+    entry->initialized = 1;
+    entry->should_finalize = h->should_finalize;
+    entry->pid = getpid();
+    pthread_mutex_unlock(&registry_mutex);
+    h->should_finalize = 0;
+  }
 
   rv = h->fl->C_GetInfo(&info);
   if (rv != CKR_OK) {
@@ -1188,24 +1705,57 @@ int init_pkcs11_module(pkcs11_handle_t *h,int flag)
    * As per PKCS#11 v2.2 we can call C_GetSlotList multiple times to check for
    * added/removed slots
    */
-  h->slot_count = -1;
-  h->slots = NULL;
-
   return refresh_slots(h);
 }
 
 void release_pkcs11_module(pkcs11_handle_t *h)
 {
+  module_entry_t *entry = h->entry;
+  int stuck;
+
+  release_slot_profile(h);
+  /* a module still busy with a call given up at its deadline is left
+   * loaded and initialised, and is not reused */
+  stuck = h->deadline ? pkcs11_deadline_pending(h->deadline) : 0;
+  if (stuck)
+    DBG1("%d cancelled PKCS#11 call(s) still running, module left loaded", stuck);
   /* finalise pkcs #11 module */
   if (h->fl != NULL)
-    if (h->should_finalize)
+    if (h->should_finalize && !stuck)
       h->fl->C_Finalize(NULL);
+  if (h->deadline)
+    pkcs11_deadline_unwrap(h->deadline);
+  /* per function totals of the traced calls */
+  if (h->traced) {
+    pkcs11_trace_report(h->traced);
+    pkcs11_trace_unwrap(h->traced);
+  }
+  if (entry != NULL) {
+    /* give the module and its slot table back to the registry */
+    pthread_mutex_lock(&registry_mutex);
+    if (entry->slots == NULL && entry->pid == getpid()) {
+      entry->slots = h->slots;
+      entry->slot_count = h->slot_count;
+      h->slots = NULL;
+    }
+    entry->refs--;
+    entry->idle_since = time(NULL);
+    if (entry->refs == 0 && (!entry->initialized || stuck))
+      drop_module_entry(entry);
+    reap_module_entries(0);
+    if (registry_next_expiry() >= 0)
+      start_registry_reaper();
+    pthread_mutex_unlock(&registry_mutex);
+    h->module_handle = NULL;
+  }
   /* unload the module */
-  if (h->module_handle != NULL)
+  if (h->module_handle != NULL && !stuck)
     dlclose(h->module_handle);
   /* release all allocated memory */
   if (h->slots != NULL)
     free(h->slots);
+  if (h->module_path != NULL)
+    free(h->module_path);
   cleanse(h, sizeof(pkcs11_handle_t));
   free(h);
 }
@@ -1404,6 +1954,99 @@ int wait_for_token(pkcs11_handle_t *h,
   return rv;
 }
 
+/*
+ * list the slots which hold a token, as indexes into the slot table.
+ * Returns the number of slots, or -1 on error.
+ */
+int find_token_slots(pkcs11_handle_t *h, unsigned int **slots)
+{
+  CK_ULONG i;
+  int n = 0;
+
+  *slots = malloc(sizeof(unsigned int) * (h->slot_count + 1));
+  if (*slots == NULL) {
+    set_error("not enough free memory available");
+    return -1;
+  }
+  for (i = 0; i < h->slot_count; i++)
+    if (h->slots[i].token_present)
+      (*slots)[n++] = i;
+  return n;
+}
+
+/*
+ * another handle on the module of h, for a session on a second slot.
+ * It shares the function list and the slot table of h, so it must be
+ * released before h, with free_pkcs11_handle(). Calls through both
+ * handles may only be made from different threads if the module was
+ * initialised for it.
+ */
+pkcs11_handle_t *dup_pkcs11_handle(pkcs11_handle_t *h)
+{
+  pkcs11_handle_t *dup;
+
+  dup = (pkcs11_handle_t *)calloc(sizeof(pkcs11_handle_t), 1);
+  if (dup == NULL) {
+    set_error("pkcs11_handle_t malloc failed: %s", strerror(errno));
+    return NULL;
+  }
+  dup->fl = h->fl;
+  dup->slots = h->slots;
+  dup->slot_count = h->slot_count;
+  dup->session = CK_INVALID_HANDLE;
+  dup->prelogin_cert_count = -1;
+  dup->parent = h;
+  return dup;
+}
+
+static void free_certs(cert_object_t **certs, int cert_count);
+
+/*
+ * release a handle made by dup_pkcs11_handle(). Its session is closed
+ * without logging out: login state is shared by all the sessions of
+ * the token.
+ */
+void free_pkcs11_handle(pkcs11_handle_t *h)
+{
+  if (h->parent == NULL) {
+    DBG("free_pkcs11_handle() called on a module handle");
+    return;
+  }
+  if (h->session != CK_INVALID_HANDLE)
+    h->fl->C_CloseSession(h->session);
+  if (h->certs != NULL)
+    free_certs(h->certs, h->cert_count);
+  cleanse(h, sizeof(pkcs11_handle_t));
+  free(h);
+}
+
+/*
+ * make h continue with the session and the certificate list of dup,
+ * then release dup. h must not have a session open.
+ */
+int adopt_pkcs11_session(pkcs11_handle_t *h, pkcs11_handle_t *dup)
+{
+  if (dup->parent != h || dup->session == CK_INVALID_HANDLE) {
+    set_error("no session to take over");
+    return -1;
+  }
+  DBG1("taking over the PKCS #11 session for slot %d", dup->current_slot + 1);
+  h->session = dup->session;
+  h->current_slot = dup->current_slot;
+  h->certs = dup->certs;
+  h->cert_count = dup->cert_count;
+  dup->session = CK_INVALID_HANDLE;
+  dup->certs = NULL;
+  dup->cert_count = 0;
+  free_pkcs11_handle(dup);
+  load_slot_profile(h);
+  /* the list was read before login: pkcs11_login() reads it again
+   * unless the token is known to show all its certificates */
+  if (h->certs != NULL)
+    h->prelogin_cert_count = h->cert_count;
+  return 0;
+}
+
 int open_pkcs11_session(pkcs11_handle_t *h, unsigned int slot)
 {
   int rv;
@@ -1420,9 +2063,41 @@ int open_pkcs11_session(pkcs11_handle_t *h, unsigned int slot)
     return -1;
   }
   h->current_slot = slot;
+  load_slot_profile(h);
   return 0;
 }
 
+/* number of certificate objects the session shows, without reading them */
+static int count_certificates(pkcs11_handle_t *h)
+{
+  CK_OBJECT_CLASS cert_class = CKO_CERTIFICATE;
+  CK_CERTIFICATE_TYPE cert_type = CKC_X_509;
+  CK_ATTRIBUTE cert_template[] = {
+    {CKA_CLASS, &cert_class, sizeof(CK_OBJECT_CLASS)}
+    ,
+    {CKA_CERTIFICATE_TYPE, &cert_type, sizeof(CK_CERTIFICATE_TYPE)}
+  };
+  CK_OBJECT_HANDLE object;
+  CK_ULONG object_count;
+  CK_RV rv;
+  int count = 0;
+
+  rv = h->fl->C_FindObjectsInit(h->session, cert_template, 2);
+  if (rv != CKR_OK) {
+    set_error("C_FindObjectsInit() failed: 0x%08lX", rv);
+    return -1;
+  }
+  while ((rv = h->fl->C_FindObjects(h->session, &object, 1, &object_count)) == CKR_OK &&
+         object_count > 0)
+    count++;
+  h->fl->C_FindObjectsFinal(h->session);
+  if (rv != CKR_OK) {
+    set_error("C_FindObjects() failed: 0x%08lX", rv);
+    return -1;
+  }
+  return count;
+}
+
 int pkcs11_login(pkcs11_handle_t *h, char *password)
 {
   int rv;
@@ -1436,6 +2111,23 @@ int pkcs11_login(pkcs11_handle_t *h, char *password)
     set_error("C_Login() failed: 0x%08lX", rv);
     return -1;
   }
+  /*
+   * while it is not known whether login reveals more certificates,
+   * forget the list read before login: get_certificate_list() will
+   * read it again and compare. A token known to show them all is
+   * checked by counting: should login now reveal more, as after a
+   * firmware or module update, the list is read again and the
+   * capability learned anew
+   */
+  if (h->prelogin_cert_count >= 0 && h->certs != NULL) {
+    if (get_slot_certs_visible(h) == TOKEN_CAP_YES &&
+        count_certificates(h) == h->prelogin_cert_count)
+      return 0;
+    DBG("certificate list read before login discarded");
+    free_certs(h->certs, h->cert_count);
+    h->certs = NULL;
+    h->cert_count = 0;
+  }
   return 0;
 }
 
@@ -1506,6 +2198,60 @@ int close_pkcs11_session(pkcs11_handle_t *h)
     h->certs = NULL;
     h->cert_count = 0;
   }
+  release_slot_profile(h);
+  return 0;
+}
+
+/* update learned capabilities after a certificate list has been read */
+static void learn_cert_visibility(pkcs11_handle_t *h)
+{
+  CK_SESSION_INFO sinfo;
+  int rv;
+
+  if (h->profile == NULL)
+    return;
+  rv = h->fl->C_GetSessionInfo(h->session, &sinfo);
+  if (rv != CKR_OK)
+    return;
+  if (sinfo.state == CKS_RO_PUBLIC_SESSION || sinfo.state == CKS_RW_PUBLIC_SESSION) {
+    /* not logged in (yet) */
+    h->prelogin_cert_count = h->cert_count;
+    if (h->cert_count > 0 &&
+        get_slot_certs_visible(h) == TOKEN_CAP_UNKNOWN)
+      DBG1("%d certificates visible before login", h->cert_count);
+    return;
+  }
+  if (h->prelogin_cert_count < 0)
+    return;
+  /* logged in: same list as before login means login can be skipped
+   * for reading certificates next time */
+  token_profile_set(h->profile, TOKEN_CAP_CERTS_WITHOUT_LOGIN,
+      h->prelogin_cert_count == h->cert_count ? TOKEN_CAP_YES : TOKEN_CAP_NO);
+}
+
+/*
+ * Before login: read the certificates of tokens known to show them, so
+ * that the list is ready once logged in. While that is not known, only
+ * count the certificate objects, for learn_cert_visibility() to compare
+ * with the list read after login.
+ */
+int prefetch_certificates(pkcs11_handle_t *h)
+{
+  int count = 0;
+
+  if (h->profile == NULL)
+    return 0;
+  switch (get_slot_certs_visible(h)) {
+  case TOKEN_CAP_YES:
+    return get_certificate_list(h, &count) ? 0 : -1;
+  case TOKEN_CAP_NO:
+    return 0;
+  }
+  count = count_certificates(h);
+  if (count < 0)
+    return -1;
+  DBG1("%d certificates visible before login", count);
+  h->prelogin_cert_count = count;
   return 0;
 }
 
@@ -1518,7 +2264,8 @@ cert_object_t **get_certificate_list(pkcs11_handle_t *h, int *ncerts)
   CK_ULONG object_count;
   X509 *x509;
   cert_object_t **certs = NULL;
-  int rv;
+  CK_RV rv;
+  int batch;
 
   CK_OBJECT_CLASS cert_class = CKO_CERTIFICATE;
   CK_CERTIFICATE_TYPE cert_type = CKC_X_509;
@@ -1537,6 +2284,10 @@ cert_object_t **get_certificate_list(pkcs11_handle_t *h, int *ncerts)
     return h->certs;
   }
 
+  /* with a profile, try batched attribute reads unless the token is
+   * known not to cope with them */
+  batch = h->profile != NULL &&
+      token_profile_get(h->profile, TOKEN_CAP_MULTI_ATTRIBUTE) != TOKEN_CAP_NO;
   rv = h->fl->C_FindObjectsInit(h->session, cert_template, 2);
   if (rv != CKR_OK) {
     set_error("C_FindObjectsInit() failed: 0x%08lX", rv);
@@ -1553,6 +2304,40 @@ cert_object_t **get_certificate_list(pkcs11_handle_t *h, int *ncerts)
 
     /* Cert found, read */
 
+    if (batch) {
+      /* one round trip for the lengths of both CKA_ID and CKA_VALUE,
+       * another one for the values */
+      cert_template[2].pValue = NULL;
+      cert_template[2].ulValueLen = 0;
+      cert_template[3].pValue = NULL;
+      cert_template[3].ulValueLen = 0;
+      rv = h->fl->C_GetAttributeValue(h->session, object, cert_template, 4);
+      if (rv == CKR_OK) {
+        id_value = malloc(cert_template[2].ulValueLen);
+        cert_value = malloc(cert_template[3].ulValueLen);
+        if (id_value == NULL || cert_value == NULL) {
+          free(id_value);
+          free(cert_value);
+          set_error("Cert malloc(%d): not enough free memory available", cert_template[3].ulValueLen);
+          goto getlist_error;
+        }
+        cert_template[2].pValue = id_value;
+        cert_template[3].pValue = cert_value;
+        rv = h->fl->C_GetAttributeValue(h->session, object, cert_template, 4);
+        if (rv != CKR_OK) {
+          free(id_value);
+          free(cert_value);
+        }
+      }
+      if (rv == CKR_OK) {
+        token_profile_set(h->profile, TOKEN_CAP_MULTI_ATTRIBUTE, TOKEN_CAP_YES);
+        goto store_cert;
+      }
+      DBG1("batched C_GetAttributeValue() failed: 0x%08lX, reading one by one", rv);
+      token_profile_set(h->profile, TOKEN_CAP_MULTI_ATTRIBUTE, TOKEN_CAP_NO);
+      batch = 0;
+    }
+
     /* pass 1: get cert id */
 
     /* retrieve cert object id length */
@@ -1603,6 +2388,7 @@ cert_object_t **get_certificate_list(pkcs11_handle_t *h, int *ncerts)
       }
 
     /* Pass 3: store certificate */
+store_cert:
 
     /* convert to X509 data structure */
       x509 = d2i_X509(NULL, (const unsigned char **)&cert_template[3].pValue, cert_template[3].ulValueLen);
@@ -1654,6 +2440,7 @@ cert_object_t **get_certificate_list(pkcs11_handle_t *h, int *ncerts)
   }
 
   *ncerts = h->cert_count;
+  learn_cert_visibility(h);
 
   /* arriving here means that's all right */
   DBG1("Found %d certificates in token",h->cert_count);
@@ -1751,6 +2538,16 @@ const char *get_slot_tokenlabel(pkcs11_handle_t *h)
   return h->slots[h->current_slot].label;
 }
 
+const char *get_slot_tokenserial(pkcs11_handle_t *h)
+{
+  return (const char *)h->slots[h->current_slot].serial;
+}
+
+const char *get_slot_description(pkcs11_handle_t *h)
+{
+  return h->slots[h->current_slot].description;
+}
+
 const X509 *get_X509_certificate(cert_object_t *cert)
 {
   return cert->x509;
@@ -36,7 +36,13 @@ PKCS11_EXTERN int find_slot_by_number(pkcs11_handle_t *h,unsigned int slot_num,
 PKCS11_EXTERN int find_slot_by_number_and_label(pkcs11_handle_t *h,
                                       int slot_num, const char *slot_label,
                                       unsigned int *slot);
+PKCS11_EXTERN int find_token_slots(pkcs11_handle_t *h, unsigned int **slots);
+PKCS11_EXTERN pkcs11_handle_t *dup_pkcs11_handle(pkcs11_handle_t *h);
+PKCS11_EXTERN void free_pkcs11_handle(pkcs11_handle_t *h);
+PKCS11_EXTERN int adopt_pkcs11_session(pkcs11_handle_t *h, pkcs11_handle_t *dup);
 PKCS11_EXTERN const char *get_slot_tokenlabel(pkcs11_handle_t *h);
+PKCS11_EXTERN const char *get_slot_tokenserial(pkcs11_handle_t *h);
+PKCS11_EXTERN const char *get_slot_description(pkcs11_handle_t *h);
 PKCS11_EXTERN int wait_for_token(pkcs11_handle_t *h,
                                  int wanted_slot_num,
                                  const char *wanted_token_label,
@@ -60,6 +66,14 @@ PKCS11_EXTERN int pkcs11_login(pkcs11_handle_t *h, char *password);
 PKCS11_EXTERN int pkcs11_pass_login(pkcs11_handle_t *h, int nullok);
 PKCS11_EXTERN int get_slot_login_required(pkcs11_handle_t *h);
 PKCS11_EXTERN int get_slot_protected_authentication_path(pkcs11_handle_t *h);
+PKCS11_EXTERN int use_token_profiles(pkcs11_handle_t *h, const char *dir);
+PKCS11_EXTERN int use_pkcs11_deadline(pkcs11_handle_t *h, int timeout, int threads);
+PKCS11_EXTERN int use_pkcs11_trace(pkcs11_handle_t *h);
+/* keep released modules for idle_timeout seconds; pins the calling module */
+PKCS11_EXTERN void pkcs11_module_registry(int idle_timeout);
+PKCS11_EXTERN void pkcs11_module_registry_flush(void);
+PKCS11_EXTERN int get_slot_certs_visible(pkcs11_handle_t *h);
+PKCS11_EXTERN int prefetch_certificates(pkcs11_handle_t *h);
 PKCS11_EXTERN cert_object_t **get_certificate_list(pkcs11_handle_t *h,
                                                   int *ncert);
 PKCS11_EXTERN int get_private_key(pkcs11_handle_t *h, cert_object_t *);
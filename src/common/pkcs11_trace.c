@@ -0,0 +1,484 @@
+/*
+ * PAM-PKCS11 PKCS#11 call tracer
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+#define __PKCS11_TRACE_C_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef HAVE_NSS
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "debug.h"
+#include "auth_trace.h"
+#include "pkcs11_trace.h"
+
+/*
+* The traced list is a copy of the module's list in which the functions
+* used by pkcs11_lib are replaced by wrappers calling the original ones.
+* The registry keeps several modules loaded at once, so each module gets
+* its own traced list and totals; a function list gives no context to its
+* functions, hence the entry points of each (see TRACE_ENTRY_POINTS).
+*/
+#define TRACE_WRAPPERS 8
+
+enum {
+	T_Initialize, T_Finalize, T_GetInfo, T_GetSlotList, T_GetSlotInfo,
+	T_GetTokenInfo, T_WaitForSlotEvent, T_OpenSession, T_CloseSession,
+	T_GetSessionInfo, T_Login, T_Logout, T_FindObjectsInit, T_FindObjects,
+	T_FindObjectsFinal, T_GetAttributeValue, T_SignInit, T_Sign,
+	T_COUNT
+};
+
+static const char *trace_names[T_COUNT] = {
+	"C_Initialize", "C_Finalize", "C_GetInfo", "C_GetSlotList", "C_GetSlotInfo",
+	"C_GetTokenInfo", "C_WaitForSlotEvent", "C_OpenSession", "C_CloseSession",
+	"C_GetSessionInfo", "C_Login", "C_Logout", "C_FindObjectsInit", "C_FindObjects",
+	"C_FindObjectsFinal", "C_GetAttributeValue", "C_SignInit", "C_Sign"
+};
+
+struct trace_wrapper {
+	CK_FUNCTION_LIST fl; /* handed out in place of the module's list */
+	CK_FUNCTION_LIST_PTR real_fl; /* the module's list, NULL when unused */
+	int refs; /* handles using the traced list */
+	struct {
+		unsigned long calls;
+		unsigned long errors;
+		unsigned long us;
+	} totals[T_COUNT];
+};
+
+static struct trace_wrapper wrappers[TRACE_WRAPPERS];
+
+/* protects the traced lists and their totals */
+static pthread_mutex_t totals_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long elapsed_us(const struct timeval *start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000UL + now.tv_usec - start->tv_usec;
+}
+
+/* account a finished call and record it with its argument summary */
+static void trace_call(struct trace_wrapper *w, int fn, const struct timeval *start, CK_RV rv,
+	const char *format, ...) {
+	unsigned long us = elapsed_us(start);
+	char args[256];
+	va_list ap;
+
+	pthread_mutex_lock(&totals_mutex);
+	w->totals[fn].calls++;
+	w->totals[fn].us += us;
+	if (rv != CKR_OK) w->totals[fn].errors++;
+	pthread_mutex_unlock(&totals_mutex);
+
+	va_start(ap, format);
+	vsnprintf(args, sizeof(args), format, ap);
+	va_end(ap);
+	auth_trace_pkcs11(trace_names[fn], rv, us, args);
+}
+
+/* attribute types of a template, as "0x11+0x102" */
+static const char *attr_types(char *buf, size_t size, CK_ATTRIBUTE_PTR attrs, CK_ULONG count) {
+	size_t len = 0;
+	CK_ULONG i;
+
+	buf[0] = '\0';
+	for (i = 0; attrs && i < count && len + 12 < size; i++)
+		len += snprintf(buf + len, size - len, "%s0x%lx", i ? "+" : "", attrs[i].type);
+	if (!len) strncpy(buf, "none", size);
+	return buf;
+}
+
+static CK_RV trace_Initialize(struct trace_wrapper *w, CK_VOID_PTR pInitArgs) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_Initialize(pInitArgs);
+	trace_call(w, T_Initialize, &start, rv, "args:%d", pInitArgs != NULL);
+	return rv;
+}
+
+static CK_RV trace_Finalize(struct trace_wrapper *w, CK_VOID_PTR pReserved) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_Finalize(pReserved);
+	trace_call(w, T_Finalize, &start, rv, "-");
+	return rv;
+}
+
+static CK_RV trace_GetInfo(struct trace_wrapper *w, CK_INFO_PTR pInfo) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_GetInfo(pInfo);
+	trace_call(w, T_GetInfo, &start, rv, "-");
+	return rv;
+}
+
+static CK_RV trace_GetSlotList(struct trace_wrapper *w, CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_GetSlotList(tokenPresent, pSlotList, pulCount);
+	trace_call(w, T_GetSlotList, &start, rv, "present:%d,list:%d,count:%lu",
+		tokenPresent != FALSE, pSlotList != NULL, pulCount ? *pulCount : 0);
+	return rv;
+}
+
+static CK_RV trace_GetSlotInfo(struct trace_wrapper *w, CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_GetSlotInfo(slotID, pInfo);
+	trace_call(w, T_GetSlotInfo, &start, rv, "slot:%lu", slotID);
+	return rv;
+}
+
+static CK_RV trace_GetTokenInfo(struct trace_wrapper *w, CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_GetTokenInfo(slotID, pInfo);
+	trace_call(w, T_GetTokenInfo, &start, rv, "slot:%lu", slotID);
+	return rv;
+}
+
+static CK_RV trace_WaitForSlotEvent(struct trace_wrapper *w, CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pReserved) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_WaitForSlotEvent(flags, pSlot, pReserved);
+	trace_call(w, T_WaitForSlotEvent, &start, rv, "flags:0x%lx,slot:%lu",
+		flags, rv == CKR_OK && pSlot ? *pSlot : 0);
+	return rv;
+}
+
+static CK_RV trace_OpenSession(struct trace_wrapper *w, CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication,
+	CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_OpenSession(slotID, flags, pApplication, Notify, phSession);
+	trace_call(w, T_OpenSession, &start, rv, "slot:%lu,flags:0x%lx,session:%lu",
+		slotID, flags, rv == CKR_OK && phSession ? *phSession : 0);
+	return rv;
+}
+
+static CK_RV trace_CloseSession(struct trace_wrapper *w, CK_SESSION_HANDLE hSession) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_CloseSession(hSession);
+	trace_call(w, T_CloseSession, &start, rv, "session:%lu", hSession);
+	return rv;
+}
+
+static CK_RV trace_GetSessionInfo(struct trace_wrapper *w, CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_GetSessionInfo(hSession, pInfo);
+	trace_call(w, T_GetSessionInfo, &start, rv, "session:%lu,state:%lu",
+		hSession, rv == CKR_OK && pInfo ? pInfo->state : 0);
+	return rv;
+}
+
+/* the PIN itself is never recorded, only whether one was given */
+static CK_RV trace_Login(struct trace_wrapper *w, CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
+	CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_Login(hSession, userType, pPin, ulPinLen);
+	trace_call(w, T_Login, &start, rv, "session:%lu,user:%lu,pin:%d",
+		hSession, userType, pPin != NULL);
+	return rv;
+}
+
+static CK_RV trace_Logout(struct trace_wrapper *w, CK_SESSION_HANDLE hSession) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_Logout(hSession);
+	trace_call(w, T_Logout, &start, rv, "session:%lu", hSession);
+	return rv;
+}
+
+static CK_RV trace_FindObjectsInit(struct trace_wrapper *w, CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate,
+	CK_ULONG ulCount) {
+	struct timeval start;
+	char types[128];
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_FindObjectsInit(hSession, pTemplate, ulCount);
+	trace_call(w, T_FindObjectsInit, &start, rv, "session:%lu,attrs:%s",
+		hSession, attr_types(types, sizeof(types), pTemplate, ulCount));
+	return rv;
+}
+
+static CK_RV trace_FindObjects(struct trace_wrapper *w, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+	CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_FindObjects(hSession, phObject, ulMaxObjectCount, pulObjectCount);
+	trace_call(w, T_FindObjects, &start, rv, "session:%lu,max:%lu,found:%lu",
+		hSession, ulMaxObjectCount, rv == CKR_OK && pulObjectCount ? *pulObjectCount : 0);
+	return rv;
+}
+
+static CK_RV trace_FindObjectsFinal(struct trace_wrapper *w, CK_SESSION_HANDLE hSession) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_FindObjectsFinal(hSession);
+	trace_call(w, T_FindObjectsFinal, &start, rv, "session:%lu", hSession);
+	return rv;
+}
+
+static CK_RV trace_GetAttributeValue(struct trace_wrapper *w, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+	CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+	struct timeval start;
+	char types[128];
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_GetAttributeValue(hSession, hObject, pTemplate, ulCount);
+	trace_call(w, T_GetAttributeValue, &start, rv, "session:%lu,object:%lu,attrs:%s",
+		hSession, hObject, attr_types(types, sizeof(types), pTemplate, ulCount));
+	return rv;
+}
+
+static CK_RV trace_SignInit(struct trace_wrapper *w, CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_SignInit(hSession, pMechanism, hKey);
+	trace_call(w, T_SignInit, &start, rv, "session:%lu,mechanism:0x%lx,key:%lu",
+		hSession, pMechanism ? pMechanism->mechanism : 0, hKey);
+	return rv;
+}
+
+static CK_RV trace_Sign(struct trace_wrapper *w, CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+	CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) {
+	struct timeval start;
+	CK_RV rv;
+
+	gettimeofday(&start, NULL);
+	rv = w->real_fl->C_Sign(hSession, pData, ulDataLen, pSignature, pulSignatureLen);
+	trace_call(w, T_Sign, &start, rv, "session:%lu,data:%lu,signature:%lu",
+		hSession, ulDataLen, pulSignatureLen ? *pulSignatureLen : 0);
+	return rv;
+}
+
+/*
+* the entry points of traced list i
+*/
+#define TRACE_ENTRY_POINTS(i) \
+static CK_RV trace_Initialize_##i(CK_VOID_PTR pInitArgs) { \
+	return trace_Initialize(&wrappers[i], pInitArgs); \
+} \
+static CK_RV trace_Finalize_##i(CK_VOID_PTR pReserved) { \
+	return trace_Finalize(&wrappers[i], pReserved); \
+} \
+static CK_RV trace_GetInfo_##i(CK_INFO_PTR pInfo) { \
+	return trace_GetInfo(&wrappers[i], pInfo); \
+} \
+static CK_RV trace_GetSlotList_##i(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, \
+	CK_ULONG_PTR pulCount) { \
+	return trace_GetSlotList(&wrappers[i], tokenPresent, pSlotList, pulCount); \
+} \
+static CK_RV trace_GetSlotInfo_##i(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo) { \
+	return trace_GetSlotInfo(&wrappers[i], slotID, pInfo); \
+} \
+static CK_RV trace_GetTokenInfo_##i(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo) { \
+	return trace_GetTokenInfo(&wrappers[i], slotID, pInfo); \
+} \
+static CK_RV trace_WaitForSlotEvent_##i(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, \
+	CK_VOID_PTR pReserved) { \
+	return trace_WaitForSlotEvent(&wrappers[i], flags, pSlot, pReserved); \
+} \
+static CK_RV trace_OpenSession_##i(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication, \
+	CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession) { \
+	return trace_OpenSession(&wrappers[i], slotID, flags, pApplication, \
+		Notify, phSession); \
+} \
+static CK_RV trace_CloseSession_##i(CK_SESSION_HANDLE hSession) { \
+	return trace_CloseSession(&wrappers[i], hSession); \
+} \
+static CK_RV trace_GetSessionInfo_##i(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo) { \
+	return trace_GetSessionInfo(&wrappers[i], hSession, pInfo); \
+} \
+static CK_RV trace_Login_##i(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, \
+	CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) { \
+	return trace_Login(&wrappers[i], hSession, userType, pPin, ulPinLen); \
+} \
+static CK_RV trace_Logout_##i(CK_SESSION_HANDLE hSession) { \
+	return trace_Logout(&wrappers[i], hSession); \
+} \
+static CK_RV trace_FindObjectsInit_##i(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, \
+	CK_ULONG ulCount) { \
+	return trace_FindObjectsInit(&wrappers[i], hSession, pTemplate, ulCount); \
+} \
+static CK_RV trace_FindObjects_##i(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, \
+	CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount) { \
+	return trace_FindObjects(&wrappers[i], hSession, phObject, \
+		ulMaxObjectCount, pulObjectCount); \
+} \
+static CK_RV trace_FindObjectsFinal_##i(CK_SESSION_HANDLE hSession) { \
+	return trace_FindObjectsFinal(&wrappers[i], hSession); \
+} \
+static CK_RV trace_GetAttributeValue_##i(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, \
+	CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) { \
+	return trace_GetAttributeValue(&wrappers[i], hSession, hObject, pTemplate, ulCount); \
+} \
+static CK_RV trace_SignInit_##i(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, \
+	CK_OBJECT_HANDLE hKey) { \
+	return trace_SignInit(&wrappers[i], hSession, pMechanism, hKey); \
+} \
+static CK_RV trace_Sign_##i(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, \
+	CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) { \
+	return trace_Sign(&wrappers[i], hSession, pData, ulDataLen, \
+		pSignature, pulSignatureLen); \
+} \
+static void trace_entry_points_##i(CK_FUNCTION_LIST_PTR fl) { \
+	fl->C_Initialize = trace_Initialize_##i; \
+	fl->C_Finalize = trace_Finalize_##i; \
+	fl->C_GetInfo = trace_GetInfo_##i; \
+	fl->C_GetSlotList = trace_GetSlotList_##i; \
+	fl->C_GetSlotInfo = trace_GetSlotInfo_##i; \
+	fl->C_GetTokenInfo = trace_GetTokenInfo_##i; \
+	fl->C_WaitForSlotEvent = trace_WaitForSlotEvent_##i; \
+	fl->C_OpenSession = trace_OpenSession_##i; \
+	fl->C_CloseSession = trace_CloseSession_##i; \
+	fl->C_GetSessionInfo = trace_GetSessionInfo_##i; \
+	fl->C_Login = trace_Login_##i; \
+	fl->C_Logout = trace_Logout_##i; \
+	fl->C_FindObjectsInit = trace_FindObjectsInit_##i; \
+	fl->C_FindObjects = trace_FindObjects_##i; \
+	fl->C_FindObjectsFinal = trace_FindObjectsFinal_##i; \
+	fl->C_GetAttributeValue = trace_GetAttributeValue_##i; \
+	fl->C_SignInit = trace_SignInit_##i; \
+	fl->C_Sign = trace_Sign_##i; \
+}
+
+TRACE_ENTRY_POINTS(0)
+TRACE_ENTRY_POINTS(1)
+TRACE_ENTRY_POINTS(2)
+TRACE_ENTRY_POINTS(3)
+TRACE_ENTRY_POINTS(4)
+TRACE_ENTRY_POINTS(5)
+TRACE_ENTRY_POINTS(6)
+TRACE_ENTRY_POINTS(7)
+
+static void (* const trace_entry_points[TRACE_WRAPPERS])(CK_FUNCTION_LIST_PTR) = {
+	trace_entry_points_0, trace_entry_points_1,
+	trace_entry_points_2, trace_entry_points_3,
+	trace_entry_points_4, trace_entry_points_5,
+	trace_entry_points_6, trace_entry_points_7
+};
+
+/* the traced list of a module, called with totals_mutex held */
+static struct trace_wrapper *find_wrapper(CK_FUNCTION_LIST_PTR fl) {
+	int i;
+
+	for (i = 0; i < TRACE_WRAPPERS; i++)
+		if (fl && wrappers[i].real_fl == fl) return &wrappers[i];
+	return NULL;
+}
+
+CK_FUNCTION_LIST_PTR pkcs11_trace_wrap(CK_FUNCTION_LIST_PTR fl) {
+	struct trace_wrapper *w;
+	int i;
+
+	pthread_mutex_lock(&totals_mutex);
+	w = find_wrapper(fl);
+	for (i = 0; !w && i < TRACE_WRAPPERS; i++) {
+		if (wrappers[i].real_fl) continue;
+		w = &wrappers[i];
+		w->fl = *fl;
+		trace_entry_points[i](&w->fl);
+		w->real_fl = fl;
+		w->refs = 0;
+		memset(w->totals, 0, sizeof(w->totals));
+	}
+	if (w) w->refs++;
+	pthread_mutex_unlock(&totals_mutex);
+	if (!w) {
+		DBG1("More than %d traced modules, calls not traced", TRACE_WRAPPERS);
+		return fl;
+	}
+	DBG("tracing PKCS#11 calls");
+	return &w->fl;
+}
+
+void pkcs11_trace_unwrap(CK_FUNCTION_LIST_PTR fl) {
+	struct trace_wrapper *w;
+
+	pthread_mutex_lock(&totals_mutex);
+	w = find_wrapper(fl);
+	if (w && --w->refs == 0)
+		w->real_fl = NULL;
+	pthread_mutex_unlock(&totals_mutex);
+}
+
+void pkcs11_trace_report(CK_FUNCTION_LIST_PTR fl) {
+	struct trace_wrapper *w;
+	int i;
+
+	pthread_mutex_lock(&totals_mutex);
+	w = find_wrapper(fl);
+	for (i = 0; w && i < T_COUNT; i++) {
+		if (!w->totals[i].calls) continue;
+		DBG4("%s: %lu call(s), %lu error(s), %lu us", trace_names[i],
+			w->totals[i].calls, w->totals[i].errors, w->totals[i].us);
+		auth_trace_pkcs11_total(trace_names[i], w->totals[i].calls,
+			w->totals[i].errors, w->totals[i].us);
+	}
+	if (w) memset(w->totals, 0, sizeof(w->totals));
+	pthread_mutex_unlock(&totals_mutex);
+}
+
+#endif /* HAVE_NSS */
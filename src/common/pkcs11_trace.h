@@ -0,0 +1,71 @@
+/*
+ * PAM-PKCS11 PKCS#11 call tracer
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/** \file
+ The PKCS#11 call tracer interposes a function list between pkcs11_lib
+ and the module: every call made through it is timed and, while an
+ authentication trace is open, recorded with a summary of its arguments
+ and its return code. Per function call counts, errors and time are
+ aggregated per module and reported with pkcs11_trace_report(). PINs,
+ keys and signed data never appear in the trace, only their lengths.
+ Up to 8 modules can be traced at once.
+*/
+
+#ifndef __PKCS11_TRACE_H_
+#define __PKCS11_TRACE_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include "rsaref/pkcs11.h"
+
+#ifndef __PKCS11_TRACE_C_
+#define PKCS11_TRACE_EXTERN extern
+#else
+#define PKCS11_TRACE_EXTERN
+#endif
+
+/**
+* Interpose the tracer. The handles tracing the same module share its
+* traced list and counters. Each call must be matched by a
+* pkcs11_trace_unwrap()
+*@param fl Function list of the module
+*@return traced function list, to be used in place of fl, or fl itself
+* when no traced list is left
+*/
+PKCS11_TRACE_EXTERN CK_FUNCTION_LIST_PTR pkcs11_trace_wrap(CK_FUNCTION_LIST_PTR fl);
+
+/**
+* Release the traced list of a module once its handle is done with it
+*@param fl Function list of the module, as given to pkcs11_trace_wrap()
+*/
+PKCS11_TRACE_EXTERN void pkcs11_trace_unwrap(CK_FUNCTION_LIST_PTR fl);
+
+/**
+* Emit the aggregated counters of a module, to the debug output and to
+* the authentication trace if one is open, then reset them
+*@param fl Function list of the module, as given to pkcs11_trace_wrap()
+*/
+PKCS11_TRACE_EXTERN void pkcs11_trace_report(CK_FUNCTION_LIST_PTR fl);
+
+#undef PKCS11_TRACE_EXTERN
+
+#endif /* __PKCS11_TRACE_H_ */
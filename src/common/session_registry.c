@@ -0,0 +1,386 @@
+/*
+ * PAM-PKCS11 session registry
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+#define __SESSION_REGISTRY_C_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "debug.h"
+#include "error.h"
+#include "session_registry.h"
+
+/*
+* Registry file format: a "key = <key>" line, then one
+* "<id> <user> <tty> <seat> <pid> <start>" line per session. Empty fields
+* are stored as '-'. Files are named after their key and updated in place
+* under flock(), so that concurrent logins never lose an entry.
+*/
+
+/* longest file name written, below NAME_MAX everywhere */
+#define REGISTRY_NAME_MAX 240
+
+/* file name of a key: anything but [A-Za-z0-9._-] is %XX encoded */
+static int registry_name(char *buf, size_t size, const char *key) {
+	static const char hex[] = "0123456789abcdef";
+	size_t len = 0;
+
+	if (size > REGISTRY_NAME_MAX) size = REGISTRY_NAME_MAX;
+	for (; *key; key++) {
+		unsigned char c = *key;
+		if (len + 4 > size) return -1;
+		if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+		    (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-') {
+			buf[len++] = c;
+		} else {
+			buf[len++] = '%';
+			buf[len++] = hex[c >> 4];
+			buf[len++] = hex[c & 0x0f];
+		}
+	}
+	buf[len] = '\0';
+	return 0;
+}
+
+/*
+* start time of a process, in clock ticks since boot, to tell it from a
+* later process reusing its pid; 0 if unknown
+*/
+static unsigned long long process_start(long pid) {
+	char path[64], buf[1024], *pt;
+	unsigned long long start = 0;
+	ssize_t len;
+	int fd, i;
+
+	if (pid <= 0) return 0;
+	snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) return 0;
+	buf[len] = '\0';
+	/* the command name may hold blanks and parentheses */
+	pt = strrchr(buf, ')');
+	if (!pt) return 0;
+	/* starttime is the 22nd field, the 20th after the command name */
+	for (i = 0; i < 20 && pt; i++) pt = strchr(pt + 1, ' ');
+	if (pt) start = strtoull(pt + 1, NULL, 10);
+	return start;
+}
+
+/* registry must not be writable by anyone but root */
+static int check_registry_dir(const char *dir, int create) {
+	struct stat st;
+	if (stat(dir, &st) < 0) {
+		if (errno != ENOENT || !create || mkdir(dir, 0755) < 0 || stat(dir, &st) < 0) {
+			set_error("stat(%s) failed: %s", dir, strerror(errno));
+			return -1;
+		}
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		set_error("%s is not a directory", dir);
+		return -1;
+	}
+	if (st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		set_error("session registry %s MUST be owned by root and MUST NOT "
+			"be writable by the group or others", dir);
+		return -1;
+	}
+	return 0;
+}
+
+static int open_registry(const char *dir, const char *key, int write) {
+	char path[1024], name[REGISTRY_NAME_MAX];
+	int fd;
+
+	if (check_registry_dir(dir, write) < 0) return -1;
+	if (registry_name(name, sizeof(name), key) < 0) {
+		set_error("session registry key too long: %s", key);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/%s.sessions", dir, name);
+	fd = write ? open(path, O_RDWR | O_CREAT, 0644) : open(path, O_RDONLY);
+	if (fd < 0) {
+		if (write || errno != ENOENT)
+			set_error("cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (flock(fd, write ? LOCK_EX : LOCK_SH) < 0) {
+		set_error("cannot lock %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* keep fields single words so that the file stays line/space separated */
+static void copy_word(char *dst, size_t size, const char *src) {
+	size_t len = 0;
+	if (src) {
+		for (; *src && len < size - 1; src++)
+			dst[len++] = (*src == ' ' || *src == '\t' || *src == '\n') ? '_' : *src;
+	}
+	dst[len] = '\0';
+	if (!len) strncpy(dst, "-", size);
+}
+
+static int entry_alive(const session_entry_t *e) {
+	unsigned long long start;
+
+	if (e->pid <= 0) return 1;
+	if (kill((pid_t)e->pid, 0) < 0 && errno == ESRCH) return 0;
+	/* same pid, another process */
+	start = e->start ? process_start(e->pid) : 0;
+	return !start || start == e->start;
+}
+
+/* read all the entries of an open registry file */
+static session_entry_t *read_entries(int fd, const char *key, int *count) {
+	session_entry_t *list = NULL, *pt;
+	char line[1024], *nl;
+	FILE *f;
+	int fd2, n = 0, size = 0;
+
+	*count = 0;
+	/* fclose() must not release the lock held on fd */
+	fd2 = dup(fd);
+	if (fd2 < 0 || !(f = fdopen(fd2, "r"))) {
+		if (fd2 >= 0) close(fd2);
+		set_error("cannot read session registry: %s", strerror(errno));
+		return NULL;
+	}
+	rewind(f);
+	if (fgets(line, sizeof(line), f)) {
+		if ((nl = strchr(line, '\n'))) *nl = '\0';
+		if (strncmp(line, "key = ", 6) || strcmp(line + 6, key)) {
+			DBG1("session registry file for [%s] holds another key, ignored", key);
+			fclose(f);
+			return NULL;
+		}
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (n == size) {
+			size = size ? size * 2 : 8;
+			pt = realloc(list, size * sizeof(session_entry_t));
+			if (!pt) break;
+			list = pt;
+		}
+		memset(&list[n], 0, sizeof(session_entry_t));
+		/* start is missing in entries written by older versions */
+		if (sscanf(line, "%63s %63s %63s %31s %ld %llu", list[n].id, list[n].user,
+			list[n].tty, list[n].seat, &list[n].pid, &list[n].start) >= 5) n++;
+	}
+	fclose(f);
+	*count = n;
+	if (!n) {
+		free(list);
+		list = NULL;
+	}
+	return list;
+}
+
+static int write_entries(int fd, const char *key, const session_entry_t *list, int count) {
+	char line[1024];
+	int i, len, rv = 0;
+
+	if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) rv = -1;
+	len = snprintf(line, sizeof(line), "key = %s\n", key);
+	if (!rv && write(fd, line, len) != len) rv = -1;
+	for (i = 0; !rv && i < count; i++) {
+		len = snprintf(line, sizeof(line), "%s %s %s %s %ld %llu\n", list[i].id,
+			list[i].user, list[i].tty, list[i].seat, list[i].pid, list[i].start);
+		if (write(fd, line, len) != len) rv = -1;
+	}
+	if (rv < 0) set_error("cannot update session registry: %s", strerror(errno));
+	return rv;
+}
+
+/* rewrite the file without stale entries and without the given id */
+static int update_registry(const char *dir, const char *key,
+	const char *id, const session_entry_t *add) {
+	session_entry_t *list, *pt;
+	int fd, i, n = 0, count, rv;
+
+	fd = open_registry(dir, key, 1);
+	if (fd < 0) return -1;
+	list = read_entries(fd, key, &count);
+	for (i = 0; i < count; i++) {
+		if (!strcmp(list[i].id, id)) continue;
+		if (!entry_alive(&list[i])) {
+			DBG2("session %s of %s is gone, dropped", list[i].id, key);
+			continue;
+		}
+		list[n++] = list[i];
+	}
+	if (add) {
+		pt = realloc(list, (n + 1) * sizeof(session_entry_t));
+		if (!pt) {
+			free(list);
+			close(fd);
+			set_error("not enough free memory available");
+			return -1;
+		}
+		list = pt;
+		list[n++] = *add;
+	}
+	rv = write_entries(fd, key, list, n);
+	free(list);
+	close(fd);
+	return rv;
+}
+
+char *session_registry_key(char *buf, unsigned int size,
+	const char *prefix, const char *value) {
+	size_t len, plen = strlen(prefix);
+	int blank = 0;
+	if (!value || !*value) return NULL;
+	snprintf(buf, size, "%s", prefix);
+	len = strlen(buf);
+	/* a slot description is the reader name cut to 64 chars */
+	if (!strcmp(prefix, SESSION_KEY_SLOT) && size > plen + 64) size = plen + 65;
+	/* fold blanks: PKCS#11 strings are blank padded */
+	for (; *value && len < size - 1; value++) {
+		if (*value == ' ' || *value == '\t' || *value == '\n') {
+			blank = 1;
+			continue;
+		}
+		if (blank && len > plen && len < size - 2) buf[len++] = ' ';
+		blank = 0;
+		buf[len++] = *value;
+	}
+	buf[len] = '\0';
+	return len > plen ? buf : NULL;
+}
+
+int session_registry_add(const char *dir, const char *key,
+	const session_entry_t *entry) {
+	session_entry_t e;
+
+	copy_word(e.id, sizeof(e.id), entry->id);
+	copy_word(e.user, sizeof(e.user), entry->user);
+	copy_word(e.tty, sizeof(e.tty), entry->tty);
+	copy_word(e.seat, sizeof(e.seat), entry->seat);
+	e.pid = entry->pid;
+	e.start = entry->start ? entry->start : process_start(entry->pid);
+	DBG3("registering session %s of %s under %s", e.id, e.user, key);
+	return update_registry(dir, key, e.id, &e);
+}
+
+int session_registry_remove(const char *dir, const char *key, const char *id) {
+	char word[64];
+
+	copy_word(word, sizeof(word), id);
+	DBG2("removing session %s from %s", word, key);
+	return update_registry(dir, key, word, NULL);
+}
+
+session_entry_t *session_registry_lookup(const char *dir,
+	const char *key, int *count) {
+	session_entry_t *list;
+	int fd, i, n = 0;
+
+	*count = 0;
+	fd = open_registry(dir, key, 0);
+	if (fd < 0) return NULL;
+	list = read_entries(fd, key, count);
+	close(fd);
+	for (i = 0; i < *count; i++) {
+		if (entry_alive(&list[i])) list[n++] = list[i];
+	}
+	*count = n;
+	if (!n) {
+		free(list);
+		list = NULL;
+	}
+	return list;
+}
+
+static const char *export_names[] = {
+	"PKCS11_SESSIONS",
+	"PKCS11_SESSION_USERS",
+	"PKCS11_SESSION_TTYS",
+	"PKCS11_SESSION_SEATS",
+	"PKCS11_SESSION_PIDS",
+	NULL
+};
+
+int session_registry_export(const char *dir, const char **keys) {
+	session_entry_t *all = NULL, *list, *pt;
+	char *values[5], pid[24];
+	const char *field;
+	int i, j, k, n = 0, count;
+
+	session_registry_unexport();
+	if (!dir) return 0;
+	for (k = 0; keys[k]; k++) {
+		list = session_registry_lookup(dir, keys[k], &count);
+		for (i = 0; i < count; i++) {
+			for (j = 0; j < n && strcmp(all[j].id, list[i].id); j++);
+			if (j < n) continue;
+			pt = realloc(all, (n + 1) * sizeof(session_entry_t));
+			if (!pt) break;
+			all = pt;
+			all[n++] = list[i];
+		}
+		free(list);
+	}
+	if (!n) return 0;
+
+	for (k = 0; k < 5; k++) {
+		values[k] = calloc(n, sizeof(all[0].id) + 1);
+		if (!values[k]) continue;
+		for (i = 0; i < n; i++) {
+			switch (k) {
+			case 0: field = all[i].id; break;
+			case 1: field = all[i].user; break;
+			case 2: field = all[i].tty; break;
+			case 3: field = all[i].seat; break;
+			default:
+				snprintf(pid, sizeof(pid), "%ld", all[i].pid);
+				field = pid;
+			}
+			if (i) strcat(values[k], " ");
+			strcat(values[k], field);
+		}
+		setenv(export_names[k], values[k], 1);
+		free(values[k]);
+	}
+	DBG1("%d session(s) affected", n);
+	free(all);
+	return n;
+}
+
+void session_registry_unexport(void) {
+	int k;
+	for (k = 0; export_names[k]; k++) unsetenv(export_names[k]);
+}
@@ -0,0 +1,122 @@
+/*
+ * PAM-PKCS11 session registry
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/** \file
+ The session registry links tokens to the login sessions opened with
+ them, so that the card event managers can act on the sessions of the
+ removed token only. pam_pkcs11 registers a session when it is opened and
+ removes it when it is closed; the event managers look the removed token
+ up and export the affected sessions to the configured action.
+
+ Sessions are indexed by key, one file per key in the registry directory,
+ named after the key: "token:<serial>" (or "label:<label>" for tokens
+ without serial number) and "slot:<slot description>". PC/SC based
+ modules use the reader name, cut to 64 chars, as slot description: slot
+ keys are cut the same way, so the reader name seen by card_eventmgr and
+ the slot description seen by pam_pkcs11 give the same key. A lookup only
+ reads the file of the given key.
+
+ Sessions are tied to the process that opened them and to its start time,
+ so that a session is not kept alive by another process reusing the pid.
+*/
+
+#ifndef __SESSION_REGISTRY_H_
+#define __SESSION_REGISTRY_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/** Registry key prefixes */
+#define SESSION_KEY_TOKEN	"token:"
+#define SESSION_KEY_LABEL	"label:"
+#define SESSION_KEY_SLOT	"slot:"
+
+typedef struct session_entry_st {
+	char id[64];	/* session id (XDG_SESSION_ID, or pid<N>) */
+	char user[64];
+	char tty[64];
+	char seat[32];
+	long pid;	/* process that opened the session */
+	unsigned long long start;	/* its start time, 0 if unknown */
+} session_entry_t;
+
+#ifndef __SESSION_REGISTRY_C_
+#define SESSION_REGISTRY_EXTERN extern
+#else
+#define SESSION_REGISTRY_EXTERN
+#endif
+
+/**
+* Build a registry key. Blanks in value are folded, and slot descriptions
+* are cut to 64 chars
+*@param buf Output buffer
+*@param size Buffer size
+*@param prefix One of the SESSION_KEY_ prefixes
+*@param value Token serial, label or slot description
+*@return buf, or NULL if value is empty
+*/
+SESSION_REGISTRY_EXTERN char *session_registry_key(char *buf, unsigned int size,
+	const char *prefix, const char *value);
+
+/**
+* Register a session under a key, replacing any entry with the same id.
+* Entries whose process is gone are dropped on the way. The start time of
+* the process is looked up if entry->start is 0.
+*@param dir Registry directory, created if needed
+*@return 0 on success, -1 on error
+*/
+SESSION_REGISTRY_EXTERN int session_registry_add(const char *dir, const char *key,
+	const session_entry_t *entry);
+
+/**
+* Remove a session from a key
+*@return 0 on success, -1 on error
+*/
+SESSION_REGISTRY_EXTERN int session_registry_remove(const char *dir, const char *key,
+	const char *id);
+
+/**
+* Get the live sessions registered under a key
+*@param count Number of entries returned
+*@return array of entries to be free()'d, NULL if there are none
+*/
+SESSION_REGISTRY_EXTERN session_entry_t *session_registry_lookup(const char *dir,
+	const char *key, int *count);
+
+/**
+* Look up the sessions of a removed token and export them to the
+* environment of the removal action as space separated lists:
+* PKCS11_SESSIONS, PKCS11_SESSION_USERS, PKCS11_SESSION_TTYS,
+* PKCS11_SESSION_SEATS and PKCS11_SESSION_PIDS.
+*@param keys NULL terminated list of keys, sessions are merged by id
+*@return number of sessions exported
+*/
+SESSION_REGISTRY_EXTERN int session_registry_export(const char *dir, const char **keys);
+
+/**
+* Remove the variables set by session_registry_export()
+*/
+SESSION_REGISTRY_EXTERN void session_registry_unexport(void);
+
+#undef SESSION_REGISTRY_EXTERN
+
+#endif /* __SESSION_REGISTRY_H_ */
@@ -0,0 +1,231 @@
+/*
+ * PAM-PKCS11 token capability profiles
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+#define __TOKEN_PROFILE_C_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "debug.h"
+#include "error.h"
+#include "strings.h"
+#include "token_profile.h"
+
+/*
+* Profile file format: one "name = value" pair per line, '#' comments.
+* The "key" line is compared on load to detect file name collisions.
+*/
+static const char *cap_names[TOKEN_CAP_COUNT] = {
+	"certs_without_login",
+	"multi_attribute"
+};
+
+/* FNV-1a: profile file names only need to be stable, not secret */
+static unsigned long long profile_hash(const char *str) {
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	for (; *str; str++) {
+		h ^= (unsigned char)*str;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* profile store must not be writable by anyone but root */
+static int check_profile_dir(const char *dir) {
+	struct stat st;
+	if (stat(dir, &st) < 0) {
+		set_error("stat(%s) failed: %s", dir, strerror(errno));
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		set_error("%s is not a directory", dir);
+		return -1;
+	}
+	if (st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		set_error("token profile dir %s MUST be owned by root and MUST NOT "
+			"be writable by the group or others", dir);
+		return -1;
+	}
+	return 0;
+}
+
+/* strip trailing blanks and the field separator from PKCS#11 padded text */
+static void append_field(char *buf, size_t size, const char *field) {
+	size_t len = strlen(buf);
+	const char *pt;
+	if (len && len < size - 1) buf[len++] = '|';
+	for (pt = field; *pt && len < size - 1; pt++)
+		buf[len++] = (*pt == '|' || *pt == '\n') ? '_' : *pt;
+	while (len > 0 && buf[len - 1] == ' ') len--;
+	buf[len] = '\0';
+}
+
+/* in-place removal of leading and trailing blanks */
+static char *strip(char *str) {
+	char *end;
+	while (*str == ' ' || *str == '\t') str++;
+	end = str + strlen(str);
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n')) end--;
+	*end = '\0';
+	return str;
+}
+
+static void parse_profile(token_profile_t *p, FILE *fd) {
+	char line[1024];
+	char *name, *value, *pt;
+	int i;
+
+	while (fgets(line, sizeof(line), fd)) {
+		if (line[0] == '#' || !(pt = strchr(line, '='))) continue;
+		*pt = '\0';
+		name = strip(line);
+		value = strip(pt + 1);
+		if (!strcmp(name, "key") && strcmp(value, p->key)) {
+			DBG1("token profile %s belongs to another token, ignored", p->file);
+			for (i = 0; i < TOKEN_CAP_COUNT; i++) p->caps[i] = TOKEN_CAP_UNKNOWN;
+			return;
+		}
+		for (i = 0; i < TOKEN_CAP_COUNT; i++) {
+			if (!strcmp(name, cap_names[i])) p->caps[i] = atoi(value) ? TOKEN_CAP_YES : TOKEN_CAP_NO;
+		}
+	}
+}
+
+token_profile_t *load_token_profile(const char *dir,
+	const char *module, const char *manufacturer,
+	const char *model, const char *firmware) {
+	token_profile_t *p;
+	char key[512] = "";
+	size_t len;
+	FILE *fd;
+	int i;
+
+	if (check_profile_dir(dir) < 0) return NULL;
+	append_field(key, sizeof(key), module);
+	append_field(key, sizeof(key), manufacturer);
+	append_field(key, sizeof(key), model);
+	append_field(key, sizeof(key), firmware);
+
+	p = calloc(1, sizeof(token_profile_t));
+	if (!p) {
+		set_error("not enough free memory available");
+		return NULL;
+	}
+	for (i = 0; i < TOKEN_CAP_COUNT; i++) p->caps[i] = TOKEN_CAP_UNKNOWN;
+	len = strlen(dir) + 1 + 16 + sizeof(".profile");
+	p->key = clone_str(key);
+	p->file = malloc(len);
+	if (!p->key || !p->file) {
+		free_token_profile(p);
+		set_error("not enough free memory available");
+		return NULL;
+	}
+	snprintf(p->file, len, "%s/%016llx.profile", dir, profile_hash(key));
+
+	fd = fopen(p->file, "r");
+	if (fd) {
+		parse_profile(p, fd);
+		fclose(fd);
+		DBG2("token profile %s loaded for [%s]", p->file, p->key);
+	} else {
+		DBG1("no token profile yet for [%s]", p->key);
+	}
+	return p;
+}
+
+int save_token_profile(token_profile_t *p) {
+	char *tmp;
+	size_t len;
+	FILE *fd;
+	int i, fdn;
+
+	if (!p || !p->dirty) return 0;
+	len = strlen(p->file) + sizeof(".XXXXXX");
+	tmp = malloc(len);
+	if (!tmp) {
+		set_error("not enough free memory available");
+		return -1;
+	}
+	snprintf(tmp, len, "%s.XXXXXX", p->file);
+	fdn = mkstemp(tmp);
+	if (fdn < 0 || !(fd = fdopen(fdn, "w"))) {
+		set_error("cannot create %s: %s", tmp, strerror(errno));
+		if (fdn >= 0) {
+			close(fdn);
+			unlink(tmp);
+		}
+		free(tmp);
+		return -1;
+	}
+	fchmod(fdn, 0644);
+	fprintf(fd, "# pam_pkcs11 token profile, automatically generated\n");
+	fprintf(fd, "key = %s\n", p->key);
+	for (i = 0; i < TOKEN_CAP_COUNT; i++) {
+		if (p->caps[i] != TOKEN_CAP_UNKNOWN)
+			fprintf(fd, "%s = %d\n", cap_names[i], p->caps[i]);
+	}
+	if (fclose(fd) != 0 || rename(tmp, p->file) < 0) {
+		set_error("cannot store token profile %s: %s", p->file, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	p->dirty = 0;
+	DBG1("token profile %s saved", p->file);
+	return 0;
+}
+
+void free_token_profile(token_profile_t *p) {
+	if (!p) return;
+	free(p->key);
+	free(p->file);
+	free(p);
+}
+
+int token_profile_get(const token_profile_t *p, int cap) {
+	if (!p || cap < 0 || cap >= TOKEN_CAP_COUNT) return TOKEN_CAP_UNKNOWN;
+	return p->caps[cap];
+}
+
+void token_profile_set(token_profile_t *p, int cap, int value) {
+	if (!p || cap < 0 || cap >= TOKEN_CAP_COUNT) return;
+	if (p->caps[cap] == value) return;
+	DBG3("token profile: %s %d -> %d", cap_names[cap], p->caps[cap], value);
+	p->caps[cap] = value;
+	p->dirty = 1;
+}
+
+unsigned long token_profile_elapsed(const struct timeval *start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_usec - start->tv_usec) / 1000;
+}
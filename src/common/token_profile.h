@@ -0,0 +1,105 @@
+/*
+ * PAM-PKCS11 token capability profiles
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/** \file
+ A token profile records what has been learned about a given kind of
+ token (PKCS#11 module, token manufacturer, model and firmware version):
+ which optional behaviours it supports. Profiles are stored one per file
+ in a local directory, and are only used to choose between equally safe
+ strategies; they never relax any security check.
+*/
+
+#ifndef __TOKEN_PROFILE_H_
+#define __TOKEN_PROFILE_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/time.h>
+
+/** Learned capabilities */
+#define TOKEN_CAP_CERTS_WITHOUT_LOGIN	0 /**< certificates are visible before C_Login */
+#define TOKEN_CAP_MULTI_ATTRIBUTE	1 /**< several attributes per C_GetAttributeValue */
+#define TOKEN_CAP_COUNT			2
+
+/** Capability state */
+#define TOKEN_CAP_UNKNOWN		-1
+#define TOKEN_CAP_NO			0
+#define TOKEN_CAP_YES			1
+
+typedef struct token_profile_st {
+	char *key;	/* module|manufacturer|model|firmware */
+	char *file;	/* where the profile is stored */
+	int caps[TOKEN_CAP_COUNT];
+	int dirty;
+} token_profile_t;
+
+#ifndef __TOKEN_PROFILE_C_
+#define TOKEN_PROFILE_EXTERN extern
+#else
+#define TOKEN_PROFILE_EXTERN
+#endif
+
+/**
+* Load (or create an empty) profile for the given token kind
+*@param dir Profile store directory
+*@param module PKCS#11 module path
+*@param manufacturer Token manufacturer ID
+*@param model Token model
+*@param firmware Token firmware version, as "major.minor"
+*@return new profile, or NULL on error
+*/
+TOKEN_PROFILE_EXTERN token_profile_t *load_token_profile(const char *dir,
+	const char *module, const char *manufacturer,
+	const char *model, const char *firmware);
+
+/**
+* Store a profile back if anything has been learned since it was loaded
+*@param profile Profile to store
+*@return 0 on success, -1 on error
+*/
+TOKEN_PROFILE_EXTERN int save_token_profile(token_profile_t *profile);
+
+/**
+* Release a profile
+*@param profile Profile to free
+*/
+TOKEN_PROFILE_EXTERN void free_token_profile(token_profile_t *profile);
+
+/**
+* Get a learned capability
+*@return TOKEN_CAP_UNKNOWN, TOKEN_CAP_NO or TOKEN_CAP_YES
+*/
+TOKEN_PROFILE_EXTERN int token_profile_get(const token_profile_t *profile, int cap);
+
+/**
+* Record an observed capability
+*/
+TOKEN_PROFILE_EXTERN void token_profile_set(token_profile_t *profile, int cap, int value);
+
+/**
+* Milliseconds elapsed since a given gettimeofday() value
+*/
+TOKEN_PROFILE_EXTERN unsigned long token_profile_elapsed(const struct timeval *start);
+
+#undef TOKEN_PROFILE_EXTERN
+
+#endif /* __TOKEN_PROFILE_H_ */
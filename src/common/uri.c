@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <time.h>
 
 #include "uri.h"
 #include "debug.h"
@@ -108,8 +109,9 @@ static size_t curl_get(void *ptr, size_t size, size_t nmemb, void *stream) {
     return size;
 }
 
-int get_from_uri(const char *uri_str, unsigned char **data, size_t *length) {
+int get_from_uri_since(const char *uri_str, time_t since, unsigned char **data, size_t *length) {
   int rv;
+  long unmet = 0;
   CURL *curl;
   char curl_error[CURL_ERROR_SIZE] = "0";
   struct curl_data_s curl_data =  { NULL, 0};
@@ -123,19 +125,38 @@ int get_from_uri(const char *uri_str, unsigned char **data, size_t *length) {
   curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_get);
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&curl_data);
+  if (since > 0) {
+    curl_easy_setopt(curl, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+    curl_easy_setopt(curl, CURLOPT_TIMEVALUE, (long)since);
+  }
   /* download data */
   rv = curl_easy_perform(curl);
+  if (rv == 0 && since > 0)
+    curl_easy_getinfo(curl, CURLINFO_CONDITION_UNMET, &unmet);
   curl_easy_cleanup(curl);
   if (rv != 0) {
     set_error("curl_easy_perform() failed: %s (%d)", curl_error, rv);
     return -1;
   }
+  if (unmet) {
+    free(curl_data.data);
+    DBG1("%s not modified", uri_str);
+    return 1;
+  }
   /* copy data */
   *data = curl_data.data;
   *length = curl_data.length;
   return 0;
 }
 
+int uri_global_init(void) {
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) {
+    set_error("curl_global_init() failed");
+    return -1;
+  }
+  return 0;
+}
+
 #else
 
 #include <sys/types.h>
@@ -321,13 +342,18 @@ static int parse_uri(const char *str, uri_t **uri)
   return rv;
 }
 
-static int get_file(uri_t *uri, unsigned char **data, ssize_t * length)
+static int get_file(uri_t *uri, time_t since, unsigned char **data, ssize_t * length)
 {
   int fd;
   ssize_t len, rv;
+  struct stat st;
 
   *length = 0;
   *data = NULL;
+  if (since > 0 && stat(uri->file->path, &st) == 0 && st.st_mtime <= since) {
+    DBG("not modified");
+    return 1;
+  }
   /* open file */
   DBG("opening...");
   fd = open(uri->file->path, O_RDONLY);
@@ -367,9 +393,11 @@ static int get_file(uri_t *uri, unsigned char **data, ssize_t * length)
   return 0;
 }
 
-static int get_http(uri_t *uri, unsigned char **data, size_t *length, int rec_level)
+static int get_http(uri_t *uri, time_t since, unsigned char **data, size_t *length, int rec_level)
 {
   int rv, sock, i, j;
+  char condition[64] = "";
+  struct tm tm;
   struct addrinfo hint = { 0, PF_UNSPEC, SOCK_STREAM, 0, 0, NULL, NULL, NULL };
   struct addrinfo *info;
   char *request;
@@ -401,13 +429,17 @@ static int get_http(uri_t *uri, unsigned char **data, size_t *length, int rec_le
     return -1;
   }
   /* send http 1.0 request */
-  request = malloc(32 + strlen(uri->http->path) + strlen(uri->http->host));
+  /* conditional request: the server answers 304 if nothing changed */
+  if (since > 0 && gmtime_r(&since, &tm))
+    strftime(condition, sizeof(condition),
+             "If-Modified-Since: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+  request = malloc(32 + strlen(uri->http->path) + strlen(uri->http->host) + strlen(condition));
   if (request == NULL) {
     close(sock);
     set_error("not enough free memory available");
     return -1;
   }
-  sprintf(request, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", uri->http->path, uri->http->host);
+  sprintf(request, "GET %s HTTP/1.0\r\nHost: %s\r\n%s\r\n", uri->http->path, uri->http->host, condition);
   len = strlen(request);
   rv = send(sock, request, len, 0);
   free(request);
@@ -482,10 +514,14 @@ static int get_http(uri_t *uri, unsigned char **data, size_t *length, int rec_le
       return -1;
     }
     /* downlaod recursively */
-    rv = get_http(ruri, data, length, ++rec_level);
+    rv = get_http(ruri, since, data, length, ++rec_level);
     free_uri(ruri);
     free(buf);
     return rv;
+  } else if (rv == 304 && since > 0) {
+    free(buf);
+    DBG("not modified");
+    return 1;
   } else if (rv != 200) {
     free(buf);
     set_error("http get command failed with error %d", rv);
@@ -584,7 +620,7 @@ static int get_ldap(uri_t *uri, unsigned char **data, size_t *length)
 }
 #endif
 
-int get_from_uri(const char *str, unsigned char **data, size_t *length)
+int get_from_uri_since(const char *str, time_t since, unsigned char **data, size_t *length)
 {
   int rv;
   uri_t *uri;
@@ -599,13 +635,13 @@ int get_from_uri(const char *str, unsigned char **data, size_t *length)
   /* download data depending on the scheme */
   switch (uri->scheme) {
     case file:
-      rv = get_file(uri, data, (ssize_t *) length);
-      if (rv != 0)
+      rv = get_file(uri, since, data, (ssize_t *) length);
+      if (rv < 0)
         set_error("get_file() failed: %s", get_error());
       break;
     case http:
-      rv = get_http(uri, data, length, 0);
-      if (rv != 0)
+      rv = get_http(uri, since, data, length, 0);
+      if (rv < 0)
         set_error("get_http() failed: %s", get_error());
       break;
     case ldap:
@@ -627,4 +663,13 @@ int get_from_uri(const char *str, unsigned char **data, size_t *length)
   return rv;
 }
 
+int uri_global_init(void) {
+  return 0;
+}
+
 #endif /* USE_CURL */
+
+int get_from_uri(const char *uri_str, unsigned char **data, size_t *length)
+{
+  return get_from_uri_since(uri_str, 0, data, length);
+}
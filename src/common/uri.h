@@ -34,6 +34,7 @@
 #include <config.h>
 #endif
 #include <stdlib.h>
+#include <time.h>
 
 #ifndef __URI_C_
 #define URI_EXTERN extern
@@ -55,6 +56,24 @@ URI_EXTERN int is_symlink(const char *path);
 */
 URI_EXTERN int get_from_uri(const char *uri_str, unsigned char **data, size_t *length);
 
+/**
+*  Downloads data from a given URI unless it has not changed since a
+*  given time (If-Modified-Since for http, modification time for files)
+*@param uri_str URL string where to retrieve data
+*@param since Time of the copy already held, 0 to always download
+*@param data Pointer to a String buffer where data is retrieved
+*@param length Length of retrieved data
+*@return -1 on error, 0 on sucess, 1 if not modified (no data returned)
+*/
+URI_EXTERN int get_from_uri_since(const char *uri_str, time_t since, unsigned char **data, size_t *length);
+
+/**
+*  Initialise the download library. Must be called once, before any
+*  other thread is started, by programs downloading from several threads
+*@return -1 on error, 0 on sucess
+*/
+URI_EXTERN int uri_global_init(void);
+
 #undef URI_EXTERN
 
 #endif /* __URI_H_ */
@@ -44,8 +44,12 @@ static const char *mapfile = "none";
 static int usepwent = 0;
 static int ignorecase = 0;
 static int id_type = CERT_CN;
+static int canonical = 0;
 static int debug = 0;
 
+/* hashed mapfile, for subject and issuer lookups in canonical form */
+static struct mapindex *name_index = NULL;
+
 static char **generic_mapper_find_entries(X509 *x509, void *context) {
         if (!x509) {
                 DBG("NULL certificate provided");
@@ -54,7 +58,7 @@ static char **generic_mapper_find_entries(X509 *x509, void *context) {
 	return cert_info(x509, id_type, ALGORITHM_NULL);
 }
 
-static char **get_mapped_entries(char **entries) {
+static char **get_mapped_entries(X509 *x509, char **entries, void *context) {
 	int match = 0;
 	char *entry;
 	int n=0;
@@ -62,6 +66,12 @@ static char **get_mapped_entries(char **entries) {
 	/* if mapfile is provided, map entries according it */
 	if ( !strcmp(mapfile,"none") ) {
 	    DBG("Use map file is disabled");
+	} else if (name_index) {
+	    char **canon = cert_info(x509,
+		id_type==CERT_SUBJECT ? CERT_CANON_SUBJECT : CERT_CANON_ISSUER, ALGORITHM_NULL);
+	    DBG1("Using indexed map file '%s'",mapfile);
+	    res = mapindex_find(name_index,canon ? canon[0] : NULL,entries[0],ignorecase,&match);
+	    if (res) entries[0]=res;
 	} else {
 	    DBG1("Using map file '%s'",mapfile);
 	    for(n=0, entry=entries[n]; entry; entry=entries[++n]) {
@@ -76,7 +86,7 @@ static char **get_mapped_entries(char **entries) {
 	    res=NULL;
 	    DBG("Using Naming Services");
 	    for(n=0,entry=entries[n];entry;entry=entries[++n]) {
-		res = search_pw_entry(entry,ignorecase);
+		res = search_pw_scope(entry,ignorecase,context);
 		if (res) entries[n]=res;
 	    }
 	}
@@ -97,7 +107,7 @@ static char *generic_mapper_find_user(X509 *x509, void *context, int *match) {
 		return 0;
 	}
 	/* do file and pwent mapping */
-	entries= get_mapped_entries(entries);
+	entries= get_mapped_entries(x509,entries,context);
 	/* and now return first nonzero item */
 	for (n=0;n<CERT_INFO_SIZE;n++) {
 	    char *str=entries[n];
@@ -127,7 +137,7 @@ static int generic_mapper_match_user(X509 *x509, const char *login, void *contex
 		return 0;
 	}
 	/* do file and pwent mapping */
-	entries= get_mapped_entries(entries);
+	entries= get_mapped_entries(x509,entries,context);
 	/* and now try to match entries with provided login  */
 	for (n=0;n<CERT_INFO_SIZE;n++) {
 	    char *str=entries[n];
@@ -144,18 +154,22 @@ static int generic_mapper_match_user(X509 *x509, const char *login, void *contex
 	return 0;
 }
 
-_DEFAULT_MAPPER_END
+static void generic_mapper_module_end(void *context) {
+	mapindex_free(name_index);
+	name_index = NULL;
+	free(context);
+}
 
 static mapper_module * init_mapper_st(scconf_block *blk, const char *name) {
 	mapper_module *pt= malloc(sizeof(mapper_module));
 	if (!pt) return NULL;
 	pt->name = name;
 	pt->block = blk;
-	pt->context = NULL;
+	pt->context = pw_scope_load(blk);
 	pt->entries = generic_mapper_find_entries;
 	pt->finder = generic_mapper_find_user;
 	pt->matcher = generic_mapper_match_user;
-	pt->deinit = mapper_module_end;
+	pt->deinit = generic_mapper_module_end;
 	return pt;
 }
 
@@ -176,6 +190,7 @@ mapper_module * generic_mapper_module_init(scconf_block *blk,const char *name) {
 	usepwent = scconf_get_bool( blk,"use_getpwent",0);
 	mapfile= scconf_get_str(blk,"mapfile",mapfile);
 	item= scconf_get_str(blk,"cert_item","cn");
+	canonical = scconf_get_bool( blk,"canonical",0);
 	} else {
 		/* should not occurs, but... */
 		DBG1("No block declaration for mapper '%s'",name);
@@ -183,6 +198,7 @@ mapper_module * generic_mapper_module_init(scconf_block *blk,const char *name) {
 	set_debug_level(debug);
 	if (!strcasecmp(item,"cn"))           id_type=CERT_CN;
 	else if (!strcasecmp(item,"subject")) id_type=CERT_SUBJECT;
+	else if (!strcasecmp(item,"issuer"))  id_type=CERT_ISSUER;
 	else if (!strcasecmp(item,"kpn") )    id_type=CERT_KPN;
 	else if (!strcasecmp(item,"email") )  id_type=CERT_EMAIL;
 	else if (!strcasecmp(item,"upn") )    id_type=CERT_UPN;
@@ -191,6 +207,14 @@ mapper_module * generic_mapper_module_init(scconf_block *blk,const char *name) {
 	else {
 	    DBG1("Invalid certificate item to search '%s'; using 'cn'",item);
 	}
+	if (canonical && strcmp(mapfile,"none")) {
+	    if (id_type==CERT_SUBJECT || id_type==CERT_ISSUER) {
+		name_index = mapindex_load(mapfile,canonical_dn);
+		if (!name_index) DBG1("Cannot index mapfile %s, using linear lookups",mapfile);
+	    } else {
+		DBG("canonical lookups only apply to 'subject' and 'issuer' items");
+	    }
+	}
 	pt = init_mapper_st(blk,name);
 	if (pt) DBG5("Generic mapper started. debug: %d, mapfile: '%s', ignorecase: %d usepwent: %d idType: '%d'",debug,mapfile,ignorecase,usepwent,id_type);
 	else DBG("Generic mapper initialization failed");
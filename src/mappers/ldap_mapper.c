@@ -71,7 +71,6 @@ static const int LDAP_CONFIG_URI_MAX = 10;
  *   - you got no error-massage from your application
  *   - believe skip ldap_unbind (*ld) for a bind handle isn't a good solution
  *
- * - implement searchtimeout
  * - implement ignorecase
  */
 
@@ -85,6 +84,26 @@ enum ldap_ssl_options
 
 typedef enum ldap_ssl_options ldap_ssl_options_t;
 
+/* what a search asks the server to return, see "search_mode" */
+enum ldap_search_mode
+{
+	SEARCH_UID,		/* uid_attribute only, no certificate value */
+	SEARCH_ATTRSONLY,	/* attribute types, no value */
+	SEARCH_MATCHED_VALUES,	/* only the certificate searched for */
+	SEARCH_FULL		/* every certificate of the entry */
+};
+
+static const char *search_modes[] = {
+	"uid", "attrsonly", "matched_values", "full", NULL
+};
+
+/* only the first entry is used, a second one is warned about */
+#define LDAP_SEARCH_SIZELIMIT 2
+
+#ifndef LDAP_NO_ATTRS
+#define LDAP_NO_ATTRS "1.1"
+#endif
+
 #ifndef LDAPS_PORT
 #define LDAPS_PORT 636
 #endif
@@ -106,10 +125,15 @@ static const char *uid_attribute;
 static const scconf_list *attribute_map;
 static const char *filter="(&(objectClass=posixAccount)(uid=%s)";
 static int searchtimeout=20;
+static int search_mode=SEARCH_UID;
 static int ignorecase=0;
 static char *uid_attribute_value;
 static int certcnt=0;
 
+/* this mapper, and the deadline of its running call */
+static mapper_module *ldap_module=NULL;
+static struct timespec call_deadline;
+
 static ldap_ssl_options_t ssl_on = SSL_OFF;
 #if defined HAVE_LDAP_START_TLS_S || (defined(HAVE_LDAP_SET_OPTION) && defined(LDAP_OPT_X_TLS))
 /* TLS/SSL specific options */
@@ -306,6 +330,25 @@ static int do_ssl_options (LDAP *ldap_connection)
 #endif
 
 
+/*
+ * bound a timeout of the configuration, in seconds, by what is left of
+ * the running mapper call. Fills tv, returns NULL if there is no limit
+ * at all (LDAP_NO_LIMIT and no deadline), else tv
+ */
+static struct timeval *ldap_timeout(int seconds, struct timeval *tv)
+{
+	int left = mapper_time_left(&call_deadline);
+
+	tv->tv_sec = seconds;
+	tv->tv_usec = 0;
+	if (left >= 0 && (seconds <= 0 || left < seconds * 1000)) {
+		tv->tv_sec = left / 1000;
+		tv->tv_usec = (left % 1000) * 1000;
+		return tv;
+	}
+	return seconds > 0 ? tv : NULL;
+}
+
 static int
 do_bind (LDAP * ldap_connection, int timelimit)
 {
@@ -318,8 +361,7 @@ do_bind (LDAP * ldap_connection, int timelimit)
 	 * set timelimit in ld for select() call in ldap_pvt_connect()
 	 * function implemented in libldap2's os-ip.c
 	 */
-  	tv.tv_sec = timelimit;
-  	tv.tv_usec = 0;
+  	ldap_timeout(timelimit, &tv);
 
 DBG2("do_bind(): bind DN=\"%s\" pass=\"%s\"",binddn,passwd);
 
@@ -417,8 +459,7 @@ static int do_open (LDAP **ld, const char* uri, int defport, ldap_ssl_options_t
 #endif /* LDAP_OPT_NETWORK_TIMEOUT */
 
 #if defined(HAVE_LDAP_SET_OPTION) && defined(LDAP_OPT_NETWORK_TIMEOUT)
-	tv.tv_sec = bind_timelimit;
-	tv.tv_usec = 0;
+	ldap_timeout(bind_timelimit, &tv);
 	ldap_set_option (*ld, LDAP_OPT_NETWORK_TIMEOUT, &tv);
 #endif /* LDAP_OPT_NETWORK_TIMEOUT */
 
@@ -458,16 +499,7 @@ static int do_open (LDAP **ld, const char* uri, int defport, ldap_ssl_options_t
 		  return rc;
 		}
 
-		if (bind_timelimit == LDAP_NO_LIMIT)
-		{
-			tvp = NULL;
-    	}
-  		else
-    	{
-      		tv.tv_sec = bind_timelimit;
-      		tv.tv_usec = 0;
-      		tvp = &tv;
-    	}
+		tvp = ldap_timeout(bind_timelimit, &tv);
 
 		rc = ldap_result (*ld, msgid, 1, tvp, &res);
 		if (rc == -1)
@@ -890,6 +922,58 @@ ldap_build_filter(const char *filter_param, const char *login, const char *map,
 	return buf;
 }
 
+/* tell whether the certificate is among the values of the entry */
+static int
+ldap_has_certificate(struct berval **bvals, X509 *x509)
+{
+	unsigned char *der;
+	size_t der_len;
+	int n, found = 0;
+
+	if (bvals == NULL)
+		return 0;
+	ldap_x509_as_binary(x509, &der, &der_len);
+	if (der == NULL)
+		return 0;
+	for (n = 0; bvals[n] != NULL && !found; n++)
+		found = bvals[n]->bv_len == der_len &&
+			!memcmp(bvals[n]->bv_val, der, der_len);
+	free(der);
+	return found;
+}
+
+#ifdef LDAP_CONTROL_VALUESRETURNFILTER
+/*
+* RFC 3876 matched values control: the server returns only the values
+* of the certificate attribute equal to the certificate searched for.
+* Not critical: a server without it returns every value.
+*/
+static LDAPControl *
+ldap_values_control(X509 *x509)
+{
+	LDAPControl *ctrl = NULL;
+	BerElement *ber;
+	char *vrf;
+
+	vrf = ldap_build_default_cert_filter(x509);
+	if (vrf == NULL)
+		return NULL;
+	ber = ber_alloc_t(LBER_USE_DER);
+	if (ber == NULL) {
+		free(vrf);
+		return NULL;
+	}
+	if (ldap_put_vrFilter(ber, vrf) == -1 ||
+	    ldap_create_control(LDAP_CONTROL_VALUESRETURNFILTER, ber, 0, &ctrl) != LDAP_SUCCESS) {
+		DBG("ldap_values_control(): cannot build the matched values control");
+		ctrl = NULL;
+	}
+	ber_free(ber, 1);
+	free(vrf);
+	return ctrl;
+}
+#endif
+
 /**
 * Get certificate from LDAP-Server.
 */
@@ -901,6 +985,9 @@ static int ldap_get_certificate(const char *login, X509 *x509) {
 	struct berval **bvals = NULL, *bv;
 	char *filter_str;
 	char *attrs[3];
+	int nattrs = 0;
+	LDAPControl *ctrls[2] = { NULL, NULL };
+	struct timeval tv, *tvp = NULL;
 	int rv = LDAP_SUCCESS;
 
 	char uri[4096];
@@ -915,9 +1002,15 @@ static int ldap_get_certificate(const char *login, X509 *x509) {
 
 	uris[0] = NULL;
 
-	attrs[0] = (char *)attribute;
-	attrs[1] = (char *)uid_attribute;
-	attrs[2] = NULL;
+	/* ask for the certificates only when they are wanted */
+	if (search_mode != SEARCH_UID)
+		attrs[nattrs++] = (char *)attribute;
+	if (uid_attribute != NULL)
+		attrs[nattrs++] = (char *)uid_attribute;
+	if (nattrs == 0)
+		attrs[nattrs++] = LDAP_NO_ATTRS;
+	attrs[nattrs] = NULL;
+	tvp = ldap_timeout(searchtimeout, &tv);
 
 	free((char *)uid_attribute_value);
 	uid_attribute_value = NULL;
@@ -984,6 +1077,10 @@ static int ldap_get_certificate(const char *login, X509 *x509) {
 	start_uri = current_uri;
 	do
 	{
+		if (mapper_time_left(&call_deadline) == 0) {
+			DBG("ldap_get_certificate(): mapper deadline passed");
+			return(-2);
+		}
 		if(uris[current_uri] != NULL)
 			DBG1("ldap_get_certificate(): try do_open for %s", uris[current_uri]);
 		rv = do_open(&ldap_connection, uris[current_uri], ldapport, ssl_on);
@@ -1010,6 +1107,11 @@ static int ldap_get_certificate(const char *login, X509 *x509) {
     	     server again. Perhaps create a state file/smem/etc. ?
     */
 
+#ifdef LDAP_CONTROL_VALUESRETURNFILTER
+	if (search_mode == SEARCH_MATCHED_VALUES)
+		ctrls[0] = ldap_values_control(x509);
+#endif
+
 	/* Search for matching entries. */
 	for (mapping = attribute_map;; mapping = mapping->next) {
 		/* Walk the list of mappings, and if we're out of those, let
@@ -1031,14 +1133,22 @@ static int ldap_get_certificate(const char *login, X509 *x509) {
 		}
 		DBG1("ldap_get_certificate(): searching with filter_str = %s",
 		     filter_str);
-		rv = ldap_search_s(ldap_connection,
+		res = NULL;
+		rv = ldap_search_ext_s(ldap_connection,
 				   base,
 				   sscope[scope],
 				   filter_str,
 				   attrs,
-				   0,
+				   search_mode == SEARCH_ATTRSONLY,
+				   ctrls[0] ? ctrls : NULL,
+				   NULL,
+				   tvp,
+				   LDAP_SEARCH_SIZELIMIT,
 				   &res);
 		free(filter_str);
+		/* the entries found before the limit are returned */
+		if (rv == LDAP_SIZELIMIT_EXCEEDED && res != NULL)
+			rv = LDAP_SUCCESS;
 		/* The first successful search means we're done. */
 		if ((rv == LDAP_SUCCESS) &&
 		    (ldap_count_entries(ldap_connection, res) > 0)) {
@@ -1046,11 +1156,16 @@ static int ldap_get_certificate(const char *login, X509 *x509) {
 			break;
 		}
 		DBG("ldap_get_certificate(): no matching entries");
+		if (res != NULL)
+			ldap_msgfree(res);
+		res = NULL;
 		/* If this was the fallback (cert-only) search, we're done. */
 		if (mapping == NULL) {
 			break;
 		}
 	}
+	if (ctrls[0] != NULL)
+		ldap_control_free(ctrls[0]);
 	if (filter_str == NULL) {
 		DBG("ldap_get_certificate(): unable to build any filter_str");
 		return(-8);
@@ -1082,11 +1197,17 @@ static int ldap_get_certificate(const char *login, X509 *x509) {
 		}
 
 		/* Count the number of certificates in the entry. */
-		DBG1("attribute name = %s", attribute);
-		bvals = ldap_get_values_len(ldap_connection, entry, attribute);
-		certcnt = ldap_count_values_len(bvals);
-		DBG1("number of user certificates = %d", certcnt);
-		ldap_value_free_len(bvals);
+		if (search_mode == SEARCH_MATCHED_VALUES || search_mode == SEARCH_FULL) {
+			DBG1("attribute name = %s", attribute);
+			bvals = ldap_get_values_len(ldap_connection, entry, attribute);
+			certcnt = ldap_count_values_len(bvals);
+			DBG2("number of user certificates = %d, presented one %s", certcnt,
+			     ldap_has_certificate(bvals, x509) ? "included" : "not included");
+			ldap_value_free_len(bvals);
+		} else {
+			DBG1("certificates not requested (search_mode = %s)",
+			     search_modes[search_mode]);
+		}
 
 		if (uid_attribute != NULL) {
 			/* Try to retrieve the user's login name from the
@@ -1124,7 +1245,9 @@ static int ldap_get_certificate(const char *login, X509 *x509) {
 static int read_config(scconf_block *blk) {
 	int debug = scconf_get_bool(blk,"debug",0);
 	const char *ssltls;
+	const char *mode;
 	const scconf_list *map;
+	int n;
 
 	ldaphost = scconf_get_str(blk,"ldaphost",ldaphost);
 	ldapport = scconf_get_int(blk,"ldapport",ldapport);
@@ -1139,6 +1262,7 @@ static int read_config(scconf_block *blk) {
 	filter = scconf_get_str(blk,"filter",filter);
 	ignorecase = scconf_get_bool(blk,"ignorecase",ignorecase);
 	searchtimeout = scconf_get_int(blk,"searchtimeout",searchtimeout);
+	mode = scconf_get_str(blk,"search_mode",search_modes[search_mode]);
 
 	ssltls =  scconf_get_str(blk,"ssl","off");
 	if (! strncasecmp (ssltls, "tls", 3))
@@ -1147,6 +1271,42 @@ static int read_config(scconf_block *blk) {
 		ssl_on = SSL_LDAPS;
 	else if( ! strncasecmp (ssltls, "ssl", 3))
 		ssl_on = SSL_LDAPS;
+	else if( ! strncasecmp (ssltls, "off", 3))
+		ssl_on = SSL_OFF;
+	else {
+		DBG1("Invalid ssl mode '%s': use off, tls, on or ssl", ssltls);
+		return -1;
+	}
+
+	for (n = 0; search_modes[n] != NULL; n++)
+		if (!strcasecmp(mode, search_modes[n]))
+			break;
+	if (search_modes[n] == NULL) {
+		DBG1("Invalid search_mode '%s': use uid, attrsonly, matched_values or full", mode);
+		return -1;
+	}
+	search_mode = n;
+	if (search_mode == SEARCH_ATTRSONLY && uid_attribute != NULL) {
+		/* attrsonly would not return the login either */
+		DBG("search_mode attrsonly cannot return uid_attribute, using uid");
+		search_mode = SEARCH_UID;
+	}
+#ifndef LDAP_CONTROL_VALUESRETURNFILTER
+	if (search_mode == SEARCH_MATCHED_VALUES) {
+		DBG("matched values control not supported by the LDAP library, using full");
+		search_mode = SEARCH_FULL;
+	}
+#endif
+
+	/* reject values that would only fail at authentication time */
+	if (scope < 0 || scope > 2) {
+		DBG1("Invalid scope %d: use 0 (base), 1 (one) or 2 (sub)", scope);
+		return -1;
+	}
+	if (ldapport < 0 || ldapport > 65535) {
+		DBG1("Invalid ldapport %d", ldapport);
+		return -1;
+	}
 
 #if defined HAVE_LDAP_START_TLS_S || (defined(HAVE_LDAP_SET_OPTION) && defined(LDAP_OPT_X_TLS))
 	/* TLS specific options */
@@ -1180,6 +1340,7 @@ DBG1("test ssltls = %s", ssltls);
 	}
 	DBG1("filter        = %s", filter);
 	DBG1("searchtimeout = %d", searchtimeout);
+	DBG1("search_mode   = %s", search_modes[search_mode]);
 	DBG1("ssl_on        = %d", ssl_on);
 #if defined HAVE_LDAP_START_TLS_S || (defined(HAVE_LDAP_SET_OPTION) && defined(LDAP_OPT_X_TLS))
 	DBG1("tls_randfile  = %s", tls_randfile);
@@ -1205,7 +1366,7 @@ static char ** ldap_mapper_find_entries(X509 *x509, void *context) {
         return entries;
 }
 
-static int ldap_mapper_match_user(X509 *x509, const char *login, void *context) {
+static int ldap_match_login(X509 *x509, const char *login) {
 	int match_found = 0;
 
 	if ( 1 != ldap_get_certificate(login, x509)){
@@ -1224,12 +1385,41 @@ static int ldap_mapper_match_user(X509 *x509, const char *login, void *context)
 	return match_found;
 }
 
+static int ldap_mapper_match_user(X509 *x509, const char *login, void *context) {
+	mapper_deadline_set(&call_deadline, ldap_module->time_left);
+	return ldap_match_login(x509, login);
+}
+
+struct ldap_search {
+	X509 *x509;
+	void *context;
+	char *res;
+};
+
+static int ldap_mapper_try_user(struct passwd *pw, void *arg) {
+	struct ldap_search *search = arg;
+	int res;
+
+	/* give up the enumeration once out of time */
+	if (mapper_time_left(&call_deadline) == 0) return -1;
+	DBG1("Trying to match certificate with user: '%s'",pw->pw_name);
+	res= ldap_match_login(search->x509,pw->pw_name);
+	if (res) {
+		DBG1("Certificate maps to user '%s'",pw->pw_name);
+		search->res= clone_str(pw->pw_name);
+		return 1;
+	}
+	DBG1("Certificate map to user '%s' failed",pw->pw_name);
+	return 0;
+}
+
 static char * ldap_mapper_find_user(X509 *x509, void *context, int *match) {
-	struct passwd *pw = NULL;
+	struct ldap_search search;
 	char *found=NULL;
 
+	mapper_deadline_set(&call_deadline, ldap_module->time_left);
 	if (uid_attribute != NULL) {
-		if ((1 == ldap_mapper_match_user(x509, NULL, context)) &&
+		if ((1 == ldap_match_login(x509, NULL)) &&
 		    (uid_attribute_value != NULL)) {
 			found = clone_str(uid_attribute_value);
 			*match = 1;
@@ -1237,21 +1427,13 @@ static char * ldap_mapper_find_user(X509 *x509, void *context, int *match) {
 		return found;
 	}
 
-	setpwent();
-	while( (pw=getpwent()) !=NULL) {
-	    int res;
-	    DBG1("Trying to match certificate with user: '%s'",pw->pw_name);
-	    res= ldap_mapper_match_user(x509,pw->pw_name,context);
-	    if (res) {
-		DBG1("Certificate maps to user '%s'",pw->pw_name);
-		found= clone_str(pw->pw_name);
+	search.x509 = x509;
+	search.context = context;
+	search.res = NULL;
+	if (pw_scope_enum(context, ldap_mapper_try_user, &search) > 0) {
+		found = search.res;
 		*match = 1;
-		break;
-	    } else {
-		DBG1("Certificate map to user '%s' failed",pw->pw_name);
-	    }
 	}
-	endpwent();
 
 #ifdef false
 	int res;
@@ -1272,11 +1454,12 @@ static mapper_module * init_mapper_st(scconf_block *blk, const char *name) {
 	if (!pt) return NULL;
 	pt->name = name;
 	pt->block = blk;
-	pt->context = NULL;
+	pt->context = pw_scope_load(blk);
 	pt->entries = ldap_mapper_find_entries;
 	pt->finder = ldap_mapper_find_user;
 	pt->matcher = ldap_mapper_match_user;
 	pt->deinit = mapper_module_end;
+	ldap_module = pt;
 
 	return pt;
 }
@@ -1291,7 +1474,12 @@ mapper_module * ldap_mapper_module_init(scconf_block *blk,const char *mapper_nam
     pt = init_mapper_st(blk,mapper_name);
 
 	if (blk) {
-		read_config(blk);
+		if (pt && read_config(blk) < 0) {
+			DBG1("Invalid configuration for mapper '%s'", mapper_name);
+			free(pt->context);
+			free(pt);
+			return NULL;
+		}
 	} else {
 		set_debug_level(1);
 		DBG1("No configuration entry for mapper '%s'. Assume defaults", mapper_name);
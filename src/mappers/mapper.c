@@ -29,8 +29,11 @@
 
 #include <sys/types.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <pwd.h>
+#include <grp.h>
 #include <regex.h>
 #include "../common/debug.h"
 #include "../common/error.h"
@@ -209,6 +212,187 @@ int mapfile_match(const char *file, char *key, const char *value, int icase) {
 	return res;
 }
 
+/* map file index related functions */
+
+/* FNV-1a, keys are already canonical */
+/* case insensitive, so that keys differing in case share a bucket */
+static unsigned int mapindex_hash(const char *key) {
+	unsigned int h = 2166136261U;
+	for (; *key; key++) {
+		h ^= (unsigned char)tolower((unsigned char)*key);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static struct mapindex_entry *new_mapindex_entry(const char *key, const char *value) {
+	struct mapindex_entry *entry = malloc(sizeof(struct mapindex_entry));
+	if (!entry) return NULL;
+	entry->key = clone_str(key);
+	entry->value = clone_str(value);
+	entry->next = NULL;
+	if (!entry->key || !entry->value) {
+		free(entry->key);
+		free(entry->value);
+		free(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+static void free_mapindex_list(struct mapindex_entry *entry) {
+	struct mapindex_entry *next;
+	for (; entry; entry = next) {
+		next = entry->next;
+		free(entry->key);
+		free(entry->value);
+		free(entry);
+	}
+}
+
+void mapindex_free(struct mapindex *idx) {
+	unsigned int i;
+	if (!idx) return;
+	for (i = 0; i < idx->nbuckets; i++) free_mapindex_list(idx->buckets[i]);
+	free_mapindex_list(idx->patterns);
+	free(idx->buckets);
+	free(idx);
+}
+
+struct mapindex *mapindex_load(const char *uri, char *(*canon)(const char *key)) {
+	struct mapindex *idx;
+	struct mapfile *mfile;
+	struct mapindex_entry *entry, **last, **last_pattern;
+	unsigned int n = 0, h;
+	char *pt;
+
+	mfile = set_mapent(uri);
+	if (!mfile) {
+		DBG1("Error processing mapfile %s",uri);
+		return NULL;
+	}
+	/* about one bucket per line */
+	for (pt = mfile->buffer; pt < mfile->buffer + mfile->length; pt++)
+		if (*pt == '\n') n++;
+	idx = calloc(1, sizeof(struct mapindex));
+	if (!idx) goto error;
+	idx->uri = uri;
+	for (idx->nbuckets = 16; idx->nbuckets < n; idx->nbuckets <<= 1);
+	idx->buckets = calloc(idx->nbuckets, sizeof(struct mapindex_entry *));
+	if (!idx->buckets) goto error;
+	last_pattern = &idx->patterns;
+	n = 0;
+	while (get_mapent(mfile)) {
+	    if (mfile->key[0]=='^' && mfile->key[strlen(mfile->key)-1]=='$') {
+		entry = new_mapindex_entry(mfile->key, mfile->value);
+		if (!entry) goto error;
+		*last_pattern = entry;
+		last_pattern = &entry->next;
+		continue;
+	    }
+	    pt = canon ? canon(mfile->key) : clone_str(mfile->key);
+	    if (!pt) {
+		DBG1("Invalid key '%s' in mapfile: skip",mfile->key);
+		continue;
+	    }
+	    h = mapindex_hash(pt) & (idx->nbuckets - 1);
+	    /* keep file order, for keys only differing in case */
+	    for (last = &idx->buckets[h]; (entry = *last) != NULL; last = &entry->next)
+		if (!strcmp(entry->key, pt)) break;
+	    if (entry) {
+		/* first entry wins, as in a linear scan */
+		DBG2("Duplicate key '%s' in mapfile %s: ignored",mfile->key,uri);
+		free(pt);
+		continue;
+	    }
+	    entry = new_mapindex_entry(pt, mfile->value);
+	    free(pt);
+	    if (!entry) goto error;
+	    *last = entry;
+	    n++;
+	}
+	end_mapent(mfile);
+	DBG2("Mapfile %s indexed: %d keys",uri,n);
+	return idx;
+error:
+	DBG1("Not enough memory to index mapfile %s",uri);
+	end_mapent(mfile);
+	mapindex_free(idx);
+	return NULL;
+}
+
+char *mapindex_find(struct mapindex *idx, const char *canon_key, const char *key, int icase, int *match) {
+	struct mapindex_entry *entry;
+	if ( (!key) || is_empty_str((char *)key) ) {
+		DBG("key to map is null or empty");
+		return NULL;
+	}
+	if (!idx) return clone_str(key);
+	if (canon_key) {
+	    unsigned int h = mapindex_hash(canon_key) & (idx->nbuckets - 1);
+	    for (entry = idx->buckets[h]; entry; entry = entry->next) {
+		if (icase ? strcasecmp(entry->key, canon_key) : strcmp(entry->key, canon_key)) continue;
+		DBG2("Found mapindex match '%s' -> '%s'",canon_key,entry->value);
+		*match = 1;
+		return clone_str(entry->value);
+	    }
+	}
+	for (entry = idx->patterns; entry; entry = entry->next) {
+	    regex_t re;
+	    int done;
+	    DBG2("Trying RE '%s' match on '%s'",entry->key,key);
+	    if (regcomp(&re,entry->key,(icase ? REG_ICASE : 0)|REG_NEWLINE)) {
+		DBG2("RE '%s' in mapfile '%s' is invalid",entry->key,idx->uri);
+		continue;
+	    }
+	    done = !regexec(&re,key,0,NULL,0);
+	    regfree(&re);
+	    if (done) {
+		DBG2("Found mapfile match '%s' -> '%s'",key,entry->value);
+		*match = 1;
+		return clone_str(entry->value);
+	    }
+	}
+	DBG("Mapfile match not found");
+	return clone_str(key);
+}
+
+int mapindex_match(struct mapindex *idx, const char *canon_key, const char *key, const char *value, int icase) {
+	int res;
+	int match = 0;
+	char *str = mapindex_find(idx,canon_key,key,icase,&match);
+	if (!str) return -1;
+	if (icase) res= (!strcasecmp(str,value))? 1:0;
+	else       res= (!strcmp(str,value))? 1:0;
+	free(str);
+	return res;
+}
+
+/* deadline related functions */
+
+void mapper_deadline_set(struct timespec *deadline, int ms) {
+	deadline->tv_sec = 0;
+	deadline->tv_nsec = 0;
+	if (ms <= 0) return;
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+int mapper_time_left(const struct timespec *deadline) {
+	struct timespec now;
+	long ms;
+	if (!deadline->tv_sec && !deadline->tv_nsec) return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? (int)ms : 0;
+}
+
 /* pwent related functions */
 
 /**
@@ -228,26 +412,149 @@ int compare_pw_entry(const char *str,struct passwd *pw, int ignorecase) {
    return 0;
 }
 
+/* uid ranges up to this size are looked up one uid at a time */
+#define PW_SCOPE_MAX_UIDS 1024
+
+struct pw_scope *pw_scope_load(scconf_block *blk) {
+	struct pw_scope *scope;
+	const char *range;
+	unsigned long min, max;
+
+	if (!blk) return NULL;
+	scope = calloc(1, sizeof(struct pw_scope));
+	if (!scope) return NULL;
+	scope->groups = scconf_find_list(blk, "search_groups");
+	scope->home_prefixes = scconf_find_list(blk, "search_home_prefix");
+	range = scconf_get_str(blk, "search_uid_range", NULL);
+	if (range) {
+		if (sscanf(range, "%lu-%lu", &min, &max) == 2 && min <= max) {
+			scope->has_uid_range = 1;
+			scope->uid_min = (uid_t)min;
+			scope->uid_max = (uid_t)max;
+		} else {
+			DBG1("Invalid search_uid_range '%s', ignored", range);
+		}
+	}
+	if (!scope->groups && !scope->home_prefixes && !scope->has_uid_range) {
+		free(scope);
+		return NULL;
+	}
+	return scope;
+}
+
+int pw_scope_check(const struct pw_scope *scope, const struct passwd *pw) {
+	const scconf_list *list;
+
+	if (!scope) return 1;
+	if (scope->has_uid_range &&
+	    (pw->pw_uid < scope->uid_min || pw->pw_uid > scope->uid_max))
+		return 0;
+	if (scope->home_prefixes) {
+		if (!pw->pw_dir) return 0;
+		for (list = scope->home_prefixes; list; list = list->next) {
+			if (!strncmp(pw->pw_dir, list->data, strlen(list->data))) break;
+		}
+		if (!list) return 0;
+	}
+	return 1;
+}
+
+/* members of the search groups, each visited once */
+static int pw_scope_enum_groups(const struct pw_scope *scope,
+	int (*fn)(struct passwd *pw, void *arg), void *arg) {
+	const scconf_list *list;
+	struct group *gr;
+	struct passwd *pw;
+	char **members = NULL, **pt;
+	int n = 0, size = 0, i, j, res = 0;
+
+	/* copy the names first: getgrnam() results are overwritten */
+	for (list = scope->groups; list; list = list->next) {
+		gr = getgrnam(list->data);
+		if (!gr) {
+			DBG1("Search group '%s' not found", list->data);
+			continue;
+		}
+		for (i = 0; gr->gr_mem[i]; i++) {
+			for (j = 0; j < n && strcmp(members[j], gr->gr_mem[i]); j++);
+			if (j < n) continue;
+			if (n == size) {
+				size = size ? 2 * size : 32;
+				pt = realloc(members, size * sizeof(char *));
+				if (!pt) break;
+				members = pt;
+			}
+			members[n] = clone_str(gr->gr_mem[i]);
+			if (members[n]) n++;
+		}
+	}
+	DBG1("%d user(s) in the search groups", n);
+	for (i = 0; i < n && !res; i++) {
+		pw = getpwnam(members[i]);
+		if (pw && pw_scope_check(scope, pw)) res = fn(pw, arg);
+	}
+	for (i = 0; i < n; i++) free(members[i]);
+	free(members);
+	return res;
+}
+
+int pw_scope_enum(const struct pw_scope *scope,
+	int (*fn)(struct passwd *pw, void *arg), void *arg) {
+	struct passwd *pw;
+	uid_t uid;
+	int res = 0;
+
+	if (scope && scope->groups) {
+		res = pw_scope_enum_groups(scope, fn, arg);
+	} else if (scope && scope->has_uid_range &&
+	    scope->uid_max - scope->uid_min < PW_SCOPE_MAX_UIDS) {
+		for (uid = scope->uid_min; !res; uid++) {
+			pw = getpwuid(uid);
+			if (pw && pw_scope_check(scope, pw)) res = fn(pw, arg);
+			if (uid == scope->uid_max) break;
+		}
+	} else {
+		setpwent(); /* reset pwent parser */
+		while (!res && (pw = getpwent()) != NULL) {
+			if (pw_scope_check(scope, pw)) res = fn(pw, arg);
+		}
+		endpwent();
+	}
+	return res;
+}
+
+struct pw_search {
+	const char *str;
+	int ignorecase;
+	char *res;
+};
+
+static int search_pw_match(struct passwd *pw, void *arg) {
+	struct pw_search *search = arg;
+	if (!compare_pw_entry(search->str, pw, search->ignorecase)) return 0;
+	DBG1("getpwent() match found: '%s'", pw->pw_name);
+	search->res = clone_str(pw->pw_name);
+	return 1;
+}
+
 /**
 * look in pw entries for an item that matches gecos or login to provided string
 * on success return login
 * on fail return null
 */
+char *search_pw_scope(const char *str, int ignorecase, const struct pw_scope *scope) {
+	struct pw_search search;
+
+	search.str = str;
+	search.ignorecase = ignorecase;
+	search.res = NULL;
+	pw_scope_enum(scope, search_pw_match, &search);
+	if (!search.res) DBG1("No pwent found matching string '%s'", str);
+	return search.res;
+}
+
 char *search_pw_entry(const char *str,int ignorecase) {
-	char *res;
-        struct passwd *pw;
-        setpwent(); /* reset pwent parser */
-        while ( (pw=getpwent()) != NULL) {
-            if( compare_pw_entry(str,pw,ignorecase) ) {
-               DBG1("getpwent() match found: '%s'",pw->pw_name);
-               res= clone_str(pw->pw_name);
-	       endpwent();
-	       return res;
-            }
-        }
-        endpwent();
-        DBG1("No pwent found matching string '%s'",str);
-        return NULL;
+	return search_pw_scope(str, ignorecase, NULL);
 }
 
 #endif
@@ -28,6 +28,7 @@
 #endif
 
 #include <sys/types.h>
+#include <time.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pwd.h>
@@ -54,6 +55,9 @@ typedef struct mapper_module_st {
     int (*matcher)(X509 *x509, const char *login, void *context);
     /** module de-initialization */
     void (*deinit)( void *context); 
+    /** milliseconds the running finder or matcher call may last, 0 if
+        unlimited. Set by the mapper manager before each call */
+    int time_left;
 } mapper_module;
 
 /**
@@ -75,6 +79,29 @@ struct mapfile {
 	char *value;
 };
 
+/**
+* A map file loaded once into a hash table, for mappers that look up
+* many keys or that cannot afford a linear scan per lookup.
+* Keys are stored in canonical form, as given by the function provided
+* on load; regular expression keys ("^...$") can not be canonicalized
+* and are kept apart, tried in file order when no exact key matches.
+*/
+struct mapindex_entry {
+	char *key;
+	char *value;
+	struct mapindex_entry *next;
+};
+
+struct mapindex {
+	/** URL of mapfile */
+	const char *uri;
+	/** hash buckets of canonical keys */
+	struct mapindex_entry **buckets;
+	unsigned int nbuckets;
+	/** regular expression entries, in file order */
+	struct mapindex_entry *patterns;
+};
+
 /* ------------------------------------------------------- */
 
 /**
@@ -140,6 +167,38 @@ MAPPER_EXTERN char *mapfile_find(const char *file,char *key,int ignorecase,int *
 */
 MAPPER_EXTERN int mapfile_match(const char *file,char *key,const char *value,int ignorecase);
 
+/**
+* Load a map file into a hashed index
+*@param uri URL of map file
+*@param canon Function returning the malloc()'d canonical form of a key,
+* or NULL to use keys verbatim
+*@return index, or NULL on error
+*/
+MAPPER_EXTERN struct mapindex *mapindex_load(const char *uri, char *(*canon)(const char *key));
+
+/**
+* Release a map file index
+*/
+MAPPER_EXTERN void mapindex_free(struct mapindex *idx);
+
+/**
+* Map a key by mean of a map file index, as mapfile_find() does
+*@param idx Map file index
+*@param canon_key Canonical form of the key, looked up in the hash table
+*@param key Key as found in the certificate, tried against regular expressions
+*@param ignorecase Flag to indicate upper/lowercase ignore in canonical keys
+* and regular expressions
+*@param match Set to 1 for mapped string return, unmodified for key return
+*@return key on no match, else a clone_str()'d of found mapping
+*/
+MAPPER_EXTERN char *mapindex_find(struct mapindex *idx, const char *canon_key, const char *key, int ignorecase, int *match);
+
+/**
+* Match a key to a login by mean of a map file index, as mapfile_match() does
+*@return 1 on match, 0 on no match, -1 on process error
+*/
+MAPPER_EXTERN int mapindex_match(struct mapindex *idx, const char *canon_key, const char *key, const char *value, int ignorecase);
+
 /* pwent related functions */
 
 /**
@@ -159,6 +218,66 @@ MAPPER_EXTERN char *search_pw_entry(const char *item, int ignorecase);
 */
 MAPPER_EXTERN int compare_pw_entry(const char *item, struct passwd *pw,int ignorecase);
 
+/**
+* Users searched when the password database is enumerated, from the
+* search_groups, search_uid_range ("min-max") and search_home_prefix
+* options of a mapper block. Members of the search groups are looked up
+* by name, and small uid ranges uid by uid, instead of reading the whole
+* database. Users whose primary group is a search group are not found
+* unless they are also listed as its members.
+*/
+struct pw_scope {
+	const scconf_list *groups;
+	const scconf_list *home_prefixes;
+	int has_uid_range;
+	uid_t uid_min;
+	uid_t uid_max;
+};
+
+/**
+* Read the search scope of a mapper
+*@param blk Mapper configuration block
+*@return scope to be free()'d, NULL when the whole database is searched
+*/
+MAPPER_EXTERN struct pw_scope *pw_scope_load(scconf_block *blk);
+
+/**
+* Test if a password entry is within the uid range and home prefixes
+*@return 1 if it is, else 0
+*/
+MAPPER_EXTERN int pw_scope_check(const struct pw_scope *scope, const struct passwd *pw);
+
+/**
+* Call fn on each user of the scope, or of the whole database if scope is
+* NULL, until it returns non zero.
+*@return last value returned by fn
+*/
+MAPPER_EXTERN int pw_scope_enum(const struct pw_scope *scope,
+	int (*fn)(struct passwd *pw, void *arg), void *arg);
+
+/**
+* As search_pw_entry(), restricted to a search scope
+*/
+MAPPER_EXTERN char *search_pw_scope(const char *item, int ignorecase, const struct pw_scope *scope);
+
+/* deadline related functions */
+
+/**
+* Set a deadline on the monotonic clock
+*@param deadline Deadline to set
+*@param ms Milliseconds from now, 0 or less for no deadline
+*/
+MAPPER_EXTERN void mapper_deadline_set(struct timespec *deadline, int ms);
+
+/**
+* Time left before a deadline. Mappers waiting on a server should not wait
+* past the time_left of their mapper_module
+*@param deadline Deadline set with mapper_deadline_set()
+*@return milliseconds left, 0 if the deadline has passed, -1 if there is
+*   no deadline
+*/
+MAPPER_EXTERN int mapper_time_left(const struct timespec *deadline);
+
 #undef MAPPER_EXTERN
 
 /* ------------------------------------------------------- */
@@ -43,6 +43,7 @@
 #include "null_mapper.h"
 #include "generic_mapper.h"
 #include "openssh_mapper.h"
+#include "userdb_mapper.h"
 
 mapper_list static_mapper_list[] = {
 #ifdef SUBJECT_MAPPER_STATIC
@@ -83,6 +84,9 @@ mapper_list static_mapper_list[] = {
 #ifdef OPENSSH_MAPPER_STATIC
 	{ "openssh",openssh_mapper_module_init },
 #endif
+#ifdef USERDB_MAPPER_STATIC
+	{ "userdb",userdb_mapper_module_init },
+#endif
 #ifdef NULL_MAPPER_STATIC
 	{ "null", null_mapper_module_init },
 #endif
@@ -131,39 +131,48 @@ static int opensc_mapper_match_user(X509 *x509, const char *user, void *context)
 	return opensc_mapper_match_certs(x509,pw->pw_dir);
 }
 
+struct cert_search {
+	X509 *x509;
+	char *res;
+};
+
+static int opensc_mapper_try_user(struct passwd *pw, void *arg) {
+	struct cert_search *search = arg;
+	int n;
+
+	DBG1("Trying to match certificate with user: '%s'",pw->pw_name);
+	n = opensc_mapper_match_certs (search->x509, pw->pw_dir);
+	if (n<0) {
+		DBG1("Error in matching process with user '%s'",pw->pw_name);
+		return -1;
+	}
+	if (n==0) {
+		DBG1("Certificate doesn't match user '%s'",pw->pw_name);
+		return 0;
+	}
+	/* arriving here means user found */
+	DBG1("Certificate match found for user '%s'",pw->pw_name);
+	search->res = clone_str(pw->pw_name);
+	return 1;
+}
+
 /*
 parses the certificate and return the _first_ user that has it in
 their ${HOME}/.eid/authorized_certificates
 */
 static char * opensc_mapper_find_user(X509 *x509, void *context, int *match) {
-	int n = 0;
-	struct passwd *pw = NULL;
-	char *res = NULL;
-        /* parse list of users until match */
-	setpwent();
-	while((pw=getpwent()) != NULL) {
-	    DBG1("Trying to match certificate with user: '%s'",pw->pw_name);
-	    n = opensc_mapper_match_certs (x509, pw->pw_dir);
-	    if (n<0) {
-		DBG1("Error in matching process with user '%s'",pw->pw_name);
-		endpwent();
-		return NULL;
-	    }
-	    if (n==0) {
-		DBG1("Certificate doesn't match user '%s'",pw->pw_name);
-	        continue;
-	    }
-	    /* arriving here means user found */
-            DBG1("Certificate match found for user '%s'",pw->pw_name);
-	    res = clone_str(pw->pw_name);
-	    endpwent();
-	    *match = 1;
-	    return res;
-        } /* next login */
+	struct cert_search search;
+
+	search.x509 = x509;
+	search.res = NULL;
+	/* parse list of users in the search scope until match */
+	if (pw_scope_enum(context, opensc_mapper_try_user, &search) > 0) {
+		*match = 1;
+		return search.res;
+	}
 	/* no user found that contains cert in their directory */
-	endpwent();
-        DBG("No entry at ${login}/.eid/authorized_certificates maps to any provided certificate");
-        return NULL;
+	DBG("No entry at ${login}/.eid/authorized_certificates maps to any provided certificate");
+	return NULL;
 }
 
 _DEFAULT_MAPPER_END
@@ -173,7 +182,7 @@ static mapper_module * init_mapper_st(scconf_block *blk, const char *name) {
 	if (!pt) return NULL;
 	pt->name = name;
 	pt->block = blk;
-	pt->context = NULL;
+	pt->context = pw_scope_load(blk);
 	pt->entries = opensc_mapper_find_entries;
 	pt->finder = opensc_mapper_find_user;
 	pt->matcher = opensc_mapper_match_user;
@@ -329,44 +329,53 @@ static int openssh_mapper_match_user(X509 *x509, const char *user, void *context
         return openssh_mapper_match_keys(x509,filename);
 }
 
+struct key_search {
+	X509 *x509;
+	char *res;
+};
+
+static int openssh_mapper_try_user(struct passwd *pw, void *arg) {
+	struct key_search *search = arg;
+	char filename[PATH_MAX];
+	int n;
+
+	DBG1("Trying to match certificate with user: '%s'",pw->pw_name);
+	if ( is_empty_str(pw->pw_dir) ) {
+		DBG1("User '%s' has no home directory",pw->pw_name);
+		return 0;
+	}
+	snprintf(filename,sizeof(filename),"%s/.ssh/authorized_keys",pw->pw_dir);
+	n = openssh_mapper_match_keys(search->x509,filename);
+	if (n<0) {
+		DBG1("Error in matching process with user '%s'",pw->pw_name);
+		return -1;
+	}
+	if (n==0) {
+		DBG1("Certificate doesn't match user '%s'",pw->pw_name);
+		return 0;
+	}
+	/* arriving here means user found */
+	DBG1("Certificate match found for user '%s'",pw->pw_name);
+	search->res = clone_str(pw->pw_name);
+	return 1;
+}
+
 /*
 parses the certificate and return the _first_ user that matches public key
 */
 static char * openssh_mapper_find_user(X509 *x509, void *context, int *match) {
-        int n = 0;
-        struct passwd *pw = NULL;
-        char *res = NULL;
-        /* parse list of users until match */
-        setpwent();
-        while((pw=getpwent()) != NULL) {
-	    char filename[PATH_MAX];
-            DBG1("Trying to match certificate with user: '%s'",pw->pw_name);
-            if ( is_empty_str(pw->pw_dir) ) {
-                DBG1("User '%s' has no home directory",pw->pw_name);
-                continue;
-            }
-	    sprintf(filename,"%s/.ssh/authorized_keys",pw->pw_dir);
-            n = openssh_mapper_match_keys (x509,filename);
-            if (n<0) {
-                DBG1("Error in matching process with user '%s'",pw->pw_name);
-                endpwent();
-                return NULL;
-            }
-            if (n==0) {
-                DBG1("Certificate doesn't match user '%s'",pw->pw_name);
-                continue;
-	    }
-            /* arriving here means user found */
-            DBG1("Certificate match found for user '%s'",pw->pw_name);
-            res = clone_str(pw->pw_name);
-            endpwent();
-	    *match = 1;
-	    return res;
-        } /* next login */
-        /* no user found that contains cert in their directory */
-        endpwent();
-        DBG("No entry at ${login}/.ssh/authorized_keys maps to any provided certificate");
-        return NULL;
+	struct key_search search;
+
+	search.x509 = x509;
+	search.res = NULL;
+	/* parse list of users in the search scope until match */
+	if (pw_scope_enum(context, openssh_mapper_try_user, &search) > 0) {
+		*match = 1;
+		return search.res;
+	}
+	/* no user found that contains cert in their directory */
+	DBG("No entry at ${login}/.ssh/authorized_keys maps to any provided certificate");
+	return NULL;
 }
 
 static mapper_module * init_mapper_st(scconf_block *blk, const char *name) {
@@ -374,7 +383,7 @@ static mapper_module * init_mapper_st(scconf_block *blk, const char *name) {
 	if (!pt) return NULL;
 	pt->name = name;
 	pt->block = blk;
-	pt->context = NULL;
+	pt->context = pw_scope_load(blk);
 	pt->entries = openssh_mapper_find_entries;
 	pt->finder = openssh_mapper_find_user;
 	pt->matcher = openssh_mapper_match_user;
@@ -83,15 +83,16 @@ static char * pwent_mapper_find_user(X509 *x509,void *context, int *match) {
 		    DBG1("Entry for %s not found (direct).", str);
                 } else {
 			DBG1("Found CN in pw database for user %s (direct).", str);
+			found_user = clone_str(pw->pw_name);
 			*match = 1;
-			return pw->pw_name;
+			return found_user;
 		}
 	}
 
 	/* Second: search all entries (old behaviour) */
 	/* parse list of uids until match */
 	for (str=*entries; str ; str=*++entries) {
-	    found_user= search_pw_entry((const char *)str,ignorecase);
+	    found_user= search_pw_scope((const char *)str,ignorecase,context);
             if (!found_user) {
                 DBG1("CN entry '%s' not found in pw database. Trying next",str);
                 continue;
@@ -116,12 +117,13 @@ static char * pwent_mapper_find_user(X509 *x509,void *context, int *match) {
 */
 static int pwent_mapper_match_user(X509 *x509, const char *login, void *context) {
         char *str;
-	struct passwd *pw = getpwnam(login);
+	struct passwd *pw;
         char **entries  = cert_info(x509,CERT_CN,ALGORITHM_NULL);
         if (!entries) {
             DBG("get_common_name() failed");
             return -1;
         }
+	pw = getpwnam(login);
 	if (!pw) {
 	    DBG1("There are no pwentry for login '%s'",login);
 	    return -1;
@@ -148,7 +150,7 @@ static mapper_module * init_mapper_st(scconf_block *blk, const char *name) {
 	if (!pt) return NULL;
 	pt->name = name;
 	pt->block = blk;
-	pt->context = NULL;
+	pt->context = pw_scope_load(blk);
 	pt->entries = pwent_mapper_find_entries;
 	pt->finder = pwent_mapper_find_user;
 	pt->matcher = pwent_mapper_match_user;
@@ -39,8 +39,16 @@
 
 static const char *filename = "none";
 static int ignorecase = 0;
+static int canonical = 0;
 static int debug = 0;
 
+/*
+* with "canonical" set, the mapfile is loaded once into a hashed index
+* of canonical subjects, and certificates are looked up by their
+* canonical subject: spacing, case and attribute order do not matter
+*/
+static struct mapindex *subject_index = NULL;
+
 /*
 * returns the Certificate subject
 */
@@ -58,11 +66,14 @@ parses the certificate and return the first Subject entry found, or NULL
 */
 static char * subject_mapper_find_user(X509 *x509, void *context, int *match) {
 	char **entries = cert_info(x509,CERT_SUBJECT,ALGORITHM_NULL);
+	char **canon;
 	if (!entries) {
 		DBG("X509_get_subject_name failed");
 		return NULL;
 	}
-	return mapfile_find(filename,entries[0],ignorecase,match);
+	if (!subject_index) return mapfile_find(filename,entries[0],ignorecase,match);
+	canon = cert_info(x509,CERT_CANON_SUBJECT,ALGORITHM_NULL);
+	return mapindex_find(subject_index,canon ? canon[0] : NULL,entries[0],ignorecase,match);
 }
 
 /*
@@ -71,14 +82,21 @@ static char * subject_mapper_find_user(X509 *x509, void *context, int *match) {
 */
 static int subject_mapper_match_user(X509 *x509, const char *login, void *context) {
 	char **entries = cert_info(x509,CERT_SUBJECT,ALGORITHM_NULL);
+	char **canon;
 	if (!entries) {
 		DBG("X509_get_subject_name failed");
 		return -1;
 	}
-	return mapfile_match(filename,entries[0],login,ignorecase);
+	if (!subject_index) return mapfile_match(filename,entries[0],login,ignorecase);
+	canon = cert_info(x509,CERT_CANON_SUBJECT,ALGORITHM_NULL);
+	return mapindex_match(subject_index,canon ? canon[0] : NULL,entries[0],login,ignorecase);
 }
 
-_DEFAULT_MAPPER_END
+static void subject_mapper_module_end(void *context) {
+	mapindex_free(subject_index);
+	subject_index = NULL;
+	free(context);
+}
 
 
 static mapper_module * init_mapper_st(scconf_block *blk, const char *name) {
@@ -90,7 +108,7 @@ static mapper_module * init_mapper_st(scconf_block *blk, const char *name) {
 	pt->entries = subject_mapper_find_entries;
 	pt->finder = subject_mapper_find_user;
 	pt->matcher = subject_mapper_match_user;
-	pt->deinit = mapper_module_end;
+	pt->deinit = subject_mapper_module_end;
 	return pt;
 }
 
@@ -108,12 +126,17 @@ mapper_module * subject_mapper_module_init(scconf_block *blk,const char *mapper_
 	debug      = scconf_get_bool(blk,"debug",0);
 	filename   = scconf_get_str(blk,"mapfile",filename);
 	ignorecase = scconf_get_bool(blk,"ignorecase",ignorecase);
+	canonical  = scconf_get_bool(blk,"canonical",canonical);
 	} else {
 		DBG1("No block declaration for mapper '%s'",mapper_name);
 	}
 	set_debug_level(debug);
+	if (canonical && strcmp(filename,"none")) {
+		subject_index = mapindex_load(filename,canonical_dn);
+		if (!subject_index) DBG1("Cannot index mapfile %s, using linear lookups",filename);
+	}
 	pt= init_mapper_st(blk,mapper_name);
-	if(pt) DBG3("Subject mapper started. debug: %d, mapfile: %s, icase: %d",debug,filename,ignorecase);
+	if(pt) DBG4("Subject mapper started. debug: %d, mapfile: %s, icase: %d, canonical: %d",debug,filename,ignorecase,canonical);
 	else DBG("Subject mapper initialization failed");
         return pt;
 }
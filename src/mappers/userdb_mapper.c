@@ -0,0 +1,552 @@
+/*
+ * PAM-PKCS11 mapping modules
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+#define __USERDB_MAPPER_C_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../common/cert_st.h"
+#include "../common/alg_st.h"
+#include "../scconf/scconf.h"
+#include "../common/debug.h"
+#include "../common/error.h"
+#include "../common/strings.h"
+#include "../common/cert_info.h"
+#include "mapper.h"
+#include "userdb_mapper.h"
+
+/*
+* Asks a local user database service, such as systemd-userdb, for the
+* user a certificate item belongs to. The query goes over the varlink
+* socket of the service: one JSON call, terminated by a NUL byte, and
+* one reply. The lookup is thus done by the service, from its own
+* indexes, instead of by enumerating the password database.
+*/
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define USERDB_MAX_REPLY (1024*1024)
+#define USERDB_DEFAULT_TIMEOUT 5000	/* ms */
+#define JSON_MAX_DEPTH 32
+
+static const char *socket_path = "/run/systemd/userdb/io.systemd.Multiplexer";
+static const char *service = "io.systemd.Multiplexer";
+static const char *method = "io.systemd.UserDatabase.GetUserRecord";
+static const char *query_field = "userName";
+static const char *login_field = "userName";
+static int id_type = CERT_UPN;
+static ALGORITHM_TYPE algorithm = ALGORITHM_SHA1;
+static int ignorecase = 0;
+static int ignoredomain = 0;
+static int timeout = USERDB_DEFAULT_TIMEOUT;
+static int debug = 0;
+
+/* this mapper, and the deadline of its running call */
+static mapper_module *userdb_module = NULL;
+static struct timespec call_deadline;
+
+/*
+* minimal JSON reader, enough to walk a varlink reply
+*/
+static const char *json_ws(const char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+	return p;
+}
+
+static const char *json_skip_string(const char *p) {
+	for (p++; *p && *p != '"'; p++)
+		if (*p == '\\' && !*++p) return NULL;
+	return *p ? p + 1 : NULL;
+}
+
+/* returns the end of the value at p, NULL if malformed */
+static const char *json_skip(const char *p, int depth) {
+	char close;
+
+	p = json_ws(p);
+	if (*p == '"') return json_skip_string(p);
+	if (*p != '{' && *p != '[') {
+		const char *start = p;
+		while (*p && !strchr(",}] \t\r\n", *p)) p++;
+		return p == start ? NULL : p;
+	}
+	if (depth >= JSON_MAX_DEPTH) return NULL;
+	close = *p == '{' ? '}' : ']';
+	p = json_ws(p + 1);
+	if (*p == close) return p + 1;
+	for (;;) {
+		if (close == '}') {
+			if (*p != '"' || !(p = json_skip_string(p))) return NULL;
+			p = json_ws(p);
+			if (*p++ != ':') return NULL;
+		}
+		if (!(p = json_skip(p, depth + 1))) return NULL;
+		p = json_ws(p);
+		if (*p == close) return p + 1;
+		if (*p++ != ',') return NULL;
+		p = json_ws(p);
+	}
+}
+
+static void put_utf8(char **out, unsigned long c) {
+	char *o = *out;
+	if (c < 0x80) {
+		*o++ = c;
+	} else if (c < 0x800) {
+		*o++ = 0xc0 | (c >> 6);
+		*o++ = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		*o++ = 0xe0 | (c >> 12);
+		*o++ = 0x80 | ((c >> 6) & 0x3f);
+		*o++ = 0x80 | (c & 0x3f);
+	} else {
+		*o++ = 0xf0 | (c >> 18);
+		*o++ = 0x80 | ((c >> 12) & 0x3f);
+		*o++ = 0x80 | ((c >> 6) & 0x3f);
+		*o++ = 0x80 | (c & 0x3f);
+	}
+	*out = o;
+}
+
+/* stops at the first non hex digit, so never reads past the string end */
+static int hex4(const char *p, unsigned long *c) {
+	int i;
+	*c = 0;
+	for (i = 0; i < 4; i++) {
+		if (!isxdigit((unsigned char)p[i])) return -1;
+		*c = (*c << 4) | (isdigit((unsigned char)p[i]) ? p[i] - '0' : (tolower((unsigned char)p[i]) - 'a' + 10));
+	}
+	return 0;
+}
+
+/* decode the string at p, NULL if p is not a string */
+static char *json_string(const char *p) {
+	const char *end;
+	char *res, *o;
+	unsigned long c, low;
+
+	p = json_ws(p);
+	if (*p != '"' || !(end = json_skip_string(p))) return NULL;
+	res = o = malloc(end - p);
+	if (!res) return NULL;
+	for (p++; *p != '"'; p++) {
+		if (*p != '\\') {
+			*o++ = *p;
+			continue;
+		}
+		switch (*++p) {
+		case 'b': *o++ = '\b'; break;
+		case 'f': *o++ = '\f'; break;
+		case 'n': *o++ = '\n'; break;
+		case 'r': *o++ = '\r'; break;
+		case 't': *o++ = '\t'; break;
+		case 'u':
+			if (hex4(p + 1, &c) < 0) goto fail;
+			p += 4;
+			if (c >= 0xd800 && c < 0xdc00 && p[1] == '\\' && p[2] == 'u'
+				&& hex4(p + 3, &low) == 0 && low >= 0xdc00 && low < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+				p += 6;
+			}
+			if (!c) goto fail;
+			put_utf8(&o, c);
+			break;
+		default: *o++ = *p; break;
+		}
+	}
+	*o = '\0';
+	return res;
+fail:
+	free(res);
+	return NULL;
+}
+
+/* value of member name of the object at p, NULL if none */
+static const char *json_member(const char *p, const char *name) {
+	char *key;
+	int found;
+
+	p = json_ws(p);
+	if (*p++ != '{') return NULL;
+	for (p = json_ws(p); *p == '"'; ) {
+		key = json_string(p);
+		if (!key || !(p = json_skip_string(p))) {
+			free(key);
+			return NULL;
+		}
+		found = !strcmp(key, name);
+		free(key);
+		p = json_ws(p);
+		if (*p++ != ':') return NULL;
+		if (found) return json_ws(p);
+		if (!(p = json_skip(p, 0))) return NULL;
+		p = json_ws(p);
+		if (*p++ != ',') return NULL;
+		p = json_ws(p);
+	}
+	return NULL;
+}
+
+/* append value as a JSON string, out must hold 6 bytes per byte of value */
+static char *json_quote(char *out, const char *value) {
+	*out++ = '"';
+	for (; *value; value++) {
+		unsigned char c = (unsigned char)*value;
+		if (c == '"' || c == '\\') {
+			*out++ = '\\';
+			*out++ = c;
+		} else if (c < 0x20) {
+			out += sprintf(out, "\\u%04x", c);
+		} else {
+			*out++ = c;
+		}
+	}
+	*out++ = '"';
+	return out;
+}
+
+/*
+* varlink call
+*/
+/*
+* bound the next socket operation by what is left of the query
+* returns -1 if no time is left
+*/
+static int userdb_wait(int fd, const struct timespec *deadline) {
+	struct timeval tv;
+	int left = mapper_time_left(deadline);
+
+	if (left == 0) {
+		set_error("no reply from %s in time", socket_path);
+		return -1;
+	}
+	tv.tv_sec = left / 1000;
+	tv.tv_usec = (left % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return 0;
+}
+
+static int userdb_connect(const struct timespec *deadline) {
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		set_error("userdb socket name too long: %s", socket_path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		set_error("socket() failed: %s", strerror(errno));
+		return -1;
+	}
+	if (userdb_wait(fd, deadline) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		set_error("cannot connect to %s: %s", socket_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* send the query for value, returns the reply or NULL on error */
+static char *userdb_call(const char *value) {
+	char *request, *pt, *reply = NULL;
+	size_t len, size = 0, got = 0;
+	ssize_t n;
+	struct timespec deadline;
+	int fd, ms;
+
+	/* the query timeout, or what is left of the mapper call if shorter */
+	ms = mapper_time_left(&call_deadline);
+	if (ms == 0) {
+		set_error("mapper deadline passed");
+		return NULL;
+	}
+	if (ms < 0 || ms > timeout) ms = timeout;
+	mapper_deadline_set(&deadline, ms);
+
+	len = 64 + strlen(method) + 6 * (strlen(query_field) + strlen(value) + strlen(service));
+	request = malloc(len);
+	if (!request) {
+		set_error("not enough free memory available");
+		return NULL;
+	}
+	pt = request + sprintf(request, "{\"method\":\"%s\",\"parameters\":{", method);
+	pt = json_quote(pt, query_field);
+	*pt++ = ':';
+	pt = json_quote(pt, value);
+	pt += sprintf(pt, ",\"service\":");
+	pt = json_quote(pt, service);
+	pt += sprintf(pt, "}}");
+	len = pt - request + 1;	/* with the terminating NUL */
+
+	fd = userdb_connect(&deadline);
+	if (fd < 0) {
+		free(request);
+		return NULL;
+	}
+	for (pt = request; len > 0; pt += n, len -= n) {
+		if (userdb_wait(fd, &deadline) < 0) goto end;
+		n = send(fd, pt, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) n = 0;
+		else if (n < 0) {
+			set_error("cannot send query to %s: %s", socket_path, strerror(errno));
+			goto end;
+		}
+	}
+	/* the reply ends with a NUL byte */
+	while (!got || reply[got - 1]) {
+		if (got == size) {
+			char *tmp;
+			size = size ? 2 * size : 4096;
+			if (size > USERDB_MAX_REPLY || !(tmp = realloc(reply, size))) {
+				set_error("reply from %s too long", socket_path);
+				goto fail;
+			}
+			reply = tmp;
+		}
+		if (userdb_wait(fd, &deadline) < 0) goto fail;
+		n = recv(fd, reply + got, size - got, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			set_error("no reply from %s: %s", socket_path,
+				n ? strerror(errno) : "connection closed");
+			goto fail;
+		}
+		got += n;
+	}
+	goto end;
+fail:
+	free(reply);
+	reply = NULL;
+end:
+	close(fd);
+	free(request);
+	return reply;
+}
+
+/*
+* look value up; returns 1 and the login when found, 0 when the service
+* knows no such user, -1 on error
+*/
+static int userdb_lookup(const char *value, char **login) {
+	const char *pt;
+	char *reply, *error;
+	int res = -1;
+
+	*login = NULL;
+	DBG2("Querying %s for '%s'", socket_path, value);
+	reply = userdb_call(value);
+	if (!reply) {
+		DBG1("userdb query failed: %s", get_error());
+		return -1;
+	}
+	if ((pt = json_member(reply, "error")) != NULL) {
+		error = json_string(pt);
+		if (error && strlen(error) > 14 && !strcmp(error + strlen(error) - 14, ".NoRecordFound")) {
+			DBG1("No user record for '%s'", value);
+			res = 0;
+		} else {
+			set_error("userdb error: %s", error ? error : "(malformed)");
+			DBG1("%s", get_error());
+		}
+		free(error);
+		free(reply);
+		return res;
+	}
+	pt = json_member(reply, "parameters");
+	if (pt) pt = json_member(pt, "record");
+	if (pt) pt = json_member(pt, login_field);
+	if (pt) *login = json_string(pt);
+	if (*login && !is_empty_str(*login)) {
+		DBG2("'%s' belongs to user '%s'", value, *login);
+		res = 1;
+	} else {
+		set_error("no '%s' string in the user record", login_field);
+		DBG1("%s", get_error());
+		free(*login);
+		*login = NULL;
+	}
+	free(reply);
+	return res;
+}
+
+/*
+* mapper functions
+*/
+static char **userdb_mapper_find_entries(X509 *x509, void *context) {
+	char **entries;
+	int n;
+	if (!x509) {
+		DBG("NULL certificate provided");
+		return NULL;
+	}
+	entries = cert_info(x509, id_type, id_type == CERT_DIGEST ? algorithm : ALGORITHM_NULL);
+	if (!entries || !ignoredomain) return entries;
+	if (id_type != CERT_UPN && id_type != CERT_EMAIL) return entries;
+	/* user@domain: keep the user part */
+	for (n = 0; entries[n]; n++) {
+		char *at = strrchr(entries[n], '@');
+		if (at) *at = '\0';
+	}
+	return entries;
+}
+
+static char *userdb_mapper_find_user(X509 *x509, void *context, int *match) {
+	char **entries;
+	char *login;
+	int n;
+
+	mapper_deadline_set(&call_deadline, userdb_module->time_left);
+	entries = userdb_mapper_find_entries(x509, context);
+	if (!entries) {
+		DBG("Cannot find any entries in certificate");
+		return NULL;
+	}
+	for (n = 0; entries[n]; n++) {
+		if (is_empty_str(entries[n])) continue;
+		if (userdb_lookup(entries[n], &login) > 0) {
+			*match = 1;
+			return login;
+		}
+	}
+	DBG("No certificate entry maps to a user");
+	return NULL;
+}
+
+static int userdb_mapper_match_user(X509 *x509, const char *login, void *context) {
+	char **entries;
+	char *found;
+	int n, res, error = 0;
+
+	if (!login || is_empty_str(login)) {
+		DBG("NULL login provided");
+		return 0;
+	}
+	mapper_deadline_set(&call_deadline, userdb_module->time_left);
+	entries = userdb_mapper_find_entries(x509, context);
+	if (!entries) {
+		DBG("Cannot find any entries in certificate");
+		return 0;
+	}
+	for (n = 0; entries[n]; n++) {
+		if (is_empty_str(entries[n])) continue;
+		res = userdb_lookup(entries[n], &found);
+		if (res < 0) error = 1;
+		if (res <= 0) continue;
+		res = ignorecase ? strcasecmp(found, login) : strcmp(found, login);
+		DBG2("Certificate maps to user '%s', %s", found, res ? "no match" : "match");
+		free(found);
+		if (!res) return 1;
+	}
+	return error ? -1 : 0;
+}
+
+_DEFAULT_MAPPER_END
+
+static mapper_module * init_mapper_st(scconf_block *blk, const char *name) {
+	mapper_module *pt= malloc(sizeof(mapper_module));
+	if (!pt) return NULL;
+	pt->name = name;
+	pt->block = blk;
+	pt->context = NULL;
+	pt->entries = userdb_mapper_find_entries;
+	pt->finder = userdb_mapper_find_user;
+	pt->matcher = userdb_mapper_match_user;
+	pt->deinit = mapper_module_end;
+	userdb_module = pt;
+	return pt;
+}
+
+/**
+* Initialization routine
+*/
+#ifndef USERDB_MAPPER_STATIC
+mapper_module * mapper_module_init(scconf_block *blk,const char *mapper_name) {
+#else
+mapper_module * userdb_mapper_module_init(scconf_block *blk,const char *mapper_name) {
+#endif
+	mapper_module *pt;
+	const char *item = "upn";
+	const char *hash_alg_string = "sha1";
+	if (blk) {
+	debug = scconf_get_bool(blk,"debug",0);
+	socket_path = scconf_get_str(blk,"socket",socket_path);
+	service = scconf_get_str(blk,"service",service);
+	method = scconf_get_str(blk,"method",method);
+	query_field = scconf_get_str(blk,"query_field",query_field);
+	login_field = scconf_get_str(blk,"login_field",login_field);
+	item = scconf_get_str(blk,"cert_item",item);
+	hash_alg_string = scconf_get_str(blk,"algorithm",hash_alg_string);
+	ignorecase = scconf_get_bool(blk,"ignorecase",ignorecase);
+	ignoredomain = scconf_get_bool(blk,"ignoredomain",ignoredomain);
+	/* do not wait on the service longer than the chain would */
+	timeout = scconf_get_int(blk,"timeout",timeout);
+	} else {
+		DBG1("No block declaration for mapper '%s'",mapper_name);
+	}
+	set_debug_level(debug);
+	if (timeout <= 0) timeout = USERDB_DEFAULT_TIMEOUT;
+	if (!strcasecmp(item,"cn"))           id_type=CERT_CN;
+	else if (!strcasecmp(item,"subject")) id_type=CERT_SUBJECT;
+	else if (!strcasecmp(item,"kpn") )    id_type=CERT_KPN;
+	else if (!strcasecmp(item,"email") )  id_type=CERT_EMAIL;
+	else if (!strcasecmp(item,"upn") )    id_type=CERT_UPN;
+	else if (!strcasecmp(item,"uid") )    id_type=CERT_UID;
+	else if (!strcasecmp(item,"serial") ) id_type=CERT_SERIAL;
+	else if (!strcasecmp(item,"digest") ) id_type=CERT_DIGEST;
+	else {
+	    DBG1("Invalid certificate item to search '%s'; using 'upn'",item);
+	    id_type=CERT_UPN;
+	}
+	algorithm = Alg_get_alg_from_string(hash_alg_string);
+	if (algorithm == ALGORITHM_NULL) {
+		DBG1("Invalid digest algorithm %s, using 'sha1'", hash_alg_string);
+		algorithm = ALGORITHM_SHA1;
+	}
+	pt = init_mapper_st(blk,mapper_name);
+	if (pt) DBG4("Userdb mapper started. debug: %d, socket: %s, method: %s, item: %s",debug,socket_path,method,item);
+	else DBG("Userdb mapper initialization failed");
+	return pt;
+}
@@ -0,0 +1,194 @@
+/*
+ * PAM-PKCS11 mapping modules
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/*
+* Checks the userdb mapper against a stand-in varlink service: a child
+* process listening on a private AF_UNIX socket, which checks the query
+* it gets and answers with a canned reply, sent in pieces.
+* The mapper source is included to reach its static functions.
+*/
+
+#include "userdb_mapper.c"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+static char server_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int failures = 0;
+
+#define CHECK(cond, what) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s (line %d)\n", what, __LINE__); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+* serve one connection: read the query up to its NUL, check that it holds
+* expect, then send reply (with its NUL) chunk bytes at a time, or nothing
+* at all if reply is NULL. Exit status 0 if the query was as expected.
+*/
+static void serve(int lfd, const char *expect, const char *reply, size_t chunk) {
+	char query[4096];
+	size_t got = 0, len, n;
+	ssize_t r;
+	int fd;
+
+	fd = accept(lfd, NULL, NULL);
+	if (fd < 0) _exit(2);
+	while (got < sizeof(query) - 1) {
+		r = recv(fd, query + got, sizeof(query) - 1 - got, 0);
+		if (r <= 0) _exit(3);
+		got += r;
+		if (!query[got - 1]) break;
+	}
+	query[got] = '\0';
+	if (expect && !strstr(query, expect)) _exit(4);
+	if (!reply) {
+		pause();
+		_exit(0);
+	}
+	for (len = strlen(reply) + 1; len > 0; reply += n, len -= n) {
+		n = len < chunk ? len : chunk;
+		if (send(fd, reply, n, MSG_NOSIGNAL) != (ssize_t)n) _exit(5);
+		usleep(1000);
+	}
+	close(fd);
+	_exit(0);
+}
+
+/* look value up against a server answering reply */
+static int lookup(const char *value, const char *expect, const char *reply,
+		size_t chunk, char **login) {
+	struct sockaddr_un addr;
+	int lfd, res, status;
+	pid_t pid;
+
+	unlink(server_path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, server_path);
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| listen(lfd, 1) < 0) {
+		perror("stand-in server");
+		exit(99);
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(99);
+	}
+	if (pid == 0) serve(lfd, expect, reply, chunk);
+	close(lfd);
+	res = userdb_lookup(value, login);
+	if (!reply) kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	if (reply) CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "query as expected");
+	unlink(server_path);
+	return res;
+}
+
+static void check_found(const char *reply, size_t chunk, const char *user, const char *what) {
+	char *login;
+	int res = lookup("jdoe@example.com", NULL, reply, chunk, &login);
+	CHECK(res == 1 && login && !strcmp(login, user), what);
+	free(login);
+}
+
+static void check_result(const char *reply, int expected, const char *what) {
+	char *login;
+	int res = lookup("jdoe@example.com", NULL, reply, 4096, &login);
+	CHECK(res == expected && !login, what);
+	free(login);
+}
+
+static void check_string(const char *json, const char *expected, const char *what) {
+	char *s = json_string(json);
+	CHECK(expected ? s && !strcmp(s, expected) : !s, what);
+	free(s);
+}
+
+int main(int argc, char **argv) {
+	char deep[4 * JSON_MAX_DEPTH + 64];
+	char *login, *pt;
+	int i, res;
+
+	snprintf(server_path, sizeof(server_path), "/tmp/userdb_test.%d", (int)getpid());
+	socket_path = server_path;
+	timeout = 2000;
+
+	/* the JSON reader */
+	check_string("\"plain\"", "plain", "plain string");
+	check_string(" \"a\\\"b\\\\c\\/d\"", "a\"b\\c/d", "simple escapes");
+	check_string("\"\\u00e9t\\u00E9\"", "\xc3\xa9t\xc3\xa9", "\\u escapes");
+	check_string("\"\\ud83d\\ude00\"", "\xf0\x9f\x98\x80", "surrogate pair");
+	check_string("\"\\u0000\"", NULL, "NUL escape rejected");
+	check_string("\"\\u12\"", NULL, "short \\u escape rejected");
+	check_string("\"\\u1", NULL, "truncated \\u escape rejected");
+	check_string("\"unterminated", NULL, "unterminated string");
+	check_string("42", NULL, "not a string");
+	CHECK(json_member("{}", "a") == NULL, "member of empty object");
+	CHECK(json_member("[1]", "a") == NULL, "member of an array");
+	pt = (char *)json_member("{\"x\":{\"a\":\"}\"},\"y\":[1,{\"a\":2},\"]\"],\"a\" : true}", "a");
+	CHECK(pt && !strncmp(pt, "true", 4), "member after nested values");
+	CHECK(json_member("{\"x\":[1,2}", "a") == NULL, "mismatched brackets");
+	CHECK(json_member("{\"x\" 1,\"a\":1}", "a") == NULL, "missing colon");
+	for (pt = deep, i = 0; i <= JSON_MAX_DEPTH; i++) pt += sprintf(pt, "[");
+	for (i = 0; i <= JSON_MAX_DEPTH; i++) pt += sprintf(pt, "]");
+	CHECK(json_skip(deep, 0) == NULL, "nesting limit");
+	CHECK(json_skip(deep + 2, 0) == deep + strlen(deep) - 2, "nesting below the limit");
+
+	/* the varlink call */
+	check_found("{\"parameters\":{\"record\":{\"userName\":\"jdoe\"}}}", 4096,
+		"jdoe", "simple record");
+	check_found("{\"parameters\":{\"record\":{\"realName\":\"J {Doe}\","
+		"\"memberOf\":[\"a\",\"b]\"],\"privileged\":{\"hashedPassword\":[\"x\"]},"
+		"\"userName\":\"j\\u00e9r\\u00f4me\",\"uid\":1000}}}", 7,
+		"j\xc3\xa9r\xc3\xb4me", "record in pieces, after nested members");
+	check_result("{\"error\":\"io.systemd.UserDatabase.NoRecordFound\",\"parameters\":{}}",
+		0, "no such record");
+	check_result("{\"error\":\"io.systemd.UserDatabase.ServiceNotAvailable\"}",
+		-1, "service error");
+	check_result("{\"error\":42}", -1, "malformed error");
+	check_result("{\"parameters\":{\"record\":{\"uid\":1000}}}", -1, "record without user name");
+	check_result("{\"parameters\":{\"record\":{\"userName\":\"\"}}}", -1, "empty user name");
+	check_result("{\"parameters\":{\"record\":{\"userName\":\"jd", -1, "truncated reply");
+	check_result("", -1, "empty reply");
+
+	/* the query is well formed JSON, whatever the certificate holds */
+	res = lookup("j\"d\\o\ne", "\"parameters\":{\"userName\":\"j\\\"d\\\\o\\u000ae\",",
+		"{\"parameters\":{\"record\":{\"userName\":\"jdoe\"}}}", 4096, &login);
+	CHECK(res == 1, "quoted query");
+	free(login);
+
+	/* a service that never answers */
+	timeout = 200;
+	res = lookup("jdoe", NULL, NULL, 0, &login);
+	CHECK(res == -1 && !login, "timeout");
+
+	/* no service at all */
+	res = userdb_lookup("jdoe", &login);
+	CHECK(res == -1 && !login, "no service");
+
+	if (failures) fprintf(stderr, "%d check(s) failed\n", failures);
+	return failures ? 1 : 0;
+}
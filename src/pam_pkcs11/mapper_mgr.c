@@ -28,18 +28,68 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <dlfcn.h>
 #include "../common/cert_st.h"
 
 #include "../scconf/scconf.h"
 #include "../common/debug.h"
 #include "../common/error.h"
+#include "../common/auth_trace.h"
 #include "../mappers/mapper.h"
 #include "../mappers/mapperlist.h"
 #include "mapper_mgr.h"
+#include "../common/module_pin.h"
 
 struct mapper_listitem *root_mapper_list;
 
+/* mapper deadlines in milliseconds, 0 means no limit */
+static int mapper_timeout = 0; /* default for every mapper */
+static int mapping_budget = 0; /* whole find/match chain */
+
+/* configuration the loaded chain is kept for, NULL if not cached */
+static scconf_context *chain_ctx = NULL;
+
+/*
+* mappers run by prematch_user() when map_before_verify_mappers is not
+* set: those reading only the certificate and local map files or
+* indexes. Mappers querying a server or the password database are left
+* for after the verification
+*/
+static const char *local_mappers[] = {
+	"cn", "digest", "generic", "krb", "mail", "ms", "null", "subject", "uid",
+	NULL
+};
+
+/* whether a mapper may run before the certificate is verified */
+static int is_premap(const scconf_list *premap, const char *name) {
+	int i;
+	if (premap) {
+		for (; premap; premap = premap->next)
+			if (!strcmp(premap->data, name)) return 1;
+		return 0;
+	}
+	for (i = 0; local_mappers[i]; i++)
+		if (!strcmp(local_mappers[i], name)) return 1;
+	return 0;
+}
+
+#define MAPPER_FIND  0
+#define MAPPER_MATCH 1
+
+struct mapper_call {
+	struct mapper_instance *module;
+	int op;
+	X509 *x509;
+	char *login; /* login to match, or login found */
+	int match;
+	int res;
+	int time_left; /* milliseconds given to the mapper, 0 if unlimited */
+	int timed_out;
+	unsigned long ms; /* time taken by the mapper itself */
+};
+
 /*
 * load and initialize a module
 * returns descriptor on success, null on fail
@@ -125,6 +175,11 @@ struct mapper_instance *load_module(scconf_context *ctx, const char * name) {
 	mymodule->module_name=name;
 	mymodule->module_path=libname;
 	mymodule->module_data=res;
+	mymodule->timeout= blk ? scconf_get_int(blk,"timeout",mapper_timeout) : mapper_timeout;
+	if (mymodule->timeout>0)
+	    DBG2("Mapper '%s' timeout: %dms",name,mymodule->timeout);
+	mymodule->premap=0;
+	res->time_left=0;
 	/* that's all folks */
 	return mymodule;
 }
@@ -161,7 +216,14 @@ void unload_module( struct mapper_instance *module ) {
 struct mapper_listitem *load_mappers( scconf_context *ctx ) {
 	struct mapper_listitem *last =NULL;
 	const scconf_list *module_list = NULL;
+	const scconf_list *premap = NULL;
 	const scconf_block *root= NULL;
+	/* the mappers are already initialized from this very configuration */
+	if (root_mapper_list && chain_ctx && chain_ctx==ctx) {
+		DBG("Reusing loaded mapper module list");
+		return root_mapper_list;
+	}
+	if (root_mapper_list) unload_mappers();
 	root_mapper_list = NULL;
 	/* extract mapper list */
 	root = scconf_find_block(ctx,NULL,"pam_pkcs11");
@@ -181,10 +243,15 @@ struct mapper_listitem *load_mappers( scconf_context *ctx ) {
            DBG("No use_mappers entry found in config");
            return NULL;
 	}
+	mapper_timeout = scconf_get_int(root,"mapper_timeout",0);
+	mapping_budget = scconf_get_int(root,"mapping_budget",0);
+	chain_ctx = scconf_get_bool(root,"mapper_cache",0) ? ctx : NULL;
+	premap = scconf_find_list(root,"map_before_verify_mappers");
 	while (module_list) {
 	    char *name = module_list->data;
 	    struct mapper_instance *module = load_module(ctx,name);
 	    if (module) {
+		module->premap = is_premap(premap,name);
 	    	struct mapper_listitem *item = malloc(sizeof(struct mapper_listitem));
 		if (!item) {
 			DBG1("Error allocating modulelist entry: %s",name);
@@ -220,9 +287,19 @@ void unload_mappers(void) {
 		item=next;
 	}
 	root_mapper_list=NULL;
+	chain_ctx=NULL;
 	return;
 }
 
+void release_mappers(void) {
+	/* kept in vain if pam_end() unloads us */
+	if (chain_ctx && root_mapper_list && pin_module() == 0) {
+		DBG("keeping mapper module list loaded");
+		return;
+	}
+	unload_mappers();
+}
+
 void inspect_certificate(X509 *x509) {
 	int old_level=get_debug_level();
 	struct mapper_listitem *item = root_mapper_list;
@@ -250,67 +327,231 @@ void inspect_certificate(X509 *x509) {
 	}
 }
 
+static unsigned long elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+* run a mapper finder or matcher. The mapper is told how much time it
+* has through its time_left field: the ones waiting on a server (ldap,
+* userdb) give up by then. An answer which is not a match and comes at
+* or after the deadline counts as a timeout.
+*/
+static void run_mapper(struct mapper_call *call) {
+	mapper_module *data = call->module->module_data;
+	int old_level= get_debug_level();
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	set_debug_level(data->dbg_level);
+	data->time_left = call->time_left;
+	if (call->op==MAPPER_FIND)
+		call->login = (*data->finder)(call->x509,data->context,&call->match);
+	else
+		call->res = (*data->matcher)(call->x509,call->login,data->context);
+	data->time_left = 0;
+	set_debug_level(old_level);
+	call->ms = elapsed_ms(&start);
+	if (call->time_left>0 && call->ms>=(unsigned long)call->time_left) {
+		if (call->op==MAPPER_FIND ? !(call->login && call->match) : call->res<=0) {
+			DBG1("Mapper '%s' timed out",call->module->module_name);
+			call->timed_out = 1;
+		}
+	}
+}
+
+/*
+* record a mapper outcome in the authentication trace
+*/
+static void trace_mapper(int op, struct mapper_instance *module,
+		const char *result, unsigned long ms) {
+	auth_trace_event(op==MAPPER_FIND ? "find" : "match",
+		module->module_name, result, ms);
+}
+
+static const char *mapper_result(struct mapper_call *call) {
+	if (call->timed_out) return "timeout";
+	if (call->op==MAPPER_FIND)
+		return (call->login && call->match) ? "match" : "nomatch";
+	if (call->res<0) return "error";
+	return call->res>0 ? "match" : "nomatch";
+}
+
+static void free_mapper_call(struct mapper_call *call) {
+	/* a found login is only owned by us when it did not match */
+	if (call->op==MAPPER_MATCH || !call->match)
+		free(call->login);
+	free(call);
+}
+
+/*
+* time a mapper of the chain is given, from its own timeout and from
+* what is left of the mapping budget
+* returns 0 if there is no limit, -1 if the budget is exhausted
+*/
+static int mapper_time(struct mapper_instance *module, const struct timespec *budget) {
+	int ms = module->timeout;
+	int left = mapper_time_left(budget);
+	if (left==0) return -1;
+	if (left>0 && (ms<=0 || left<ms)) ms = left;
+	return ms>0 ? ms : 0;
+}
+
+static struct mapper_call *new_mapper_call(struct mapper_instance *module,
+		int op, X509 *x509, const char *login) {
+	struct mapper_call *call = calloc(1,sizeof(struct mapper_call));
+	if (!call) {
+		set_error("No space to alloc mapper call");
+		return NULL;
+	}
+	if (login) {
+		call->login = strdup(login);
+		if (!call->login) {
+			free(call);
+			set_error("No space to alloc mapper call");
+			return NULL;
+		}
+	}
+	call->module = module;
+	call->op = op;
+	call->x509 = x509;
+	return call;
+}
+
 /*
 * this function search mapper module list until
 * find a module that returns a login name for
 * provided certificate
+* Mappers run one after the other: they share the password database
+* cursor, the error buffer and the ldap connection, and one left running
+* behind the first match could not be stopped.
 */
 char * find_user(X509 *x509) {
-	int old_level= get_debug_level();
 	struct mapper_listitem *item = root_mapper_list;
+	struct timespec budget;
+	int timeouts = 0;
 	if (!x509) return NULL;
+	mapper_deadline_set(&budget,mapping_budget);
 	while (item) {
 	    char *login = NULL;
 	    if(! item->module->module_data->finder) {
 	    	DBG1("Mapper '%s' has no find() function",item->module->module_name);
 	    } else {
-			int match = 0;
+		int match = 0;
+		int ms = mapper_time(item->module,&budget);
+		struct mapper_call *call;
 
-			set_debug_level(item->module->module_data->dbg_level);
-	        login = (*item->module->module_data->finder)(x509,item->module->module_data->context, &match);
-		set_debug_level(old_level);
+		if (ms<0) {
+		    DBG1("Mapping budget exhausted before mapper '%s'",item->module->module_name);
+		    timeouts++;
+		    break;
+		}
+		call = new_mapper_call(item->module,MAPPER_FIND,x509,NULL);
+		if (!call) break;
+		call->time_left = ms;
+		run_mapper(call);
+		trace_mapper(MAPPER_FIND,item->module,mapper_result(call),call->ms);
+		if (call->timed_out) {
+		    /* time-out means no match */
+		    timeouts++;
+		    free_mapper_call(call);
+		    item=item->next;
+		    continue;
+		}
+		login = call->login;
+		match = call->match;
+		call->login = NULL;
+		free_mapper_call(call);
 	    	DBG3("Mapper '%s' found %s, matched %d", item->module->module_name,login, match);
-			if (login) {
-				if (match)
-					return login;
-				free(login);
+		if (login) {
+			if (match) {
+				if (timeouts) DBG1("find_user(): %d mapper timeouts",timeouts);
+				return login;
 			}
+			free(login);
+		}
 	    }
 	    item=item->next;
 	}
+	if (timeouts) DBG1("find_user(): %d mapper timeouts",timeouts);
 	return NULL;
 }
 
-/**
-* This function search mapper module list until
-* find a module that match provided login name
-* if login is null, call find_user and returns 1,or 0 depending on user found
-* @return 1 if match
-*         0 on no match
-*         -1 on error
+/*
+* match_user() and prematch_user(): run the mappers of the chain, or
+* only those allowed before the verification, until one matches
 */
-int match_user(X509 *x509, const char *login) {
-	int old_level= get_debug_level();
+static int match_chain(X509 *x509, const char *login, int premap_only) {
 	struct mapper_listitem *item = root_mapper_list;
+	struct timespec budget;
+	int timeouts = 0;
 	if (!x509) return -1;
 	/* if no login provided, call  */
 	if (!login) return 0;
+	mapper_deadline_set(&budget,mapping_budget);
 	while (item) {
 	    int res=0; /* default: no match */
-	    if (!item->module->module_data->matcher) {
+	    if (premap_only && !item->module->premap) {
+	    	DBG1("Mapper '%s' left for after the verification",item->module->module_name);
+	    } else if (!item->module->module_data->matcher) {
 	    	DBG1("Mapper '%s' has no match() function",item->module->module_name);
 	    } else {
-		set_debug_level(item->module->module_data->dbg_level);
-	        res = (*item->module->module_data->matcher)(x509,login,item->module->module_data->context);
-		set_debug_level(old_level);
+		int ms = mapper_time(item->module,&budget);
+		struct mapper_call *call;
+
+		if (ms<0) {
+		    DBG1("Mapping budget exhausted before mapper '%s'",item->module->module_name);
+		    timeouts++;
+		    break;
+		}
+		call = new_mapper_call(item->module,MAPPER_MATCH,x509,login);
+		if (!call) return -1;
+		call->time_left = ms;
+		run_mapper(call);
+		trace_mapper(MAPPER_MATCH,item->module,mapper_result(call),call->ms);
+		if (call->timed_out) {
+		    /* time-out means no match */
+		    timeouts++;
+		} else {
+		    res = call->res;
+		}
+		free_mapper_call(call);
 	        DBG2("Mapper module %s match() returns %d",item->module->module_name,res);
 	    }
-	    if (res>0) return res;
+	    if (res>0) {
+		if (timeouts) DBG1("match_user(): %d mapper timeouts",timeouts);
+		return res;
+	    }
 	    if (res<0) { /* show error and continue */
 	    	DBG1("Error in module %s",item->module->module_name);
 	    }
 	    item=item->next;
 	}
+	if (timeouts) DBG1("match_user(): %d mapper timeouts",timeouts);
 	return 0;
 }
 
+/**
+* This function search mapper module list until
+* find a module that match provided login name
+* if login is null, call find_user and returns 1,or 0 depending on user found
+* @return 1 if match
+*         0 on no match
+*         -1 on error
+*/
+int match_user(X509 *x509, const char *login) {
+	return match_chain(x509,login,0);
+}
+
+int prematch_user(X509 *x509, const char *login) {
+	return match_chain(x509,login,1);
+}
+
+int prematch_is_final(void) {
+	struct mapper_listitem *item;
+	for (item = root_mapper_list; item; item = item->next)
+		if (!item->module->premap) return 0;
+	return 1;
+}
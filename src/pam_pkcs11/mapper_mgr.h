@@ -40,6 +40,8 @@ struct mapper_instance {
     const char *module_name;
     const char *module_path;
     mapper_module *module_data;
+    int timeout; /* milliseconds, 0 means no limit */
+    int premap; /* may run before the certificate is verified */
 };
 
 /*
@@ -71,6 +73,16 @@ struct mapper_listitem *load_mappers( scconf_context *ctx );
 */
 void unload_mappers(void);
 
+/**
+* end of use of the mapper module chain: unload it, unless mapper_cache
+* is set, in which case it is kept for the next load_mappers() call on
+* the same configuration, and pam_pkcs11 stays loaded until the process
+* exits. The kept chain serves successive authentications only: mappers
+* keep their options in globals, so it is never shared by two
+* authentications running at once, nor called from other threads
+*/
+void release_mappers(void);
+
 /*
 * this function search mapper module list until
 * find a module that returns a login name for
@@ -88,6 +100,22 @@ char * find_user(X509 *x509);
 */
 int match_user(X509 *x509, const char *login);
 
+/**
+* match_user() restricted to the mappers allowed to run before the
+* certificate is verified: those of map_before_verify_mappers, by
+* default the ones reading only the certificate and local files
+* @return 1 if match
+*         0 on no match
+*         -1 on error
+*/
+int prematch_user(X509 *x509, const char *login);
+
+/**
+* whether every mapper of the chain runs in prematch_user(), so that
+* its "no match" is final
+*/
+int prematch_is_final(void);
+
 /*
 * This funcions goest throught the mapper list
 * and trying to get the certificate strings to be used on each
@@ -20,6 +20,7 @@
 
 #include <syslog.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "config.h"
 #include "../scconf/scconf.h"
 #include "../common/debug.h"
@@ -36,7 +37,7 @@
 * configuration related functions
 */
 
-struct configuration_st configuration = {
+static const struct configuration_st default_configuration = {
 	CONFDIR "/pam_pkcs11.conf",	/* char * config_file; */
 	NULL,				/* scconf_context *ctx; */
         0,				/* int debug; */
@@ -60,14 +61,31 @@ struct configuration_st configuration = {
 		CONFDIR "/cacerts",
 		CONFDIR "/crls",
 		CONFDIR "/nssdb",
-		OCSP_NONE
+		OCSP_NONE,
+		0,
+		0,
+		0
 	},
 	N_("Smart card"),			/* token_type */
 	NULL,				/* char *username */
 	0,                               /* int quiet */
-	0			/* err_display_time */
+	0,			/* err_display_time */
+	NULL,			/* token_profile_dir */
+	NULL,			/* trace_file */
+	NULL,			/* session_registry */
+	1,			/* batch_messages */
+	1,			/* cert_progress */
+	0,			/* pkcs11_trace */
+	0,			/* map_before_verify */
+	0,			/* module_cache_timeout */
+	0,			/* multi_token */
+	0,			/* token_timeout */
+	0,			/* piv_fast_path */
+	NULL			/* piv_atrs */
 };
 
+struct configuration_st configuration;
+
 #ifdef DEBUG_CONFIG
 static void display_config (void) {
         DBG1("debug %d",configuration.debug);
@@ -89,10 +107,56 @@ static void display_config (void) {
         DBG1("crl_policy %d",configuration.policy.crl_policy);
         DBG1("signature_policy %d",configuration.policy.signature_policy);
         DBG1("ocsp_policy %d",configuration.policy.ocsp_policy);
+        DBG1("crl_max_age %d",configuration.policy.crl_max_age);
+        DBG1("crl_grace %d",configuration.policy.crl_grace);
+        DBG1("chain_cache_ttl %d",configuration.policy.chain_cache_ttl);
 		DBG1("err_display_time %d", configuration.err_display_time);
+        DBG1("token_profile_dir %s",configuration.token_profile_dir);
+        DBG1("trace_file %s",configuration.trace_file);
+        DBG1("session_registry %s",configuration.session_registry);
+        DBG1("batch_messages %d",configuration.batch_messages);
+        DBG1("cert_progress %d",configuration.cert_progress);
+        DBG1("pkcs11_trace %d",configuration.pkcs11_trace);
+        DBG1("map_before_verify %d",configuration.map_before_verify);
+        DBG1("module_cache_timeout %d",configuration.module_cache_timeout);
+        DBG1("multi_token %d",configuration.multi_token);
+        DBG1("token_timeout %d",configuration.token_timeout);
+        DBG1("piv_fast_path %d",configuration.piv_fast_path);
 }
 #endif
 
+/*
+* The parsed configuration tree is kept between authentications while
+* the file does not change, so that the mapper chain built from it can
+* be kept loaded as well (see mapper_cache). It only lasts as long as
+* pam_pkcs11 stays loaded, see module_pin.h.
+* Nothing else is carried over: pk_configure() starts again from the
+* defaults, the tree and the module arguments of the current call. There
+* is a single configuration per process, not one per PAM handle, and the
+* mappers keep their options in globals: authentications in one process
+* are configured one after the other, never at the same time.
+*/
+static int config_parsed = 0;
+static char config_path[1024];
+static struct stat config_stat;
+
+static void remember_config(void) {
+	if (stat(configuration.config_file, &config_stat) < 0) return;
+	strncpy(config_path, configuration.config_file, sizeof(config_path) - 1);
+	config_path[sizeof(config_path) - 1] = '\0';
+	config_parsed = 1;
+}
+
+static int config_unchanged(void) {
+	struct stat st;
+	if (!config_parsed || !configuration.ctx) return 0;
+	if (strcmp(config_path, configuration.config_file)) return 0;
+	if (stat(configuration.config_file, &st) < 0) return 0;
+	return st.st_dev == config_stat.st_dev && st.st_ino == config_stat.st_ino &&
+		st.st_size == config_stat.st_size && st.st_mtime == config_stat.st_mtime &&
+		st.st_ctime == config_stat.st_ctime;
+}
+
 /*
 parse configuration file
 */
@@ -101,9 +165,20 @@ static void parse_config_file(void) {
 	const scconf_list *mapper_list;
 	const scconf_list *policy_list;
  	const scconf_list *screen_saver_list;
+ 	const scconf_list *atr_list;
  	const scconf_list *tmp;
 	scconf_context *ctx;
 	const scconf_block *root;
+	if (config_unchanged()) {
+	   DBG1("Reusing parsed configuration file %s",configuration.config_file);
+	   ctx = configuration.ctx;
+	} else {
+	/* a mapper chain kept for the previous tree points into it */
+	if (configuration.ctx) {
+	   unload_mappers();
+	   scconf_free(configuration.ctx);
+	}
+	config_parsed = 0;
 	configuration.ctx = scconf_new(configuration.config_file);
 	if (!configuration.ctx) {
            DBG("Error creating conf context");
@@ -114,6 +189,8 @@ static void parse_config_file(void) {
            DBG1("Error parsing file %s",configuration.config_file);
 	   return;
 	}
+	remember_config();
+	}
 	/* now parse options */
 	root = scconf_find_block(ctx, NULL, "pam_pkcs11");
 	if (!root) {
@@ -143,6 +220,20 @@ static void parse_config_file(void) {
 	    scconf_get_bool(root,"wait_for_card",configuration.wait_for_card);
 	configuration.pkcs11_module = ( char * )
 	    scconf_get_str(root,"use_pkcs11_module",configuration.pkcs11_module);
+	configuration.trace_file = ( char * )
+	    scconf_get_str(root,"trace_file",configuration.trace_file);
+	configuration.pkcs11_trace =
+	    scconf_get_bool(root,"pkcs11_trace",configuration.pkcs11_trace);
+	configuration.map_before_verify =
+	    scconf_get_bool(root,"map_before_verify",configuration.map_before_verify);
+	configuration.multi_token =
+	    scconf_get_bool(root,"multi_token",configuration.multi_token);
+	configuration.session_registry = ( char * )
+	    scconf_get_str(root,"session_registry",configuration.session_registry);
+	configuration.batch_messages =
+	    scconf_get_bool(root,"batch_messages",configuration.batch_messages);
+	configuration.cert_progress =
+	    scconf_get_bool(root,"cert_progress",configuration.cert_progress);
 	/* search pkcs11 module options */
 	pkcs11_mblocks = scconf_find_blocks(ctx,root,"pkcs11_module",configuration.pkcs11_module);
         if (!pkcs11_mblocks) {
@@ -179,6 +270,34 @@ static void parse_config_file(void) {
 
 	    configuration.support_threads =
 	        scconf_get_bool(pkcs11_mblk,"support_threads",configuration.support_threads);
+	    configuration.token_profile_dir = (char *)
+	        scconf_get_str(pkcs11_mblk,"token_profile_dir",configuration.token_profile_dir);
+	    configuration.policy.crl_max_age =
+	        scconf_get_int(pkcs11_mblk,"crl_max_age",configuration.policy.crl_max_age);
+	    configuration.policy.crl_grace =
+	        scconf_get_int(pkcs11_mblk,"crl_grace",configuration.policy.crl_grace);
+	    configuration.policy.chain_cache_ttl =
+	        scconf_get_int(pkcs11_mblk,"chain_cache_ttl",configuration.policy.chain_cache_ttl);
+	    configuration.module_cache_timeout =
+	        scconf_get_int(pkcs11_mblk,"module_cache_timeout",configuration.module_cache_timeout);
+	    configuration.token_timeout =
+	        scconf_get_int(pkcs11_mblk,"token_timeout",configuration.token_timeout);
+	    configuration.piv_fast_path =
+	        scconf_get_bool(pkcs11_mblk,"piv_fast_path",configuration.piv_fast_path);
+	    atr_list = scconf_find_list(pkcs11_mblk,"piv_atr");
+	    if (atr_list) {
+		int count,i;
+		for (count=0, tmp=atr_list; tmp ; tmp=tmp->next, count++);
+
+		free(configuration.piv_atrs);
+		configuration.piv_atrs = malloc((count+1)*sizeof(char *));
+		if (configuration.piv_atrs) {
+		    for (i=0, tmp=atr_list; tmp; tmp=tmp->next, i++) {
+			configuration.piv_atrs[i] = (char *)tmp->data;
+		    }
+		    configuration.piv_atrs[count] = 0;
+		}
+	    }
 	    policy_list= scconf_find_list(pkcs11_mblk,"cert_policy");
 	    while(policy_list) {
 	        if ( !strcmp(policy_list->data,"none") ) {
@@ -230,6 +349,36 @@ static void parse_config_file(void) {
 	return;
 }
 
+/*
+* the strings taken from the module arguments: the PAM handle and its
+* arguments go away at pam_end(), the configuration stays
+*/
+static char **arg_copies = NULL;
+static int arg_ncopies = 0;
+
+static const char *copy_arg(const char *value) {
+	char *copy = arg_copies ? strdup(value) : NULL;
+	/* the argument itself is still good for this call */
+	if (!copy) return value;
+	arg_copies[arg_ncopies++] = copy;
+	return copy;
+}
+
+static void reset_config(int argc) {
+	scconf_context *ctx = configuration.ctx;
+	int i;
+
+	free(configuration.screen_savers);
+	free(configuration.piv_atrs);
+	for (i = 0; i < arg_ncopies; i++) free(arg_copies[i]);
+	free(arg_copies);
+	arg_ncopies = 0;
+	arg_copies = calloc(argc + 1, sizeof(char *));
+	configuration = default_configuration;
+	configuration.ctx = ctx;
+	set_debug_level(0);
+}
+
 /*
 * values are taken in this order (low to high precedence):
 * 1- default values
@@ -238,10 +387,11 @@ static void parse_config_file(void) {
 */
 struct configuration_st *pk_configure( int argc, const char **argv ) {
 	int i;
+	reset_config(argc);
 	/* try to find a configuration file entry */
 	for (i = 0; i < argc; i++) {
 	    if (strstr(argv[i],"config_file=") ) {
-		configuration.config_file=1+strchr(argv[i],'=');
+		configuration.config_file=copy_arg(1+strchr(argv[i],'='));
 		break;
 	    }
     	}
@@ -292,12 +442,60 @@ struct configuration_st *pk_configure( int argc, const char **argv ) {
 		set_debug_level(-2);
 		continue;
 	   }
+	   if (strcmp("batch_messages", argv[i]) == 0) {
+		configuration.batch_messages = 1;
+		continue;
+	   }
+	   if (strcmp("nobatch_messages", argv[i]) == 0) {
+		configuration.batch_messages = 0;
+		continue;
+	   }
+	   if (strcmp("cert_progress", argv[i]) == 0) {
+		configuration.cert_progress = 1;
+		continue;
+	   }
+	   if (strcmp("nocert_progress", argv[i]) == 0) {
+		configuration.cert_progress = 0;
+		continue;
+	   }
+	   if (strcmp("pkcs11_trace", argv[i]) == 0) {
+		configuration.pkcs11_trace = 1;
+		continue;
+	   }
+	   if (strcmp("nopkcs11_trace", argv[i]) == 0) {
+		configuration.pkcs11_trace = 0;
+		continue;
+	   }
+	   if (strcmp("map_before_verify", argv[i]) == 0) {
+		configuration.map_before_verify = 1;
+		continue;
+	   }
+	   if (strcmp("nomap_before_verify", argv[i]) == 0) {
+		configuration.map_before_verify = 0;
+		continue;
+	   }
+	   if (strcmp("multi_token", argv[i]) == 0) {
+		configuration.multi_token = 1;
+		continue;
+	   }
+	   if (strcmp("nomulti_token", argv[i]) == 0) {
+		configuration.multi_token = 0;
+		continue;
+	   }
+	   if (strcmp("piv_fast_path", argv[i]) == 0) {
+		configuration.piv_fast_path = 1;
+		continue;
+	   }
+	   if (strcmp("nopiv_fast_path", argv[i]) == 0) {
+		configuration.piv_fast_path = 0;
+		continue;
+	   }
 	   if (strstr(argv[i],"pkcs11_module=") ) {
-		configuration.pkcs11_module = argv[i] + sizeof("pkcs11_module=")-1;
+		configuration.pkcs11_module = copy_arg(argv[i] + sizeof("pkcs11_module=")-1);
 		continue;
 	   }
 	   if (strstr(argv[i],"slot_description=") ) {
-		configuration.slot_description = argv[i] + sizeof("slot_description=")-1;
+		configuration.slot_description = copy_arg(argv[i] + sizeof("slot_description=")-1);
 		continue;
 	   }
 
@@ -307,15 +505,35 @@ struct configuration_st *pk_configure( int argc, const char **argv ) {
 	   }
 
 	   if (strstr(argv[i],"ca_dir=") ) {
-		configuration.policy.ca_dir = argv[i] + sizeof("ca_dir=")-1;
+		configuration.policy.ca_dir = copy_arg(argv[i] + sizeof("ca_dir=")-1);
 		continue;
 	   }
 	   if (strstr(argv[i],"crl_dir=") ) {
-		configuration.policy.crl_dir = argv[i] + sizeof("crl_dir=")-1;
+		configuration.policy.crl_dir = copy_arg(argv[i] + sizeof("crl_dir=")-1);
+		continue;
+	   }
+	   if (strstr(argv[i],"crl_max_age=") ) {
+		sscanf(argv[i],"crl_max_age=%d",&configuration.policy.crl_max_age);
+		continue;
+	   }
+	   if (strstr(argv[i],"crl_grace=") ) {
+		sscanf(argv[i],"crl_grace=%d",&configuration.policy.crl_grace);
+		continue;
+	   }
+	   if (strstr(argv[i],"chain_cache_ttl=") ) {
+		sscanf(argv[i],"chain_cache_ttl=%d",&configuration.policy.chain_cache_ttl);
+		continue;
+	   }
+	   if (strstr(argv[i],"module_cache_timeout=") ) {
+		sscanf(argv[i],"module_cache_timeout=%d",&configuration.module_cache_timeout);
+		continue;
+	   }
+	   if (strstr(argv[i],"token_timeout=") ) {
+		sscanf(argv[i],"token_timeout=%d",&configuration.token_timeout);
 		continue;
 	   }
 	   if (strstr(argv[i],"nss_dir=") ) {
-		configuration.policy.nss_dir = argv[i] + sizeof("nss_dir=")-1;
+		configuration.policy.nss_dir = copy_arg(argv[i] + sizeof("nss_dir=")-1);
 		continue;
 	   }
 	   if (strstr(argv[i],"cert_policy=") ) {
@@ -346,8 +564,23 @@ struct configuration_st *pk_configure( int argc, const char **argv ) {
 		continue;
 	   }
 
+	   if (strstr(argv[i],"token_profile_dir=") ) {
+		configuration.token_profile_dir = copy_arg(argv[i] + sizeof("token_profile_dir=")-1);
+		continue;
+	   }
+
+	   if (strstr(argv[i],"trace_file=") ) {
+		configuration.trace_file = copy_arg(argv[i] + sizeof("trace_file=")-1);
+		continue;
+	   }
+
+	   if (strstr(argv[i],"session_registry=") ) {
+		configuration.session_registry = copy_arg(argv[i] + sizeof("session_registry=")-1);
+		continue;
+	   }
+
 	   if (strstr(argv[i],"token_type=") ) {
-		configuration.token_type = argv[i] + sizeof("token_type=")-1;
+		configuration.token_type = copy_arg(argv[i] + sizeof("token_type=")-1);
 		continue;
 	   }
 
@@ -46,6 +46,18 @@ struct configuration_st {
 	const char *username; /* provided user name */
 	int quiet;
 	int err_display_time;
+	const char *token_profile_dir;
+	const char *trace_file;
+	const char *session_registry;
+	int batch_messages;
+	int cert_progress;
+	int pkcs11_trace;
+	int map_before_verify;
+	int module_cache_timeout;
+	int multi_token;
+	int token_timeout;
+	int piv_fast_path;
+	const char **piv_atrs;
 };
 
 struct configuration_st *pk_configure( int argc, const char **argv );
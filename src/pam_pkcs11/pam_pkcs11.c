@@ -38,6 +38,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "../scconf/scconf.h"
 #include "../common/debug.h"
 #include "../common/error.h"
@@ -45,7 +46,12 @@
 #include "../common/cert_vfy.h"
 #include "../common/cert_info.h"
 #include "../common/cert_st.h"
+#include "../common/alg_st.h"
+#include "../common/token_profile.h"
+#include "../common/auth_trace.h"
+#include "../common/session_registry.h"
 #include "pam_config.h"
+#include "piv_card.h"
 #include "mapper_mgr.h"
 
 #ifdef ENABLE_NLS
@@ -148,6 +154,146 @@ static int pam_pkcs11_prompt(const pam_handle_t *pamh, int style, char **resp, c
 #endif
 
 
+/*
+ * Informational messages are queued and sent with the next prompt or
+ * error message, or at the next stage boundary, in a single conv() call:
+ * graphical and remote greeters pay a D-Bus or network round trip for
+ * each call.
+ */
+#define MSG_QUEUE_SIZE 16
+static char *msg_queue[MSG_QUEUE_SIZE];
+static int msg_queued = 0;
+static int msg_batch = 1;
+
+static int conv_call(pam_handle_t *pamh, int n,
+	const struct pam_message **msgp, struct pam_response **resp)
+{
+  int rv;
+  struct pam_conv *conv;
+
+  *resp = NULL;
+  rv = pam_get_item(pamh, PAM_CONV, (const void **)&conv);
+  if (rv == PAM_SUCCESS) {
+    if ((conv == NULL) || (conv->conv == NULL))
+      rv = PAM_CRED_INSUFFICIENT;
+    else
+      rv = conv->conv(n, msgp, resp, conv->appdata_ptr);
+  }
+  return rv;
+}
+
+/*
+ * Overwrites and releases the n responses of a conversation
+ */
+static void free_responses(struct pam_response *resp, int n)
+{
+  int i;
+
+  if (resp == NULL)
+    return;
+  for (i = 0; i < n; i++) {
+    if (resp[i].resp) {
+      cleanse(resp[i].resp, strlen(resp[i].resp));
+      free(resp[i].resp);
+    }
+  }
+  free(resp);
+}
+
+/*
+ * Sends the queued messages, followed by msg if not NULL, in one
+ * conversation. The answer to msg is returned in answer if requested.
+ * Applications that only take one message per call get them one by one;
+ * queued messages that still cannot be shown are logged instead.
+ */
+static int converse(pam_handle_t *pamh, const struct pam_message *msg, char **answer)
+{
+  int rv, i, n = 0;
+  struct pam_message msgs[MSG_QUEUE_SIZE + 1];
+  /* an array of pointers to an array suits both the Linux-PAM and the
+   * Solaris interpretation of the conv() arguments */
+  const struct pam_message *msgp[MSG_QUEUE_SIZE + 1];
+  struct pam_response *resp = NULL;
+
+  for (i = 0; i < msg_queued; i++, n++) {
+    msgs[n].msg_style = PAM_TEXT_INFO;
+    msgs[n].msg = msg_queue[i];
+    msgp[n] = &msgs[n];
+  }
+  if (msg) {
+    msgs[n] = *msg;
+    msgp[n] = &msgs[n];
+    n++;
+  }
+  if (n == 0)
+    return PAM_SUCCESS;
+
+  rv = conv_call(pamh, n, msgp, &resp);
+  if (rv != PAM_SUCCESS && msg_queued > 0) {
+    for (i = 0; i < msg_queued; i++) {
+      if (conv_call(pamh, 1, &msgp[i], &resp) != PAM_SUCCESS)
+        pam_syslog(pamh, LOG_INFO, "%s", msg_queue[i]);
+      free_responses(resp, 1);
+      resp = NULL;
+    }
+    /* msg is now alone */
+    if (msg) {
+      rv = conv_call(pamh, 1, &msgp[n - 1], &resp);
+      n = 1;
+    } else {
+      rv = PAM_SUCCESS;
+      n = 0;
+    }
+  }
+  for (i = 0; i < msg_queued; i++)
+    free(msg_queue[i]);
+  msg_queued = 0;
+  if (rv != PAM_SUCCESS)
+    return rv;
+
+  if (answer) {
+    if ((resp == NULL) || (resp[n - 1].resp == NULL))
+      rv = PAM_CRED_INSUFFICIENT;
+    else
+      *answer = strdup(resp[n - 1].resp);
+  }
+  free_responses(resp, n);
+  return rv;
+}
+
+/*
+ * Shows a message: informational ones are queued when batching is on
+ */
+static void pkcs11_message(pam_handle_t *pamh, int style, const char *fmt, ...)
+{
+  struct pam_message msg;
+  char text[256];
+  va_list va;
+
+  va_start(va, fmt);
+  vsnprintf(text, sizeof text, fmt, va);
+  va_end(va);
+
+  if (style == PAM_TEXT_INFO && msg_batch && msg_queued < MSG_QUEUE_SIZE) {
+    msg_queue[msg_queued] = strdup(text);
+    if (msg_queue[msg_queued]) {
+      msg_queued++;
+      return;
+    }
+  }
+  msg.msg_style = style;
+  msg.msg = text;
+  converse(pamh, &msg, NULL);
+}
+
+/*
+ * Sends the queued messages before a blocking step
+ */
+static void flush_messages(pam_handle_t *pamh)
+{
+  converse(pamh, NULL, NULL);
+}
+
 /*
  * Gets the users password. Depending whether it was already asked, either
  * a prompt is shown or the old value is returned.
@@ -156,12 +302,7 @@ static int pam_get_pwd(pam_handle_t *pamh, char **pwd, char *text, int oitem, in
 {
   int rv;
   const char *old_pwd;
-  struct pam_conv *conv;
   struct pam_message msg;
-  struct pam_response *resp;
-  /* struct pam_message *(msgp[1]) = { &msg}; */
-  const struct pam_message *(msgp[1]);
-  msgp[0] = &msg;
 
   /* use stored password if variable oitem is set */
   if ((oitem == PAM_AUTHTOK) || (oitem == PAM_OLDAUTHTOK)) {
@@ -177,22 +318,12 @@ static int pam_get_pwd(pam_handle_t *pamh, char **pwd, char *text, int oitem, in
 
   /* ask the user for the password if variable text is set */
   if (text != NULL) {
+    /* queued messages are shown along with the prompt */
     msg.msg_style = PAM_PROMPT_ECHO_OFF;
     msg.msg = text;
-    rv = pam_get_item(pamh, PAM_CONV, &conv);
-    if (rv != PAM_SUCCESS)
-      return rv;
-    if ((conv == NULL) || (conv->conv == NULL))
-      return PAM_CRED_INSUFFICIENT;
-    rv = conv->conv(1, msgp, &resp, conv->appdata_ptr);
+    rv = converse(pamh, &msg, pwd);
     if (rv != PAM_SUCCESS)
       return rv;
-    if ((resp == NULL) || (resp[0].resp == NULL))
-      return PAM_CRED_INSUFFICIENT;
-    *pwd = strdup(resp[0].resp);
-    /* overwrite memory and release it */
-    cleanse(resp[0].resp, strlen(resp[0].resp));
-    free(&resp[0]);
     /* save password if variable nitem is set */
     if ((nitem == PAM_AUTHTOK) || (nitem == PAM_OLDAUTHTOK)) {
       rv = pam_set_item(pamh, nitem, *pwd);
@@ -204,9 +335,320 @@ static int pam_get_pwd(pam_handle_t *pamh, char **pwd, char *text, int oitem, in
   return PAM_CRED_INSUFFICIENT;
 }
 
-PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
+static const char *crl_policy_names[] = { "none", "online", "offline", "auto" };
+
+/* pam_end() cleanup: release the trace record of the last authentication */
+static void free_auth_trace(pam_handle_t *pamh, void *data, int error_status)
+{
+  auth_trace_free(data);
+}
+
+/* certificates read before login, while the PIN is asked */
+struct prefetch {
+  pkcs11_handle_t *ph;
+  struct auth_trace *trace;
+  pthread_t thread;
+  int threaded;
+};
+
+static void *run_prefetch(void *arg)
+{
+  struct prefetch *pf = arg;
+
+  auth_trace_use(pf->trace);
+  if (prefetch_certificates(pf->ph) != 0)
+    DBG1("certificates not read before login: %s", get_error());
+  return NULL;
+}
+
+static void start_prefetch(struct prefetch *pf, pkcs11_handle_t *ph)
+{
+  pf->ph = ph;
+  pf->trace = auth_trace_current();
+  pf->threaded = pthread_create(&pf->thread, NULL, run_prefetch, pf) == 0;
+  if (!pf->threaded)
+    DBG("cannot start a thread to read certificates before login, skipped");
+}
+
+/* no PKCS#11 call may be made on ph before this */
+static void end_prefetch(struct prefetch *pf)
+{
+  struct timeval start;
+
+  if (!pf->threaded)
+    return;
+  gettimeofday(&start, NULL);
+  pthread_join(pf->thread, NULL);
+  pf->threaded = 0;
+  auth_trace_event("stage", "prelogin_certlist", "ok", token_profile_elapsed(&start));
+}
+
+/*
+ * multi_token: the certificates of every present token are read at once,
+ * each token in its own thread with its own session. They are verified and
+ * mapped afterwards, on the calling thread: the mapper chain serves one
+ * caller at a time.
+ */
+struct token_scan {
+  pkcs11_handle_t *ph; /* session on the scanned token */
+  unsigned int slot;
+  pthread_mutex_t *token_mutex; /* serializes PKCS#11 calls, if needed */
+  int opened;
+  int ncert;
+  cert_object_t **certs;
+  struct auth_trace *trace;
+  pthread_t thread;
+  int threaded;
+};
+
+static void *read_token(void *arg)
+{
+  struct token_scan *scan = arg;
+
+  auth_trace_use(scan->trace);
+  if (scan->token_mutex)
+    pthread_mutex_lock(scan->token_mutex);
+  scan->opened = open_pkcs11_session(scan->ph, scan->slot) == 0;
+  if (scan->opened)
+    scan->certs = get_certificate_list(scan->ph, &scan->ncert);
+  if (scan->token_mutex)
+    pthread_mutex_unlock(scan->token_mutex);
+  if (!scan->certs)
+    scan->ncert = 0;
+  return NULL;
+}
+
+/*
+ * Whether a certificate is valid and maps to user (to any user if user
+ * is NULL), checked as the certificate loop of pkcs11_authenticate() does
+ */
+static int check_certificate(X509 *x509, struct configuration_st *configuration,
+    const char *user)
+{
+  int match = 0;
+
+  if (user && configuration->map_before_verify) {
+    match = prematch_user(x509, user);
+    if (match < 0 || (match == 0 && prematch_is_final()))
+      return 0;
+  }
+  if (verify_certificate(x509, &configuration->policy) != 1)
+    return 0;
+  if (user) {
+    if (!match)
+      match = match_user(x509, user);
+  } else {
+    char *login = find_user(x509);
+    match = login != NULL;
+    free(login);
+  }
+  return match > 0;
+}
+
+/* first valid certificate of a scanned token mapped to the user, if any */
+static X509 *check_token(struct token_scan *scan,
+    struct configuration_st *configuration, const char *user)
+{
+  int i;
+
+  for (i = 0; i < scan->ncert; i++) {
+    X509 *x509 = (X509 *)get_X509_certificate(scan->certs[i]);
+    if (!x509) continue;
+    if (check_certificate(x509, configuration, user)) {
+      DBG2("slot %d: certificate #%d is valid and mapped", scan->slot + 1, i + 1);
+      return x509;
+    }
+    DBG2("slot %d: certificate #%d is not valid or not mapped", scan->slot + 1, i + 1);
+  }
+  return NULL;
+}
+
+/* fingerprint of a certificate, to recognise it in another list */
+static void cert_fingerprint(X509 *x509, char *buf, size_t size)
 {
-  int i, rv;
+  char **digest = cert_info(x509, CERT_DIGEST, ALGORITHM_SHA256);
+
+  buf[0] = '\0';
+  if (digest && digest[0]) {
+    snprintf(buf, size, "%s", digest[0]);
+    free(digest[0]);
+    digest[0] = NULL;
+  }
+}
+
+/*
+ * piv_fast_path: the PIV Authentication certificate is read straight from
+ * the card while the PKCS#11 session is being opened and the PIN typed.
+ * It is verified and mapped afterwards, on the calling thread.
+ */
+struct piv_fast_path {
+  const char *reader; /* reader named by slot_description, if any */
+  const char *user; /* user to match, NULL to find one */
+  struct configuration_st *configuration;
+  X509 *cert; /* certificate read from the card, if any */
+  struct auth_trace *trace;
+  pthread_t thread;
+  int threaded;
+};
+
+#ifndef HAVE_NSS
+static void *run_piv_fast_path(void *arg)
+{
+  struct piv_fast_path *fast = arg;
+  const unsigned char *p;
+  unsigned char *der;
+  size_t len;
+
+  auth_trace_use(fast->trace);
+  if (piv_read_auth_cert(fast->reader, fast->configuration->piv_atrs, &der, &len) != 0) {
+    DBG1("no PIV certificate read: %s", get_error());
+    return NULL;
+  }
+  p = der;
+  fast->cert = d2i_X509(NULL, &p, len);
+  free(der);
+  if (!fast->cert)
+    DBG("the PIV Authentication certificate cannot be decoded");
+  return NULL;
+}
+#endif
+
+static void start_piv_fast_path(struct piv_fast_path *fast,
+    struct configuration_st *configuration, const char *user)
+{
+  memset(fast, 0, sizeof(*fast));
+  if (configuration->slot_description != NULL &&
+      strcmp(configuration->slot_description, "none") != 0)
+    fast->reader = configuration->slot_description;
+  fast->user = is_spaced_str(user) ? NULL : user;
+  fast->configuration = configuration;
+  fast->trace = auth_trace_current();
+#ifdef HAVE_NSS
+  DBG("the PIV fast path is not supported with NSS");
+#else
+  fast->threaded = pthread_create(&fast->thread, NULL, run_piv_fast_path, fast) == 0;
+  if (!fast->threaded)
+    DBG("cannot start a thread for the PIV fast path, skipped");
+#endif
+}
+
+/*
+ * Wait for the fast path, if running. Unless verified is NULL or already
+ * holds a certificate, the certificate read is then verified and mapped,
+ * and its fingerprint handed over in verified if it passes.
+ */
+static void end_piv_fast_path(struct piv_fast_path *fast, char *verified, size_t size)
+{
+  struct timeval start;
+  int ok = 0;
+
+  if (!fast->threaded)
+    return;
+  gettimeofday(&start, NULL);
+  pthread_join(fast->thread, NULL);
+  fast->threaded = 0;
+#ifndef HAVE_NSS
+  if (fast->cert && verified && !verified[0]) {
+    ok = check_certificate(fast->cert, fast->configuration, fast->user);
+    DBG1("the PIV Authentication certificate is %s",
+      ok ? "valid and mapped" : "not valid or not mapped");
+    if (ok)
+      cert_fingerprint(fast->cert, verified, size);
+  }
+  if (fast->cert)
+    X509_free(fast->cert);
+  fast->cert = NULL;
+#endif
+  if (verified)
+    auth_trace_event("stage", "piv_fast_path", ok ? "ok" : "fail",
+      token_profile_elapsed(&start));
+}
+
+/*
+ * Scan every present token and make ph continue on the first one, in slot
+ * order, with a valid certificate mapped to the user; failing that, on the
+ * first one showing no certificate before login. The fingerprint of the
+ * certificate found, if any, is returned in verified.
+ * Returns 1 if ph was moved to a scanned token, 0 if it is left alone.
+ */
+static int select_token(pkcs11_handle_t *ph, struct configuration_st *configuration,
+    const char *user, char *verified, size_t size)
+{
+  pthread_mutex_t token_mutex = PTHREAD_MUTEX_INITIALIZER;
+  struct token_scan *scans;
+  unsigned int *slots;
+  X509 *cert = NULL;
+  int i, n, selected = -1, hidden = -1;
+
+  verified[0] = '\0';
+  n = find_token_slots(ph, &slots);
+  if (n < 2) {
+    free(slots);
+    return 0;
+  }
+  scans = calloc(n, sizeof(struct token_scan));
+  if (!scans) {
+    free(slots);
+    return 0;
+  }
+  if (is_spaced_str(user))
+    user = NULL;
+  DBG1("checking the certificates of %d tokens", n);
+  for (i = 0; i < n; i++) {
+    struct token_scan *scan = &scans[i];
+
+    scan->ph = dup_pkcs11_handle(ph);
+    if (!scan->ph) continue;
+    scan->slot = slots[i];
+    scan->token_mutex = configuration->support_threads ? NULL : &token_mutex;
+    scan->trace = auth_trace_current();
+    scan->threaded = pthread_create(&scan->thread, NULL, read_token, scan) == 0;
+    if (!scan->threaded) {
+      DBG1("cannot start a thread for slot %d, reading inline", slots[i] + 1);
+      read_token(scan);
+    }
+  }
+  /* certificates are checked in slot order, as each token is read; once a
+   * token is selected, the others are only waited for */
+  for (i = 0; i < n; i++) {
+    struct token_scan *scan = &scans[i];
+
+    if (scan->threaded)
+      pthread_join(scan->thread, NULL);
+    if (!scan->ph || selected >= 0) continue;
+    cert = check_token(scan, configuration, user);
+    if (cert)
+      selected = i;
+    else if (scan->opened && scan->ncert == 0 && hidden < 0)
+      hidden = i;
+  }
+  if (selected < 0)
+    selected = hidden;
+  if (selected >= 0) {
+    DBG2("continuing on slot %d (%s)", slots[selected] + 1,
+      cert ? "mapped certificate" : "certificates need login");
+    if (cert)
+      cert_fingerprint(cert, verified, size);
+    if (adopt_pkcs11_session(ph, scans[selected].ph) == 0) {
+      scans[selected].ph = NULL;
+    } else {
+      DBG1("adopt_pkcs11_session() failed: %s", get_error());
+      verified[0] = '\0';
+      selected = -1;
+    }
+  }
+  for (i = 0; i < n; i++)
+    if (scans[i].ph)
+      free_pkcs11_handle(scans[i].ph);
+  pthread_mutex_destroy(&token_mutex);
+  free(scans);
+  free(slots);
+  return selected >= 0;
+}
+
+static int pkcs11_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+  int i, rv, match, preverified;
   const char *user = NULL;
   char *password;
   unsigned int slot_num = 0;
@@ -225,6 +667,16 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
   char env_temp[256] = "";
   char **issuer, **serial;
   const char *login_token_name = NULL;
+  struct timeval start;
+  char verified[128]; /* certificate checked by the multi_token scan
+                        or the PIV fast path */
+  int token_selected = 0, mappers_loaded = 0;
+  struct piv_fast_path fast;
+  struct prefetch prefetch;
+  struct auth_trace *trace;
+
+  fast.threaded = 0;
+  prefetch.threaded = 0;
 
 #ifdef ENABLE_NLS
   setlocale(LC_ALL, "");
@@ -232,7 +684,8 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
   textdomain(PACKAGE);
 #endif
 
-  pam_prompt(pamh, PAM_TEXT_INFO , NULL, _("Smartcard authentication starts"));
+  msg_batch = 1;
+  pkcs11_message(pamh, PAM_TEXT_INFO, _("Smartcard authentication starts"));
 
   /* first of all check whether debugging should be enabled */
   for (i = 0; i < argc; i++)
@@ -246,6 +699,9 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 	ERR("Error setting configuration parameters");
 	return PAM_AUTHINFO_UNAVAIL;
   }
+  msg_batch = configuration->batch_messages;
+  if (!msg_batch)
+    flush_messages(pamh);
 
   /* Either slot_description or slot_num, but not both, needs to be used */
   if ((configuration->slot_description != NULL && configuration->slot_num != -1) || (configuration->slot_description == NULL && configuration->slot_num == -1)) {
@@ -320,9 +776,10 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
   } else {
 	rv = pam_get_item(pamh, PAM_USER, &user);
 	if (rv != PAM_SUCCESS || user == NULL || user[0] == '\0') {
-	  pam_prompt(pamh, PAM_TEXT_INFO, NULL,
+	  pkcs11_message(pamh, PAM_TEXT_INFO,
 		  _("Please insert your %s or enter your username."),
 		  _(configuration->token_type));
+	  flush_messages(pamh);
 	  /* get user name */
 	  rv = pam_get_user(pamh, &user, NULL);
 
@@ -342,6 +799,9 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     return PAM_IGNORE;
   }
 
+  /* keep the module between authentications of this process */
+  pkcs11_module_registry(configuration->module_cache_timeout);
+
   /* load pkcs #11 module */
   DBG("loading pkcs #11 module...");
   rv = load_pkcs11_module(configuration->pkcs11_modulepath, &ph);
@@ -351,12 +811,22 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     if (!configuration->quiet) {
 		pam_syslog(pamh, LOG_ERR, "load_pkcs11_module() failed loading %s: %s",
 			configuration->pkcs11_modulepath, get_error());
-		pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2302: PKCS#11 module failed loading"));
+		pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2302: PKCS#11 module failed loading"));
 		sleep(configuration->err_display_time);
 	}
     return PAM_AUTHINFO_UNAVAIL;
   }
 
+  /* give up on token operations that hang, below the tracer so that it
+   * records the cancelled calls */
+  if (configuration->token_timeout > 0)
+    use_pkcs11_deadline(ph, configuration->token_timeout,
+                        configuration->support_threads);
+
+  /* time every call made to the module */
+  if (configuration->pkcs11_trace)
+    use_pkcs11_trace(ph);
+
   /* initialise pkcs #11 module */
   DBG("initialising pkcs #11 module...");
   rv = init_pkcs11_module(ph,configuration->support_threads);
@@ -365,12 +835,16 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     ERR1("init_pkcs11_module() failed: %s", get_error());
     if (!configuration->quiet) {
 		pam_syslog(pamh, LOG_ERR, "init_pkcs11_module() failed: %s", get_error());
-		pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2304: PKCS#11 module could not be initialized"));
+		pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2304: PKCS#11 module could not be initialized"));
 		sleep(configuration->err_display_time);
 	}
     return PAM_AUTHINFO_UNAVAIL;
   }
 
+  /* learn and use per token model capabilities */
+  if (configuration->token_profile_dir != NULL)
+    use_token_profiles(ph, configuration->token_profile_dir);
+
   /* open pkcs #11 session */
   if (configuration->slot_description != NULL) {
     rv = find_slot_by_slotlabel_and_tokenlabel(ph,
@@ -384,7 +858,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     ERR("no suitable token available");
     if (!configuration->quiet) {
 		pam_syslog(pamh, LOG_ERR, "no suitable token available");
-		pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2306: No suitable token available"));
+		pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2306: No suitable token available"));
 		sleep(configuration->err_display_time);
 	}
 
@@ -397,13 +871,14 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
      * or because we used one to log in */
     if (login_token_name || configuration->wait_for_card) {
       if (login_token_name) {
-        pam_prompt(pamh, PAM_TEXT_INFO, NULL,
+        pkcs11_message(pamh, PAM_TEXT_INFO,
 			_("Please insert your smart card called \"%.32s\"."),
 			login_token_name);
       } else {
-        pam_prompt(pamh, PAM_TEXT_INFO, NULL,
+        pkcs11_message(pamh, PAM_TEXT_INFO,
                  _("Please insert your smart card."));
       }
+      flush_messages(pamh);
 
       if (configuration->slot_description != NULL) {
 	rv = wait_for_token_by_slotlabel(ph, configuration->slot_description,
@@ -419,7 +894,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
       }
     } else if (user) {
 		if (!configuration->quiet) {
-			pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2308: No smartcard found"));
+			pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2308: No smartcard found"));
 			sleep(configuration->err_display_time);
 		}
 
@@ -429,9 +904,10 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     } else {
       /* we haven't prompted for the user yet, get the user and see if
        * the smart card has been inserted in the mean time */
-      pam_prompt(pamh, PAM_TEXT_INFO, NULL,
+      pkcs11_message(pamh, PAM_TEXT_INFO,
 	    _("Please insert your %s or enter your username."),
 		_(configuration->token_type));
+      flush_messages(pamh);
       rv = pam_get_user(pamh, &user, NULL);
 
       /* check one last time for the smart card before bouncing to the next
@@ -446,7 +922,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
       if (rv != 0) {
         /* user gave us a user id and no smart card go to next module */
 		if (!configuration->quiet) {
-			pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2310: No smartcard found"));
+			pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2310: No smartcard found"));
 			sleep(configuration->err_display_time);
 		}
 
@@ -455,17 +931,46 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
       }
     }
   } else {
-      pam_prompt(pamh, PAM_TEXT_INFO, NULL,
+      pkcs11_message(pamh, PAM_TEXT_INFO,
 		  _("%s found."), _(configuration->token_type));
   }
-  rv = open_pkcs11_session(ph, slot_num);
+
+  /* from now on, every external call is timed in the trace (if any);
+   * the record goes with the PAM handle */
+  trace = auth_trace_begin(configuration->trace_file,
+    is_spaced_str(user) ? "find" : "match",
+    crl_policy_names[configuration->policy.crl_policy]);
+  if (trace)
+    pam_set_data(pamh, "pkcs11_auth_trace", trace, free_auth_trace);
+  verified[0] = '\0';
+  if (configuration->multi_token && login_token_name == NULL &&
+      (configuration->slot_num == 0 ||
+       (configuration->slot_description != NULL &&
+        strcmp(configuration->slot_description, "none") == 0))) {
+    /* the mapper chain tells which token holds the user's certificate */
+    gettimeofday(&start, NULL);
+    load_mappers(configuration->ctx);
+    auth_trace_event("stage", "load_mappers", "ok", token_profile_elapsed(&start));
+    mappers_loaded = 1;
+    gettimeofday(&start, NULL);
+    token_selected = select_token(ph, configuration, user, verified, sizeof(verified));
+    auth_trace_event("stage", "select_token", token_selected ? "ok" : "fail",
+      token_profile_elapsed(&start));
+  }
+  if (configuration->piv_fast_path && !token_selected)
+    start_piv_fast_path(&fast, configuration, user);
+  gettimeofday(&start, NULL);
+  rv = token_selected ? 0 : open_pkcs11_session(ph, slot_num);
+  auth_trace_event("stage", "session", rv == 0 ? "ok" : "error",
+    token_profile_elapsed(&start));
   if (rv != 0) {
     ERR1("open_pkcs11_session() failed: %s", get_error());
     if (!configuration->quiet) {
 		pam_syslog(pamh, LOG_ERR, "open_pkcs11_session() failed: %s", get_error());
-		pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2312: open PKCS#11 session failed"));
+		pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2312: open PKCS#11 session failed"));
 		sleep(configuration->err_display_time);
 	}
+    end_piv_fast_path(&fast, NULL, 0);
     release_pkcs11_module(ph);
     return pkcs11_pam_fail;
   }
@@ -475,18 +980,28 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     ERR1("get_slot_login_required() failed: %s", get_error());
     if (!configuration->quiet) {
 		pam_syslog(pamh, LOG_ERR, "get_slot_login_required() failed: %s", get_error());
-		pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2314: Slot login failed"));
+		pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2314: Slot login failed"));
 		sleep(configuration->err_display_time);
 	}
+    end_piv_fast_path(&fast, NULL, 0);
+    close_pkcs11_session(ph);
     release_pkcs11_module(ph);
     return pkcs11_pam_fail;
   } else if (rv) {
     /* get password */
-	pam_prompt(pamh, PAM_TEXT_INFO, NULL,
+	pkcs11_message(pamh, PAM_TEXT_INFO,
 		_("Welcome %.32s!"), get_slot_tokenlabel(ph));
 
 	/* no CKF_PROTECTED_AUTHENTICATION_PATH */
 	rv = get_slot_protected_authentication_path(ph);
+
+	/* tokens known (or not yet known not) to show their certificates
+	 * before login get them read, or counted, while the user is typing
+	 * the PIN; a failure is not fatal, the list is read after login */
+	if (configuration->token_profile_dir != NULL &&
+	    get_slot_certs_visible(ph) != TOKEN_CAP_NO)
+		start_prefetch(&prefetch, ph);
+
 	if ((-1 == rv) || (0 == rv))
 	{
 		char password_prompt[128];
@@ -502,9 +1017,12 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 		}
 		if (rv != PAM_SUCCESS) {
 			if (!configuration->quiet) {
-				pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2316: password could not be read"));
+				pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2316: password could not be read"));
 				sleep(configuration->err_display_time);
 			}
+			end_piv_fast_path(&fast, NULL, 0);
+			end_prefetch(&prefetch);
+			close_pkcs11_session(ph);
 			release_pkcs11_module(ph);
 			pam_syslog(pamh, LOG_ERR,
 					"pam_get_pwd() failed: %s", pam_strerror(pamh, rv));
@@ -516,13 +1034,16 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 
 		/* check password length */
 		if (!configuration->nullok && strlen(password) == 0) {
+			end_piv_fast_path(&fast, NULL, 0);
+			end_prefetch(&prefetch);
+			close_pkcs11_session(ph);
 			release_pkcs11_module(ph);
 			cleanse(password, strlen(password));
 			free(password);
 			pam_syslog(pamh, LOG_ERR,
 					"password length is zero but the 'nullok' argument was not defined.");
 			if (!configuration->quiet) {
-				pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2318: Empty smartcard PIN not allowed."));
+				pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2318: Empty smartcard PIN not allowed."));
 				sleep(configuration->err_display_time);
 			}
 			return PAM_AUTH_ERR;
@@ -530,8 +1051,9 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 	}
 	else
 	{
-		pam_prompt(pamh, PAM_TEXT_INFO, NULL,
+		pkcs11_message(pamh, PAM_TEXT_INFO,
 			_("Enter your %s PIN on the pinpad"), _(configuration->token_type));
+		flush_messages(pamh);
 		/* use pin pad */
 		password = NULL;
 	}
@@ -539,7 +1061,11 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     /* call pkcs#11 login to ensure that the user is the real owner of the card
      * we need to do thise before get_certificate_list because some tokens
      * can not read their certificates until the token is authenticated */
+    end_prefetch(&prefetch);
+    gettimeofday(&start, NULL);
     rv = pkcs11_login(ph, password);
+    auth_trace_event("stage", "login", rv == 0 ? "ok" : "error",
+      token_profile_elapsed(&start));
     /* erase and free in-memory password data asap */
 	if (password)
 	{
@@ -550,38 +1076,95 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
       ERR1("open_pkcs11_login() failed: %s", get_error());
 		if (!configuration->quiet) {
 			pam_syslog(pamh, LOG_ERR, "open_pkcs11_login() failed: %s", get_error());
-			pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2320: Wrong smartcard PIN"));
+			pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2320: Wrong smartcard PIN"));
 			sleep(configuration->err_display_time);
 		}
       goto auth_failed_nopw;
     }
   }
 
+  /* the certificate read by the fast path is recognised in the list */
+  if (fast.threaded && !mappers_loaded) {
+    gettimeofday(&start, NULL);
+    load_mappers(configuration->ctx);
+    auth_trace_event("stage", "load_mappers", "ok", token_profile_elapsed(&start));
+    mappers_loaded = 1;
+  }
+  end_piv_fast_path(&fast, verified, sizeof(verified));
+
+  gettimeofday(&start, NULL);
   cert_list = get_certificate_list(ph, &ncert);
+  auth_trace_event("stage", "certlist", cert_list ? "ok" : "error",
+    token_profile_elapsed(&start));
+  for (i = 0; cert_list && i < ncert; i++) {
+    X509 *x509 = (X509 *)get_X509_certificate(cert_list[i]);
+    if (x509) auth_trace_cert(i + 1, x509);
+  }
   if (rv<0) {
     ERR1("get_certificate_list() failed: %s", get_error());
     if (!configuration->quiet) {
 		pam_syslog(pamh, LOG_ERR, "get_certificate_list() failed: %s", get_error());
-		pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2322: No certificate found"));
+		pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2322: No certificate found"));
 		sleep(configuration->err_display_time);
 	}
     goto auth_failed_nopw;
   }
 
   /* load mapper modules */
-  load_mappers(configuration->ctx);
+  if (!mappers_loaded) {
+    gettimeofday(&start, NULL);
+    load_mappers(configuration->ctx);
+    auth_trace_event("stage", "load_mappers", "ok", token_profile_elapsed(&start));
+  }
 
   /* find a valid and matching certificates */
   for (i = 0; i < ncert; i++) {
     X509 *x509 = (X509 *)get_X509_certificate(cert_list[i]);
     if (!x509 ) continue; /* sanity check */
+    auth_trace_set_cert(i + 1);
+
+    /* with multi_token or piv_fast_path, the certificate which selected
+       the token, or was read from the card, has already been verified
+       and mapped */
+    preverified = 0;
+    if (verified[0]) {
+      char fingerprint[128];
+      cert_fingerprint(x509, fingerprint, sizeof(fingerprint));
+      preverified = strcmp(fingerprint, verified) == 0;
+    }
+
+    /* with map_before_verify, skip the certificates of somebody else
+       before the verification, which may have to download CRLs.
+       Only the mappers allowed before the verification run here: a
+       certificate they do not map is still verified and given to the
+       whole chain, unless they are the whole chain.
+       A mapper error is only reported for a valid certificate, as
+       it would be without the option */
+    match = preverified;
+    if (configuration->map_before_verify && !is_spaced_str(user) && !preverified) {
+      gettimeofday(&start, NULL);
+      match = prematch_user(x509, user);
+      auth_trace_event("prematch", NULL, match > 0 ? "ok" : (match ? "error" : "fail"),
+        token_profile_elapsed(&start));
+      if (match == 0 && prematch_is_final()) {
+        DBG1("certificate #%d does not match the user, not verified", i + 1);
+        continue; /* try next certificate */
+      }
+    }
+
     DBG1("verifying the certificate #%d", i + 1);
-	if (!configuration->quiet) {
-		pam_prompt(pamh, PAM_TEXT_INFO, NULL, _("verifying certificate"));
+	if (!configuration->quiet && configuration->cert_progress) {
+		pkcs11_message(pamh, PAM_TEXT_INFO, _("verifying certificate"));
 	}
 
       /* verify certificate (date, signature, CRL, ...) */
-      rv = verify_certificate(x509,&configuration->policy);
+      gettimeofday(&start, NULL);
+      rv = preverified ? 1 : verify_certificate(x509,&configuration->policy);
+      {
+        char result[16];
+        snprintf(result, sizeof(result), "%d", rv);
+        auth_trace_event("verify", NULL, result, token_profile_elapsed(&start));
+      }
       if (rv < 0) {
         ERR1("verify_certificate() failed: %s", get_error());
         if (!configuration->quiet) {
@@ -589,19 +1172,19 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
                    "verify_certificate() failed: %s", get_error());
 			switch (rv) {
 				case -2: // X509_V_ERR_CERT_HAS_EXPIRED:
-					pam_prompt(pamh, PAM_ERROR_MSG , NULL,
+					pkcs11_message(pamh, PAM_ERROR_MSG,
 						_("Error 2324: Certificate has expired"));
 					break;
 				case -3: // X509_V_ERR_CERT_NOT_YET_VALID:
-					pam_prompt(pamh, PAM_ERROR_MSG , NULL,
+					pkcs11_message(pamh, PAM_ERROR_MSG,
 						_("Error 2326: Certificate not yet valid"));
 					break;
 				case -4: // X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY:
-					pam_prompt(pamh, PAM_ERROR_MSG , NULL,
+					pkcs11_message(pamh, PAM_ERROR_MSG,
 						_("Error 2328: Certificate signature invalid"));
 					break;
 				default:
-					pam_prompt(pamh, PAM_ERROR_MSG , NULL,
+					pkcs11_message(pamh, PAM_ERROR_MSG,
 						_("Error 2330: Certificate invalid"));
 					break;
 			}
@@ -637,7 +1220,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
             if (!configuration->quiet) {
 				pam_syslog(pamh, LOG_ERR,
                        "pam_set_item() failed %s", pam_strerror(pamh, rv));
-				pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2332: setting PAM userentry failed"));
+				pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2332: setting PAM userentry failed"));
 				sleep(configuration->err_display_time);
 			}
 	    goto auth_failed_nopw;
@@ -648,12 +1231,12 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     } else {
       /* User provided:
          check whether the certificate matches the user */
-        rv = match_user(x509, user);
+        rv = match ? match : match_user(x509, user);
         if (rv < 0) { /* match error; abort and return */
           ERR1("match_user() failed: %s", get_error());
 			if (!configuration->quiet) {
 				pam_syslog(pamh, LOG_ERR, "match_user() failed: %s", get_error());
-				pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2334: No matching user"));
+				pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2334: No matching user"));
 				sleep(configuration->err_display_time);
 			}
 	  goto auth_failed_nopw;
@@ -674,16 +1257,17 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 		if (!configuration->quiet) {
 			pam_syslog(pamh, LOG_ERR,
 				"no valid certificate which meets all requirements found");
-		pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2336: No matching certificate found"));
+		pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2336: No matching certificate found"));
 		sleep(configuration->err_display_time);
 	}
     goto auth_failed_nopw;
   }
+  auth_trace_event("chosen", NULL, "ok", 0);
 
 
   /* if signature check is enforced, generate random data, sign and verify */
   if (configuration->policy.signature_policy) {
-		pam_prompt(pamh, PAM_TEXT_INFO, NULL, _("Checking signature"));
+		pkcs11_message(pamh, PAM_TEXT_INFO, _("Checking signature"));
 
 
 #ifdef notdef
@@ -703,7 +1287,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
       ERR1("get_random_value() failed: %s", get_error());
 		if (!configuration->quiet){
 			pam_syslog(pamh, LOG_ERR, "get_random_value() failed: %s", get_error());
-			pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2338: Getting random value failed"));
+			pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2338: Getting random value failed"));
 			sleep(configuration->err_display_time);
 		}
       goto auth_failed_nopw;
@@ -711,13 +1295,16 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
 
     /* sign random value */
     signature = NULL;
+    gettimeofday(&start, NULL);
     rv = sign_value(ph, chosen_cert, random_value, sizeof(random_value),
 		    &signature, &signature_length);
+    auth_trace_event("stage", "sign", rv == 0 ? "ok" : "error",
+      token_profile_elapsed(&start));
     if (rv != 0) {
       ERR1("sign_value() failed: %s", get_error());
 		if (!configuration->quiet) {
 			pam_syslog(pamh, LOG_ERR, "sign_value() failed: %s", get_error());
-			pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2340: Signing failed"));
+			pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2340: Signing failed"));
 			sleep(configuration->err_display_time);
 		}
       goto auth_failed_nopw;
@@ -736,7 +1323,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
       ERR1("verify_signature() failed: %s", get_error());
 		if (!configuration->quiet) {
 			pam_syslog(pamh, LOG_ERR, "verify_signature() failed: %s", get_error());
-			pam_prompt(pamh, PAM_ERROR_MSG , NULL, _("Error 2342: Verifying signature failed"));
+			pkcs11_message(pamh, PAM_ERROR_MSG, _("Error 2342: Verifying signature failed"));
 			sleep(configuration->err_display_time);
 		}
       return PAM_AUTH_ERR;
@@ -763,6 +1350,22 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
            pam_strerror(pamh, rv));
   }
 
+  /* token serial and slot identify the sessions to act on at card removal */
+  if (get_slot_tokenserial(ph) && *get_slot_tokenserial(ph)) {
+    snprintf(env_temp, sizeof(env_temp) - 1,
+	   "PKCS11_LOGIN_TOKEN_SERIAL=%.*s",
+	   (int)((sizeof(env_temp) - 1) - strlen("PKCS11_LOGIN_TOKEN_SERIAL=") -1),
+	   get_slot_tokenserial(ph));
+    pam_putenv(pamh, env_temp);
+  }
+  if (get_slot_description(ph) && *get_slot_description(ph)) {
+    snprintf(env_temp, sizeof(env_temp) - 1,
+	   "PKCS11_LOGIN_SLOT=%.*s",
+	   (int)((sizeof(env_temp) - 1) - strlen("PKCS11_LOGIN_SLOT=") -1),
+	   get_slot_description(ph));
+    pam_putenv(pamh, env_temp);
+  }
+
   issuer = cert_info((X509 *)get_X509_certificate(chosen_cert), CERT_ISSUER,
                      ALGORITHM_NULL);
   if (issuer) {
@@ -808,7 +1411,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
   }
 
   /* unload mapper modules */
-  unload_mappers();
+  release_mappers();
 
   /* close pkcs #11 session */
   rv = close_pkcs11_session(ph);
@@ -817,7 +1420,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     ERR1("close_pkcs11_session() failed: %s", get_error());
 		if (!configuration->quiet) {
 			pam_syslog(pamh, LOG_ERR, "close_pkcs11_module() failed: %s", get_error());
-			pam_prompt(pamh, PAM_ERROR_MSG , NULL, ("Error 2344: Closing PKCS#11 session failed"));
+			pkcs11_message(pamh, PAM_ERROR_MSG, ("Error 2344: Closing PKCS#11 session failed"));
 			sleep(configuration->err_display_time);
 		}
     return pkcs11_pam_fail;
@@ -835,12 +1438,24 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, cons
     free(password); /* erase and free in-memory password data */
 
 auth_failed_nopw:
-    unload_mappers();
+    end_piv_fast_path(&fast, NULL, 0);
+    release_mappers();
     close_pkcs11_session(ph);
     release_pkcs11_module(ph);
     return pkcs11_pam_fail;
 }
 
+PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv)
+{
+  int rv = pkcs11_authenticate(pamh, flags, argc, argv);
+  /* messages queued since the last prompt */
+  flush_messages(pamh);
+  /* store the trace record, if one has been started */
+  auth_trace_end(rv == PAM_SUCCESS ? "success" :
+    rv == PAM_IGNORE ? "ignore" : "failure");
+  return rv;
+}
+
 PAM_EXTERN int pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
   DBG("pam_sm_setcred() called");
@@ -856,20 +1471,104 @@ PAM_EXTERN int pam_sm_acct_mgmt(pam_handle_t *pamh, int flags, int argc, const c
   return PAM_SERVICE_ERR;
 }
 
+static void free_session_id(pam_handle_t *pamh, void *data, int error_status)
+{
+  free(data);
+}
+
+/*
+ * Add or remove the session in the session registry, under the serial
+ * (or label) of the token used to authenticate and under its slot.
+ */
+static int update_session_registry(pam_handle_t *pamh, int argc, const char **argv, int open)
+{
+  struct configuration_st *configuration;
+  session_entry_t entry;
+  const char *value, *id = NULL;
+  char key[2][256];
+  const void *data;
+  int i, rv = 0;
+
+  configuration = pk_configure(argc, argv);
+  if (!configuration) {
+    ERR("Error setting configuration parameters");
+    return PAM_SERVICE_ERR;
+  }
+  if (!configuration->session_registry) {
+    ERR("Warning: no session_registry configured, session is not recorded");
+    pam_syslog(pamh, LOG_WARNING,
+               "no session_registry configured, session is not recorded");
+    return PAM_SERVICE_ERR;
+  }
+  /* the session was not opened with a smart card: nothing to track */
+  if (!pam_getenv(pamh, "PKCS11_LOGIN_TOKEN_NAME")) {
+    DBG("session not opened with a token");
+    return PAM_IGNORE;
+  }
+
+  /* the id chosen when opening is kept, XDG_SESSION_ID may appear later */
+  if (pam_get_data(pamh, "pkcs11_session_id", &data) == PAM_SUCCESS && data) {
+    id = data;
+  }
+  memset(&entry, 0, sizeof(entry));
+  if (!id) {
+    value = pam_getenv(pamh, "XDG_SESSION_ID");
+    if (value && *value) {
+      snprintf(entry.id, sizeof(entry.id), "%s", value);
+    } else {
+      snprintf(entry.id, sizeof(entry.id), "pid%ld", (long)getpid());
+    }
+    if (open) {
+      pam_set_data(pamh, "pkcs11_session_id", strdup(entry.id), free_session_id);
+    }
+  } else {
+    snprintf(entry.id, sizeof(entry.id), "%s", id);
+  }
+
+  memset(key, 0, sizeof(key));
+  if (!session_registry_key(key[0], sizeof(key[0]), SESSION_KEY_TOKEN,
+                            pam_getenv(pamh, "PKCS11_LOGIN_TOKEN_SERIAL"))) {
+    session_registry_key(key[0], sizeof(key[0]), SESSION_KEY_LABEL,
+                         pam_getenv(pamh, "PKCS11_LOGIN_TOKEN_NAME"));
+  }
+  session_registry_key(key[1], sizeof(key[1]), SESSION_KEY_SLOT,
+                       pam_getenv(pamh, "PKCS11_LOGIN_SLOT"));
+
+  if (open) {
+    if (pam_get_item(pamh, PAM_USER, &data) == PAM_SUCCESS && data)
+      snprintf(entry.user, sizeof(entry.user), "%s", (const char *)data);
+    if (pam_get_item(pamh, PAM_TTY, &data) == PAM_SUCCESS && data)
+      snprintf(entry.tty, sizeof(entry.tty), "%s", (const char *)data);
+    value = pam_getenv(pamh, "XDG_SEAT");
+    if (value)
+      snprintf(entry.seat, sizeof(entry.seat), "%s", value);
+    entry.pid = getpid();
+  }
+
+  for (i = 0; i < 2; i++) {
+    if (!key[i][0]) continue;
+    if (open)
+      rv = session_registry_add(configuration->session_registry, key[i], &entry);
+    else
+      rv = session_registry_remove(configuration->session_registry, key[i], entry.id);
+    if (rv < 0) {
+      ERR1("session registry update failed: %s", get_error());
+      if (!configuration->quiet)
+        pam_syslog(pamh, LOG_ERR, "session registry update failed: %s", get_error());
+      return PAM_SESSION_ERR;
+    }
+  }
+  return PAM_SUCCESS;
+}
+
 PAM_EXTERN int pam_sm_open_session(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
-  ERR("Warning: Function pam_sm_open_session() is not implemented in this module");
-  pam_syslog(pamh, LOG_WARNING,
-             "Function pm_sm_open_session() is not implemented in this module");
-  return PAM_SERVICE_ERR;
+  return update_session_registry(pamh, argc, argv, 1);
 }
 
 PAM_EXTERN int pam_sm_close_session(pam_handle_t *pamh, int flags, int argc, const char **argv)
 {
-  ERR("Warning: Function pam_sm_close_session() is not implemented in this module");
-  pam_syslog(pamh, LOG_WARNING,
-           "Function pm_sm_close_session() is not implemented in this module");
-  return PAM_SERVICE_ERR;
+  return update_session_registry(pamh, argc, argv, 0);
 }
 
 PAM_EXTERN int pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
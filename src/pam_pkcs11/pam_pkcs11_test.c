@@ -0,0 +1,206 @@
+/*
+ * PAM-PKCS11 conversation with the application
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/*
+* Checks the batched messages against stand-in applications: one taking
+* any number of messages per conv() call, one taking a single message per
+* call, and ones refusing some or all messages. The PAM calls the module
+* makes are provided here, and every response is allocated, so that a
+* response released twice or read past its end shows up.
+* The module source is included to reach its static functions.
+*/
+
+#include "pam_pkcs11.c"
+
+static int failures = 0;
+
+#define CHECK(cond, what) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s (line %d)\n", what, __LINE__); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+* the application
+*/
+static int max_messages; /* messages taken per conv() call, 0 for any */
+static int refuse_all; /* every call fails */
+static const char *refused; /* a message the application cannot show */
+static int calls;
+static char shown[4096]; /* messages shown, one per line */
+static char logged[4096]; /* messages sent to syslog instead */
+static int log_seen; /* logged is filled in: pam_syslog() is not ours otherwise */
+
+static int conversation(int n, const struct pam_message **msgp,
+		struct pam_response **resp, void *appdata_ptr) {
+	struct pam_response *r;
+	int i;
+
+	calls++;
+	if (refuse_all || (max_messages && n > max_messages))
+		return PAM_CONV_ERR;
+	for (i = 0; i < n; i++)
+		if (refused && !strcmp(msgp[i]->msg, refused))
+			return PAM_CONV_ERR;
+	r = calloc(n, sizeof(*r));
+	if (!r) return PAM_BUF_ERR;
+	for (i = 0; i < n; i++) {
+		strcat(shown, msgp[i]->msg);
+		strcat(shown, "\n");
+		r[i].resp = strdup(msgp[i]->msg_style == PAM_PROMPT_ECHO_OFF ? "123456" : "");
+	}
+	*resp = r;
+	return PAM_SUCCESS;
+}
+
+static struct pam_conv application = { conversation, NULL };
+
+int pam_get_item(const pam_handle_t *pamh, int item_type, const void **item) {
+	if (item_type != PAM_CONV) return PAM_SYSTEM_ERR;
+	*item = &application;
+	return PAM_SUCCESS;
+}
+
+#if defined(HAVE_SECURITY_PAM_EXT_H) && !defined(OPENPAM)
+void pam_syslog(const pam_handle_t *pamh, int priority, const char *fmt, ...) {
+	size_t len = strlen(logged);
+	va_list va;
+
+	log_seen = 1;
+	va_start(va, fmt);
+	vsnprintf(logged + len, sizeof(logged) - len, fmt, va);
+	va_end(va);
+	strncat(logged, "\n", sizeof(logged) - strlen(logged) - 1);
+}
+#endif
+
+static void reset(int max, const char *refuse) {
+	max_messages = max;
+	refused = refuse;
+	refuse_all = 0;
+	calls = 0;
+	shown[0] = logged[0] = '\0';
+}
+
+static void queue(const char *first, ...) {
+	const char *text;
+	va_list va;
+
+	va_start(va, first);
+	for (text = first; text; text = va_arg(va, const char *))
+		pkcs11_message(NULL, PAM_TEXT_INFO, "%s", text);
+	va_end(va);
+}
+
+static int prompt(char **answer) {
+	struct pam_message msg;
+
+	msg.msg_style = PAM_PROMPT_ECHO_OFF;
+	msg.msg = "PIN:";
+	*answer = NULL;
+	return converse(NULL, &msg, answer);
+}
+
+int main(int argc, char **argv) {
+	char expected[4096], text[32];
+	char *answer;
+	int i, rv;
+
+	/* messages go along with the prompt */
+	reset(0, NULL);
+	queue("one", "two", NULL);
+	CHECK(calls == 0 && msg_queued == 2, "information queued");
+	rv = prompt(&answer);
+	CHECK(rv == PAM_SUCCESS && answer && !strcmp(answer, "123456"), "batched prompt answered");
+	CHECK(calls == 1 && !strcmp(shown, "one\ntwo\nPIN:\n"), "one call for the batch");
+	CHECK(msg_queued == 0, "queue emptied");
+	free(answer);
+
+	/* or are sent on their own */
+	reset(0, NULL);
+	queue("one", "two", NULL);
+	flush_messages(NULL);
+	CHECK(calls == 1 && !strcmp(shown, "one\ntwo\n"), "batch flushed");
+	flush_messages(NULL);
+	CHECK(calls == 1, "nothing to flush");
+
+	/* one message per call: the batch is sent again one by one */
+	reset(1, NULL);
+	queue("one", "two", "three", NULL);
+	flush_messages(NULL);
+	CHECK(calls == 4 && !strcmp(shown, "one\ntwo\nthree\n"), "flushed one by one");
+	CHECK(msg_queued == 0, "queue emptied after one by one flush");
+
+	reset(1, NULL);
+	queue("one", "two", NULL);
+	rv = prompt(&answer);
+	CHECK(rv == PAM_SUCCESS && answer && !strcmp(answer, "123456"), "prompt answered alone");
+	CHECK(calls == 4 && !strcmp(shown, "one\ntwo\nPIN:\n"), "prompt after messages one by one");
+	free(answer);
+
+	reset(1, NULL);
+	queue("one", NULL);
+	pkcs11_message(NULL, PAM_ERROR_MSG, "%s", "bad");
+	CHECK(calls == 3 && !strcmp(shown, "one\nbad\n"), "error message after messages one by one");
+
+	/* a full queue goes out with the next message */
+	reset(1, NULL);
+	expected[0] = '\0';
+	for (i = 0; i <= MSG_QUEUE_SIZE; i++) {
+		snprintf(text, sizeof(text), "message %d", i);
+		pkcs11_message(NULL, PAM_TEXT_INFO, "%s", text);
+		strcat(expected, text);
+		strcat(expected, "\n");
+	}
+	CHECK(calls == MSG_QUEUE_SIZE + 2 && !strcmp(shown, expected), "full queue sent one by one");
+	CHECK(msg_queued == 0, "full queue emptied");
+
+	/* a message the application cannot show is logged */
+	reset(1, "two");
+	queue("one", "two", "three", NULL);
+	flush_messages(NULL);
+	CHECK(calls == 4 && !strcmp(shown, "one\nthree\n"), "others shown");
+	CHECK(!log_seen || !strcmp(logged, "two\n"), "refused message logged");
+
+	reset(1, "one");
+	queue("one", "two", NULL);
+	rv = prompt(&answer);
+	CHECK(rv == PAM_SUCCESS && answer && !strcmp(answer, "123456"), "prompt after a refused message");
+	CHECK(!strcmp(shown, "two\nPIN:\n"), "message after a refused message");
+	CHECK(!log_seen || !strcmp(logged, "one\n"), "first message logged");
+	free(answer);
+
+	/* an application showing nothing at all */
+	reset(0, NULL);
+	refuse_all = 1;
+	queue("one", "two", NULL);
+	rv = prompt(&answer);
+	CHECK(rv == PAM_CONV_ERR && !answer, "prompt refused");
+	CHECK(calls == 4 && msg_queued == 0, "every message tried");
+	CHECK(!log_seen || !strcmp(logged, "one\ntwo\n"), "all messages logged");
+	queue("three", NULL);
+	flush_messages(NULL);
+	CHECK(msg_queued == 0, "queue emptied when nothing is shown");
+
+	if (failures) fprintf(stderr, "%d check(s) failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * PAM-PKCS11 direct PIV card access
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+#define __PIV_CARD_C_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "../common/debug.h"
+#include "../common/error.h"
+#include "piv_card.h"
+
+#ifdef HAVE_PCSC
+
+#include <pcsclite.h>
+#include <wintypes.h>
+#include <winscard.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/* SELECT of the PIV application, PIX truncated to its version independent part */
+static const unsigned char piv_select[] = {
+	0x00, 0xA4, 0x04, 0x00, 0x09,
+	0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00,
+	0x00
+};
+
+/* GET DATA of the PIV Authentication certificate container, 5FC105 */
+static const unsigned char piv_get_auth_cert[] = {
+	0x00, 0xCB, 0x3F, 0xFF, 0x05, 0x5C, 0x03, 0x5F, 0xC1, 0x05,
+	0x00
+};
+
+/* biggest container read, and biggest certificate once inflated */
+#define PIV_MAX_OBJECT 16384
+#define PIV_MAX_CERT 65536
+
+/*
+* Send a case 4 APDU and collect the whole answer in buf, whose size is
+* given in len, following the 61xx (more data) and 6Cxx (wrong length)
+* status words. Returns the last status word, -1 on a transmission error.
+*/
+static int piv_transmit(SCARDHANDLE card, const SCARD_IO_REQUEST *pci,
+	const unsigned char *apdu, DWORD apdu_len, unsigned char *buf, size_t *len)
+{
+	unsigned char cmd[16], rsp[258];
+	DWORD cmd_len, rsp_len;
+	size_t size = *len;
+	int i, sw1, sw2;
+	LONG rv;
+
+	memcpy(cmd, apdu, apdu_len);
+	cmd_len = apdu_len;
+	/* T=0 does not carry the Le of a case 4 APDU, the card answers 61xx */
+	if (pci == SCARD_PCI_T0)
+		cmd_len--;
+	*len = 0;
+	for (i = 0; i < PIV_MAX_OBJECT / 256 + 2; i++) {
+		rsp_len = sizeof(rsp);
+		rv = SCardTransmit(card, pci, cmd, cmd_len, NULL, rsp, &rsp_len);
+		if (rv != SCARD_S_SUCCESS) {
+			set_error("SCardTransmit() failed: %s", pcsc_stringify_error(rv));
+			return -1;
+		}
+		if (rsp_len < 2) {
+			set_error("truncated answer from the card");
+			return -1;
+		}
+		sw1 = rsp[rsp_len - 2];
+		sw2 = rsp[rsp_len - 1];
+		rsp_len -= 2;
+		if (rsp_len > size - *len) {
+			set_error("answer of the card too long");
+			return -1;
+		}
+		memcpy(buf + *len, rsp, rsp_len);
+		*len += rsp_len;
+		if (sw1 == 0x61) {
+			/* GET RESPONSE */
+			cmd[0] = 0x00; cmd[1] = 0xC0; cmd[2] = 0x00; cmd[3] = 0x00;
+			cmd[4] = sw2;
+			cmd_len = 5;
+		} else if (sw1 == 0x6C) {
+			/* same command, with the length the card asks for */
+			cmd[cmd_len - 1] = sw2;
+		} else {
+			return (sw1 << 8) | sw2;
+		}
+	}
+	set_error("the card keeps on answering");
+	return -1;
+}
+
+/* value of a one byte tag among the BER-TLVs in [p, end), or NULL */
+static const unsigned char *piv_find_tag(const unsigned char *p,
+	const unsigned char *end, unsigned char tag, size_t *len)
+{
+	while (end - p >= 2) {
+		unsigned char t = *p++;
+		size_t l = *p++;
+
+		if (l & 0x80) {
+			int n = l & 0x7F;
+
+			if (n < 1 || n > 3 || end - p < n)
+				return NULL;
+			for (l = 0; n > 0; n--)
+				l = (l << 8) | *p++;
+		}
+		if ((size_t)(end - p) < l)
+			return NULL;
+		if (t == tag) {
+			*len = l;
+			return p;
+		}
+		p += l;
+	}
+	return NULL;
+}
+
+#ifdef HAVE_ZLIB
+static int piv_inflate(const unsigned char *in, size_t in_len,
+	unsigned char **out, size_t *out_len)
+{
+	z_stream z;
+	unsigned char *buf;
+	int rv;
+
+	buf = malloc(PIV_MAX_CERT);
+	if (!buf) {
+		set_error("not enough free memory available");
+		return -1;
+	}
+	memset(&z, 0, sizeof(z));
+	/* 15 + 32: gzip or zlib header, both are met on cards */
+	if (inflateInit2(&z, 15 + 32) != Z_OK) {
+		free(buf);
+		set_error("inflateInit2() failed");
+		return -1;
+	}
+	z.next_in = (Bytef *)in;
+	z.avail_in = in_len;
+	z.next_out = buf;
+	z.avail_out = PIV_MAX_CERT;
+	rv = inflate(&z, Z_FINISH);
+	*out_len = z.total_out;
+	inflateEnd(&z);
+	if (rv != Z_STREAM_END) {
+		free(buf);
+		set_error("cannot inflate the certificate: %d", rv);
+		return -1;
+	}
+	*out = buf;
+	return 0;
+}
+#endif
+
+/* take the certificate out of its container */
+static int piv_parse_cert(const unsigned char *object, size_t object_len,
+	unsigned char **der, size_t *der_len)
+{
+	const unsigned char *data, *cert, *info;
+	size_t data_len, cert_len, info_len;
+
+	data = piv_find_tag(object, object + object_len, 0x53, &data_len);
+	if (!data) {
+		set_error("malformed PIV certificate container");
+		return -1;
+	}
+	cert = piv_find_tag(data, data + data_len, 0x70, &cert_len);
+	if (!cert || cert_len == 0) {
+		set_error("no certificate in the PIV container");
+		return -1;
+	}
+	/* CertInfo, bit 0: the certificate is compressed */
+	info = piv_find_tag(data, data + data_len, 0x71, &info_len);
+	if (info && info_len > 0 && (info[0] & 0x01)) {
+#ifdef HAVE_ZLIB
+		DBG1("inflating a %d bytes certificate", (int)cert_len);
+		return piv_inflate(cert, cert_len, der, der_len);
+#else
+		set_error("compressed PIV certificate, no zlib support");
+		return -1;
+#endif
+	}
+	*der = malloc(cert_len);
+	if (!*der) {
+		set_error("not enough free memory available");
+		return -1;
+	}
+	memcpy(*der, cert, cert_len);
+	*der_len = cert_len;
+	return 0;
+}
+
+/* whether an ATR starts with one of the prefixes */
+static int piv_atr_match(const unsigned char *atr, DWORD atr_len, const char **atrs)
+{
+	for (; *atrs; atrs++) {
+		const char *p = *atrs;
+		unsigned int byte;
+		DWORD i = 0;
+
+		while (*p) {
+			if (*p == ':' || *p == ' ') {
+				p++;
+				continue;
+			}
+			if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]) ||
+			    sscanf(p, "%2x", &byte) != 1)
+				break;
+			if (i >= atr_len || atr[i] != byte)
+				break;
+			i++;
+			p += 2;
+		}
+		if (*p == '\0' && i > 0)
+			return 1;
+	}
+	return 0;
+}
+
+int piv_read_auth_cert(const char *reader, const char **atrs,
+	unsigned char **der, size_t *der_len)
+{
+	SCARDCONTEXT ctx;
+	SCARDHANDLE card;
+	SCARD_READERSTATE *states = NULL;
+	DWORD readers_len, protocol, i, count = 0;
+	const SCARD_IO_REQUEST *pci;
+	char *readers = NULL, *name;
+	unsigned char *object = NULL;
+	size_t len;
+	int rv = -1, sw, chosen = -1;
+	LONG lrv;
+
+	*der = NULL;
+	*der_len = 0;
+	lrv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx);
+	if (lrv != SCARD_S_SUCCESS) {
+		set_error("SCardEstablishContext() failed: %s", pcsc_stringify_error(lrv));
+		return -1;
+	}
+	lrv = SCardListReaders(ctx, NULL, NULL, &readers_len);
+	if (lrv == SCARD_S_SUCCESS) {
+		readers = malloc(readers_len);
+		if (!readers) {
+			set_error("not enough free memory available");
+			goto end;
+		}
+		lrv = SCardListReaders(ctx, NULL, readers, &readers_len);
+	}
+	if (lrv != SCARD_S_SUCCESS) {
+		set_error("SCardListReaders() failed: %s", pcsc_stringify_error(lrv));
+		goto end;
+	}
+	for (name = readers; *name; name += strlen(name) + 1)
+		count++;
+	states = calloc(count, sizeof(SCARD_READERSTATE));
+	if (!states) {
+		set_error("not enough free memory available");
+		goto end;
+	}
+	for (i = 0, name = readers; i < count; i++, name += strlen(name) + 1) {
+		states[i].szReader = name;
+		states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+	}
+	lrv = SCardGetStatusChange(ctx, 0, states, count);
+	if (lrv != SCARD_S_SUCCESS) {
+		set_error("SCardGetStatusChange() failed: %s", pcsc_stringify_error(lrv));
+		goto end;
+	}
+
+	/* the reader the PKCS#11 slot is named after, or the only card */
+	for (i = 0; i < count; i++) {
+		if (!(states[i].dwEventState & SCARD_STATE_PRESENT))
+			continue;
+		if (reader) {
+			if (strncmp(states[i].szReader, reader, strlen(reader)) == 0) {
+				chosen = i;
+				break;
+			}
+		} else if (chosen >= 0) {
+			set_error("several cards present");
+			goto end;
+		} else {
+			chosen = i;
+		}
+	}
+	if (chosen < 0) {
+		set_error("no card present");
+		goto end;
+	}
+	if (atrs && !piv_atr_match(states[chosen].rgbAtr, states[chosen].cbAtr, atrs)) {
+		set_error("the card in '%s' is not a listed PIV card", states[chosen].szReader);
+		goto end;
+	}
+
+	DBG1("reading the PIV Authentication certificate in '%s'", states[chosen].szReader);
+	lrv = SCardConnect(ctx, states[chosen].szReader, SCARD_SHARE_SHARED,
+		SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card, &protocol);
+	if (lrv != SCARD_S_SUCCESS) {
+		set_error("SCardConnect() failed: %s", pcsc_stringify_error(lrv));
+		goto end;
+	}
+	pci = protocol == SCARD_PROTOCOL_T0 ? SCARD_PCI_T0 : SCARD_PCI_T1;
+	object = malloc(PIV_MAX_OBJECT);
+	/* the middleware must not select another application in between */
+	lrv = object ? SCardBeginTransaction(card) : SCARD_S_SUCCESS;
+	if (!object || lrv != SCARD_S_SUCCESS) {
+		if (!object)
+			set_error("not enough free memory available");
+		else
+			set_error("SCardBeginTransaction() failed: %s", pcsc_stringify_error(lrv));
+		SCardDisconnect(card, SCARD_LEAVE_CARD);
+		goto end;
+	}
+	len = PIV_MAX_OBJECT;
+	sw = piv_transmit(card, pci, piv_select, sizeof(piv_select), object, &len);
+	if (sw == 0x9000) {
+		len = PIV_MAX_OBJECT;
+		sw = piv_transmit(card, pci, piv_get_auth_cert, sizeof(piv_get_auth_cert),
+			object, &len);
+		if (sw >= 0 && sw != 0x9000)
+			set_error("cannot read the PIV Authentication certificate: %04X", sw);
+	} else if (sw >= 0) {
+		set_error("no PIV application on the card: %04X", sw);
+	}
+	SCardEndTransaction(card, SCARD_LEAVE_CARD);
+	SCardDisconnect(card, SCARD_LEAVE_CARD);
+	if (sw == 0x9000)
+		rv = piv_parse_cert(object, len, der, der_len);
+
+end:
+	free(object);
+	free(states);
+	free(readers);
+	SCardReleaseContext(ctx);
+	return rv;
+}
+
+#else
+
+int piv_read_auth_cert(const char *reader, const char **atrs,
+	unsigned char **der, size_t *der_len)
+{
+	*der = NULL;
+	*der_len = 0;
+	set_error("PC/SC support not compiled in");
+	return -1;
+}
+
+#endif /* HAVE_PCSC */
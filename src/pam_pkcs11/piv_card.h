@@ -0,0 +1,64 @@
+/*
+ * PAM-PKCS11 direct PIV card access
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/** \file
+ Reads the PIV Authentication certificate (container 5FC105) of a PIV or
+ PIV compatible CAC card straight through PC/SC, with two APDUs, instead
+ of waiting for the PKCS#11 middleware to read and parse every container
+ of the card. Certificates stored compressed are inflated when zlib is
+ available.
+
+ The certificate read this way is only a hint: it is worth nothing until
+ the same certificate shows in the PKCS#11 list, whose private key then
+ signs the challenge as usual.
+*/
+
+#ifndef __PIV_CARD_H_
+#define __PIV_CARD_H_
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stddef.h>
+
+#ifndef __PIV_CARD_C_
+#define PIV_CARD_EXTERN extern
+#else
+#define PIV_CARD_EXTERN
+#endif
+
+/**
+* Read the PIV Authentication certificate of the card in a reader
+*@param reader Start of the name of the reader to use, NULL to use the
+*   only reader holding a card
+*@param atrs NULL terminated list of ATR prefixes in hex ("3b:f8:13..."),
+*   the card must match one of them; NULL to accept any card having the
+*   PIV application
+*@param der Returns the DER encoded certificate, to be freed by the caller
+*@param der_len Returns the size of the certificate
+*@return 0 on success, -1 on error (no card, not a PIV card, ...)
+*/
+PIV_CARD_EXTERN int piv_read_auth_cert(const char *reader, const char **atrs,
+	unsigned char **der, size_t *der_len);
+
+#undef PIV_CARD_EXTERN
+
+#endif /* __PIV_CARD_H_ */
@@ -0,0 +1,350 @@
+/*
+ * PAM-PKCS11 direct PIV card access
+ * pam-pkcs11 is copyright (C) 2003-2004 of Mario Strasser <mast@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * $Id$
+ */
+
+/*
+* Checks piv_read_auth_cert() against virtual cards. This program is not
+* linked with pcsc-lite: it provides the PC/SC calls itself, as three
+* readers. The PIV card answers SELECT, GET DATA and GET RESPONSE from
+* the container set up by each check.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pcsclite.h>
+#include <wintypes.h>
+#include <winscard.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "piv_card.h"
+
+static int failures = 0;
+
+#define CHECK(cond, what) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s (line %d)\n", what, __LINE__); \
+		failures++; \
+	} \
+} while (0)
+
+/*
+* the virtual readers
+*/
+static const char reader_names[] = "Empty Reader 00 00\0Virtual PIV 01 00\0Other Card 02 00\0";
+static const unsigned char piv_atr[] = {
+	0x3b, 0xf8, 0x13, 0x00, 0x00, 0x81, 0x31, 0xfe,
+	0x15, 0x59, 0x75, 0x62, 0x69, 0x6b, 0x65, 0x79, 0x34, 0xd4
+};
+static const unsigned char other_atr[] = { 0x3b, 0x8f, 0x80, 0x01 };
+
+static struct {
+	int other_present; /* a card in "Other Card" too */
+	int t0; /* T=0 rather than T=1 */
+	int not_piv; /* the card has no PIV application */
+	int endless; /* the card keeps on answering 61xx */
+	unsigned char object[20000]; /* container 5FC105 */
+	size_t object_len;
+	/* observed */
+	int contexts, connections, transactions;
+	int bad_apdu;
+} vc;
+
+static int connected_piv, selected;
+static size_t object_pos;
+
+const SCARD_IO_REQUEST g_rgSCardT0Pci = { SCARD_PROTOCOL_T0, sizeof(SCARD_IO_REQUEST) };
+const SCARD_IO_REQUEST g_rgSCardT1Pci = { SCARD_PROTOCOL_T1, sizeof(SCARD_IO_REQUEST) };
+
+const char *pcsc_stringify_error(const LONG rv) {
+	static char buf[32];
+	snprintf(buf, sizeof(buf), "0x%08lX", (unsigned long)rv);
+	return buf;
+}
+
+LONG SCardEstablishContext(DWORD scope, LPCVOID r1, LPCVOID r2, LPSCARDCONTEXT ctx) {
+	vc.contexts++;
+	*ctx = 1;
+	return SCARD_S_SUCCESS;
+}
+
+LONG SCardReleaseContext(SCARDCONTEXT ctx) {
+	vc.contexts--;
+	return SCARD_S_SUCCESS;
+}
+
+LONG SCardListReaders(SCARDCONTEXT ctx, LPCSTR groups, LPSTR readers, LPDWORD len) {
+	if (readers) {
+		if (*len < sizeof(reader_names)) return SCARD_E_INSUFFICIENT_BUFFER;
+		memcpy(readers, reader_names, sizeof(reader_names));
+	}
+	*len = sizeof(reader_names);
+	return SCARD_S_SUCCESS;
+}
+
+LONG SCardGetStatusChange(SCARDCONTEXT ctx, DWORD timeout, SCARD_READERSTATE *states, DWORD n) {
+	DWORD i;
+
+	for (i = 0; i < n; i++) {
+		states[i].dwEventState = SCARD_STATE_EMPTY;
+		states[i].cbAtr = 0;
+		if (!strncmp(states[i].szReader, "Virtual", 7)) {
+			states[i].dwEventState = SCARD_STATE_PRESENT;
+			states[i].cbAtr = sizeof(piv_atr);
+			memcpy(states[i].rgbAtr, piv_atr, sizeof(piv_atr));
+		} else if (!strncmp(states[i].szReader, "Other", 5) && vc.other_present) {
+			states[i].dwEventState = SCARD_STATE_PRESENT;
+			states[i].cbAtr = sizeof(other_atr);
+			memcpy(states[i].rgbAtr, other_atr, sizeof(other_atr));
+		}
+	}
+	return SCARD_S_SUCCESS;
+}
+
+LONG SCardConnect(SCARDCONTEXT ctx, LPCSTR reader, DWORD mode, DWORD protocols,
+		LPSCARDHANDLE card, LPDWORD protocol) {
+	vc.connections++;
+	connected_piv = !strncmp(reader, "Virtual", 7);
+	selected = 0;
+	*card = 7;
+	*protocol = vc.t0 ? SCARD_PROTOCOL_T0 : SCARD_PROTOCOL_T1;
+	return SCARD_S_SUCCESS;
+}
+
+LONG SCardDisconnect(SCARDHANDLE card, DWORD disposition) {
+	vc.connections--;
+	return SCARD_S_SUCCESS;
+}
+
+LONG SCardBeginTransaction(SCARDHANDLE card) {
+	vc.transactions++;
+	return SCARD_S_SUCCESS;
+}
+
+LONG SCardEndTransaction(SCARDHANDLE card, DWORD disposition) {
+	vc.transactions--;
+	return SCARD_S_SUCCESS;
+}
+
+/* next piece of the container, with 61xx while more is left */
+static DWORD answer_chunk(LPBYTE rsp, size_t want) {
+	size_t left = vc.object_len - object_pos;
+	size_t n = left < want ? left : want;
+
+	if (vc.endless) {
+		rsp[0] = 0x61;
+		rsp[1] = 0x00;
+		return 2;
+	}
+	memcpy(rsp, vc.object + object_pos, n);
+	object_pos += n;
+	left -= n;
+	rsp[n] = left ? 0x61 : 0x90;
+	rsp[n + 1] = left > 255 ? 0 : left;
+	return n + 2;
+}
+
+LONG SCardTransmit(SCARDHANDLE card, const SCARD_IO_REQUEST *pci, LPCBYTE apdu, DWORD apdu_len,
+		SCARD_IO_REQUEST *rpci, LPBYTE rsp, LPDWORD rsp_len) {
+	/* T=0 carries no Le on a case 4 APDU, T=1 does */
+	DWORD extra = vc.t0 ? 0 : 1;
+
+	if ((pci == SCARD_PCI_T0) != (vc.t0 != 0)) vc.bad_apdu++;
+	if (apdu[1] == 0xA4) {
+		if (apdu_len != 5 + apdu[4] + extra) vc.bad_apdu++;
+		selected = connected_piv && !vc.not_piv && apdu[4] == 9 &&
+			!memcmp(apdu + 5, "\xA0\x00\x00\x03\x08\x00\x00\x10\x00", 9);
+		rsp[0] = selected ? 0x90 : 0x6A;
+		rsp[1] = selected ? 0x00 : 0x82;
+		*rsp_len = 2;
+	} else if (apdu[1] == 0xCB && selected && !memcmp(apdu + 5, "\x5C\x03\x5F\xC1\x05", 5)) {
+		if (apdu_len != 10 + extra) vc.bad_apdu++;
+		object_pos = 0;
+		*rsp_len = answer_chunk(rsp, 256);
+	} else if (apdu[1] == 0xC0 && selected) {
+		*rsp_len = answer_chunk(rsp, apdu[4] ? apdu[4] : 256);
+	} else {
+		rsp[0] = 0x6D;
+		rsp[1] = 0x00;
+		*rsp_len = 2;
+	}
+	return SCARD_S_SUCCESS;
+}
+
+/*
+* containers
+*/
+static size_t put_tlv(unsigned char *p, unsigned char tag, const unsigned char *value, size_t len) {
+	size_t n = 0;
+
+	p[n++] = tag;
+	if (len > 255) {
+		p[n++] = 0x82;
+		p[n++] = len >> 8;
+		p[n++] = len & 0xff;
+	} else if (len > 127) {
+		p[n++] = 0x81;
+		p[n++] = len;
+	} else {
+		p[n++] = len;
+	}
+	if (len) memcpy(p + n, value, len);
+	return n + len;
+}
+
+/* the container of a certificate, with its CertInfo byte */
+static void set_container(const unsigned char *cert, size_t len, int info) {
+	static unsigned char data[sizeof(vc.object)];
+	unsigned char b = info;
+	size_t n;
+
+	n = put_tlv(data, 0x70, cert, len);
+	if (info >= 0) n += put_tlv(data + n, 0x71, &b, 1);
+	n += put_tlv(data + n, 0xFE, NULL, 0);
+	vc.object_len = put_tlv(vc.object, 0x53, data, n);
+}
+
+static void reset_card(void) {
+	memset(&vc, 0, sizeof(vc));
+}
+
+static int read_cert(const char *reader, const char **atrs, unsigned char **der, size_t *len) {
+	int rv = piv_read_auth_cert(reader, atrs, der, len);
+
+	CHECK(vc.contexts == 0, "PC/SC context released");
+	CHECK(vc.connections == 0, "card disconnected");
+	CHECK(vc.transactions == 0, "transaction ended");
+	CHECK(vc.bad_apdu == 0, "well formed APDUs");
+	return rv;
+}
+
+static void check_read(const unsigned char *cert, size_t cert_len, const char *reader,
+		const char **atrs, const char *what) {
+	unsigned char *der;
+	size_t len;
+	int rv = read_cert(reader, atrs, &der, &len);
+
+	CHECK(rv == 0 && len == cert_len && !memcmp(der, cert, len), what);
+	free(der);
+}
+
+static void check_fail(const char *reader, const char **atrs, const char *what) {
+	unsigned char *der;
+	size_t len;
+	int rv = read_cert(reader, atrs, &der, &len);
+
+	CHECK(rv == -1 && der == NULL && len == 0, what);
+	free(der);
+}
+
+int main(int argc, char **argv) {
+	static unsigned char cert[1500];
+	const char *piv_atrs[] = { "3b:f8:13:00:00:81:31:fe", NULL };
+	const char *other_atrs[] = { "3b:8f:80", "3B F8 14", NULL };
+	size_t i;
+
+	/* not a real certificate: the bytes are only carried */
+	cert[0] = 0x30;
+	for (i = 1; i < sizeof(cert); i++) cert[i] = (unsigned char)(i * 7);
+
+	/* T=1, several GET RESPONSE */
+	reset_card();
+	set_container(cert, sizeof(cert), 0);
+	check_read(cert, sizeof(cert), NULL, NULL, "read over T=1");
+
+	/* T=0 */
+	reset_card();
+	vc.t0 = 1;
+	set_container(cert, sizeof(cert), 0);
+	check_read(cert, sizeof(cert), NULL, NULL, "read over T=0");
+
+	/* small container, one answer, no CertInfo */
+	reset_card();
+	set_container(cert, 100, -1);
+	check_read(cert, 100, NULL, NULL, "read in one answer");
+
+#ifdef HAVE_ZLIB
+	/* gzip compressed certificate */
+	{
+		unsigned char z[sizeof(cert) + 64];
+		z_stream s;
+
+		reset_card();
+		memset(&s, 0, sizeof(s));
+		deflateInit2(&s, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+		s.next_in = cert;
+		s.avail_in = sizeof(cert);
+		s.next_out = z;
+		s.avail_out = sizeof(z);
+		deflate(&s, Z_FINISH);
+		set_container(z, s.total_out, 1);
+		deflateEnd(&s);
+		check_read(cert, sizeof(cert), NULL, NULL, "compressed certificate");
+
+		reset_card();
+		set_container(cert, sizeof(cert), 1);
+		check_fail(NULL, NULL, "corrupt compressed certificate");
+	}
+#endif
+
+	/* reader selection */
+	reset_card();
+	vc.other_present = 1;
+	set_container(cert, sizeof(cert), 0);
+	check_fail(NULL, NULL, "several cards, no reader named");
+	check_read(cert, sizeof(cert), "Virtual PIV", NULL, "several cards, reader named");
+	check_fail("Other Card", NULL, "not a PIV card");
+	check_fail("Empty Reader", NULL, "no card in the reader named");
+	check_fail("Missing", NULL, "no such reader");
+
+	/* ATR filter */
+	reset_card();
+	set_container(cert, sizeof(cert), 0);
+	check_read(cert, sizeof(cert), NULL, piv_atrs, "listed ATR");
+	check_fail(NULL, other_atrs, "unlisted ATR");
+
+	/* cards which misbehave */
+	reset_card();
+	vc.not_piv = 1;
+	set_container(cert, sizeof(cert), 0);
+	check_fail(NULL, NULL, "no PIV application");
+
+	reset_card();
+	vc.endless = 1;
+	set_container(cert, sizeof(cert), 0);
+	check_fail(NULL, NULL, "card answering 61xx forever");
+
+	reset_card();
+	vc.object_len = put_tlv(vc.object, 0x53, (const unsigned char *)"\x71\x01\x00", 3);
+	check_fail(NULL, NULL, "container without certificate");
+
+	reset_card();
+	set_container(cert, sizeof(cert), 0);
+	vc.object_len -= 10;
+	check_fail(NULL, NULL, "truncated container");
+
+	if (failures) fprintf(stderr, "%d check(s) failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -30,6 +30,7 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 
 #include <pcsclite.h>
 #include <wintypes.h>
@@ -39,6 +40,8 @@
 #include "../scconf/scconf.h"
 #include "../common/debug.h"
 #include "../common/error.h"
+#include "../common/session_registry.h"
+#include "../common/event_socket.h"
 
 #ifndef HAVE_DAEMON
 int daemon(int nochdir, int noclose);
@@ -66,6 +69,38 @@ scconf_context *ctx = NULL;
 const scconf_block *root;
 SCARDCONTEXT hContext;
 char *pidfile = NULL;
+const char *session_registry = NULL;
+const char *event_socket = NULL;
+const char *event_socket_group = NULL;
+int event_socket_mode = EVENT_SOCKET_MODE;
+
+/*
+* Card filters, compiled from the "filter" blocks of the configuration.
+* The first filter whose criteria all match the reader name and the ATR
+* of an inserted card decides whether its events are handled; cards
+* matched by none follow filter_default. The decision taken on
+* insertion also applies to the removal, which has no ATR.
+*/
+typedef struct atr_rule_st {
+	unsigned char atr[MAX_ATR_SIZE];
+	unsigned char mask[MAX_ATR_SIZE];
+	DWORD len;
+} atr_rule_t;
+
+typedef struct card_filter_st {
+	const char *name;
+	int accept;
+	const scconf_list *readers;	/* fnmatch() patterns */
+	atr_rule_t *atrs;
+	int natrs;
+	struct card_filter_st *next;
+} card_filter_t;
+
+card_filter_t *filters = NULL;
+int filter_default = 1;
+
+/* pvUserData of the reader state while its card is filtered out */
+static char card_filtered_out;
 char AraKiri = FALSE;
 
 static void thats_all_folks(void) {
@@ -77,6 +112,8 @@ static void thats_all_folks(void) {
         DBG1("SCardReleaseContext: %X", rv);
     }
 
+    event_socket_close();
+
     /* free configuration context */
     if (ctx)
 	scconf_free(ctx);
@@ -162,6 +199,144 @@ static int execute_event (const char *action) {
 	return 0;
 }
 
+/*
+ * export the sessions opened with a token of the given reader to the
+ * card_remove actions. Slot keys are cut as PKCS#11 slot descriptions
+ * are, so the reader name finds the sessions of its slot
+ */
+static void export_sessions(const char *reader) {
+	char key[128];
+	const char *keys[2] = { NULL, NULL };
+
+	if (!session_registry) return;
+	keys[0] = session_registry_key(key, sizeof(key), SESSION_KEY_SLOT, reader);
+	if (keys[0]) session_registry_export(session_registry, keys);
+}
+
+/* parse "3B:8F:80" or "3B8F80", return the number of bytes or -1 */
+static int parse_hex(const char *str, unsigned char *buf, int size) {
+	int n = 0, half = 0, v;
+	for (; *str; str++) {
+		if (*str == ':' || *str == ' ') continue;
+		if (*str >= '0' && *str <= '9') v = *str - '0';
+		else if (*str >= 'a' && *str <= 'f') v = *str - 'a' + 10;
+		else if (*str >= 'A' && *str <= 'F') v = *str - 'A' + 10;
+		else return -1;
+		if (!half) {
+			if (n == size) return -1;
+			buf[n] = v << 4;
+		} else buf[n++] |= v;
+		half = !half;
+	}
+	return half ? -1 : n;
+}
+
+/* "atr" or "atr/mask", the mask defaults to an exact match */
+static int parse_atr_rule(const char *str, atr_rule_t *rule) {
+	char value[6 * MAX_ATR_SIZE + 2], *slash;
+	int len, mlen;
+
+	if (strlen(str) >= sizeof(value)) return -1;
+	strcpy(value, str);
+	slash = strchr(value, '/');
+	if (slash) *slash++ = '\0';
+	len = parse_hex(value, rule->atr, MAX_ATR_SIZE);
+	if (len <= 0) return -1;
+	memset(rule->mask, 0xff, sizeof(rule->mask));
+	if (slash) {
+		mlen = parse_hex(slash, rule->mask, MAX_ATR_SIZE);
+		if (mlen != len) return -1;
+	}
+	rule->len = len;
+	return 0;
+}
+
+static int parse_filters(void) {
+	scconf_block **blocks;
+	const scconf_list *list;
+	card_filter_t *filter, **last = &filters;
+	const char *str;
+	int i, n;
+
+	str = scconf_get_str(root, "filter_default", "accept");
+	if (!strcmp(str, "accept")) filter_default = 1;
+	else if (!strcmp(str, "ignore")) filter_default = 0;
+	else {
+		DBG1("Invalid filter_default value: '%s'", str);
+		return -1;
+	}
+	blocks = scconf_find_blocks(ctx, root, "filter", NULL);
+	if (!blocks) return 0;
+	for (i = 0; blocks[i]; i++) {
+		filter = calloc(1, sizeof(card_filter_t));
+		if (!filter) break;
+		filter->name = blocks[i]->name ? blocks[i]->name->data : "";
+		str = scconf_get_str(blocks[i], "action", "accept");
+		if (!strcmp(str, "accept")) filter->accept = 1;
+		else if (strcmp(str, "ignore")) {
+			DBG2("Invalid action '%s' in filter '%s'", str, filter->name);
+			free(filter);
+			free(blocks);
+			return -1;
+		}
+		filter->readers = scconf_find_list(blocks[i], "reader");
+		list = scconf_find_list(blocks[i], "atr");
+		for (n = 0; list; list = list->next) n++;
+		if (n) filter->atrs = calloc(n, sizeof(atr_rule_t));
+		for (list = scconf_find_list(blocks[i], "atr"); list && filter->atrs;
+			list = list->next) {
+			if (parse_atr_rule(list->data, &filter->atrs[filter->natrs]) < 0) {
+				DBG2("Invalid atr '%s' in filter '%s'", list->data, filter->name);
+				free(filter->atrs);
+				free(filter);
+				free(blocks);
+				return -1;
+			}
+			filter->natrs++;
+		}
+		*last = filter;
+		last = &filter->next;
+	}
+	free(blocks);
+	return 0;
+}
+
+static int filter_matches(const card_filter_t *filter, const char *reader,
+	const unsigned char *atr, DWORD atr_len) {
+	const scconf_list *list;
+	DWORD j;
+	int i;
+
+	if (filter->readers) {
+		for (list = filter->readers; list; list = list->next)
+			if (!fnmatch(list->data, reader, 0)) break;
+		if (!list) return 0;
+	}
+	if (!filter->natrs) return 1;
+	for (i = 0; i < filter->natrs; i++) {
+		const atr_rule_t *rule = &filter->atrs[i];
+		if (rule->len != atr_len) continue;
+		for (j = 0; j < atr_len && !((atr[j] ^ rule->atr[j]) & rule->mask[j]); j++);
+		if (j == atr_len) return 1;
+	}
+	return 0;
+}
+
+/* should the events of this card be handled? */
+static int card_accepted(const char *reader, const unsigned char *atr,
+	DWORD atr_len) {
+	const card_filter_t *filter;
+
+	for (filter = filters; filter; filter = filter->next) {
+		if (filter_matches(filter, reader, atr, atr_len)) {
+			DBG3("Card in '%s' %s by filter '%s'", reader,
+				filter->accept ? "accepted" : "ignored", filter->name);
+			return filter->accept;
+		}
+	}
+	return filter_default;
+}
+
 static int parse_config_file(void) {
         ctx = scconf_new(cfgfile);
         if (!ctx) {
@@ -182,7 +357,15 @@ static int parse_config_file(void) {
 	daemonize = scconf_get_bool(root,"daemon",daemonize);
 	timeout = scconf_get_int(root,"timeout",timeout);
 	timeout_limit = scconf_get_int(root,"timeout_limit",0);
+	session_registry = scconf_get_str(root,"session_registry",NULL);
+	event_socket = scconf_get_str(root,"event_socket",event_socket);
+	event_socket_group = scconf_get_str(root,"event_socket_group",NULL);
+	event_socket_mode = (int)strtol(scconf_get_str(root,"event_socket_mode","0660"),NULL,8);
 	if (debug) set_debug_level(1);
+	if (parse_filters() < 0) {
+		DBG1("Invalid card filter in config: '%s'",cfgfile);
+		return -1;
+	}
 	return 0;
 }
 
@@ -236,6 +419,10 @@ static int parse_args(int argc, char *argv[]) {
 		 pidfile = strchr(argv[i],'=') +1;
 		continue;
 	    }
+	    if (strstr(argv[i],"event_socket=") ) {
+		 event_socket = strchr(argv[i],'=') +1;
+		continue;
+	    }
             if (strstr(argv[i],"debug") ) {
 		continue;  /* already parsed: skip */
 	    }
@@ -247,7 +434,7 @@ static int parse_args(int argc, char *argv[]) {
 	    }
 	    fprintf(stderr,"unknown option %s\n",argv[i]);
 	    /* arriving here means syntax error */
-	    fprintf(stderr,"Usage %s [[no]debug] [[no]daemon] [timeout=<timeout>] [timeout_limit=<limit>] [config_file=<file>] [kill] [pidfile=<file>]\n",argv[0]);
+	    fprintf(stderr,"Usage %s [[no]debug] [[no]daemon] [timeout=<timeout>] [timeout_limit=<limit>] [config_file=<file>] [kill] [pidfile=<file>] [event_socket=<file>]\n",argv[0]);
 	    fprintf(stderr,"Defaults: debug=0 daemon=0 timeout=%d (ms) timeout_limit=0 (none) config_file=%s\n",DEF_TIMEOUT,DEF_CONFIG_FILE );
 	    exit(1);
         } /* for */
@@ -302,6 +489,19 @@ static void create_pidfile(char *filename)
     close(fd);
 }
 
+/* filter decision taken on the card of a reader of the previous table */
+static void *filter_decision(const char *reader,
+	const SCARD_READERSTATE *states, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+	if (!strcmp(states[i].szReader, reader))
+	    return states[i].pvUserData;
+    }
+    return NULL;
+}
+
 static void signal_trap(int sig)
 {
     (void)sig;
@@ -315,11 +515,11 @@ static void signal_trap(int sig)
 int main(int argc, char *argv[]) {
     int current_reader;
     LONG rv;
-    SCARD_READERSTATE *rgReaderStates_t = NULL;
+    SCARD_READERSTATE *rgReaderStates_t = NULL, *old_states = NULL;
     DWORD dwReaders, dwReadersOld;
-    LPSTR mszReaders = NULL;
+    LPSTR mszReaders = NULL, old_names = NULL;
     char *ptr, **readers = NULL;
-    int nbReaders, i;
+    int nbReaders, i, old_count = 0;
     int first_loop = TRUE;
 
     parse_args(argc,argv);
@@ -344,6 +544,15 @@ int main(int argc, char *argv[]) {
 	return 0;
     }
 
+    /* publish events to subscribers */
+    if (event_socket &&
+	event_socket_open(event_socket, event_socket_group, event_socket_mode) < 0) {
+	fprintf(stderr, "%s\n", get_error());
+	if (ctx)
+	    scconf_free(ctx);
+	return 1;
+    }
+
     /* put my self into background if flag is set */
     if (daemonize) {
 	DBG("Going to be daemon...");
@@ -357,6 +566,7 @@ int main(int argc, char *argv[]) {
     rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
     if (rv != SCARD_S_SUCCESS) {
         DBG1("SCardEstablishContext: Cannot Connect to Resource Manager %lX", rv);
+	event_socket_close();
 	if (ctx)
 	    scconf_free(ctx);
         return 1;
@@ -370,12 +580,21 @@ int main(int argc, char *argv[]) {
 	create_pidfile(pidfile);
 
 get_readers:
+    /* the previous table is kept until the filter decisions taken on its
+     * cards are carried over to the new one, by reader name */
+    if (rgReaderStates_t) {
+	free(old_states);
+	free(old_names);
+	old_states = rgReaderStates_t;
+	old_names = mszReaders;
+	old_count = nbReaders;
+	rgReaderStates_t = NULL;
+	mszReaders = NULL;
+    }
     /* free memory possibly allocated in a previous loop */
     /* free() already check if pt is null, so no check needed */
     free(readers);
     readers = NULL;
-    free(rgReaderStates_t);
-    rgReaderStates_t = NULL;
 
     /* Retrieve the available readers list.
      *
@@ -459,7 +678,15 @@ get_readers:
     for (i=0; i<nbReaders; i++) {
         rgReaderStates_t[i].szReader = readers[i];
         rgReaderStates_t[i].dwCurrentState = SCARD_STATE_UNAWARE;
+        /* a filtered out card is still filtered out on removal */
+        rgReaderStates_t[i].pvUserData =
+            filter_decision(readers[i], old_states, old_count);
     }
+    free(old_states);
+    old_states = NULL;
+    free(old_names);
+    old_names = NULL;
+    old_count = 0;
 
     /* Wait endlessly for all events in the list of readers
      * We only stop in case of an error
@@ -475,6 +702,8 @@ get_readers:
 	   if (AraKiri)
 		break;
 
+	event_socket_accept();
+
         /* Now we have an event, check all the readers to see what happened */
         for (current_reader=0; current_reader < nbReaders; current_reader++) {
 	    unsigned long new_state;
@@ -494,6 +723,16 @@ get_readers:
              * above.
              */
 
+	    /* decide on insertion, even on the first pass, as the removal
+	     * of the card has no ATR to filter on */
+	    new_state = rgReaderStates_t[current_reader].dwEventState;
+	    if (new_state & SCARD_STATE_PRESENT) {
+		rgReaderStates_t[current_reader].pvUserData =
+		    card_accepted(rgReaderStates_t[current_reader].szReader,
+			rgReaderStates_t[current_reader].rgbAtr,
+			rgReaderStates_t[current_reader].cbAtr) ? NULL : &card_filtered_out;
+	    }
+
 	    if (first_loop)
 		continue; /* skip first pass */
 
@@ -502,7 +741,6 @@ get_readers:
                 rgReaderStates_t[current_reader].szReader);
 
             /* Dump the full current state */
-	    new_state = rgReaderStates_t[current_reader].dwEventState;
             DBG1("Card state: 0x%08ld", new_state);
 
             if (new_state & SCARD_STATE_UNKNOWN) {
@@ -510,13 +748,35 @@ get_readers:
                 goto get_readers;
             }
 
+            /* card of no interest, see the filter blocks */
+            if (rgReaderStates_t[current_reader].pvUserData == &card_filtered_out) {
+                DBG("Card filtered out, event ignored");
+                if (new_state & SCARD_STATE_EMPTY)
+                    rgReaderStates_t[current_reader].pvUserData = NULL;
+                continue;
+            }
+
             if (new_state & SCARD_STATE_EMPTY) {
                     DBG("Card removed");
+		    event_socket_publish("card_remove",
+			rgReaderStates_t[current_reader].szReader, NULL, NULL, NULL);
+		    export_sessions(rgReaderStates_t[current_reader].szReader);
 		    execute_event("card_remove");
+		    session_registry_unexport();
             }
 
             if (new_state & SCARD_STATE_PRESENT) {
+                    char atr[2 * MAX_ATR_SIZE + 1];
+                    DWORD j;
+
                     DBG("Card inserted");
+		    for (j = 0; j < rgReaderStates_t[current_reader].cbAtr
+			&& j < MAX_ATR_SIZE; j++)
+			sprintf(atr + 2 * j, "%02X",
+			    rgReaderStates_t[current_reader].rgbAtr[j]);
+		    atr[2 * j] = '\0';
+		    event_socket_publish("card_insert",
+			rgReaderStates_t[current_reader].szReader, NULL, NULL, atr);
 		    execute_event("card_insert");
             }
         } /* for */
@@ -534,6 +794,8 @@ end:
     readers = NULL;
     free(rgReaderStates_t);
     rgReaderStates_t = NULL;
+    free(old_states);
+    free(old_names);
 
     if (pidfile)
 	remove_pidfile(pidfile);
@@ -0,0 +1,544 @@
+/*
+ * PKCS #11 PAM Login Module
+ * Configuration cost analyser
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * $Id$
+ */
+
+/*
+* Loads a configuration with the same code as pam_pkcs11, and tells what
+* each stage of an authentication is expected to cost: certificate
+* verification and every mapper of the chain, in the find (no user name
+* given) and match (user name given) modes. Orderings and policies known
+* to add latency are reported. With a sample certificate, every stage is
+* also run and timed.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "../scconf/scconf.h"
+#include "../common/debug.h"
+#include "../common/error.h"
+#include "../common/uri.h"
+#include "../common/pkcs11_lib.h"
+#include "../common/cert_vfy.h"
+#include "../pam_pkcs11/pam_config.h"
+#include "../pam_pkcs11/mapper_mgr.h"
+
+#ifndef HAVE_NSS
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#endif
+
+#define DEFAULT_ROUNDS 3
+#define MAX_STAGES 64
+
+/* cost classes, from the cheapest */
+enum {
+	COST_LOCAL = 0,		/* certificate contents or a single lookup */
+	COST_INDEXED,		/* map file index or user database service lookup */
+	COST_FILE,		/* linear read of a map file */
+	COST_SCAN,		/* enumeration of the password database */
+	COST_NETWORK,		/* remote request per lookup */
+	COST_SCAN_NETWORK,	/* remote request per enumerated user */
+	COST_UNKNOWN
+};
+
+static const char *cost_names[] = {
+	"local", "indexed", "file", "scan", "network", "scan+network", "unknown"
+};
+
+struct stage {
+	const char *name;	/* use_mappers entry */
+	char type[32];		/* mapper implementation */
+	int find;		/* cost class without user name */
+	int match;		/* cost class with a user name */
+	char notes[256];
+	int index;		/* map file index built at load time */
+	struct mapper_instance *module;
+};
+
+static struct stage stages[MAX_STAGES];
+static int nstages = 0;
+
+/* findings are printed after the stage table */
+#define MAX_FINDINGS 64
+static char *findings[MAX_FINDINGS];
+static int nfindings = 0;
+static int warnings = 0;
+
+static void add_finding(int warning, const char *fmt, va_list ap) {
+	char buf[512];
+	int len;
+
+	if (nfindings == MAX_FINDINGS) return;
+	len = snprintf(buf, sizeof(buf), warning ? "warning: " : "note: ");
+	vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+	findings[nfindings] = strdup(buf);
+	if (findings[nfindings]) nfindings++;
+	if (warning) warnings++;
+}
+
+static void warn(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	add_finding(1, fmt, ap);
+	va_end(ap);
+}
+
+static void note(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	add_finding(0, fmt, ap);
+	va_end(ap);
+}
+
+static void add_note(struct stage *st, const char *fmt, ...) {
+	size_t len = strlen(st->notes);
+	va_list ap;
+	if (len && len < sizeof(st->notes) - 2) {
+		strcpy(st->notes + len, "; ");
+		len += 2;
+	}
+	va_start(ap, fmt);
+	vsnprintf(st->notes + len, sizeof(st->notes) - len, fmt, ap);
+	va_end(ap);
+}
+
+static int is_remote(const char *uri) {
+	return is_uri(uri) > 0 && strncmp(uri, "file://", 7) != 0;
+}
+
+/* mapper implementation: the entry name for static mappers, else the
+   library name without its _mapper.so suffix */
+static void mapper_type(struct mapper_instance *module, char *type, size_t size) {
+	const char *pt = module->module_path;
+	size_t len;
+
+	if (!pt) {
+		snprintf(type, size, "%s", module->module_name);
+		return;
+	}
+	if (strrchr(pt, '/')) pt = strrchr(pt, '/') + 1;
+	len = strcspn(pt, ".");
+	if (len > 7 && !strncmp(pt + len - 7, "_mapper", 7)) len -= 7;
+	if (len >= size) len = size - 1;
+	memcpy(type, pt, len);
+	type[len] = '\0';
+}
+
+/* cost of a lookup in a mapfile, with or without a canonical index */
+static int mapfile_cost(struct stage *st, const char *mapfile, int indexed) {
+	struct stat buf;
+	const char *path = mapfile;
+
+	if (!strcmp(mapfile, "none")) return COST_LOCAL;
+	st->index = indexed;
+	if (is_remote(mapfile)) {
+		if (indexed) {
+			add_note(st, "index downloaded from %s when the chain is loaded", mapfile);
+			return COST_INDEXED;
+		}
+		add_note(st, "%s downloaded for every lookup", mapfile);
+		return COST_NETWORK;
+	}
+	if (!strncmp(path, "file://", 7)) path += 7;
+	if (stat(path, &buf) < 0) {
+		add_note(st, "mapfile %s not found", path);
+		return indexed ? COST_INDEXED : COST_FILE;
+	}
+	if (indexed) return COST_INDEXED;
+	add_note(st, "%ld kB read for every lookup", (long)(buf.st_size + 1023) / 1024);
+	return COST_FILE;
+}
+
+static int has_scope(const scconf_block *blk) {
+	return blk && (scconf_find_list(blk, "search_groups")
+		|| scconf_find_list(blk, "search_home_prefix")
+		|| scconf_get_str(blk, "search_uid_range", NULL));
+}
+
+/* scan costs are reported with what restricts them */
+static void scan_note(struct stage *st, const scconf_block *blk) {
+	if (has_scope(blk)) {
+		add_note(st, "enumeration restricted by search_* options");
+		return;
+	}
+	add_note(st, "enumerates every user of the password database");
+	warn("mapper '%s' enumerates every user of the password database: "
+		"set search_groups, search_uid_range or search_home_prefix", st->name);
+}
+
+static void classify_mapper(struct stage *st, const scconf_block *blk) {
+	const char *type = st->type;
+	const char *mapfile = blk ? scconf_get_str(blk, "mapfile", "none") : "none";
+
+	st->find = st->match = COST_UNKNOWN;
+	if (!strcmp(type, "null") || !strcmp(type, "ms") || !strcmp(type, "krb")) {
+		st->find = st->match = COST_LOCAL;
+	} else if (!strcmp(type, "subject")) {
+		int canonical = blk ? scconf_get_bool(blk, "canonical", 0) : 0;
+		st->find = st->match = mapfile_cost(st, mapfile, canonical);
+		if (st->find >= COST_FILE)
+			add_note(st, "canonical = true indexes the mapfile");
+	} else if (!strcmp(type, "digest") || !strcmp(type, "cn")
+		|| !strcmp(type, "uid") || !strcmp(type, "mail")) {
+		st->find = st->match = mapfile_cost(st, mapfile, 0);
+	} else if (!strcmp(type, "generic")) {
+		const char *item = blk ? scconf_get_str(blk, "cert_item", "cn") : "cn";
+		int canonical = blk ? scconf_get_bool(blk, "canonical", 0) : 0;
+		canonical = canonical && (!strcasecmp(item, "subject") || !strcasecmp(item, "issuer"));
+		st->find = st->match = mapfile_cost(st, mapfile, canonical);
+		if (blk && scconf_get_bool(blk, "use_getpwent", 0)) {
+			if (st->find < COST_SCAN) st->find = st->match = COST_SCAN;
+			scan_note(st, blk);
+		}
+	} else if (!strcmp(type, "userdb")) {
+		st->find = st->match = COST_INDEXED;
+		add_note(st, "one query to the user database service");
+	} else if (!strcmp(type, "pwent")) {
+		st->find = COST_SCAN;
+		st->match = COST_LOCAL;
+		scan_note(st, blk);
+	} else if (!strcmp(type, "openssh") || !strcmp(type, "opensc")) {
+		st->find = COST_SCAN;
+		st->match = COST_FILE;
+		add_note(st, "reads a file in the home directory of each candidate");
+		scan_note(st, blk);
+	} else if (!strcmp(type, "ldap")) {
+		const scconf_list *map;
+		int templates = 0;
+		for (map = blk ? scconf_find_list(blk, "attribute_map") : NULL; map; map = map->next)
+			templates++;
+		st->match = COST_NETWORK;
+		add_note(st, "up to %d search(es) per lookup", templates + 1);
+		if (blk && !strcasecmp(scconf_get_str(blk, "search_mode", "uid"), "full"))
+			add_note(st, "every certificate of the entry fetched");
+		if (templates > 1)
+			warn("mapper '%s' has %d attribute_map templates: a certificate without an "
+				"entry costs %d LDAP searches; keep the template that matches most "
+				"certificates first, or only one", st->name, templates, templates + 1);
+		if (blk && scconf_get_str(blk, "uid_attribute", NULL)) {
+			st->find = COST_NETWORK;
+		} else {
+			st->find = COST_SCAN_NETWORK;
+			add_note(st, "one search per enumerated user without uid_attribute");
+			warn("mapper '%s' runs LDAP searches for every candidate user when no "
+				"user name is given: set uid_attribute", st->name);
+		}
+	} else {
+		add_note(st, "unknown mapper, not classified");
+	}
+}
+
+/* mappers giving up their queries at the deadline they are given: the
+   others run to completion whatever the timeouts */
+static int honours_deadline(const struct stage *st) {
+	return !strcmp(st->type, "ldap") || !strcmp(st->type, "userdb");
+}
+
+/* the chain walks mappers in order until one of them answers: a scan or
+   a network mapper is paid for by every certificate a later mapper maps */
+static void check_order(const char *mode, int find) {
+	int i, j;
+	for (i = 0; i < nstages; i++) {
+		int ci = find ? stages[i].find : stages[i].match;
+		if (ci < COST_SCAN || ci == COST_UNKNOWN) continue;
+		for (j = i + 1; j < nstages; j++) {
+			int cj = find ? stages[j].find : stages[j].match;
+			if (cj == COST_UNKNOWN || cj >= ci) continue;
+			warn("%s: mapper '%s' (%s) runs before the cheaper mapper '%s' (%s)",
+				mode, stages[i].name, cost_names[ci], stages[j].name, cost_names[cj]);
+			break;
+		}
+	}
+}
+
+static int verify_cost(struct configuration_st *conf, char *notes, size_t size) {
+	cert_policy *policy = &conf->policy;
+	struct stat buf;
+	int cost = COST_LOCAL;
+
+	notes[0] = '\0';
+	switch (policy->crl_policy) {
+	case CRLP_ONLINE:
+		cost = COST_NETWORK;
+		snprintf(notes, size, "crl_online");
+		warn("crl_online downloads the CRLs at every authentication: use crl_auto "
+			"with a crl_dir kept up to date by pkcs11_crl_sync");
+		break;
+	case CRLP_AUTO:
+	case CRLP_OFFLINE:
+		snprintf(notes, size, policy->crl_policy == CRLP_AUTO ?
+			"crl_auto, network when the local CRL is stale" : "crl_offline");
+		if (!policy->crl_dir || stat(policy->crl_dir, &buf) < 0) {
+			if (policy->crl_policy == CRLP_AUTO) {
+				cost = COST_NETWORK;
+				warn("crl_dir %s does not exist: crl_auto downloads the CRLs "
+					"at every authentication", policy->crl_dir ? policy->crl_dir : "(unset)");
+			} else {
+				warn("crl_dir %s does not exist: crl_offline fails every verification",
+					policy->crl_dir ? policy->crl_dir : "(unset)");
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	if (policy->ocsp_policy == OCSP_ON) {
+		cost = COST_NETWORK;
+		strncat(notes, notes[0] ? ", ocsp_on" : "ocsp_on", size - strlen(notes) - 1);
+		warn("ocsp_on queries the OCSP responder at every authentication");
+	}
+	if (policy->signature_policy)
+		strncat(notes, notes[0] ? ", signature: one key operation on the token"
+			: "signature: one key operation on the token", size - strlen(notes) - 1);
+	if (cost == COST_NETWORK && !conf->map_before_verify)
+		note("every certificate of the token is verified before the user name is "
+			"checked: map_before_verify skips the ones of other users");
+	return cost;
+}
+
+static double elapsed_ms(const struct timeval *start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+static void print_probe(const char *stage, const char *op, double min, double max,
+		const char *result) {
+	printf("%-20s %-6s %9.1f %9.1f  %s\n", stage, op, min, max, result);
+}
+
+#ifndef HAVE_NSS
+static X509 *load_certificate(const char *file) {
+	X509 *x509;
+	FILE *fd = fopen(file, "r");
+
+	if (!fd) {
+		fprintf(stderr, "Cannot open %s\n", file);
+		return NULL;
+	}
+	x509 = PEM_read_X509(fd, NULL, NULL, NULL);
+	if (!x509) {
+		rewind(fd);
+		x509 = d2i_X509_fp(fd, NULL);
+	}
+	fclose(fd);
+	if (!x509) fprintf(stderr, "No certificate found in %s\n", file);
+	return x509;
+}
+
+/* run every stage on the sample certificate, rounds times */
+static void probe(struct configuration_st *conf, X509 *x509, const char *user, int rounds) {
+	struct timeval start;
+	double ms, min, max;
+	char label[64];
+	int i, n, rv = 0;
+
+	printf("\n%-20s %-6s %9s %9s  %s\n", "Probe", "Op", "Min ms", "Max ms", "Result");
+	if (crypto_init(&conf->policy) != 0) {
+		printf("%-20s cannot initialize crypto\n", "verify");
+	} else {
+		min = max = 0;
+		for (n = 0; n < rounds; n++) {
+			gettimeofday(&start, NULL);
+			rv = verify_certificate(x509, &conf->policy);
+			ms = elapsed_ms(&start);
+			if (!n || ms < min) min = ms;
+			if (ms > max) max = ms;
+		}
+		print_probe("verify", "verify", min, max,
+			rv == 1 ? "valid" : rv == 0 ? "invalid" : "error");
+	}
+	for (i = 0; i < nstages; i++) {
+		mapper_module *data = stages[i].module->module_data;
+		int old_level = get_debug_level();
+		char *login = NULL;
+		int match = 0;
+
+		snprintf(label, sizeof(label), "mapper %s", stages[i].name);
+		min = max = 0;
+		set_debug_level(data->dbg_level);
+		for (n = 0; n < rounds && data->finder; n++) {
+			free(login);
+			match = 0;
+			gettimeofday(&start, NULL);
+			login = (*data->finder)(x509, data->context, &match);
+			ms = elapsed_ms(&start);
+			if (!n || ms < min) min = ms;
+			if (ms > max) max = ms;
+		}
+		set_debug_level(old_level);
+		if (data->finder)
+			print_probe(label, "find", min, max, login && match ? login : "nomatch");
+		free(login);
+		if (!user || !data->matcher) continue;
+		min = max = 0;
+		set_debug_level(data->dbg_level);
+		for (n = 0; n < rounds; n++) {
+			gettimeofday(&start, NULL);
+			rv = (*data->matcher)(x509, user, data->context);
+			ms = elapsed_ms(&start);
+			if (!n || ms < min) min = ms;
+			if (ms > max) max = ms;
+		}
+		set_debug_level(old_level);
+		print_probe(label, "match", min, max,
+			rv > 0 ? "match" : rv == 0 ? "nomatch" : "error");
+	}
+}
+#endif
+
+static void usage(void) {
+	printf("usage: pkcs11_config_cost [config_file=<file>] [cert=<file>] [user=<login>]\n"
+		"       [rounds=<n>] [debug]\n");
+}
+
+int main(int argc, const char **argv) {
+	struct configuration_st *conf;
+	struct mapper_listitem *chain, *item;
+	const scconf_list *list;
+	const scconf_block *root;
+	scconf_block **blocks;
+	const char **args;
+	const char *cert_file = NULL, *user = NULL;
+	char notes[256];
+	int rounds = DEFAULT_ROUNDS, nargs = 0, i, vcost;
+	int deadline, budget;
+
+	args = calloc(argc, sizeof(char *));
+	if (!args) {
+		fprintf(stderr, "not enough free memory available\n");
+		return 2;
+	}
+	/* our own options, the others are pam_pkcs11 ones */
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "cert=", 5)) {
+			cert_file = argv[i] + 5;
+		} else if (!strncmp(argv[i], "user=", 5)) {
+			user = argv[i] + 5;
+		} else if (!strncmp(argv[i], "rounds=", 7)) {
+			rounds = atoi(argv[i] + 7);
+			if (rounds < 1) rounds = 1;
+		} else if (!strcmp(argv[i], "help")) {
+			usage();
+			return 0;
+		} else {
+			args[nargs++] = argv[i];
+		}
+	}
+
+	conf = pk_configure(nargs, args);
+	if (!conf || !conf->ctx) {
+		fprintf(stderr, "Cannot load configuration\n");
+		return 2;
+	}
+	root = scconf_find_block(conf->ctx, NULL, "pam_pkcs11");
+	if (!root) {
+		fprintf(stderr, "No pam_pkcs11 block in %s\n", conf->config_file);
+		return 2;
+	}
+	chain = load_mappers(conf->ctx);
+	printf("Configuration: %s\n", conf->config_file);
+
+	/* stages in chain order; entries which did not load are reported */
+	for (list = scconf_find_list(root, "use_mappers"); list; list = list->next) {
+		for (item = chain; item; item = item->next)
+			if (!strcmp(item->module->module_name, list->data)) break;
+		if (!item) {
+			warn("mapper '%s' could not be loaded and is skipped", list->data);
+			continue;
+		}
+		if (nstages == MAX_STAGES) break;
+		stages[nstages].name = item->module->module_name;
+		stages[nstages].module = item->module;
+		mapper_type(item->module, stages[nstages].type, sizeof(stages[nstages].type));
+		blocks = scconf_find_blocks(conf->ctx, root, "mapper", list->data);
+		classify_mapper(&stages[nstages], blocks ? blocks[0] : NULL);
+		free(blocks);
+		nstages++;
+	}
+	if (!nstages) warn("no mapper in use_mappers could be loaded");
+
+	vcost = verify_cost(conf, notes, sizeof(notes));
+
+	printf("\n%-20s %-13s %-13s %s\n", "Stage", "Find", "Match", "Notes");
+	printf("%-20s %-13s %-13s %s\n", "verify",
+		cost_names[vcost], cost_names[vcost], notes);
+	for (i = 0; i < nstages; i++) {
+		char label[64];
+		snprintf(label, sizeof(label), "mapper %s", stages[i].name);
+		printf("%-20s %-13s %-13s %s\n", label, cost_names[stages[i].find],
+			cost_names[stages[i].match], stages[i].notes);
+	}
+	if (nstages || nfindings) printf("\n");
+
+	check_order("find", 1);
+	check_order("match", 0);
+	budget = scconf_get_int(root, "mapping_budget", 0);
+	for (i = 0; i < nstages; i++) {
+		int cost = stages[i].find > stages[i].match ? stages[i].find : stages[i].match;
+		deadline = stages[i].module->timeout;
+		if (!honours_deadline(&stages[i])) {
+			if (cost < COST_FILE || (deadline <= 0 && budget <= 0)) continue;
+			warn("mapper '%s' (%s) does not honour deadlines: it runs to completion, "
+				"and its timeout or mapping_budget only turns a late answer into "
+				"no match", stages[i].name, cost_names[cost]);
+			continue;
+		}
+		if (cost < COST_NETWORK) continue;
+		if (deadline <= 0 && budget <= 0)
+			warn("mapper '%s' waits on the network without a deadline: "
+				"set mapper_timeout, its timeout or mapping_budget", stages[i].name);
+	}
+	if (!scconf_get_bool(root, "mapper_cache", 0)) {
+		for (i = 0; i < nstages; i++)
+			if (stages[i].index) break;
+		if (i < nstages)
+			note("mapper_cache is not set: map file indexes are rebuilt at every "
+				"authentication");
+	}
+	if (conf->module_cache_timeout <= 0)
+		note("module_cache_timeout is not set: the PKCS#11 module is loaded and "
+			"initialised at every authentication");
+	for (i = 0; i < nfindings; i++) {
+		printf("%s\n", findings[i]);
+		free(findings[i]);
+	}
+
+	if (cert_file) {
+#ifndef HAVE_NSS
+		X509 *x509 = load_certificate(cert_file);
+		if (x509) {
+			probe(conf, x509, user, rounds);
+			X509_free(x509);
+		}
+#else
+		printf("\nprobes need an OpenSSL build of pam_pkcs11\n");
+#endif
+	}
+	unload_mappers();
+	free(args);
+	return warnings ? 1 : 0;
+}
@@ -0,0 +1,594 @@
+/*
+ * PKCS #11 PAM Login Module
+ * CRL synchronisation tool
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * $Id$
+ */
+
+/*
+* Keeps crl_dir up to date for the offline revocation checks: collects
+* the CRL distribution points of every CA certificate found in ca_dir and
+* of the sample certificates given with cert=, downloads the CRLs concurrently (with conditional requests, so that an
+* unchanged CRL is not transferred again), verifies each one against its
+* issuer in ca_dir, and installs it in crl_dir with an atomic rename and
+* a <hash>.rN link, as pkcs11_make_hash_link would. Each distribution
+* point has its own file, since an issuer may partition its CRL.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include "../scconf/scconf.h"
+#include "../common/debug.h"
+#include "../common/error.h"
+#include "../common/uri.h"
+
+#ifndef HAVE_NSS
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#include "../common/pam-pkcs11-ossl-compat.h"
+#endif
+
+#define PAM_PKCS11_CONF CONFDIR "/pam_pkcs11.conf"
+#define DEFAULT_JOBS 4
+
+#ifndef HAVE_NSS
+
+enum { SYNC_FAILED = 0, SYNC_INSTALLED, SYNC_UNCHANGED, SYNC_NOT_MODIFIED };
+
+static const char *status_names[] = {
+	"failed", "installed", "unchanged", "not modified"
+};
+
+struct sync_job {
+	char *uri;
+	unsigned long issuer_hash;	/* expected CRL issuer, 0 if unknown */
+	int status;
+	char message[256];
+};
+
+static STACK_OF(X509) *cas = NULL;
+static STACK_OF(X509) *samples = NULL;	/* certificates issued by the CAs */
+static struct sync_job *jobs = NULL;
+static int njobs = 0;
+static int next_job = 0;
+static const char *crl_dir = NULL;
+static int force = 0;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t install_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* keep a certificate read from a file, once, and only a CA one if ca_only */
+static void keep_cert(STACK_OF(X509) *stack, X509 *x509, int ca_only) {
+	int i;
+
+	for (i = 0; i < sk_X509_num(stack); i++) {
+		if (!X509_cmp(sk_X509_value(stack, i), x509)) break;
+	}
+	/* hash links make most certificates appear twice */
+	if (i < sk_X509_num(stack) || (ca_only && X509_check_ca(x509) <= 0)) {
+		X509_free(x509);
+		return;
+	}
+	sk_X509_push(stack, x509);
+}
+
+/* read every certificate of a PEM or DER file */
+static void load_cert_file(const char *path, STACK_OF(X509) *stack, int ca_only) {
+	X509 *x509;
+	FILE *fd;
+	int n = 0;
+
+	fd = fopen(path, "r");
+	if (!fd) return;
+	while ((x509 = PEM_read_X509(fd, NULL, NULL, NULL)) != NULL) {
+		n++;
+		keep_cert(stack, x509, ca_only);
+	}
+	ERR_clear_error();
+	if (!n) {
+		rewind(fd);
+		x509 = d2i_X509_fp(fd, NULL);
+		ERR_clear_error();
+		if (x509) keep_cert(stack, x509, ca_only);
+	}
+	fclose(fd);
+}
+
+/* read the certificates of a file, or of every file of a directory */
+static int load_certs(const char *path, STACK_OF(X509) *stack, int ca_only) {
+	struct dirent *entry;
+	char file[1024];
+	DIR *d;
+
+	if (is_dir(path) <= 0) {
+		if (is_file(path) <= 0) {
+			fprintf(stderr, "Cannot read %s\n", path);
+			return -1;
+		}
+		load_cert_file(path, stack, ca_only);
+		return 0;
+	}
+	d = opendir(path);
+	if (!d) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+		snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+		if (is_file(file) <= 0) continue;
+		load_cert_file(file, stack, ca_only);
+	}
+	closedir(d);
+	return 0;
+}
+
+/* FNV-1a, to tell apart the distribution points of one issuer */
+static unsigned long dp_hash(const char *uri) {
+	unsigned int h = 0x811c9dc5U;
+	for (; *uri; uri++) {
+		h ^= (unsigned char)*uri;
+		h *= 0x01000193U;
+	}
+	return h;
+}
+
+/* file of the CRL of an issuer downloaded from a distribution point */
+static void crl_file(char *buf, size_t size, unsigned long hash, const char *uri) {
+	snprintf(buf, size, "crl_%08lx_%08lx.pem", hash, dp_hash(uri));
+}
+
+static int load_cas(const char *dir) {
+	if (is_dir(dir) <= 0) {
+		fprintf(stderr, "Cannot open ca_dir %s\n", dir);
+		return -1;
+	}
+	if (load_certs(dir, cas, 1) < 0) return -1;
+	DBG1("%d CA certificate(s) loaded", sk_X509_num(cas));
+	return sk_X509_num(cas);
+}
+
+static int add_job(const char *uri, unsigned long issuer_hash) {
+	struct sync_job *pt;
+	int i;
+
+	for (i = 0; i < njobs; i++) {
+		if (!strcmp(jobs[i].uri, uri)) return 0;
+	}
+	pt = realloc(jobs, (njobs + 1) * sizeof(struct sync_job));
+	if (!pt) return -1;
+	jobs = pt;
+	memset(&jobs[njobs], 0, sizeof(struct sync_job));
+	jobs[njobs].uri = strdup(uri);
+	if (!jobs[njobs].uri) return -1;
+	jobs[njobs].issuer_hash = issuer_hash;
+	njobs++;
+	return 0;
+}
+
+/*
+* the distribution points of a certificate give the CRLs of its issuer,
+* so the issuer of the downloaded CRL is known in advance
+*/
+static int add_distribution_points(X509 *x509) {
+	STACK_OF(DIST_POINT) *dist_points;
+	DIST_POINT *point;
+	GENERAL_NAME *name;
+	int j, k;
+
+	dist_points = X509_get_ext_d2i(x509, NID_crl_distribution_points, NULL, NULL);
+	if (!dist_points) return 0;
+	for (j = 0; j < sk_DIST_POINT_num(dist_points); j++) {
+		point = sk_DIST_POINT_value(dist_points, j);
+		if (!point->distpoint || point->distpoint->type != 0) continue;
+		for (k = 0; k < sk_GENERAL_NAME_num(point->distpoint->name.fullname); k++) {
+			name = sk_GENERAL_NAME_value(point->distpoint->name.fullname, k);
+			if (name->type != GEN_URI) continue;
+			if (add_job((const char *)name->d.ia5->data,
+				X509_NAME_hash(X509_get_issuer_name(x509))) < 0) {
+				sk_DIST_POINT_pop_free(dist_points, DIST_POINT_free);
+				return -1;
+			}
+		}
+	}
+	sk_DIST_POINT_pop_free(dist_points, DIST_POINT_free);
+	return 0;
+}
+
+/*
+* A CA certificate only gives the CRL of the CA above it: the CRL of a CA
+* issuing user certificates is listed in those certificates, hence the
+* samples.
+*/
+static int collect_distribution_points(void) {
+	int i;
+
+	for (i = 0; i < sk_X509_num(cas); i++) {
+		if (add_distribution_points(sk_X509_value(cas, i)) < 0) return -1;
+	}
+	for (i = 0; i < sk_X509_num(samples); i++) {
+		if (add_distribution_points(sk_X509_value(samples, i)) < 0) return -1;
+	}
+	return 0;
+}
+
+static X509_CRL *parse_crl(unsigned char *data, size_t length) {
+	const unsigned char *p = data;
+	X509_CRL *crl;
+	BIO *bio;
+
+	bio = BIO_new_mem_buf(data, length);
+	crl = bio ? PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL) : NULL;
+	BIO_free(bio);
+	if (!crl) crl = d2i_X509_CRL(NULL, &p, length);
+	ERR_clear_error();
+	return crl;
+}
+
+static X509_CRL *read_crl_file(const char *path) {
+	X509_CRL *crl;
+	FILE *fd;
+
+	fd = fopen(path, "r");
+	if (!fd) return NULL;
+	crl = PEM_read_X509_CRL(fd, NULL, NULL, NULL);
+	fclose(fd);
+	ERR_clear_error();
+	return crl;
+}
+
+/* a CRL is only installed if signed by a CA of ca_dir and current */
+static int check_crl(X509_CRL *crl, char *message, size_t size) {
+	EVP_PKEY *pkey;
+	X509 *ca;
+	int i, rv = 0;
+
+	for (i = 0; i < sk_X509_num(cas) && rv != 1; i++) {
+		ca = sk_X509_value(cas, i);
+		if (X509_NAME_cmp(X509_get_subject_name(ca), X509_CRL_get_issuer(crl)))
+			continue;
+		pkey = X509_get_pubkey(ca);
+		if (!pkey) continue;
+		rv = X509_CRL_verify(crl, pkey);
+		EVP_PKEY_free(pkey);
+	}
+	ERR_clear_error();
+	if (rv != 1) {
+		snprintf(message, size, "not signed by any CA of ca_dir");
+		return -1;
+	}
+	if (X509_cmp_current_time(X509_CRL_get0_lastUpdate(crl)) >= 0) {
+		snprintf(message, size, "not yet valid");
+		return -1;
+	}
+	if (X509_CRL_get0_nextUpdate(crl) &&
+		X509_cmp_current_time(X509_CRL_get0_nextUpdate(crl)) <= 0) {
+		snprintf(message, size, "expired");
+		return -1;
+	}
+	return 0;
+}
+
+/* make sure one <hash>.rN link points to file, replacing nothing else */
+static int link_crl(unsigned long hash, const char *file) {
+	char link[1024], tmp[1024], target[1024];
+	ssize_t len;
+	int n;
+
+	for (n = 0; ; n++) {
+		snprintf(link, sizeof(link), "%s/%08lx.r%d", crl_dir, hash, n);
+		len = readlink(link, target, sizeof(target) - 1);
+		if (len >= 0) {
+			target[len] = '\0';
+			if (!strcmp(target, file)) return 0;
+			continue;
+		}
+		if (errno == ENOENT) break;
+		/* regular file installed by hand: leave it alone */
+		if (errno == EINVAL) continue;
+		set_error("readlink(%s) failed: %s", link, strerror(errno));
+		return -1;
+	}
+	snprintf(tmp, sizeof(tmp), "%s/.%08lx.r%d.%ld", crl_dir, hash, n, (long)getpid());
+	unlink(tmp);
+	if (symlink(file, tmp) < 0 || rename(tmp, link) < 0) {
+		set_error("cannot create %s: %s", link, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static int install_crl(struct sync_job *job, X509_CRL *crl) {
+	char file[64], path[1024], tmp[1024];
+	unsigned long hash;
+	X509_CRL *old;
+	int day, sec, fdn;
+	FILE *fd;
+
+	hash = X509_NAME_hash(X509_CRL_get_issuer(crl));
+	crl_file(file, sizeof(file), hash, job->uri);
+	snprintf(path, sizeof(path), "%s/%s", crl_dir, file);
+
+	pthread_mutex_lock(&install_mutex);
+	/* a mirror may serve an older CRL than the one installed: keep the newest */
+	old = read_crl_file(path);
+	if (old) {
+		if (X509_NAME_cmp(X509_CRL_get_issuer(old), X509_CRL_get_issuer(crl))) {
+			X509_CRL_free(old);
+			pthread_mutex_unlock(&install_mutex);
+			snprintf(job->message, sizeof(job->message),
+				"%s holds the CRL of another issuer", path);
+			return SYNC_FAILED;
+		}
+		if (ASN1_TIME_diff(&day, &sec, X509_CRL_get0_lastUpdate(old),
+			X509_CRL_get0_lastUpdate(crl)) && day <= 0 && sec <= 0) {
+			X509_CRL_free(old);
+			/* still current: remember when it was last checked */
+			if (!day && !sec) utime(path, NULL);
+			pthread_mutex_unlock(&install_mutex);
+			return link_crl(hash, file) < 0 ? SYNC_FAILED : SYNC_UNCHANGED;
+		}
+		X509_CRL_free(old);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", crl_dir, file);
+	fdn = mkstemp(tmp);
+	if (fdn < 0 || !(fd = fdopen(fdn, "w"))) {
+		snprintf(job->message, sizeof(job->message), "cannot create %s: %s",
+			tmp, strerror(errno));
+		if (fdn >= 0) {
+			close(fdn);
+			unlink(tmp);
+		}
+		pthread_mutex_unlock(&install_mutex);
+		return SYNC_FAILED;
+	}
+	fchmod(fdn, 0644);
+	if (!PEM_write_X509_CRL(fd, crl) || fflush(fd) != 0 || fsync(fdn) < 0 ||
+		fclose(fd) != 0 || rename(tmp, path) < 0) {
+		snprintf(job->message, sizeof(job->message), "cannot store %s: %s",
+			path, strerror(errno));
+		unlink(tmp);
+		pthread_mutex_unlock(&install_mutex);
+		return SYNC_FAILED;
+	}
+	if (link_crl(hash, file) < 0) {
+		pthread_mutex_unlock(&install_mutex);
+		return SYNC_FAILED;
+	}
+	pthread_mutex_unlock(&install_mutex);
+	snprintf(job->message, sizeof(job->message), "%s", path);
+	return SYNC_INSTALLED;
+}
+
+static void run_job(struct sync_job *job) {
+	unsigned char *data = NULL;
+	size_t length = 0;
+	char file[64], path[1024];
+	struct stat st;
+	time_t since = 0;
+	X509_CRL *crl;
+	int rv;
+
+	if (!force && job->issuer_hash) {
+		crl_file(file, sizeof(file), job->issuer_hash, job->uri);
+		snprintf(path, sizeof(path), "%s/%s", crl_dir, file);
+		if (stat(path, &st) == 0) since = st.st_mtime;
+	}
+	DBG2("downloading %s (since %ld)", job->uri, (long)since);
+	rv = get_from_uri_since(job->uri, since, &data, &length);
+	if (rv < 0) {
+		job->status = SYNC_FAILED;
+		return;
+	}
+	if (rv == 1) {
+		job->status = SYNC_NOT_MODIFIED;
+		return;
+	}
+	crl = parse_crl(data, length);
+	free(data);
+	if (!crl) {
+		snprintf(job->message, sizeof(job->message), "not a CRL");
+		job->status = SYNC_FAILED;
+		return;
+	}
+	if (check_crl(crl, job->message, sizeof(job->message)) < 0) {
+		job->status = SYNC_FAILED;
+	} else {
+		job->status = install_crl(job, crl);
+	}
+	X509_CRL_free(crl);
+}
+
+static void *worker(void *arg) {
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job_mutex);
+		i = next_job < njobs ? next_job++ : -1;
+		pthread_mutex_unlock(&job_mutex);
+		if (i < 0) break;
+		/* errors of the job land in its message */
+		set_error_buffer(jobs[i].message, sizeof(jobs[i].message));
+		run_job(&jobs[i]);
+		set_error_buffer(NULL, 0);
+	}
+	return NULL;
+}
+
+#endif /* HAVE_NSS */
+
+/* ca_dir and crl_dir of the pkcs11 module in use in pam_pkcs11.conf */
+static int read_pam_config(const char *file, const char **ca_dir, const char **crl) {
+	const scconf_block *root;
+	scconf_block **blocks;
+	scconf_context *ctx;
+	const char *module;
+
+	ctx = scconf_new(file);
+	if (!ctx || scconf_parse(ctx) <= 0) {
+		fprintf(stderr, "Cannot parse %s\n", file);
+		return -1;
+	}
+	root = scconf_find_block(ctx, NULL, "pam_pkcs11");
+	if (!root) return 0;
+	module = scconf_get_str(root, "use_pkcs11_module", "default");
+	blocks = scconf_find_blocks(ctx, root, "pkcs11_module", module);
+	if (blocks && blocks[0]) {
+		/* the context is kept: strings point into it */
+		*ca_dir = scconf_get_str(blocks[0], "ca_dir", *ca_dir);
+		*crl = scconf_get_str(blocks[0], "crl_dir", *crl);
+	}
+	free(blocks);
+	return 0;
+}
+
+static void usage(void) {
+	printf("usage: pkcs11_crl_sync [config_file=<file>] [ca_dir=<dir>] [crl_dir=<dir>]\n"
+	       "                       [cert=<file or dir>]... [uri=<crl uri>]... [jobs=<n>]\n"
+	       "                       [force] [verbose] [debug]\n");
+}
+
+int main(int argc, const char **argv) {
+	const char *config_file = PAM_PKCS11_CONF;
+	const char *ca_dir = CONFDIR "/cacerts";
+	const char *crl = CONFDIR "/crls";
+	const char *ca_arg = NULL, *crl_arg = NULL;
+	int nthreads = DEFAULT_JOBS, verbose = 0, i;
+#ifndef HAVE_NSS
+	pthread_t *threads;
+	int counts[4] = { 0, 0, 0, 0 };
+
+	cas = sk_X509_new_null();
+	samples = sk_X509_new_null();
+	if (!cas || !samples) {
+		fprintf(stderr, "not enough free memory available\n");
+		return 1;
+	}
+#endif
+
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "config_file=", 12)) {
+			config_file = argv[i] + 12;
+		}
+	}
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "debug")) {
+			set_debug_level(1);
+		} else if (!strcmp(argv[i], "verbose")) {
+			verbose = 1;
+		} else if (!strcmp(argv[i], "force")) {
+#ifndef HAVE_NSS
+			force = 1;
+#endif
+		} else if (!strncmp(argv[i], "config_file=", 12)) {
+			continue;
+		} else if (!strncmp(argv[i], "ca_dir=", 7)) {
+			ca_arg = argv[i] + 7;
+		} else if (!strncmp(argv[i], "crl_dir=", 8)) {
+			crl_arg = argv[i] + 8;
+		} else if (!strncmp(argv[i], "jobs=", 5)) {
+			nthreads = atoi(argv[i] + 5);
+		} else if (!strncmp(argv[i], "cert=", 5)) {
+#ifndef HAVE_NSS
+			/* certificates issued by the CAs, listing the CRLs of their issuer */
+			if (load_certs(argv[i] + 5, samples, 0) < 0)
+				return 1;
+#endif
+		} else if (!strncmp(argv[i], "uri=", 4)) {
+#ifndef HAVE_NSS
+			/* extra distribution point, e.g. the CRL of end user certificates */
+			if (add_job(argv[i] + 4, 0) < 0) {
+				fprintf(stderr, "not enough free memory available\n");
+				return 1;
+			}
+#endif
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (read_pam_config(config_file, &ca_dir, &crl) < 0)
+		return 1;
+	if (ca_arg) ca_dir = ca_arg;
+	if (crl_arg) crl = crl_arg;
+	if (nthreads < 1) nthreads = 1;
+
+#ifdef HAVE_NSS
+	fprintf(stderr, "pkcs11_crl_sync is not available with NSS: "
+		"CRLs are stored in the NSS database (see crlutil)\n");
+	return 1;
+#else
+	crl_dir = crl;
+	if (is_dir(crl_dir) <= 0) {
+		fprintf(stderr, "crl_dir %s is not a directory\n", crl_dir);
+		return 1;
+	}
+	if (load_cas(ca_dir) < 0 || collect_distribution_points() < 0)
+		return 1;
+	if (!njobs) {
+		printf("no CRL distribution point found\n");
+		return 0;
+	}
+	if (nthreads > njobs) nthreads = njobs;
+	/* not thread safe: must be done before the workers start */
+	if (uri_global_init() < 0) {
+		fprintf(stderr, "%s\n", get_error());
+		return 1;
+	}
+	DBG2("%d distribution point(s), %d job(s)", njobs, nthreads);
+
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (!threads) {
+		fprintf(stderr, "not enough free memory available\n");
+		return 1;
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0) break;
+	}
+	/* no thread at all: do the work here */
+	if (i == 0) worker(NULL);
+	while (i-- > 0) pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < njobs; i++) {
+		counts[jobs[i].status]++;
+		if (jobs[i].status == SYNC_FAILED)
+			fprintf(stderr, "%s: %s\n", jobs[i].uri, jobs[i].message);
+		else if (verbose)
+			printf("%s: %s\n", jobs[i].uri, status_names[jobs[i].status]);
+		free(jobs[i].uri);
+	}
+	free(jobs);
+	sk_X509_pop_free(cas, X509_free);
+	sk_X509_pop_free(samples, X509_free);
+	printf("CRLs installed: %d, unchanged: %d, not modified: %d, failed: %d\n",
+		counts[SYNC_INSTALLED], counts[SYNC_UNCHANGED],
+		counts[SYNC_NOT_MODIFIED], counts[SYNC_FAILED]);
+	return counts[SYNC_FAILED] ? 1 : 0;
+#endif
+}
@@ -32,6 +32,8 @@
 #include "../common/pkcs11_lib.h"
 #include "../common/debug.h"
 #include "../common/error.h"
+#include "../common/session_registry.h"
+#include "../common/event_socket.h"
 
 #ifdef HAVE_NSS
 #include <secmod.h>
@@ -62,6 +64,10 @@ int daemonize;
 int debug;
 const char *cfgfile;
 char *pkcs11_module = NULL;
+const char *session_registry = NULL;
+const char *event_socket = NULL;
+const char *event_socket_group = NULL;
+int event_socket_mode = EVENT_SOCKET_MODE;
 #ifdef HAVE_NSS
 char *nss_dir = NULL;
 #endif
@@ -97,6 +103,7 @@ static void thats_all_folks(void)
 {
 	int rv;
 	DBG("Exitting");
+	event_socket_close();
 #ifdef HAVE_NSS
 	if (module)
 	{
@@ -125,6 +132,36 @@ static void thats_all_folks(void)
 	return;
 }
 
+/*
+ * export the sessions opened with the removed token to the card_remove
+ * actions. serial and label are as returned by C_GetTokenInfo()
+ */
+static void export_sessions(const char *serial, const char *label,
+	const char *slot)
+{
+	char value[65], key[3][128];
+	const char *keys[3] = { NULL, NULL, NULL };
+	int n = 0;
+
+	if (!session_registry)
+		return;
+	snprintf(value, sizeof(value), "%.16s", serial);
+	keys[n] = session_registry_key(key[n], sizeof(key[n]),
+		SESSION_KEY_TOKEN, value);
+	if (!keys[n])
+	{
+		snprintf(value, sizeof(value), "%.32s", label);
+		keys[n] = session_registry_key(key[n], sizeof(key[n]),
+			SESSION_KEY_LABEL, value);
+	}
+	if (keys[n])
+		n++;
+	snprintf(value, sizeof(value), "%.64s", slot);
+	keys[n] = session_registry_key(key[n], sizeof(key[n]),
+		SESSION_KEY_SLOT, value);
+	session_registry_export(session_registry, keys);
+}
+
 extern char **environ;
 static int my_system(char *command)
 {
@@ -264,6 +301,11 @@ static int parse_config_file(void)
 #ifdef HAVE_NSS
 	nss_dir = (char *) scconf_get_str(root, "nss_dir", nss_dir);
 #endif
+	session_registry = scconf_get_str(root, "session_registry", NULL);
+	event_socket = scconf_get_str(root, "event_socket", event_socket);
+	event_socket_group = scconf_get_str(root, "event_socket_group", NULL);
+	event_socket_mode = (int) strtol(scconf_get_str(root,
+		"event_socket_mode", "0660"), NULL, 8);
 	if (debug)
 		set_debug_level(1);
 	return 0;
@@ -330,6 +372,11 @@ static int parse_args(int argc, char *argv[])
 			pkcs11_module = 1 + strchr(argv[i], '=');
 			continue;
 		}
+		if (strstr(argv[i], "event_socket="))
+		{
+			event_socket = 1 + strchr(argv[i], '=');
+			continue;
+		}
 #ifdef HAVE_NSS
 		if (strstr(argv[i], "nss_dir="))
 		{
@@ -354,7 +401,7 @@ static int parse_args(int argc, char *argv[])
 		/* arriving here means syntax error */
 		fprintf(stderr, "PKCS#11 Event Manager\n\n");
 		fprintf(stderr,
-			"Usage %s [[no]debug] [[no]daemon] [polling_time=<time>] [expire_time=<limit>] [config_file=<file>] [pkcs11_module=<module>]\n",
+			"Usage %s [[no]debug] [[no]daemon] [polling_time=<time>] [expire_time=<limit>] [config_file=<file>] [pkcs11_module=<module>] [event_socket=<file>]\n",
 			argv[0]);
 		fprintf(stderr,
 			"\n\nDefaults: debug=0 daemon=0 polltime=%d (ms) expiretime=0 (none) config_file=%s pkcs11_module=%s\n",
@@ -371,42 +418,86 @@ struct SlotStatusStr
 	CK_SLOT_ID slotID;
 	PRUint32 series;
 	int present;
+	/* insertions and removals handled so far */
+	unsigned long generation;
+	/* last event batch the slot was queued in */
+	unsigned long batch;
+	/* token seen on insertion, to find its sessions on removal */
+	char serial[17];
+	char label[33];
+	char slot[65];
+	struct SlotStatusStr *next;
 };
 
-struct SlotStatusStr *slotStatus = NULL;
-int slotCount = 0;
-int maxEntries = 0;
+/*
+* Slot status is kept in a hash table indexed by slot ID: modules such as
+* HSM appliances may expose thousands of slots. Entries are allocated one
+* by one, so that pointers to them survive a resize.
+*/
+static struct SlotStatusStr **slotTable = NULL;
+static unsigned int tableSize = 0;	/* always a power of two */
+static unsigned int slotCount = 0;
+
+#define TABLE_MIN_SIZE 64
+
+/* maximum number of pending events handled in one pass */
+#define EVENT_BATCH 256
+
+static unsigned int hash_slot(CK_SLOT_ID slotID)
+{
+	unsigned long h = (unsigned long) slotID;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	return (unsigned int) h & (tableSize - 1);
+}
 
 static int do_expand_slot_status(void)
 {
-#define ENTRY_STEP 10
-	struct SlotStatusStr *tmp;
-	tmp = (struct SlotStatusStr *)
-		realloc(slotStatus,
-		(maxEntries + ENTRY_STEP) * sizeof(struct SlotStatusStr));
-	if (!tmp)
+	struct SlotStatusStr **old = slotTable, *entry, *next;
+	unsigned int oldSize = tableSize, i, h;
+	unsigned int newSize = tableSize ? tableSize * 2 : TABLE_MIN_SIZE;
+
+	slotTable = calloc(newSize, sizeof(struct SlotStatusStr *));
+	if (!slotTable)
 	{
+		slotTable = old;
 		return 0;
 	}
-	slotStatus = tmp;
-	maxEntries += ENTRY_STEP;
+	tableSize = newSize;
+	for (i = 0; i < oldSize; i++)
+	{
+		for (entry = old[i]; entry; entry = next)
+		{
+			next = entry->next;
+			h = hash_slot(entry->slotID);
+			entry->next = slotTable[h];
+			slotTable[h] = entry;
+		}
+	}
+	free(old);
+	DBG1("slot status table resized to %u buckets", tableSize);
 	return 1;
 }
 
 static struct SlotStatusStr *get_token_status(CK_SLOT_ID slotID)
 {
-	/* linear search is ok for modules with few slots, if we have modules with
-	 * thousands of slots or more, we would need to revisit this */
-	int i;
+	struct SlotStatusStr *entry;
+	unsigned int h;
 
-	for (i = 0; i < slotCount; i++)
+	if (tableSize)
 	{
-		if (slotStatus[i].slotID == slotID)
+		for (entry = slotTable[hash_slot(slotID)]; entry; entry = entry->next)
 		{
-			return &slotStatus[i];
+			if (entry->slotID == slotID)
+			{
+				return entry;
+			}
 		}
 	}
-	if (slotCount >= maxEntries)
+	/* keep the load factor under 3/4 */
+	if (4 * (slotCount + 1) > 3 * tableSize)
 	{
 		if (!do_expand_slot_status())
 		{
@@ -414,11 +505,78 @@ static struct SlotStatusStr *get_token_status(CK_SLOT_ID slotID)
 		}
 	}
 
-	i = slotCount++;
-	slotStatus[i].slotID = slotID;
-	slotStatus[i].present = 0;
-	slotStatus[i].series = 0;
-	return &slotStatus[i];
+	entry = calloc(1, sizeof(struct SlotStatusStr));
+	if (!entry)
+	{
+		return NULL;
+	}
+	entry->slotID = slotID;
+	h = hash_slot(slotID);
+	entry->next = slotTable[h];
+	slotTable[h] = entry;
+	slotCount++;
+	return entry;
+}
+
+/* act on the current state of a slot that reported an event */
+static void handle_slot_event(PK11SlotInfo *slot, struct SlotStatusStr *slotStatus)
+{
+	/* if the slot is present, see if it was just removed */
+	if (PK11_IsPresent(slot))
+	{
+		PRUint32 series = PK11_GetSlotSeries(slot);
+
+		/* skip spurious insert events */
+		if (series != slotStatus->series)
+		{
+#ifdef notdef
+			/* if one was already present, remove it
+			 * This can happen if you pull the token and insert it
+			 * before the PK11_IsPresent call above */
+			if (slotStatus->present)
+			{
+				DBG("Card removed, ");
+				execute_event("card_remove");
+			}
+#endif
+			CK_TOKEN_INFO tinfo;
+
+			if (PK11_GetTokenInfo(slot, &tinfo) == SECSuccess)
+			{
+				snprintf(slotStatus->serial, sizeof(slotStatus->serial),
+					"%.16s", (char *) tinfo.serialNumber);
+				snprintf(slotStatus->label, sizeof(slotStatus->label),
+					"%.32s", (char *) tinfo.label);
+			}
+			snprintf(slotStatus->slot, sizeof(slotStatus->slot), "%s",
+				PK11_GetSlotName(slot));
+			slotStatus->generation++;
+			DBG2("Card inserted in slot %lu (generation %lu), ",
+				slotStatus->slotID, slotStatus->generation);
+			event_socket_publish("card_insert", slotStatus->slot,
+				slotStatus->label, slotStatus->serial, NULL);
+			execute_event("card_insert");
+		}
+		slotStatus->series = series;
+		slotStatus->present = 1;
+	}
+	else
+	{
+		if (slotStatus->present)
+		{
+			slotStatus->generation++;
+			DBG2("Card removed from slot %lu (generation %lu), ",
+				slotStatus->slotID, slotStatus->generation);
+			event_socket_publish("card_remove", slotStatus->slot,
+				slotStatus->label, slotStatus->serial, NULL);
+			export_sessions(slotStatus->serial, slotStatus->label,
+				slotStatus->slot);
+			execute_event("card_remove");
+			session_registry_unexport();
+		}
+		slotStatus->series = 0;
+		slotStatus->present = 0;
+	}
 }
 #else
 /*
@@ -441,6 +599,48 @@ static int get_a_token(void)
 		return CARD_PRESENT;
 	return CARD_NOT_PRESENT;
 }
+
+/* token seen on insertion, to find its sessions on removal */
+char token_serial[17];
+char token_label[33];
+char token_slot[65];
+
+/*
+* remember serial, label and slot of the first available token
+*/
+static void remember_token(void)
+{
+	CK_SLOT_ID slot, *slots;
+	CK_SLOT_INFO sinfo;
+	CK_TOKEN_INFO tinfo;
+	unsigned long num_tokens = 0;
+
+	token_serial[0] = token_label[0] = token_slot[0] = '\0';
+	if (ph->fl->C_GetSlotList(TRUE, NULL, &num_tokens) != CKR_OK
+		|| num_tokens < 1)
+		return;
+	slots = malloc(num_tokens * sizeof(CK_SLOT_ID));
+	if (!slots)
+		return;
+	if (ph->fl->C_GetSlotList(TRUE, slots, &num_tokens) != CKR_OK
+		|| num_tokens < 1)
+	{
+		free(slots);
+		return;
+	}
+	slot = slots[0];
+	free(slots);
+	if (ph->fl->C_GetSlotInfo(slot, &sinfo) == CKR_OK)
+		snprintf(token_slot, sizeof(token_slot), "%.64s",
+			(char *) sinfo.slotDescription);
+	if (ph->fl->C_GetTokenInfo(slot, &tinfo) == CKR_OK)
+	{
+		snprintf(token_serial, sizeof(token_serial), "%.16s",
+			(char *) tinfo.serialNumber);
+		snprintf(token_label, sizeof(token_label), "%.32s",
+			(char *) tinfo.label);
+	}
+}
 #endif
 
 int main(int argc, char *argv[])
@@ -522,6 +722,18 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* publish events to subscribers */
+	if (event_socket && event_socket_open(event_socket,
+		event_socket_group, event_socket_mode) < 0)
+	{
+		fprintf(stderr, "%s\n", get_error());
+		SECMOD_DestroyModule(module);
+		NSS_Shutdown();
+		if (ctx)
+			scconf_free(ctx);
+		return 1;
+	}
+
 #ifdef HAVE_DAEMON
 	if (daemonize)
 	{
@@ -529,6 +741,7 @@ int main(int argc, char *argv[])
 		if (daemon(0, debug) < 0)
 		{
 			DBG1("Error in daemon() call: %s", strerror(errno));
+			event_socket_close();
 			SECMOD_DestroyModule(module);
 			rv = NSS_Shutdown();
 			if (ctx)
@@ -548,7 +761,11 @@ int main(int argc, char *argv[])
 	{
 		/* wait for any token uses C_WaitForSlotEvent if the token supports it.
 		 * otherwise it polls by hand*/
+		static unsigned long batch = 0;
+		PK11SlotInfo *pending[EVENT_BATCH];
+		struct SlotStatusStr *status[EVENT_BATCH];
 		struct SlotStatusStr *slotStatus;
+		int i, count = 0;
 		PK11SlotInfo *slot = SECMOD_WaitForAnyTokenEvent(module, 0,
 			PR_SecondsToInterval(polling_time));
 
@@ -557,45 +774,47 @@ int main(int argc, char *argv[])
 		{
 			break;
 		}
+		event_socket_accept();
 
-		/* examine why we got the event */
-		slotStatus = get_token_status(PK11_GetSlotID(slot));
-
-		/* if the slot is present, see if it was just removed */
-		if (PK11_IsPresent(slot))
+		/* drain the events already pending, so that a burst of changes
+		 * is handled in one pass and each slot only once */
+		batch++;
+		while (slot != NULL)
 		{
-			PRUint32 series = PK11_GetSlotSeries(slot);
-
-			/* skip spurious insert events */
-			if (series != slotStatus->series)
+			/* examine why we got the event */
+			slotStatus = get_token_status(PK11_GetSlotID(slot));
+			if (slotStatus == NULL)
 			{
-#ifdef notdef
-				/* if one was already present, remove it
-				 * This can happen if you pull the token and insert it
-				 * before the PK11_IsPresent call above */
-				if (slotStatus->present)
-				{
-					DBG("Card removed, ");
-					execute_event("card_remove");
-				}
-#endif
-				DBG("Card inserted, ");
-				execute_event("card_insert");
+				DBG("Not enough memory to track slot status");
+				PK11_FreeSlot(slot);
 			}
-			slotStatus->series = series;
-			slotStatus->present = 1;
-		}
-		else
-		{
-			if (slotStatus->present)
+			else if (slotStatus->batch == batch)
 			{
-				DBG("Card removed, ");
-				execute_event("card_remove");
+				/* already queued, its state is read when handled */
+				PK11_FreeSlot(slot);
+			}
+			else
+			{
+				slotStatus->batch = batch;
+				pending[count] = slot;
+				status[count++] = slotStatus;
+			}
+			if (count == EVENT_BATCH)
+			{
+				break;
 			}
-			slotStatus->series = 0;
-			slotStatus->present = 0;
+			slot = SECMOD_WaitForAnyTokenEvent(module, CKF_DONT_BLOCK, 0);
+		}
+		if (count > 1)
+		{
+			DBG1("Handling events of %d slots", count);
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			handle_slot_event(pending[i], status[i]);
+			PK11_FreeSlot(pending[i]);
 		}
-		PK11_FreeSlot(slot);
 	}
 	while (1);
 
@@ -618,6 +837,17 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* publish events to subscribers */
+	if (event_socket && event_socket_open(event_socket,
+		event_socket_group, event_socket_mode) < 0)
+	{
+		fprintf(stderr, "%s\n", get_error());
+		release_pkcs11_module(ph);
+		if (ctx)
+			scconf_free(ctx);
+		return 1;
+	}
+
 #ifdef HAVE_DAEMON
 	/* put my self into background if flag is set */
 	if (daemonize)
@@ -626,6 +856,7 @@ int main(int argc, char *argv[])
 		if (daemon(0, debug) < 0)
 		{
 			DBG1("Error in daemon() call: %s", strerror(errno));
+			event_socket_close();
 			release_pkcs11_module(ph);
 			if (ctx)
 				scconf_free(ctx);
@@ -665,6 +896,7 @@ int main(int argc, char *argv[])
 	do
 	{
 		sleep(polling_time);
+		event_socket_accept();
 		/* try to find an slot with available token(s) */
 		new_state = get_a_token();
 		if (new_state == CARD_ERROR)
@@ -695,6 +927,7 @@ int main(int argc, char *argv[])
 			if (expire_count >= expire_time)
 			{
 				DBG("Timeout on Card Removed ");
+				event_socket_publish("expire_time", NULL, NULL, NULL, NULL);
 				execute_event("expire_time");
 				expire_count = 0;	/*restart timer */
 			}
@@ -703,12 +936,18 @@ int main(int argc, char *argv[])
 		{						/* state changed; parse event */
 			old_state = new_state;
 			expire_count = 0;
+			if (new_state == CARD_PRESENT)
+				remember_token();
 			if (!first_loop++)
 				continue;		/*skip first pass */
 			if (new_state == CARD_NOT_PRESENT)
 			{
 				DBG("Card removed, ");
+				event_socket_publish("card_remove", token_slot,
+					token_label, token_serial, NULL);
+				export_sessions(token_serial, token_label, token_slot);
 				execute_event("card_remove");
+				session_registry_unexport();
 				/*
 				   some pkcs11's fails on reinsert card. To avoid this
 				   re-initialize library on card removal
@@ -730,6 +969,8 @@ int main(int argc, char *argv[])
 			if (new_state == CARD_PRESENT)
 			{
 				DBG("Card inserted, ");
+				event_socket_publish("card_insert", token_slot,
+					token_label, token_serial, NULL);
 				execute_event("card_insert");
 			}
 		}
@@ -0,0 +1,499 @@
+/*
+ * PKCS #11 PAM Login Module
+ * Incremental hash link maintenance for CA and CRL directories
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * $Id$
+ */
+
+/*
+* Creates a <hash>.N symbolic link for each CA certificate and a
+* <hash>.rN link for each CRL of a directory, as OpenSSL hash lookups
+* expect. Replaces the former shell script, which ran openssl twice per
+* file and rebuilt every link on each run.
+*
+* The subject hash of every file is kept in a cache file in the
+* directory, keyed by name, size, inode and mtime, and by content digest
+* when these change: only new or modified files are parsed. Links are
+* only created or replaced when their target changes, each one with an
+* atomic rename, and stale links are removed last, so the directory
+* always resolves every certificate while being updated.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/pem.h>
+#include <openssl/evp.h>
+#include <openssl/err.h>
+#include "../common/debug.h"
+#include "../common/pam-pkcs11-ossl-compat.h"
+
+#define CACHE_FILE ".pkcs11_hash_link.cache"
+
+#define TYPE_NONE 'n'	/* neither a CA certificate nor a CRL */
+#define TYPE_CA 'a'	/* basicConstraints CA, was 'c' for X509_check_ca() */
+#define TYPE_CRL 'r'
+
+struct file_entry {
+	char *name;
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+	char digest[2 * EVP_MAX_MD_SIZE + 1];
+	char type;
+	unsigned long hash;
+	int slot;	/* assigned link index */
+};
+
+struct link_entry {
+	char *name;
+	char *target;
+};
+
+static int verbose = 0;
+static int changes = 0;
+
+static int cmp_file_name(const void *a, const void *b) {
+	return strcmp(((const struct file_entry *)a)->name,
+		((const struct file_entry *)b)->name);
+}
+
+static int cmp_link_name(const void *a, const void *b) {
+	return strcmp(((const struct link_entry *)a)->name,
+		((const struct link_entry *)b)->name);
+}
+
+/* group files by link family, in name order inside a family */
+static int cmp_file_group(const void *a, const void *b) {
+	const struct file_entry *fa = a, *fb = b;
+	if (fa->type != fb->type) return fa->type - fb->type;
+	if (fa->hash != fb->hash) return fa->hash < fb->hash ? -1 : 1;
+	return strcmp(fa->name, fb->name);
+}
+
+/* "<8 hex>.N" or "<8 hex>.rN" */
+static int parse_link_name(const char *name, unsigned long *hash, char *type, int *n) {
+	const char *pt;
+	char *end;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (!strchr("0123456789abcdef", name[i]) || !name[i]) return 0;
+	}
+	if (name[8] != '.') return 0;
+	pt = name + 9;
+	*type = TYPE_CA;
+	if (*pt == 'r') {
+		*type = TYPE_CRL;
+		pt++;
+	}
+	if (*pt < '0' || *pt > '9') return 0;
+	*n = (int)strtol(pt, &end, 10);
+	if (*end) return 0;
+	*hash = strtoul(name, NULL, 16);
+	return 1;
+}
+
+static int load_cache(struct file_entry **cache) {
+	struct file_entry e, *pt;
+	char line[2048], *name;
+	long mtime, size, ino;
+	int i, n = 0, size_alloc = 0;
+	FILE *fd;
+
+	*cache = NULL;
+	fd = fopen(CACHE_FILE, "r");
+	if (!fd) return 0;
+	while (fgets(line, sizeof(line), fd)) {
+		memset(&e, 0, sizeof(e));
+		if (sscanf(line, "%128s %ld %ld %ld %c %lx", e.digest, &mtime, &size,
+			&ino, &e.type, &e.hash) != 6) continue;
+		/* older classification rules: parse the file again */
+		if (e.type != TYPE_NONE && e.type != TYPE_CA && e.type != TYPE_CRL) continue;
+		/* the name is the last field and may contain blanks */
+		for (i = 0, name = line; i < 6 && name; i++) {
+			name = strchr(name, ' ');
+			if (name) name++;
+		}
+		if (!name) continue;
+		name[strcspn(name, "\n")] = '\0';
+		if (n == size_alloc) {
+			size_alloc = size_alloc ? size_alloc * 2 : 256;
+			pt = realloc(*cache, size_alloc * sizeof(struct file_entry));
+			if (!pt) break;
+			*cache = pt;
+		}
+		e.name = strdup(name);
+		if (!e.name) break;
+		e.mtime = (time_t)mtime;
+		e.size = (off_t)size;
+		e.ino = (ino_t)ino;
+		e.slot = -1;
+		(*cache)[n++] = e;
+	}
+	fclose(fd);
+	qsort(*cache, n, sizeof(struct file_entry), cmp_file_name);
+	return n;
+}
+
+static int save_cache(struct file_entry *files, int count) {
+	char tmp[64];
+	FILE *fd;
+	int i, fdn;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", CACHE_FILE);
+	fdn = mkstemp(tmp);
+	if (fdn < 0 || !(fd = fdopen(fdn, "w"))) {
+		if (fdn >= 0) {
+			close(fdn);
+			unlink(tmp);
+		}
+		fprintf(stderr, "cannot create %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	fchmod(fdn, 0644);
+	for (i = 0; i < count; i++) {
+		fprintf(fd, "%s %ld %ld %ld %c %08lx %s\n", files[i].digest,
+			(long)files[i].mtime, (long)files[i].size, (long)files[i].ino,
+			files[i].type, files[i].hash, files[i].name);
+	}
+	if (fclose(fd) != 0 || rename(tmp, CACHE_FILE) < 0) {
+		fprintf(stderr, "cannot store %s: %s\n", CACHE_FILE, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static unsigned char *read_file(const char *name, size_t *length) {
+	unsigned char *data;
+	struct stat st;
+	FILE *fd;
+
+	fd = fopen(name, "r");
+	if (!fd) return NULL;
+	if (fstat(fileno(fd), &st) < 0 || !(data = malloc(st.st_size + 1))) {
+		fclose(fd);
+		return NULL;
+	}
+	*length = fread(data, 1, st.st_size, fd);
+	fclose(fd);
+	return data;
+}
+
+static void digest_data(const unsigned char *data, size_t length, char *out) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len, i;
+
+	EVP_Digest(data, length, md, &len, EVP_sha256(), NULL);
+	for (i = 0; i < len; i++) sprintf(out + 2 * i, "%02x", md[i]);
+	out[2 * len] = '\0';
+}
+
+/* same rules as the former script: first object, PEM or DER */
+static void classify(struct file_entry *e, const unsigned char *data, size_t length) {
+	const unsigned char *p;
+	X509_CRL *crl;
+	X509 *x509;
+	BIO *bio;
+
+	e->type = TYPE_NONE;
+	e->hash = 0;
+	bio = BIO_new_mem_buf((void *)data, length);
+	x509 = bio ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+	BIO_free(bio);
+	if (!x509) {
+		p = data;
+		x509 = d2i_X509(NULL, &p, length);
+	}
+	if (x509) {
+		/*
+		 * only a basicConstraints CA: X509_check_ca() also accepts v1
+		 * certificates and Netscape cert types. The flags are cached by
+		 * X509_check_purpose()
+		 */
+		X509_check_purpose(x509, -1, 0);
+		if (X509_get_extension_flags(x509) & EXFLAG_CA) {
+			e->type = TYPE_CA;
+			e->hash = X509_NAME_hash(X509_get_subject_name(x509));
+		} else {
+			DBG1("%s is not a CA certificate", e->name);
+		}
+		X509_free(x509);
+		ERR_clear_error();
+		return;
+	}
+	bio = BIO_new_mem_buf((void *)data, length);
+	crl = bio ? PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL) : NULL;
+	BIO_free(bio);
+	if (!crl) {
+		p = data;
+		crl = d2i_X509_CRL(NULL, &p, length);
+	}
+	if (crl) {
+		e->type = TYPE_CRL;
+		e->hash = X509_NAME_hash(X509_CRL_get_issuer(crl));
+		X509_CRL_free(crl);
+	} else {
+		printf("we got a problem with: %s\n", e->name);
+	}
+	ERR_clear_error();
+}
+
+/* fill in type and hash, from the cache whenever the file did not change */
+static void identify(struct file_entry *e, struct file_entry *cache, int ncache) {
+	struct file_entry *c;
+	unsigned char *data;
+	size_t length = 0;
+
+	c = bsearch(e, cache, ncache, sizeof(struct file_entry), cmp_file_name);
+	if (c && c->mtime == e->mtime && c->size == e->size && c->ino == e->ino) {
+		strcpy(e->digest, c->digest);
+		e->type = c->type;
+		e->hash = c->hash;
+		return;
+	}
+	data = read_file(e->name, &length);
+	if (!data) {
+		fprintf(stderr, "cannot read %s: %s\n", e->name, strerror(errno));
+		e->type = TYPE_NONE;
+		strcpy(e->digest, "-");
+		return;
+	}
+	digest_data(data, length, e->digest);
+	if (c && !strcmp(c->digest, e->digest)) {
+		/* touched or copied over, same content */
+		e->type = c->type;
+		e->hash = c->hash;
+	} else {
+		DBG1("parsing %s", e->name);
+		classify(e, data, length);
+	}
+	free(data);
+}
+
+static int set_link(const char *link, const char *target) {
+	char tmp[1024];
+
+	snprintf(tmp, sizeof(tmp), ".%s.%ld", link, (long)getpid());
+	unlink(tmp);
+	if (symlink(target, tmp) < 0 || rename(tmp, link) < 0) {
+		fprintf(stderr, "cannot link %s to %s: %s\n", link, target, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	if (verbose) printf("%s -> %s\n", link, target);
+	changes++;
+	return 0;
+}
+
+static void link_name(char *buf, size_t size, const struct file_entry *e, int n) {
+	snprintf(buf, size, "%08lx.%s%d", e->hash, e->type == TYPE_CRL ? "r" : "", n);
+}
+
+/*
+* give the files of one family the links 0..count-1, keeping the
+* current index of files already linked so that unchanged families
+* are not touched
+*/
+static int link_family(struct file_entry *files, int count,
+	struct link_entry *links, int nlinks) {
+	struct link_entry key, *l;
+	char name[64];
+	struct stat st;
+	int i, n, used, rv = 0;
+	int *taken;
+
+	taken = calloc(count, sizeof(int));
+	if (!taken) return -1;
+	for (i = 0; i < count; i++) files[i].slot = -1;
+	/* a certificate stored under its own hash name is its own link */
+	for (i = 0; i < count; i++) {
+		for (n = 0; n < count; n++) {
+			link_name(name, sizeof(name), &files[i], n);
+			if (!strcmp(name, files[i].name) && !taken[n]) {
+				files[i].slot = n;
+				taken[n] = 1;
+			}
+		}
+	}
+	for (n = 0; n < count; n++) {
+		if (taken[n]) continue;
+		link_name(name, sizeof(name), &files[0], n);
+		key.name = name;
+		l = bsearch(&key, links, nlinks, sizeof(struct link_entry), cmp_link_name);
+		if (!l) continue;
+		for (i = 0; i < count; i++) {
+			if (files[i].slot < 0 && !strcmp(files[i].name, l->target)) {
+				files[i].slot = n;
+				taken[n] = 1;
+				break;
+			}
+		}
+	}
+	for (i = 0, n = 0; i < count; i++) {
+		if (files[i].slot >= 0) continue;
+		while (taken[n]) n++;
+		files[i].slot = n;
+		taken[n] = 1;
+		link_name(name, sizeof(name), &files[i], n);
+		/* never overwrite a regular file */
+		if (lstat(name, &st) == 0 && !S_ISLNK(st.st_mode)) {
+			printf("we got a problem with: %s (%s is not a link)\n",
+				files[i].name, name);
+			continue;
+		}
+		if (set_link(name, files[i].name) < 0) rv = -1;
+	}
+	for (used = 0, n = 0; n < count; n++) used += taken[n];
+	DBG3("%08lx: %d file(s), %d link(s)", files[0].hash, count, used);
+	free(taken);
+	return rv;
+}
+
+/* links pointing nowhere useful: beyond the family size or unknown family */
+static void remove_stale_links(struct file_entry *files, int nfiles,
+	struct link_entry *links, int nlinks) {
+	struct file_entry *f;
+	unsigned long hash;
+	char type;
+	int i, j, n, wanted;
+
+	for (i = 0; i < nlinks; i++) {
+		if (!parse_link_name(links[i].name, &hash, &type, &n)) continue;
+		wanted = 0;
+		for (j = 0; j < nfiles; j++) {
+			f = &files[j];
+			if (f->type == type && f->hash == hash && f->slot == n) {
+				wanted = 1;
+				break;
+			}
+		}
+		if (wanted) continue;
+		if (unlink(links[i].name) == 0) {
+			if (verbose) printf("removed %s\n", links[i].name);
+			changes++;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	struct file_entry *files = NULL, *cache = NULL, *pt;
+	struct link_entry *links = NULL, *lpt;
+	const char *dir = NULL;
+	struct dirent *entry;
+	char target[1024], type;
+	unsigned long hash;
+	struct stat st;
+	int nfiles = 0, nlinks = 0, ncache = 0, size = 0, lsize = 0;
+	int force = 0, i, j, n, rv = 0;
+	ssize_t len;
+	DIR *d;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "debug")) set_debug_level(1);
+		else if (!strcmp(argv[i], "verbose")) verbose = 1;
+		else if (!strcmp(argv[i], "force")) force = 1;
+		else if (!dir) dir = argv[i];
+		else {
+			fprintf(stderr, "usage: %s [verbose] [force] [debug] [directory]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (dir && chdir(dir) < 0) {
+		printf("Error: %s is not a valid directory!\n", dir);
+		return 1;
+	}
+	if (!force) ncache = load_cache(&cache);
+
+	d = opendir(".");
+	if (!d) {
+		fprintf(stderr, "cannot read directory: %s\n", strerror(errno));
+		return 1;
+	}
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+		if (lstat(entry->d_name, &st) < 0) continue;
+		if (S_ISLNK(st.st_mode)) {
+			if (!parse_link_name(entry->d_name, &hash, &type, &n)) continue;
+			len = readlink(entry->d_name, target, sizeof(target) - 1);
+			if (len < 0) continue;
+			target[len] = '\0';
+			if (nlinks == lsize) {
+				lsize = lsize ? lsize * 2 : 256;
+				lpt = realloc(links, lsize * sizeof(struct link_entry));
+				if (!lpt) break;
+				links = lpt;
+			}
+			links[nlinks].name = strdup(entry->d_name);
+			links[nlinks].target = strdup(target);
+			if (links[nlinks].name && links[nlinks].target) nlinks++;
+			continue;
+		}
+		if (!S_ISREG(st.st_mode)) continue;
+		if (nfiles == size) {
+			size = size ? size * 2 : 256;
+			pt = realloc(files, size * sizeof(struct file_entry));
+			if (!pt) break;
+			files = pt;
+		}
+		memset(&files[nfiles], 0, sizeof(struct file_entry));
+		files[nfiles].name = strdup(entry->d_name);
+		if (!files[nfiles].name) break;
+		files[nfiles].mtime = st.st_mtime;
+		files[nfiles].size = st.st_size;
+		files[nfiles].ino = st.st_ino;
+		files[nfiles].slot = -1;
+		nfiles++;
+	}
+	closedir(d);
+	qsort(links, nlinks, sizeof(struct link_entry), cmp_link_name);
+
+	for (i = 0; i < nfiles; i++) identify(&files[i], cache, ncache);
+
+	/* create or move the links family by family, then drop the leftovers */
+	qsort(files, nfiles, sizeof(struct file_entry), cmp_file_group);
+	for (i = 0; i < nfiles; i = j) {
+		for (j = i + 1; j < nfiles && files[j].type == files[i].type &&
+			files[j].hash == files[i].hash; j++);
+		if (files[i].type == TYPE_NONE) continue;
+		if (link_family(&files[i], j - i, links, nlinks) < 0) rv = 1;
+	}
+	remove_stale_links(files, nfiles, links, nlinks);
+
+	qsort(files, nfiles, sizeof(struct file_entry), cmp_file_name);
+	if (save_cache(files, nfiles) < 0) rv = 1;
+	DBG2("%d file(s), %d link change(s)", nfiles, changes);
+
+	for (i = 0; i < nfiles; i++) free(files[i].name);
+	for (i = 0; i < ncache; i++) free(cache[i].name);
+	for (i = 0; i < nlinks; i++) {
+		free(links[i].name);
+		free(links[i].target);
+	}
+	free(files);
+	free(cache);
+	free(links);
+	return rv;
+}
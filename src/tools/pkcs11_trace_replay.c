@@ -0,0 +1,505 @@
+/*
+ * PKCS #11 PAM Login Module
+ * Authentication trace replay tool
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * $Id$
+ */
+
+/*
+* Replays the authentication traces recorded by pam_pkcs11 (see the
+* trace_file option) against a candidate configuration, without any
+* token or directory: every recorded external call answers with its
+* recorded outcome and duration, calls that were never made during the
+* recording answer with a configurable stand-in. The latency
+* distributions of the current and candidate configurations are then
+* compared.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../scconf/scconf.h"
+#include "../common/debug.h"
+#include "../common/error.h"
+#include "../common/strndup.h"
+
+#define PAM_PKCS11_CONF CONFDIR "/pam_pkcs11.conf"
+
+#define DEFAULT_STAND_IN 100	/* ms, unrecorded mapper or verify call */
+#define DEFAULT_CRL_STAND_IN 200	/* ms, unrecorded CRL download */
+
+struct trace_event {
+	char kind[16];
+	int cert;
+	char name[64];
+	unsigned long ms;
+	char result[16];
+};
+
+struct trace {
+	char mode[8];		/* find or match */
+	char crl[8];		/* revocation policy at recording time */
+	int ncerts;
+	int chosen;		/* recorded chosen certificate, 0 if none */
+	struct trace_event *events;
+	int nevents;
+};
+
+/* what the replay needs to know about a configuration */
+struct replay_config {
+	const char *file;
+	scconf_context *ctx;
+	const char **mappers;
+	int *timeouts;
+	int nmappers;
+	int budget;
+	int crl_online;		/* CRL downloads happen */
+	int signature;
+};
+
+struct stand_in {
+	const char *name;
+	unsigned long ms;
+};
+
+static struct stand_in *stand_ins = NULL;
+static int nstand_ins = 0;
+static unsigned long default_stand_in = DEFAULT_STAND_IN;
+static unsigned long crl_stand_in = DEFAULT_CRL_STAND_IN;
+
+/*
+* configuration handling
+*/
+
+static int load_replay_config(struct replay_config *c, const char *file) {
+	const scconf_block *root;
+	scconf_block **blocks, *blk;
+	const scconf_list *list;
+	const char *module;
+	int mapper_timeout, i;
+
+	memset(c, 0, sizeof(*c));
+	c->file = file;
+	c->ctx = scconf_new(file);
+	if (!c->ctx || scconf_parse(c->ctx) <= 0) {
+		fprintf(stderr, "Error parsing configuration file %s\n", file);
+		return -1;
+	}
+	root = scconf_find_block(c->ctx, NULL, "pam_pkcs11");
+	if (!root) {
+		fprintf(stderr, "pam_pkcs11 block not found in %s\n", file);
+		return -1;
+	}
+	mapper_timeout = scconf_get_int(root, "mapper_timeout", 0);
+	c->budget = scconf_get_int(root, "mapping_budget", 0);
+
+	/* same rules as mapper_mgr.c */
+	list = scconf_find_list(root, "use_mappers");
+	for (; list; list = list->next) c->nmappers++;
+	c->mappers = calloc(c->nmappers + 1, sizeof(char *));
+	c->timeouts = calloc(c->nmappers + 1, sizeof(int));
+	if (!c->mappers || !c->timeouts) {
+		fprintf(stderr, "not enough free memory available\n");
+		return -1;
+	}
+	list = scconf_find_list(root, "use_mappers");
+	for (i = 0; list; list = list->next, i++) {
+		c->mappers[i] = list->data;
+		c->timeouts[i] = mapper_timeout;
+		blocks = scconf_find_blocks(c->ctx, root, "mapper", list->data);
+		if (!blocks) continue;
+		blk = blocks[0];
+		free(blocks);
+		if (blk) c->timeouts[i] = scconf_get_int(blk, "timeout", mapper_timeout);
+	}
+
+	/* same rules as pam_config.c */
+	module = scconf_get_str(root, "use_pkcs11_module", "default");
+	blocks = scconf_find_blocks(c->ctx, root, "pkcs11_module", module);
+	blk = blocks ? blocks[0] : NULL;
+	free(blocks);
+	list = blk ? scconf_find_list(blk, "cert_policy") : NULL;
+	for (; list; list = list->next) {
+		if (!strcmp(list->data, "none")) {
+			c->crl_online = 0;
+			c->signature = 0;
+		} else if (!strcmp(list->data, "crl_auto") || !strcmp(list->data, "crl_online")) {
+			c->crl_online = 1;
+		} else if (!strcmp(list->data, "crl_offline")) {
+			c->crl_online = 0;
+		} else if (!strcmp(list->data, "signature")) {
+			c->signature = 1;
+		}
+	}
+	return 0;
+}
+
+static void free_replay_config(struct replay_config *c) {
+	if (c->ctx) scconf_free(c->ctx);
+	free(c->mappers);
+	free(c->timeouts);
+}
+
+/*
+* trace file parsing
+*/
+
+/* copy the value of "key=" from a trace line */
+static int get_field(const char *line, const char *key, char *value, size_t size) {
+	const char *pt = line;
+	size_t len = strlen(key), n;
+
+	while ((pt = strstr(pt, key)) != NULL) {
+		if ((pt == line || pt[-1] == ' ') && pt[len] == '=') break;
+		pt += len;
+	}
+	if (!pt) return -1;
+	pt += len + 1;
+	n = strcspn(pt, " \n");
+	if (n >= size) n = size - 1;
+	memcpy(value, pt, n);
+	value[n] = '\0';
+	return 0;
+}
+
+static unsigned long get_ulong(const char *line, const char *key) {
+	char value[32];
+	if (get_field(line, key, value, sizeof(value)) < 0) return 0;
+	return strtoul(value, NULL, 10);
+}
+
+static int add_event(struct trace *t, const char *line) {
+	struct trace_event *ev;
+	size_t n = strcspn(line, " ");
+
+	ev = realloc(t->events, (t->nevents + 1) * sizeof(struct trace_event));
+	if (!ev) return -1;
+	t->events = ev;
+	ev = &t->events[t->nevents++];
+	memset(ev, 0, sizeof(*ev));
+	if (n >= sizeof(ev->kind)) n = sizeof(ev->kind) - 1;
+	memcpy(ev->kind, line, n);
+	ev->cert = (int)get_ulong(line, "cert");
+	ev->ms = get_ulong(line, "ms");
+	get_field(line, "name", ev->name, sizeof(ev->name));
+	get_field(line, "result", ev->result, sizeof(ev->result));
+	if (!strcmp(ev->kind, "chosen")) t->chosen = ev->cert;
+	return 0;
+}
+
+/*
+* read all the records of a trace file
+* returns the number of traces, -1 on error
+*/
+static int read_traces(const char *file, struct trace **traces) {
+	FILE *fd;
+	char line[512];
+	struct trace *list = NULL, *t = NULL, *tmp;
+	int n = 0;
+
+	fd = fopen(file, "r");
+	if (!fd) {
+		perror(file);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fd)) {
+		if (!strncmp(line, "auth ", 5)) {
+			tmp = realloc(list, (n + 1) * sizeof(struct trace));
+			if (!tmp) break;
+			list = tmp;
+			t = &list[n++];
+			memset(t, 0, sizeof(*t));
+			strcpy(t->mode, "find");
+			strcpy(t->crl, "none");
+			get_field(line, "mode", t->mode, sizeof(t->mode));
+			get_field(line, "crl", t->crl, sizeof(t->crl));
+		} else if (!t || line[0] == '\n') {
+			continue;
+		} else if (!strncmp(line, "cert ", 5)) {
+			int cert = (int)get_ulong(line, "n");
+			if (cert > t->ncerts) t->ncerts = cert;
+		} else if (!strncmp(line, "end ", 4)) {
+			t = NULL;
+		} else if (!strncmp(line, "pkcs11", 6)) {
+			/* PKCS#11 call records are not replayed */
+			continue;
+		} else if (add_event(t, line) < 0) {
+			break;
+		}
+	}
+	fclose(fd);
+	*traces = list;
+	return n;
+}
+
+/*
+* replay model
+*/
+
+/* cert -1 matches any certificate, name NULL any name */
+static const struct trace_event *find_event(const struct trace *t,
+		const char *kind, int cert, const char *name) {
+	int i;
+	for (i = 0; i < t->nevents; i++) {
+		const struct trace_event *ev = &t->events[i];
+		if (strcmp(ev->kind, kind) || (cert >= 0 && ev->cert != cert)) continue;
+		if (name && strcmp(ev->name, name)) continue;
+		return ev;
+	}
+	return NULL;
+}
+
+static unsigned long mapper_stand_in(const char *name) {
+	int i;
+	for (i = 0; i < nstand_ins; i++) {
+		if (!strcmp(stand_ins[i].name, name)) return stand_ins[i].ms;
+	}
+	return default_stand_in;
+}
+
+/*
+* walk the mapper chain of a configuration for one certificate
+* returns 1 on match, 0 otherwise; *cost gets the time spent
+*/
+static int replay_chain(const struct replay_config *c, const struct trace *t,
+		int cert, unsigned long *cost, int *unrecorded) {
+	unsigned long elapsed = 0, d, limit;
+	int i, match = 0;
+
+	for (i = 0; i < c->nmappers; i++) {
+		const struct trace_event *ev = find_event(t, t->mode, cert, c->mappers[i]);
+		/* chains stop when the budget is exhausted */
+		if (c->budget > 0 && elapsed >= (unsigned long)c->budget) break;
+		if (ev) {
+			/* a recorded time out only tells how long it lasted at least */
+			d = ev->ms;
+			match = !strcmp(ev->result, "match");
+		} else {
+			d = mapper_stand_in(c->mappers[i]);
+			match = 0;
+			(*unrecorded)++;
+		}
+		limit = c->timeouts[i] > 0 ? (unsigned long)c->timeouts[i] : 0;
+		if (c->budget > 0) {
+			unsigned long left = (unsigned long)c->budget - elapsed;
+			if (!limit || left < limit) limit = left;
+		}
+		if (limit && d > limit) {
+			d = limit;
+			match = 0;
+		}
+		elapsed += d;
+		if (match) break;
+	}
+	*cost = elapsed;
+	return match;
+}
+
+/*
+* replay one trace against a configuration
+* returns the modelled latency; *chosen gets the certificate picked
+*/
+static unsigned long replay_trace(const struct replay_config *c, const struct trace *t,
+		int *chosen, int *unrecorded) {
+	unsigned long total = 0, verify_avg = 0, cost;
+	int recorded_online = !strcmp(t->crl, "online") || !strcmp(t->crl, "auto");
+	int i, nverify = 0, cert;
+
+	*chosen = 0;
+	/* token and module stages do not depend on the configuration */
+	for (i = 0; i < t->nevents; i++) {
+		const struct trace_event *ev = &t->events[i];
+		if (!strcmp(ev->kind, "verify")) {
+			verify_avg += ev->ms;
+			nverify++;
+		}
+		if (strcmp(ev->kind, "stage") || !strcmp(ev->name, "sign")) continue;
+		total += ev->ms;
+	}
+	verify_avg = nverify ? verify_avg / nverify : default_stand_in;
+
+	for (cert = 1; cert <= t->ncerts && !*chosen; cert++) {
+		const struct trace_event *ev = find_event(t, "verify", cert, NULL);
+		unsigned long verify, crl = 0;
+		int rv = 1;
+
+		if (ev) {
+			verify = ev->ms;
+			rv = atoi(ev->result);
+		} else {
+			verify = verify_avg;
+			(*unrecorded)++;
+		}
+		for (i = 0; i < t->nevents; i++) {
+			if (!strcmp(t->events[i].kind, "crl") && t->events[i].cert == cert)
+				crl += t->events[i].ms;
+		}
+		if (recorded_online && !c->crl_online) {
+			verify -= crl < verify ? crl : verify;
+		} else if (!recorded_online && c->crl_online) {
+			verify += crl_stand_in;
+			(*unrecorded)++;
+		}
+		total += verify;
+		if (rv != 1) continue;
+		if (replay_chain(c, t, cert, &cost, unrecorded)) *chosen = cert;
+		total += cost;
+	}
+
+	if (*chosen && c->signature) {
+		const struct trace_event *ev = find_event(t, "stage", -1, "sign");
+		if (ev) {
+			total += ev->ms;
+		} else {
+			total += default_stand_in;
+			(*unrecorded)++;
+		}
+	}
+	return total;
+}
+
+static int cmp_ulong(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long percentile(const unsigned long *sorted, int n, int p) {
+	return sorted[(n - 1) * p / 100];
+}
+
+static void print_distribution(unsigned long *old_ms, unsigned long *new_ms, int n) {
+	unsigned long long old_sum = 0, new_sum = 0;
+	static const int p[] = { 50, 90, 99 };
+	int i;
+
+	for (i = 0; i < n; i++) {
+		old_sum += old_ms[i];
+		new_sum += new_ms[i];
+	}
+	qsort(old_ms, n, sizeof(unsigned long), cmp_ulong);
+	qsort(new_ms, n, sizeof(unsigned long), cmp_ulong);
+	printf("%-8s %12s %12s\n", "", "old (ms)", "new (ms)");
+	printf("%-8s %12llu %12llu\n", "mean", old_sum / n, new_sum / n);
+	for (i = 0; i < 3; i++) {
+		printf("p%-7d %12lu %12lu\n", p[i],
+			percentile(old_ms, n, p[i]), percentile(new_ms, n, p[i]));
+	}
+	printf("%-8s %12lu %12lu\n", "max", old_ms[n - 1], new_ms[n - 1]);
+}
+
+static int add_stand_in(const char *arg) {
+	const char *pt = strchr(arg, ':');
+	struct stand_in *tmp;
+
+	if (!pt) return -1;
+	tmp = realloc(stand_ins, (nstand_ins + 1) * sizeof(struct stand_in));
+	if (!tmp) return -1;
+	stand_ins = tmp;
+	stand_ins[nstand_ins].name = strndup(arg, pt - arg);
+	stand_ins[nstand_ins].ms = strtoul(pt + 1, NULL, 10);
+	if (!stand_ins[nstand_ins].name) return -1;
+	nstand_ins++;
+	return 0;
+}
+
+static void usage(void) {
+	printf("usage: pkcs11_trace_replay trace_file=<file> new=<config> [old=<config>]\n"
+	       "                           [stand_in=<mapper>:<ms>]... [default_stand_in=<ms>]\n"
+	       "                           [crl_stand_in=<ms>] [verbose] [debug]\n");
+}
+
+int main(int argc, const char **argv) {
+	const char *trace_file = NULL, *old_file = PAM_PKCS11_CONF, *new_file = NULL;
+	struct replay_config old_conf, new_conf;
+	struct trace *traces = NULL;
+	unsigned long *old_ms, *new_ms;
+	int verbose = 0, ntraces, i;
+	int old_unrecorded = 0, new_unrecorded = 0, recorded_diff = 0, diff = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "debug")) {
+			set_debug_level(1);
+		} else if (!strcmp(argv[i], "verbose")) {
+			verbose = 1;
+		} else if (!strncmp(argv[i], "trace_file=", 11)) {
+			trace_file = argv[i] + 11;
+		} else if (!strncmp(argv[i], "old=", 4)) {
+			old_file = argv[i] + 4;
+		} else if (!strncmp(argv[i], "new=", 4)) {
+			new_file = argv[i] + 4;
+		} else if (!strncmp(argv[i], "default_stand_in=", 17)) {
+			default_stand_in = strtoul(argv[i] + 17, NULL, 10);
+		} else if (!strncmp(argv[i], "crl_stand_in=", 13)) {
+			crl_stand_in = strtoul(argv[i] + 13, NULL, 10);
+		} else if (!strncmp(argv[i], "stand_in=", 9)) {
+			if (add_stand_in(argv[i] + 9) < 0) {
+				fprintf(stderr, "Invalid stand-in %s\n", argv[i] + 9);
+				return 1;
+			}
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (!trace_file || !new_file) {
+		usage();
+		return 1;
+	}
+
+	if (load_replay_config(&old_conf, old_file) < 0 ||
+	    load_replay_config(&new_conf, new_file) < 0)
+		return 1;
+	ntraces = read_traces(trace_file, &traces);
+	if (ntraces <= 0) {
+		fprintf(stderr, "No trace found in %s\n", trace_file);
+		return 1;
+	}
+	old_ms = calloc(ntraces, sizeof(unsigned long));
+	new_ms = calloc(ntraces, sizeof(unsigned long));
+	if (!old_ms || !new_ms) {
+		fprintf(stderr, "not enough free memory available\n");
+		return 1;
+	}
+
+	for (i = 0; i < ntraces; i++) {
+		int old_chosen, new_chosen;
+		old_ms[i] = replay_trace(&old_conf, &traces[i], &old_chosen, &old_unrecorded);
+		new_ms[i] = replay_trace(&new_conf, &traces[i], &new_chosen, &new_unrecorded);
+		if (old_chosen != traces[i].chosen) recorded_diff++;
+		if (old_chosen != new_chosen) diff++;
+		if (verbose) {
+			printf("trace %d: old %lums cert #%d, new %lums cert #%d\n",
+				i + 1, old_ms[i], old_chosen, new_ms[i], new_chosen);
+		}
+	}
+
+	printf("traces replayed: %d\n", ntraces);
+	print_distribution(old_ms, new_ms, ntraces);
+	printf("stand-in responses: old %d, new %d\n", old_unrecorded, new_unrecorded);
+	printf("different certificate chosen (old/new): %d\n", diff);
+	if (recorded_diff)
+		printf("warning: %d traces do not replay as recorded with %s\n",
+			recorded_diff, old_file);
+
+	for (i = 0; i < ntraces; i++) free(traces[i].events);
+	free(traces);
+	free(old_ms);
+	free(new_ms);
+	free_replay_config(&old_conf);
+	free_replay_config(&new_conf);
+	return 0;
+}